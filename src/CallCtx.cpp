@@ -1,6 +1,7 @@
 #include "CallCtx.h"
 #include "AmSession.h"
 #include "sip/defs.h"
+#include "cdr/CdrPool.h"
 
 
 int fake_logger::log(const char* buf, int len,
@@ -42,7 +43,7 @@ SqlCallProfile *CallCtx::getFirstProfile(){
 		return NULL;
 	current_profile = profiles.begin();
 	attempt_num = 0;
-	cdr = new Cdr(**current_profile);
+	cdr = CdrPool::instance()->create(**current_profile);
 	return *current_profile;
 }
 
@@ -65,7 +66,7 @@ SqlCallProfile *CallCtx::getNextProfile(bool early_state, bool resource_failover
 		}
 		if(!resource_failover){
 			attempt_num++;
-			cdr = new Cdr(*cdr,**next_profile);
+			cdr = CdrPool::instance()->create(*cdr,**next_profile);
 		} else {
 			cdr->update_sql(**next_profile);
 		}
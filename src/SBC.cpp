@@ -60,6 +60,7 @@ SBC - feature-wishlist
 #include "SubscriptionDialog.h"
 #include "RegisterDialog.h"
 #include "RegisterCache.h"
+#include "cdr/CdrPool.h"
 
 #include <algorithm>
 
@@ -131,6 +132,7 @@ SBCFactory::SBCFactory(const string& _app_name)
 SBCFactory::~SBCFactory() {
   RegisterCache::dispose();
   yeti.reset();
+  CdrPool::dispose();
 }
 
 int SBCFactory::onLoad()
@@ -239,7 +241,7 @@ AmSession* SBCFactory::onInvite(const AmSipRequest& req, const string& app_name,
         if(!call_ctx->SQLexception) { //avoid to write cdr on failed getprofile()
             router.write_cdr(cdr,true);
         } else {
-            delete cdr;
+            CdrPool::instance()->release(cdr);
         }
         delete call_ctx;
         return NULL;
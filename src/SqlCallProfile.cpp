@@ -552,12 +552,13 @@ void SqlCallProfile::infoPrint(const DynFieldsT &df){
 		}
 
 
-		for(AmArg::ValueStruct::const_iterator it = dyn_fields.begin();
-			it!=dyn_fields.end();++it)
+		unsigned int slot = 0;
+		for(DynFieldsT::const_iterator it = df.begin();
+			it!=df.end() && slot < dyn_fields.size();++it,++slot)
 		{
-			const AmArg &a = it->second;
+			const AmArg &a = dyn_fields[slot];
 			DBG("dynamic_field['%s']: %s [%s]\n",
-				 it->first.c_str(),
+				 it->name.c_str(),
 				 AmArg::print(a).c_str(),
 				 a.t2str(a.getType()));
 		}
@@ -677,9 +678,10 @@ bool SqlCallProfile::readTranscoder(const pqxx::result::tuple &t){
 }
 
 bool SqlCallProfile::readDynFields(const pqxx::result::tuple &t,const DynFieldsT &df){
-	dyn_fields.assertStruct();
-	for(DynFieldsT::const_iterator it = df.begin();it!=df.end();++it){
-		it->tuple2AmArg(t,dyn_fields[it->name]);
+	unsigned int slot = 0;
+	dyn_fields.resize(df.size());
+	for(DynFieldsT::const_iterator it = df.begin();it!=df.end();++it,++slot){
+		it->tuple2AmArg(t,dyn_fields[slot]);
 	}
 	return true;
 }
@@ -31,7 +31,7 @@ struct SqlCallProfile
 	/** whether or not we should parse trusted headers from this gateway */
 	bool trusted_hdrs_gw;
 
-	AmArg dyn_fields;
+	DynFieldsValues dyn_fields;
 
 	string resources;
 	ResourceList rl;
@@ -121,6 +121,7 @@ try {
 			DBG("load_interface_out:     %ld: %s : %s, %s",i,
 				varname,vartype,t["forcdr"].c_str());
 			if(true==t["forcdr"].as<bool>()){
+				dyn_fields_slots[varname] = dyn_fields.size();
 				dyn_fields.push_back(DynField(varname,vartype));
 				if(!serialize_dynamic_fields){
 					cdr_types.push_back(vartype);
@@ -131,6 +132,9 @@ try {
 	if(serialize_dynamic_fields){
 		cdr_types.push_back("json"); //dynamic fields serialized to json
 	}
+	if(cfg.getParameterInt("cdr_idempotency_key",0)){
+		cdr_types.push_back("varchar"); //node_id/local_tag/attempt_num
+	}
 
 	{
 		pqxx::nontransaction t(c);
@@ -262,7 +266,8 @@ int SqlRouter::configure(AmConfigReader &cfg){
   cache_enabled = cfg.getParameterInt("profiles_cache_enabled",0);
   if(cache_enabled){
     cache_check_interval = cfg.getParameterInt("profiles_cache_check_interval",30);
-	cache_buckets = cfg.getParameterInt("profiles_cache_buckets",65000);
+	//initial capacity. cache table grows on demand
+	cache_buckets = cfg.getParameterInt("profiles_cache_buckets",1024);
 	cache = new ProfilesCache(used_header_fields,cache_buckets,cache_check_interval);
   }
   return 0;
@@ -546,10 +551,16 @@ void SqlRouter::dbg_get_profiles(AmArg &fields_values){
 }
 
 void SqlRouter::align_cdr(Cdr &cdr){
-    DynFieldsT_iterator it = dyn_fields.begin();
-    for(;it!=dyn_fields.end();++it){
-        cdr.dyn_fields[it->name] = AmArg();
-    }
+    cdr.dyn_fields.clear();
+    cdr.dyn_fields.resize(dyn_fields.size());
+}
+
+bool SqlRouter::getDynFieldSlot(const string &name, unsigned int &slot) const {
+	DynFieldsSlots::const_iterator it = dyn_fields_slots.find(name);
+	if(it==dyn_fields_slots.end())
+		return false;
+	slot = it->second;
+	return true;
 }
 
 void SqlRouter::write_cdr(Cdr* cdr, bool last)
@@ -668,6 +679,12 @@ void SqlRouter::showOpenedFiles(AmArg &arg){
 	}
 }
 
+void SqlRouter::showCdrImport(AmArg &arg){
+	if(cdr_writer){
+		cdr_writer->showImport(arg);
+	}
+}
+
 void SqlRouter::getStats(AmArg &arg){
   AmArg underlying_stats;
       /* SqlRouter stats */
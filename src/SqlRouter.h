@@ -41,8 +41,11 @@ public:
   void getStats(AmArg &arg);
   void getConfig(AmArg &arg);
   void showOpenedFiles(AmArg &arg);
+  void showCdrImport(AmArg &arg);
 
   const DynFieldsT &getDynFields() const { return dyn_fields; }
+  /* returns false for unknown field */
+  bool getDynFieldSlot(const string &name, unsigned int &slot) const;
 
   SqlRouter();
   ~SqlRouter();
@@ -82,6 +85,7 @@ private:
   PreparedQueriesT prepared_queries;
   PreparedQueriesT cdr_prepared_queries;
   DynFieldsT dyn_fields;
+  DynFieldsSlots dyn_fields_slots;
 };
 
 #endif
@@ -8,6 +8,7 @@
 #include <AmThread.h>
 
 #include "log.h"
+#include "../hash/hashfn.h"
 
 template<class key_type,class lookup_key_type,class data_type>
 class MurmurHash : public AmMutex {
@@ -0,0 +1,67 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "AmArg.h"
+#include "AmUtils.h"
+
+#include <sys/time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <cstdio>
+
+/* synthetic benchmarks run in process by RPC requests (see yeti_rpc.cpp) */
+
+#define DEFAULT_CDR_BENCH_ITERATIONS 100000
+#define DEFAULT_CDR_POOL_BENCH_CALLS 10000
+#define DEFAULT_CALLS_FILTER_BENCH_CALLS 100000
+#define DEFAULT_HASH_BENCH_ENTRIES 200000
+
+/* compare JsonWriter based CDR blobs serialization with cJSON trees.
+ * checks output is identical and measures CDRs serialized per second */
+void cdr_serialize_bench(int iterations, AmArg &ret);
+
+/* compare new/delete of Cdr objects with CdrPool recycling.
+ * runs several rounds of 'calls' concurrent CDRs. reports heap and RSS growth
+ * of the warm-up round and of the next ones, throughput and pool hits */
+void cdr_pool_bench(int calls, AmArg &ret);
+
+/* fill CdrList with synthetic calls and measure filter matching throughput
+ * with rules checked in the requested and in the ranked order.
+ * builtin rules sets are used if no rules passed */
+void calls_filter_bench(int calls, const AmArg &rules, AmArg &ret);
+
+/* compare OpenHash table with the chained MurmurHash table it replaced
+ * (kept in bench/ as baseline) and std::unordered_map
+ * on string keys similar to calls local tags.
+ * measures inserts, hit/miss lookups, iteration, erases and heap usage */
+void hash_bench(int entries, AmArg &ret);
+
+/* helpers */
+
+static inline double elapsed_sec(const struct timeval &start){
+	struct timeval now,diff;
+	gettimeofday(&now,NULL);
+	timersub(&now,&start,&diff);
+	return timeval2double(diff);
+}
+
+static inline long heap_bytes(){
+	struct mallinfo mi = mallinfo();
+	return mi.uordblks+mi.hblkhd;
+}
+
+static inline long rss_bytes(){
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm","r");
+	if(!f) return 0;
+	if(1!=fscanf(f,"%*s %ld",&pages)) pages = 0;
+	fclose(f);
+	return pages*sysconf(_SC_PAGESIZE);
+}
+
+static inline void bench_result(AmArg &a, const char *rate_name, long ops, double sec){
+	a["elapsed"] = sec;
+	a[rate_name] = sec > 0 ? (long)(ops/sec) : 0;
+}
+
+#endif // BENCH_H
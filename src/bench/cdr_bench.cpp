@@ -0,0 +1,368 @@
+#include "bench.h"
+#include "../cdr/Cdr.h"
+#include "../cdr/CdrPool.h"
+#include "../cdr/JsonWriter.h"
+#include "log.h"
+#include "cJSON.h"
+
+#include <sstream>
+
+/* reference cJSON implementation of Cdr blobs serialization */
+
+static string join_payloads(const vector<string> &v1, const vector<string> &v2){
+	std::stringstream ss;
+	for(vector<string>::const_iterator i = v1.begin();i!=v1.end();++i){
+		if(i != v1.begin()) ss << ",";
+		ss << *i;
+	}
+	ss << "/";
+	for(vector<string>::const_iterator i = v2.begin();i!=v2.end();++i){
+		if(i != v2.begin()) ss << ",";
+		ss << *i;
+	}
+	return ss.str();
+}
+
+#define add_tv2json(name,value) \
+	if(timerisset(&value)) cJSON_AddNumberToObject(j,name,timeval2double(value)); \
+	else cJSON_AddNullToObject(j,name)
+
+static char *cjson_rtp_stats(Cdr &c){
+	cJSON *j = cJSON_CreateObject();
+	cJSON_AddStringToObject(j,"lega_rx_payloads",
+		join_payloads(c.legA_payloads.incoming,c.legA_payloads.incoming_relayed).c_str());
+	cJSON_AddStringToObject(j,"lega_tx_payloads",
+		join_payloads(c.legA_payloads.outgoing,c.legA_payloads.outgoing_relayed).c_str());
+	cJSON_AddStringToObject(j,"legb_rx_payloads",
+		join_payloads(c.legB_payloads.incoming,c.legB_payloads.incoming_relayed).c_str());
+	cJSON_AddStringToObject(j,"legb_tx_payloads",
+		join_payloads(c.legB_payloads.outgoing,c.legB_payloads.outgoing_relayed).c_str());
+	cJSON_AddNumberToObject(j,"lega_rx_bytes",c.legA_bytes_recvd);
+	cJSON_AddNumberToObject(j,"lega_tx_bytes",c.legA_bytes_sent);
+	cJSON_AddNumberToObject(j,"legb_rx_bytes",c.legB_bytes_recvd);
+	cJSON_AddNumberToObject(j,"legb_tx_bytes",c.legB_bytes_sent);
+	cJSON_AddNumberToObject(j,"lega_rx_decode_errs",c.legA_stream_errors.decode_errors);
+	cJSON_AddNumberToObject(j,"lega_rx_no_buf_errs",c.legA_stream_errors.out_of_buffer_errors);
+	cJSON_AddNumberToObject(j,"lega_rx_parse_errs",c.legA_stream_errors.rtp_parse_errors);
+	cJSON_AddNumberToObject(j,"legb_rx_decode_errs",c.legB_stream_errors.decode_errors);
+	cJSON_AddNumberToObject(j,"legb_rx_no_buf_errs",c.legB_stream_errors.out_of_buffer_errors);
+	cJSON_AddNumberToObject(j,"legb_rx_parse_errs",c.legB_stream_errors.rtp_parse_errors);
+	char *s = cJSON_PrintUnformatted(j);
+	cJSON_Delete(j);
+	return s;
+}
+
+static char *cjson_timers_data(Cdr &c){
+	cJSON *j = cJSON_CreateObject();
+	add_tv2json("time_start",c.start_time);
+	add_tv2json("leg_b_time",c.bleg_invite_time);
+	add_tv2json("time_connect",c.connect_time);
+	add_tv2json("time_end",c.end_time);
+	add_tv2json("time_1xx",c.sip_10x_time);
+	add_tv2json("time_18x",c.sip_18x_time);
+	cJSON_AddNumberToObject(j,"time_limit",c.time_limit);
+	cJSON_AddNumberToObject(j,"isup_propagation_delay",c.isup_propagation_delay);
+	char *s = cJSON_PrintUnformatted(j);
+	cJSON_Delete(j);
+	return s;
+}
+
+#undef add_tv2json
+
+static cJSON *cjson_dtmf_queue(std::queue<Cdr::dtmf_event_info> &q, const struct timeval *t){
+	cJSON *a = cJSON_CreateArray();
+	while(!q.empty()){
+		Cdr::dtmf_event_info &e = q.front();
+		struct timeval offset;
+		cJSON *j = cJSON_CreateObject();
+		cJSON_AddNumberToObject(j,"e",e.event);
+		cJSON_AddNumberToObject(j,"r",e.rx_proto);
+		cJSON_AddNumberToObject(j,"t",e.tx_proto);
+		timersub(&e.time,t,&offset);
+		cJSON_AddNumberToObject(j,"o",timeval2double(offset));
+		cJSON_AddItemToArray(a,j);
+		q.pop();
+	}
+	return a;
+}
+
+static char *cjson_dtmf_events(Cdr &c){
+	const struct timeval *t = timerisset(&c.connect_time) ? &c.connect_time : &c.end_time;
+	cJSON *j = cJSON_CreateObject();
+	cJSON_AddItemToObject(j,"a2b",cjson_dtmf_queue(c.dtmf_events_a2b,t));
+	cJSON_AddItemToObject(j,"b2a",cjson_dtmf_queue(c.dtmf_events_b2a,t));
+	char *s = cJSON_PrintUnformatted(j);
+	cJSON_Delete(j);
+	return s;
+}
+
+static char *cjson_dynamic(Cdr &c, const DynFieldsT &df){
+	cJSON *j = cJSON_CreateObject();
+	unsigned int slot = 0;
+	for(DynFieldsT_const_iterator it = df.begin();it!=df.end();++it,++slot){
+		const char *namep = it->name.c_str();
+		const AmArg &arg = c.dyn_field(slot);
+		switch(arg.getType()){
+		case AmArg::Int: cJSON_AddNumberToObject(j,namep,arg.asInt()); break;
+		case AmArg::LongLong: cJSON_AddNumberToObject(j,namep,arg.asLongLong()); break;
+		case AmArg::Bool: cJSON_AddBoolToObject(j,namep,arg.asBool()); break;
+		case AmArg::CStr: cJSON_AddStringToObject(j,namep,arg.asCStr()); break;
+		default: cJSON_AddNullToObject(j,namep);
+		}
+	}
+	char *s = cJSON_PrintUnformatted(j);
+	cJSON_Delete(j);
+	return s;
+}
+
+/* test data */
+
+static void fill_dtmf(Cdr &c){
+	struct timeval t = c.connect_time;
+	for(int i = 0;i<4;i++){
+		t.tv_usec+=123457;
+		c.add_dtmf_event(true,i,t,1,2);
+		c.add_dtmf_event(false,i+5,t,2,1);
+	}
+}
+
+static void fill_cdr(Cdr &c, DynFieldsT &df){
+	gettimeofday(&c.start_time,NULL);
+	c.bleg_invite_time = c.start_time;
+	c.bleg_invite_time.tv_usec = 5021;
+	c.sip_18x_time = c.bleg_invite_time;
+	c.sip_18x_time.tv_sec+=2;
+	c.connect_time = c.sip_18x_time;
+	c.connect_time.tv_sec+=3;
+	c.end_time = c.connect_time;
+	c.end_time.tv_sec+=97;
+	c.time_limit = 7200;
+	c.isup_propagation_delay = 0;
+
+	c.legA_payloads.incoming.push_back("PCMA");
+	c.legA_payloads.incoming.push_back("telephone-event");
+	c.legA_payloads.outgoing.push_back("PCMA");
+	c.legB_payloads.incoming_relayed.push_back("G729");
+	c.legB_payloads.outgoing_relayed.push_back("G729");
+	c.legA_bytes_recvd = 1612800;
+	c.legA_bytes_sent = 1609120;
+	c.legB_bytes_recvd = 4294967296UL;
+	c.legB_bytes_sent = 402160;
+	c.legA_stream_errors.decode_errors = 1;
+
+	df.push_back(DynField("customer_id","integer"));
+	df.push_back(DynField("customer_acc","varchar"));
+	df.push_back(DynField("customer_price","numeric"));
+	df.push_back(DynField("customer_big","bigint"));
+	df.push_back(DynField("is_internal","boolean"));
+	df.push_back(DynField("src_name","varchar"));
+	c.dyn_fields.push_back(1042);
+	c.dyn_fields.push_back("acc-\"42\"\\x");
+	c.dyn_fields.push_back(AmArg());
+	c.dyn_fields.push_back(AmArg((long long)12345678901LL));
+	c.dyn_fields.push_back(false);
+	c.dyn_fields.push_back("Name\twith\ncontrols");
+}
+
+void cdr_serialize_bench(int iterations, AmArg &ret)
+{
+	Cdr c;
+	DynFieldsT df;
+	struct timeval start;
+	char *s[4];
+	string w_out[4];
+	size_t bytes = 0;
+
+	fill_cdr(c,df);
+	JsonWriter &w = JsonWriter::local();
+
+	//check output
+	fill_dtmf(c);
+	s[0] = cjson_timers_data(c);
+	s[1] = cjson_rtp_stats(c);
+	s[2] = cjson_dtmf_events(c);
+	s[3] = cjson_dynamic(c,df);
+
+	fill_dtmf(c);
+	w.reset(); c.serialize_timers_data(w); w_out[0] = w.str();
+	w.reset(); c.serialize_rtp_stats(w); w_out[1] = w.str();
+	w.reset(); c.serialize_dtmf_events(w); w_out[2] = w.str();
+	w.reset(); c.serialize_dynamic(w,df); w_out[3] = w.str();
+
+	bool identical = true;
+	for(int i = 0;i<4;i++){
+		if(w_out[i]!=s[i]){
+			identical = false;
+			AmArg &m = ret["mismatch"];
+			AmArg d;
+			d["cjson"] = s[i];
+			d["writer"] = w_out[i];
+			m.push(d);
+		}
+		free(s[i]);
+	}
+	ret["identical"] = identical;
+	ret["iterations"] = iterations;
+
+	//cJSON trees
+	gettimeofday(&start,NULL);
+	for(int n = 0;n<iterations;n++){
+		fill_dtmf(c);
+		s[0] = cjson_timers_data(c);
+		s[1] = cjson_rtp_stats(c);
+		s[2] = cjson_dtmf_events(c);
+		s[3] = cjson_dynamic(c,df);
+		for(int i = 0;i<4;i++){
+			bytes+=strlen(s[i]);
+			free(s[i]);
+		}
+	}
+	bench_result(ret["cjson"],"cdrs_per_sec",iterations,elapsed_sec(start));
+
+	//streaming writer
+	gettimeofday(&start,NULL);
+	for(int n = 0;n<iterations;n++){
+		fill_dtmf(c);
+		w.reset(); c.serialize_timers_data(w); bytes+=w.str().size();
+		w.reset(); c.serialize_rtp_stats(w); bytes+=w.str().size();
+		w.reset(); c.serialize_dtmf_events(w); bytes+=w.str().size();
+		w.reset(); c.serialize_dynamic(w,df); bytes+=w.str().size();
+	}
+	bench_result(ret["writer"],"cdrs_per_sec",iterations,elapsed_sec(start));
+
+	DBG("cdr_serialize_bench: %d iterations, %lu bytes",iterations,bytes);
+}
+
+/* Cdr allocations */
+
+#define CDR_POOL_BENCH_ROUNDS 5
+
+static void fill_call(Cdr &c, int n){
+	//values longer than strings SSO buffer like in real calls
+	string id = int2str(n);
+	c.local_tag = "3c2b8a4e-"+id+"-4f1d-9b7e-0c1d2e3f4a5b";
+	c.global_tag = "1f0e9d8c-"+id+"-7b6a-5948-372615049382";
+	c.orig_call_id = "a84b4c76e66710-"+id+"@sbc.example.com";
+	c.term_call_id = "65be2d1f-"+id+"-c4b3-a291-8f7e6d5c4b3a";
+	c.legA_remote_ip = "192.168.100.200";
+	c.legA_local_ip = "10.100.200.201";
+	c.legB_remote_ip = "172.16.254.253";
+	c.legB_local_ip = "10.100.200.202";
+	c.disconnect_reason = "Normal call clearing";
+	c.resources = "1:42,3;2:17,10;3:1042,100";
+	c.dyn_fields.push_back(1042);
+	c.dyn_fields.push_back("customer-account-0001042");
+	c.dyn_fields.push_back("vendor-account-00000017");
+	c.dyn_fields.push_back("4930123456789");
+	c.legA_payloads.incoming.push_back("PCMA");
+	c.legA_payloads.incoming.push_back("telephone-event");
+	c.legB_payloads.outgoing.push_back("PCMA");
+	c.legB_payloads.outgoing.push_back("telephone-event");
+	struct timeval t = c.start_time;
+	c.add_dtmf_event(true,1,t,1,2);
+	c.add_dtmf_event(false,2,t,2,1);
+}
+
+/* memory usage is sampled each round when all the calls are alive.
+ * the first round is the warm-up: both modes allocate objects there.
+ * growth after it shows whether the next rounds reuse that memory */
+struct pool_bench_usage {
+	long rss_start, heap_start;
+	long rss_warmup, heap_warmup;	//after the first round
+	long rss_peak, heap_peak;		//max of the next rounds
+	double warmup_sec;
+	struct timeval start;
+
+	void begin(){
+		rss_start = rss_bytes();
+		heap_start = heap_bytes();
+		gettimeofday(&start,NULL);
+	}
+
+	void sample(int round){
+		long rss = rss_bytes(), heap = heap_bytes();
+		if(round==0){
+			rss_warmup = rss_peak = rss;
+			heap_warmup = heap_peak = heap;
+			return;
+		}
+		if(rss > rss_peak) rss_peak = rss;
+		if(heap > heap_peak) heap_peak = heap;
+	}
+
+	void warmed_up(){
+		warmup_sec = elapsed_sec(start);
+		gettimeofday(&start,NULL);
+	}
+
+	void result(AmArg &a, int calls){
+		AmArg &w = a["warmup"];
+		w["rss_growth"] = rss_warmup-rss_start;
+		w["heap_growth"] = heap_warmup-heap_start;
+		w["heap_per_call"] = (heap_warmup-heap_start)/calls;
+		w["elapsed"] = warmup_sec;
+		a["rss_growth_after_warmup"] = rss_peak-rss_warmup;
+		a["heap_growth_after_warmup"] = heap_peak-heap_warmup;
+		bench_result(a,"calls_per_sec",(long)(CDR_POOL_BENCH_ROUNDS-1)*calls,elapsed_sec(start));
+	}
+};
+
+static long pool_hits(_CdrPool &pool){
+	AmArg s;
+	pool.getStats(s);
+	const AmArg &a = s["reused"];
+	return isArgLongLong(a) ? (long)a.asLongLong() : a.asInt();
+}
+
+void cdr_pool_bench(int calls, AmArg &ret)
+{
+	vector<Cdr *> cdrs(calls);
+	pool_bench_usage usage;
+
+	ret["calls"] = calls;
+	ret["rounds"] = CDR_POOL_BENCH_ROUNDS;
+
+	//new/delete per call
+	usage.begin();
+	for(int r = 0;r<CDR_POOL_BENCH_ROUNDS;r++){
+		for(int i = 0;i<calls;i++){
+			cdrs[i] = new Cdr();
+			fill_call(*cdrs[i],i);
+		}
+		usage.sample(r);
+		for(int i = 0;i<calls;i++)
+			delete cdrs[i];
+		if(r==0) usage.warmed_up();
+	}
+	usage.result(ret["heap"],calls);
+
+	//recycling. own pool to leave the global one untouched
+	_CdrPool pool;
+	pool.configure(calls);
+	SqlCallProfile profile;
+	long warmup_hits = 0;
+	usage.begin();
+	for(int r = 0;r<CDR_POOL_BENCH_ROUNDS;r++){
+		for(int i = 0;i<calls;i++){
+			cdrs[i] = pool.create(profile);
+			fill_call(*cdrs[i],i);
+		}
+		usage.sample(r);
+		for(int i = 0;i<calls;i++)
+			pool.release(cdrs[i]);
+		if(r==0){
+			usage.warmed_up();
+			warmup_hits = pool_hits(pool);
+		}
+	}
+	AmArg &p = ret["pool"];
+	usage.result(p,calls);
+	long hits = pool_hits(pool);
+	p["hits"] = hits;
+	p["warmup"]["hits"] = warmup_hits;
+	p["hit_ratio_after_warmup"] =
+		(double)(hits-warmup_hits)/((long)(CDR_POOL_BENCH_ROUNDS-1)*calls);
+	pool.getStats(p["stats"]);
+
+	DBG("cdr_pool_bench: %d calls, %d rounds",calls,CDR_POOL_BENCH_ROUNDS);
+}
@@ -0,0 +1,114 @@
+#include "bench.h"
+#include "../hash/CdrList.h"
+#include "log.h"
+
+#define CALLS_FILTER_BENCH_ROUNDS 5
+
+/* cheap checks are placed last to show reordering effect */
+static const char *builtin_rules[][4] = {
+	{ "orig_call_id!=unknown", "audio_record_enabled!=1", "legA_remote_ip=10.0.0.7", NULL },
+	{ "local_tag!=none", "time_limit>=3600", "attempt_num=2", NULL },
+	{ "active_resources_json!=null", "duration>300", "legB_remote_port=5061", NULL },
+	{ NULL }
+};
+
+static void fill_call(Cdr &c, int n, const struct timeval &now){
+	string id = int2str(n);
+	c.local_tag = "3c2b8a4e-"+id+"-4f1d-9b7e-0c1d2e3f4a5b";
+	c.global_tag = "1f0e9d8c-"+id+"-7b6a-5948-372615049382";
+	c.orig_call_id = "a84b4c76e66710-"+id+"@sbc.example.com";
+	c.term_call_id = "65be2d1f-"+id+"-c4b3-a291-8f7e6d5c4b3a";
+	c.legA_remote_ip = "10.0."+int2str((n>>8)&0xff)+"."+int2str(n&0xff);
+	c.legA_local_ip = "10.100.200.201";
+	c.legB_remote_ip = "172.16.254.253";
+	c.legB_local_ip = "10.100.200.202";
+	c.legA_remote_port = c.legB_remote_port = 5060+(n%4);
+	c.legA_local_port = c.legB_local_port = 5060;
+	c.attempt_num = 1+n%3;
+	c.time_limit = 1800*(1+n%4);
+	c.audio_record_enabled = (n%10==0);
+	c.resources = "1:42,3;2:17,10";
+	c.start_time = now;
+	c.start_time.tv_sec-=n%900;
+	//a third of calls is not connected yet
+	if(n%3){
+		c.connect_time = c.start_time;
+		c.connect_time.tv_sec+=5;
+	}
+}
+
+static void release_calls(CdrList &list, vector<Cdr *> &cdrs){
+	for(vector<Cdr *>::iterator it = cdrs.begin(); it!=cdrs.end(); ++it){
+		list.erase(*it);
+		delete *it;
+	}
+}
+
+static void bench_rules(CdrList &list, int calls, const vector<string> &rules_str,
+						bool reorder, AmArg &ret)
+{
+	struct timeval start;
+	unsigned long matched = 0;
+	cmp_rules rules(0,0,reorder);
+
+	for(vector<string>::const_iterator it = rules_str.begin(); it!=rules_str.end(); ++it)
+		parse_rule(rules,*it);
+
+	gettimeofday(&start,NULL);
+	for(int r = 0;r<CALLS_FILTER_BENCH_ROUNDS;r++)
+		matched = list.countMatched(rules);
+	double sec = elapsed_sec(start);
+
+	ret["matched"] = (long)matched;
+	bench_result(ret,"calls_per_sec",(long)CALLS_FILTER_BENCH_ROUNDS*calls,sec);
+	rules.getInfo(ret["program"]);
+}
+
+void calls_filter_bench(int calls, const AmArg &rules, AmArg &ret)
+{
+	vector<vector<string> > sets;
+	vector<Cdr *> cdrs(calls);
+	CdrList list(calls);
+	struct timeval now;
+
+	if(rules.size()){
+		sets.push_back(vector<string>());
+		for(unsigned int i = 0;i<rules.size();i++)
+			sets.back().push_back(rules.get(i).asCStr());
+	} else {
+		for(int i = 0;builtin_rules[i][0];i++){
+			sets.push_back(vector<string>());
+			for(int k = 0;builtin_rules[i][k];k++)
+				sets.back().push_back(builtin_rules[i][k]);
+		}
+	}
+
+	gettimeofday(&now,NULL);
+	for(int i = 0;i<calls;i++){
+		cdrs[i] = new Cdr();
+		fill_call(*cdrs[i],i,now);
+		list.insert(cdrs[i]);
+	}
+
+	ret["calls"] = calls;
+	ret["rounds"] = CALLS_FILTER_BENCH_ROUNDS;
+	AmArg &results = ret["results"];
+	results.assertArray();
+	try {
+		for(vector<vector<string> >::const_iterator it = sets.begin(); it!=sets.end(); ++it){
+			results.push(AmArg());
+			AmArg &r = results.back();
+			for(vector<string>::const_iterator rit = it->begin(); rit!=it->end(); ++rit)
+				r["rules"].push(*rit);
+			bench_rules(list,calls,*it,false,r["requested_order"]);
+			bench_rules(list,calls,*it,true,r["ranked_order"]);
+		}
+	} catch(...) {
+		release_calls(list,cdrs);
+		throw;
+	}
+
+	release_calls(list,cdrs);
+
+	DBG("calls_filter_bench: %d calls, %lu rules sets",calls,sets.size());
+}
@@ -0,0 +1,158 @@
+#include "bench.h"
+#include "MurmurHash.h"
+#include "../hash/OpenHash.h"
+#include "log.h"
+
+#include <unordered_map>
+
+/* same keys handling as in CdrList */
+template <class base>
+class bench_hash: public base {
+  public:
+	bench_hash(unsigned long size): base(size) {}
+	typename base::entry *get_first() { return this->first; }
+  protected:
+	uint64_t hash_lookup_key(const string *key){
+		return this->hashfn(key->c_str(),key->size());
+	}
+	bool cmp_lookup_key(const string *k1,const string *k2){
+		return *k1 == *k2;
+	}
+	void init_key(string **dest,const string *src){
+		*dest = new string(*src);
+	}
+	void free_key(string *key){
+		delete key;
+	}
+};
+
+/* MurmurHash iterates the linked entries list */
+template <class K,class L,class D>
+static unsigned long iterate(bench_hash<MurmurHash<K,L,D> > &h){
+	unsigned long n = 0;
+	for(typename MurmurHash<K,L,D>::entry *e = h.get_first(); e; e = e->list_next)
+		if(e->data) n++;
+	return n;
+}
+
+/* OpenHash iterates the dense entries vector */
+template <class K,class L,class D>
+static unsigned long iterate(bench_hash<OpenHash<K,L,D> > &h){
+	unsigned long n = 0;
+	typename OpenHash<K,L,D>::cursor pos;
+	typename OpenHash<K,L,D>::entry *e;
+	h.cursor_link(pos);
+	while((e = h.cursor_next_entry(pos)))
+		if(e->data) n++;
+	h.cursor_unlink(pos);
+	return n;
+}
+
+static void op_result(AmArg &a, long ops, double sec){
+	bench_result(a,"ops_per_sec",ops,sec);
+}
+
+template <class H>
+static void bench(H &h, const vector<string> &keys, const vector<string> &missed, AmArg &ret)
+{
+	struct timeval start;
+	int data = 0;
+	long heap = heap_bytes();
+	unsigned long found = 0;
+
+	gettimeofday(&start,NULL);
+	for(vector<string>::const_iterator it = keys.begin(); it!=keys.end(); ++it)
+		h.insert(&(*it),&data,false,true);
+	op_result(ret["insert"],keys.size(),elapsed_sec(start));
+	ret["heap_growth"] = heap_bytes()-heap;
+
+	gettimeofday(&start,NULL);
+	for(vector<string>::const_iterator it = keys.begin(); it!=keys.end(); ++it)
+		if(h.at_data(&(*it),false)) found++;
+	op_result(ret["lookup_hit"],keys.size(),elapsed_sec(start));
+
+	gettimeofday(&start,NULL);
+	for(vector<string>::const_iterator it = missed.begin(); it!=missed.end(); ++it)
+		if(h.at_data(&(*it),false)) found++;
+	op_result(ret["lookup_miss"],missed.size(),elapsed_sec(start));
+
+	gettimeofday(&start,NULL);
+	unsigned long iterated = iterate(h);
+	op_result(ret["iterate"],iterated,elapsed_sec(start));
+
+	gettimeofday(&start,NULL);
+	for(vector<string>::const_iterator it = keys.begin(); it!=keys.end(); ++it)
+		h.erase_lookup_key(&(*it),false);
+	op_result(ret["erase"],keys.size(),elapsed_sec(start));
+
+	ret["found"] = (long)found;
+	ret["left"] = (long)h.get_count();
+}
+
+/* reference node based table with the same keys ownership */
+static void bench_std(const vector<string> &keys, const vector<string> &missed, AmArg &ret)
+{
+	typedef std::unordered_map<string,int *> map_t;
+	map_t h;
+	struct timeval start;
+	int data = 0;
+	long heap = heap_bytes();
+	unsigned long found = 0;
+
+	gettimeofday(&start,NULL);
+	for(vector<string>::const_iterator it = keys.begin(); it!=keys.end(); ++it)
+		h.insert(std::make_pair(*it,&data));
+	op_result(ret["insert"],keys.size(),elapsed_sec(start));
+	ret["heap_growth"] = heap_bytes()-heap;
+
+	gettimeofday(&start,NULL);
+	for(vector<string>::const_iterator it = keys.begin(); it!=keys.end(); ++it)
+		if(h.find(*it)!=h.end()) found++;
+	op_result(ret["lookup_hit"],keys.size(),elapsed_sec(start));
+
+	gettimeofday(&start,NULL);
+	for(vector<string>::const_iterator it = missed.begin(); it!=missed.end(); ++it)
+		if(h.find(*it)!=h.end()) found++;
+	op_result(ret["lookup_miss"],missed.size(),elapsed_sec(start));
+
+	unsigned long iterated = 0;
+	gettimeofday(&start,NULL);
+	for(map_t::const_iterator it = h.begin(); it!=h.end(); ++it)
+		if(it->second) iterated++;
+	op_result(ret["iterate"],iterated,elapsed_sec(start));
+
+	gettimeofday(&start,NULL);
+	for(vector<string>::const_iterator it = keys.begin(); it!=keys.end(); ++it)
+		h.erase(*it);
+	op_result(ret["erase"],keys.size(),elapsed_sec(start));
+
+	ret["found"] = (long)found;
+	ret["left"] = (long)h.size();
+}
+
+void hash_bench(int entries, AmArg &ret)
+{
+	vector<string> keys, missed;
+
+	keys.reserve(entries);
+	missed.reserve(entries);
+	for(int i = 0;i<entries;i++){
+		string id = int2str(i);
+		keys.push_back("3c2b8a4e-"+id+"-4f1d-9b7e-0c1d2e3f4a5b");
+		missed.push_back("7d6c5b4a-"+id+"-3f2e-1d0c-b9a8f7e6d5c4");
+	}
+
+	ret["entries"] = entries;
+	{
+		//CdrList table before OpenHash with its default buckets count
+		bench_hash<MurmurHash<string,string,int> > h(65000);
+		bench(h,keys,missed,ret["murmur_hash"]);
+	}
+	bench_std(keys,missed,ret["unordered_map"]);
+	{
+		bench_hash<OpenHash<string,string,int> > h(1024);
+		bench(h,keys,missed,ret["open_hash"]);
+	}
+
+	DBG("hash_bench: %d entries",entries);
+}
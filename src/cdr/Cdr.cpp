@@ -82,6 +82,8 @@ void Cdr::init(){
     writed=false;
     suppress = false;
 	inserted2list = false;
+	spool_id = 0;
+	timerclear(&queued_time);
 
 	disconnect_initiator = DisconnectUndefined;
 	disconnect_initiator_writed = false;
@@ -244,7 +246,9 @@ void Cdr::update(UpdateAction act){
 
 void Cdr::update(const ResourceList &rl){
     if(rl.empty()) return;
-    cJSON *j = cJSON_CreateArray(),*i;
+    JsonWriter &w = JsonWriter::local();
+    w.reset();
+    w.begin_array();
     active_resources_amarg.clear();
     for(ResourceList::const_iterator rit = rl.begin();rit!=rl.end();++rit){
         const Resource &r = (*rit);
@@ -253,21 +257,19 @@ void Cdr::update(const ResourceList &rl){
 
         active_resources_amarg.push(AmArg());
         AmArg &a = active_resources_amarg.back();
-        i = cJSON_CreateObject();
+        w.begin_object();
 
-        cJSON_AddNumberToObject(i,"type",r.type);
+        w.add_number("type",r.type);
         a["type"] = r.type;
-        cJSON_AddNumberToObject(i,"id",r.id);
+        w.add_number("id",r.id);
         a["id"] = r.id;
-        cJSON_AddNumberToObject(i,"takes",r.takes);
+        w.add_number("takes",r.takes);
         a["takes"] = r.takes;
 
-        cJSON_AddItemToArray(j,i);
+        w.end_object();
     }
-    char *s = cJSON_PrintUnformatted(j);
-    active_resources = s;
-    free(s);
-    cJSON_Delete(j);
+    w.end_array();
+    active_resources = w.str();
 }
 
 void Cdr::update_failed_resource(const Resource &r) {
@@ -375,7 +377,10 @@ Cdr::Cdr(const Cdr& cdr,const SqlCallProfile &profile){
 
 	init();
 	update_sql(profile);
+	init_next_attempt(cdr);
+}
 
+void Cdr::init_next_attempt(const Cdr &cdr){
 	attempt_num = cdr.attempt_num+1;
 	end_time = start_time = cdr.start_time;
 
@@ -403,6 +408,37 @@ Cdr::~Cdr()
     //DBG("~Cdr() %p",this);
 }
 
+void Cdr::reset(){
+	//clear() keeps strings and vectors capacity for the next call
+	is_last = false;
+	orig_call_id.clear();
+	term_call_id.clear();
+	local_tag.clear();
+	global_tag.clear();
+	outbound_proxy.clear();
+	resources.clear();
+	dyn_fields.clear();
+	trusted_hdrs.clear();
+	fields_values.clear();
+	active_resources_amarg.clear();
+
+	legA_payloads.incoming.clear();
+	legA_payloads.outgoing.clear();
+	legA_payloads.incoming_relayed.clear();
+	legA_payloads.outgoing_relayed.clear();
+	legB_payloads.incoming.clear();
+	legB_payloads.outgoing.clear();
+	legB_payloads.incoming_relayed.clear();
+	legB_payloads.outgoing_relayed.clear();
+	legA_stream_errors = AmRtpStream::ErrorsStats();
+	legB_stream_errors = AmRtpStream::ErrorsStats();
+
+	while(!dtmf_events_a2b.empty()) dtmf_events_a2b.pop();
+	while(!dtmf_events_b2a.empty()) dtmf_events_b2a.pop();
+
+	init();
+}
+
 static string join_str_vector2(const vector<string> &v1,
                                const vector<string> &v2,
                                const string &delim){
@@ -423,16 +459,14 @@ static string join_str_vector2(const vector<string> &v1,
 }
 
 #define field_name fields[i++]
-#define add_str2json(value) cJSON_AddStringToObject(j,field_name,value)
-#define add_num2json(value) cJSON_AddNumberToObject(j,field_name,value)
+#define add_str2json(value) w.add_string(field_name,value)
+#define add_num2json(value) w.add_number(field_name,value)
 #define add_tv2json(value) \
-	if(timerisset(&value)) cJSON_AddNumberToObject(j,field_name,timeval2double(value)); \
-	else cJSON_AddNullToObject(j,field_name)
+	if(timerisset(&value)) w.add_number(field_name,timeval2double(value)); \
+	else w.add_null(field_name)
 
-char *Cdr::serialize_rtp_stats(){
+void Cdr::serialize_rtp_stats(JsonWriter &w){
 	int i = 0;
-	cJSON *j;
-	char *s;
 	static const char *fields[] = {
 		"lega_rx_payloads",
 		"lega_tx_payloads",
@@ -450,7 +484,7 @@ char *Cdr::serialize_rtp_stats(){
 		"legb_rx_parse_errs",
 	};
 
-	j = cJSON_CreateObject();
+	w.begin_object();
 
 	//tx/rx uploads
 	add_str2json(join_str_vector2(
@@ -487,15 +521,11 @@ char *Cdr::serialize_rtp_stats(){
 	add_num2json(legB_stream_errors.out_of_buffer_errors);
 	add_num2json(legB_stream_errors.rtp_parse_errors);
 
-	s = cJSON_PrintUnformatted(j);
-	cJSON_Delete(j);
-	return s;
+	w.end_object();
 }
 
-char *Cdr::serialize_timers_data(){
+void Cdr::serialize_timers_data(JsonWriter &w){
 	int i = 0;
-	cJSON *j;
-	char *s;
 
 	static const char *fields[] = {
 		"time_start",
@@ -508,7 +538,7 @@ char *Cdr::serialize_timers_data(){
 		"isup_propagation_delay"
 	};
 
-	j = cJSON_CreateObject();
+	w.begin_object();
 
 	add_tv2json(start_time);
 	add_tv2json(bleg_invite_time);
@@ -519,9 +549,7 @@ char *Cdr::serialize_timers_data(){
 	add_num2json(time_limit);
 	add_num2json(isup_propagation_delay);
 
-	s = cJSON_PrintUnformatted(j);
-	cJSON_Delete(j);
-	return s;
+	w.end_object();
 }
 
 void Cdr::add_dtmf_event(bool aleg, int event, struct timeval &now, int rx_proto, int tx_proto)
@@ -531,89 +559,76 @@ void Cdr::add_dtmf_event(bool aleg, int event, struct timeval &now, int rx_proto
 	q.push(dtmf_event_info(event,now,rx_proto,tx_proto));
 }
 
-cJSON *Cdr::dtmf_event_info::serialize2json(const struct timeval *t) {
+void Cdr::dtmf_event_info::serialize2json(JsonWriter &w, const struct timeval *t) {
 	struct timeval offset;
 
-	cJSON *j = cJSON_CreateObject();
+	w.begin_object();
 
-	cJSON_AddNumberToObject(j,"e",event);
-	cJSON_AddNumberToObject(j,"r",rx_proto);
-	cJSON_AddNumberToObject(j,"t",tx_proto);
+	w.add_number("e",event);
+	w.add_number("r",rx_proto);
+	w.add_number("t",tx_proto);
 
 	timersub(&time,t,&offset);
-	cJSON_AddNumberToObject(j,"o",timeval2double(offset));
+	w.add_number("o",timeval2double(offset));
 
-	return j;
+	w.end_object();
 }
 
-char *Cdr::serialize_dtmf_events() {
-	cJSON *j, *a;
-
+void Cdr::serialize_dtmf_events(JsonWriter &w) {
 	const struct timeval *t = timerisset(&connect_time) ? &connect_time : &end_time;
 
-	j = cJSON_CreateObject();
+	w.begin_object();
 
-	a = cJSON_CreateArray();
+	w.begin_array("a2b");
 	while(!dtmf_events_a2b.empty()){
-		cJSON_AddItemToArray(a,
-			dtmf_events_a2b.front().serialize2json(t));
+		dtmf_events_a2b.front().serialize2json(w,t);
 		dtmf_events_a2b.pop();
 	}
-	cJSON_AddItemToObject(j,"a2b",a);
+	w.end_array();
 
-	a = cJSON_CreateArray();
+	w.begin_array("b2a");
 	while(!dtmf_events_b2a.empty()){
-		cJSON_AddItemToArray(a,
-			dtmf_events_b2a.front().serialize2json(t));
+		dtmf_events_b2a.front().serialize2json(w,t);
 		dtmf_events_b2a.pop();
 	}
-	cJSON_AddItemToObject(j,"b2a",a);
-
-	char *s = cJSON_PrintUnformatted(j);
-	cJSON_Delete(j);
+	w.end_array();
 
-	return s;
+	w.end_object();
 }
 
-char *Cdr::serialize_dynamic(const DynFieldsT &df) {
-	cJSON *j;
-	char *s;
-
-	j = cJSON_CreateObject();
+void Cdr::serialize_dynamic(JsonWriter &w, const DynFieldsT &df) {
+	w.begin_object();
 
+	unsigned int slot = 0;
 	for(DynFieldsT_const_iterator it = df.begin();
-		it!=df.end();++it)
+		it!=df.end();++it,++slot)
 	{
-		const string &name = it->name.c_str();
-		const char *namep = name.c_str();
-		const AmArg &arg = dyn_fields[name];
-		//invoc_AmArg(invoc, dyn_fields[it->first]);
+		const char *namep = it->name.c_str();
+		const AmArg &arg = dyn_field(slot);
 		switch(arg.getType()){
 		case AmArg::Int:
-			cJSON_AddNumberToObject(j,namep,arg.asInt());
+			w.add_number(namep,arg.asInt());
 			break;
 		case AmArg::LongLong:
-			cJSON_AddNumberToObject(j,namep,arg.asLongLong());
+			w.add_number(namep,arg.asLongLong());
 			break;
 		case AmArg::Bool:
-			cJSON_AddBoolToObject(j,namep,arg.asBool());
+			w.add_bool(namep,arg.asBool());
 			break;
 		case AmArg::CStr:
-			cJSON_AddStringToObject(j,namep,arg.asCStr());
+			w.add_string(namep,arg.asCStr());
 			break;
 		case AmArg::Undef:
-			cJSON_AddNullToObject(j,namep);
+			w.add_null(namep);
 			break;
 		default:
-			ERROR("invoc_AmArg. unhandled AmArg type %s",
+			ERROR("serialize_dynamic. unhandled AmArg type %s",
 				  arg.t2str(arg.getType()));
-			cJSON_AddNullToObject(j,namep);
+			w.add_null(namep);
 		} //switch
 	} //for
 
-	s = cJSON_PrintUnformatted(j);
-	cJSON_Delete(j);
-	return s;
+	w.end_object();
 }
 
 #undef add_str2json
@@ -621,180 +636,97 @@ char *Cdr::serialize_dynamic(const DynFieldsT &df) {
 #undef add_num2json
 #undef field_name
 
-static inline void invoc_AmArg(pqxx::prepare::invocation &invoc,const AmArg &arg){
-	short type = arg.getType();
-	switch(type){
-	case AmArg::Int:      { invoc(arg.asInt()); } break;
-	case AmArg::LongLong: { invoc(arg.asLongLong()); } break;
-	case AmArg::Bool:     { invoc(arg.asBool()); } break;
-	case AmArg::CStr:     { invoc(arg.asCStr()); } break;
-	case AmArg::Undef:    { invoc(); } break;
-	default: {
-		ERROR("invoc_AmArg. unhandled AmArg type %s",arg.t2str(type));
-		invoc();
-	}
-	}
-}
-
-void Cdr::invoc(pqxx::prepare::invocation &invoc,
-				AmArg &invoced_values,
+void Cdr::get_fields_values(AmArg &fields_values,
 				const DynFieldsT &df,
 				bool serialize_dynamic_fields)
 {
-#define invoc_field(field_value)\
-	invoced_values.push(AmArg(field_value));\
-	invoc(field_value);
-
-#define invoc_null()\
-	invoced_values.push(AmArg());\
-	invoc();
-
-#define invoc_field_cond(field_value,condition)\
-	if(condition) { invoc_field(field_value); }\
-	else { invoc_null(); }
-
-#define invoc_json(func) do { \
-	char *s = func; \
-	invoc_field(s); \
-	free(s); \
+#define add_field(field_value)\
+	fields_values.push(AmArg(field_value));
+
+#define add_null()\
+	fields_values.push(AmArg());
+
+#define add_field_cond(field_value,condition)\
+	if(condition) { add_field(field_value); }\
+	else { add_null(); }
+
+#define add_json(func) do { \
+	w.reset(); \
+	func; \
+	add_field(w.str()); \
 } while(0)
 
-	invoc_field(attempt_num);
-	invoc_field(is_last);
-	invoc_field(legA_local_ip);
-	invoc_field(legA_local_port);
-	invoc_field(legA_remote_ip);
-	invoc_field(legA_remote_port);
-	invoc_field(legB_local_ip);
-	invoc_field(legB_local_port);
-	invoc_field(legB_remote_ip);
-	invoc_field(legB_remote_port);
-
-	invoc_json(serialize_timers_data());
-
-	invoc_field(sip_early_media_present);
-	invoc_field(disconnect_code);
-	invoc_field(disconnect_reason);
-	invoc_field(disconnect_initiator);
-	invoc_field(disconnect_internal_code);
-	invoc_field(disconnect_internal_reason);
+	JsonWriter &w = JsonWriter::local();
+
+	fields_values.assertArray();
+
+	add_field(attempt_num);
+	add_field(is_last);
+	add_field(legA_local_ip);
+	add_field(legA_local_port);
+	add_field(legA_remote_ip);
+	add_field(legA_remote_port);
+	add_field(legB_local_ip);
+	add_field(legB_local_port);
+	add_field(legB_remote_ip);
+	add_field(legB_remote_port);
+
+	add_json(serialize_timers_data(w));
+
+	add_field(sip_early_media_present);
+	add_field(disconnect_code);
+	add_field(disconnect_reason);
+	add_field(disconnect_initiator);
+	add_field(disconnect_internal_code);
+	add_field(disconnect_internal_reason);
 	if(is_last){
-		invoc_field(disconnect_rewrited_code);
-		invoc_field(disconnect_rewrited_reason);
+		add_field(disconnect_rewrited_code);
+		add_field(disconnect_rewrited_reason);
 	} else {
-		invoc_field(0);
-		invoc_field("");
+		add_field(0);
+		add_field("");
 	}
-	invoc_field(orig_call_id);
-	invoc_field(term_call_id);
-	invoc_field(local_tag);
-	invoc_field(msg_logger_path);
-	invoc_field(dump_level_id);
-	invoc_field(audio_record_enabled);
+	add_field(orig_call_id);
+	add_field(term_call_id);
+	add_field(local_tag);
+	add_field(msg_logger_path);
+	add_field(dump_level_id);
+	add_field(audio_record_enabled);
 
-	invoc_json(serialize_rtp_stats());
+	add_json(serialize_rtp_stats(w));
 
-	invoc_field(global_tag);
+	add_field(global_tag);
 
-	invoc_field(resources);
-	invoc_field(active_resources);
+	add_field(resources);
+	add_field(active_resources);
 
-	invoc_field_cond(failed_resource_type_id,
-					 failed_resource_type_id!=-1);
-	invoc_field_cond(failed_resource_id,
-					 failed_resource_id!=-1);
+	add_field_cond(failed_resource_type_id,
+				   failed_resource_type_id!=-1);
+	add_field_cond(failed_resource_id,
+				   failed_resource_id!=-1);
 
 	if(dtmf_events_a2b.empty() && dtmf_events_b2a.empty()) {
-		invoc_null();
+		add_null();
 	} else {
-		invoc_json(serialize_dtmf_events());
+		add_json(serialize_dtmf_events(w));
 	}
 
-	/* invocate dynamic fields  */
+	/* dynamic fields  */
 	if(serialize_dynamic_fields){
-		invoc_json(serialize_dynamic(df));
+		add_json(serialize_dynamic(w,df));
 	} else {
-		for(DynFieldsT_const_iterator it = df.begin();
-			it!=df.end();++it)
-		invoc_AmArg(invoc, dyn_fields[it->name]);
+		for(unsigned int slot = 0;slot < df.size();slot++)
+			fields_values.push(dyn_field(slot));
 	}
-	/* invocate trusted hdrs  */
+	/* trusted hdrs  */
 	for(vector<AmArg>::const_iterator i = trusted_hdrs.begin();
 		i != trusted_hdrs.end(); ++i)
-	invoc_AmArg(invoc,*i);
-
-#undef invoc_json
-#undef invoc_field
-}
-
-template<class T>
-static void join_csv(ofstream &s, const T &a){
-	if(!a.size())
-		return;
+	fields_values.push(*i);
 
-	int n = a.size()-1;
-
-	s << ",";
-	for(int k = 0;k<n;k++)
-		s << "'" << AmArg::print(a[k]) << "',";
-	s << "'" << AmArg::print(a[n]) << "'";
-}
-
-void Cdr::to_csv_stream(ofstream &s, const DynFieldsT &df)
-{
-#define add_value(v) s << "'"<<v<< "'" << ','
-#define add_json(func) do { \
-	char *jstr = func; \
-	add_value(jstr); \
-	free(jstr); \
-} while(0)
-
-	add_value(attempt_num);
-	add_value(is_last);
-	add_value(legA_local_ip); add_value(legA_local_port);
-	add_value(legA_remote_ip); add_value(legA_remote_port);
-	add_value(legB_local_ip); add_value(legB_local_port);
-	add_value(legB_remote_ip); add_value(legB_remote_port);
-	add_value(sip_early_media_present);
-	add_json(serialize_timers_data());
-
-	add_value(disconnect_code); add_value(disconnect_reason);
-	add_value(disconnect_initiator);
-	add_value(disconnect_internal_code); add_value(disconnect_internal_reason);
-
-	if(is_last){
-		add_value(disconnect_rewrited_code);
-		add_value(disconnect_rewrited_reason);
-	} else {
-		add_value(0);
-		add_value("");
-	}
-
-	add_value(orig_call_id); add_value(term_call_id);
-	add_value(local_tag); add_value(msg_logger_path);
-	add_value(dump_level_id);
-
-	add_json(serialize_rtp_stats());
-
-	add_value(global_tag);
-
-	add_value(resources);
-	add_value(active_resources);
-
-		//dynamic fields
-	if(dyn_fields.size()){
-		s << ",";
-		for(DynFieldsT_const_iterator it = df.begin();
-			it!=df.end();++it)
-		{
-			if(it!=df.begin()) s << ",";
-			s << "'" << AmArg::print(dyn_fields[it->name]) << "'";
-		}
-	}
-		//trusted fields
-	join_csv(s,trusted_hdrs);
 #undef add_json
-#undef add_value
+#undef add_field_cond
+#undef add_null
+#undef add_field
 }
 
 void Cdr::info(AmArg &s)
@@ -7,7 +7,7 @@
 #include "../resources/Resource.h"
 #include "AmRtpStream.h"
 #include "AmISUP.h"
-#include "cJSON.h"
+#include "JsonWriter.h"
 #include <pqxx/pqxx>
 
 enum UpdateAction {
@@ -78,11 +78,16 @@ struct Cdr: public
 	string global_tag;
     int time_limit;
 
-    AmArg dyn_fields;
+    DynFieldsValues dyn_fields;	//indexed by DynField position
     string outbound_proxy;
 
 	vector<AmArg> trusted_hdrs;
 
+	//filled once by CdrThread to reuse on failover and spooling
+	AmArg fields_values;
+	unsigned long long spool_id;
+	struct timeval queued_time;		//CdrThread::postcdr() time
+
 	AmRtpStream::PayloadsHistory legA_payloads;
 	AmRtpStream::PayloadsHistory legB_payloads;
 
@@ -105,7 +110,7 @@ struct Cdr: public
 		struct timeval time;
 		dtmf_event_info(int e,struct timeval &now, int r, int t):
 			event(e), time(now), rx_proto(r), tx_proto(t) {}
-		cJSON *serialize2json(const struct timeval *t);
+		void serialize2json(JsonWriter &w, const struct timeval *t);
 	};
 	std::queue<dtmf_event_info> dtmf_events_a2b;
 	std::queue<dtmf_event_info> dtmf_events_b2a;
@@ -116,6 +121,9 @@ struct Cdr: public
     ~Cdr();
 
     void init();
+	/* prepare recycled object for the new call. see CdrPool */
+	void reset();
+	void init_next_attempt(const Cdr &cdr);
 	void update_sql(const SqlCallProfile &profile);
 	void update_sbc(const SBCCallProfile &profile);
 	void update(const AmSipRequest &req);
@@ -137,18 +145,22 @@ struct Cdr: public
     void refuse(const SBCCallProfile &profile);
 	void refuse(int code, string reason);
 
-	void invoc(pqxx::prepare::invocation &invoc,
-			   AmArg &invoced_values,
+	/* writecdr() arguments after is_master,node_id,pop_id */
+	void get_fields_values(AmArg &fields_values,
 			   const DynFieldsT &df,
 			   bool serialize_dynamic_fields);
-	void to_csv_stream(ofstream &s, const DynFieldsT &df);
     //serializators
-    char *serialize_rtp_stats();
-	char *serialize_timers_data();
-	char *serialize_dtmf_events();
-	char *serialize_dynamic(const DynFieldsT &df);
+    void serialize_rtp_stats(JsonWriter &w);
+	void serialize_timers_data(JsonWriter &w);
+	void serialize_dtmf_events(JsonWriter &w);
+	void serialize_dynamic(JsonWriter &w, const DynFieldsT &df);
 
 	void info(AmArg &s);
+
+	const AmArg &dyn_field(unsigned int slot) const {
+		static const AmArg undef;
+		return slot < dyn_fields.size() ? dyn_fields[slot] : undef;
+	}
 };
 
 #endif // CDR_H
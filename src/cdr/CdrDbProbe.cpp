@@ -0,0 +1,238 @@
+#include "CdrDbProbe.h"
+#include "CdrWriter.h"
+#include "../alarms.h"
+#include "log.h"
+
+#include <libpq-fe.h>
+
+CdrDbProbe::CdrDbProbe():
+	wakeup(false),
+	stopped(false),
+	gotostop(false),
+	config(NULL)
+{
+	for(int i = 0;i<2;i++){
+		role &r = roles[i];
+		r.master = (i==0);
+		r.name = r.master ? "master" : "slave";
+		r.alarm_id = r.master ? alarms::CDR_DB_CONN : alarms::CDR_DB_CONN_SLAVE;
+		r.enabled = false;
+		r.reachable = true;
+		r.need_conn = false;
+		r.ready = NULL;
+		r.alarm = false;
+	}
+	clearStats();
+}
+
+CdrDbProbe::~CdrDbProbe()
+{
+	cleanup();
+}
+
+void CdrDbProbe::configure(const CdrThreadCfg &cfg)
+{
+	config = &cfg;
+	roles[0].conn_str = cfg.masterdb.conn_str();
+	roles[0].enabled = true;
+	roles[1].conn_str = cfg.slavedb.conn_str();
+	roles[1].enabled = cfg.failover_to_slave;
+}
+
+void CdrDbProbe::cleanup()
+{
+	AmLock l(mut);
+	for(int i = 0;i<2;i++){
+		delete roles[i].ready;
+		roles[i].ready = NULL;
+	}
+	for(list<cdr_writer_connection *>::iterator it = retired.begin();
+		it!=retired.end();++it)
+	{
+		delete *it;
+	}
+	retired.clear();
+}
+
+void CdrDbProbe::exchange(role &r, cdr_writer_connection *&conn)
+{
+	if(!r.enabled)
+		return;
+
+	if(conn && !conn->is_open()){
+		//writer closes connection on exception. destroy it out of writer loop
+		retired.push_back(conn);
+		conn = NULL;
+	}
+
+	if(conn)
+		return;
+
+	if(r.ready){
+		DBG("CdrDbProbe %p: pass ready %s connection to writer",this,r.name);
+		conn = r.ready;
+		r.ready = NULL;
+		r.exchanges++;
+	} else {
+		r.need_conn = true;
+	}
+}
+
+void CdrDbProbe::exchange(cdr_writer_connection *&masterconn,
+						  cdr_writer_connection *&slaveconn)
+{
+	bool wake;
+	mut.lock();
+		exchange(roles[0],masterconn);
+		exchange(roles[1],slaveconn);
+		wake = !retired.empty() ||
+			   (roles[0].need_conn && !roles[0].ready) ||
+			   (roles[1].need_conn && !roles[1].ready);
+	mut.unlock();
+	if(wake) wakeup.set(true);
+}
+
+bool CdrDbProbe::ping(role &r)
+{
+	//checks server accepts connections without session setup
+	if(PQPING_OK==PQping(r.conn_str.c_str()))
+		return true;
+	r.pings_failed++;
+	return false;
+}
+
+void CdrDbProbe::set_alarm(role &r, bool failed)
+{
+	if(failed && !r.alarm){
+		ERROR("CdrDbProbe %p %s DB connection failed alarm raised",this,r.name);
+		r.alarm = true;
+		RAISE_ALARM(r.alarm_id);
+	} else if(!failed && r.alarm){
+		INFO("CdrDbProbe %p %s DB connection failed alarm cleared",this,r.name);
+		r.alarm = false;
+		CLEAR_ALARM(r.alarm_id);
+	}
+}
+
+void CdrDbProbe::probe(role &r)
+{
+	cdr_writer_connection *c = NULL;
+	bool need_conn;
+
+	if(!r.enabled)
+		return;
+
+	r.reachable = ping(r);
+
+	mut.lock();
+		need_conn = r.need_conn && !r.ready;
+		//ready connection is not used by writer yet. we can check it
+		c = r.ready;
+		r.ready = NULL;
+	mut.unlock();
+
+	if(c){
+		try {
+			pqxx::work t(*c);
+			t.commit();
+		} catch(const pqxx::pqxx_exception &e){
+			DBG("CdrDbProbe %p: ready %s connection is broken: %s",
+				this,r.name,e.base().what());
+			delete c;
+			c = NULL;
+			need_conn = true;
+		}
+	}
+
+	if(!c && need_conn && r.reachable){
+		try {
+			if(!cdr_connectdb(&c,r.conn_str,r.master,*config)){
+				delete c;
+				c = NULL;
+			}
+		} catch(const std::exception &e){
+			ERROR("CdrDbProbe %p: %s connection failed: %s",this,r.name,e.what());
+			delete c;
+			c = NULL;
+		}
+		if(c) r.connects++;
+		else r.connect_failures++;
+	}
+
+	mut.lock();
+		r.ready = c;
+		if(c) r.need_conn = false;
+	mut.unlock();
+
+	set_alarm(r,!r.reachable || (need_conn && !c));
+}
+
+void CdrDbProbe::run()
+{
+	list<cdr_writer_connection *> to_delete;
+
+	setThreadName("yeti-cdr-probe");
+	INFO("Starting CdrDbProbe thread");
+
+	while(true){
+		wakeup.wait_for_to(config->check_interval);
+		wakeup.set(false);
+
+		if(gotostop){
+			stopped.set(true);
+			return;
+		}
+
+		mut.lock();
+			to_delete.swap(retired);
+		mut.unlock();
+		for(list<cdr_writer_connection *>::iterator it = to_delete.begin();
+			it!=to_delete.end();++it)
+		{
+			delete *it;
+		}
+		to_delete.clear();
+
+		probe(roles[0]);
+		probe(roles[1]);
+	}
+}
+
+void CdrDbProbe::on_stop()
+{
+	INFO("Stopping CdrDbProbe thread");
+	gotostop = true;
+	wakeup.set(true);
+	stopped.wait_for();
+	cleanup();
+}
+
+void CdrDbProbe::getStats(AmArg &arg)
+{
+	AmLock l(mut);
+	for(int i = 0;i<2;i++){
+		const role &r = roles[i];
+		if(!r.enabled)
+			continue;
+		AmArg &a = arg[r.name];
+		a["reachable"] = r.reachable;
+		a["need_conn"] = r.need_conn;
+		a["ready"] = r.ready!=NULL;
+		a["pings_failed"] = (long)r.pings_failed;
+		a["connects"] = (long)r.connects;
+		a["connect_failures"] = (long)r.connect_failures;
+		a["exchanges"] = (long)r.exchanges;
+	}
+	arg["retired"] = (int)retired.size();
+}
+
+void CdrDbProbe::clearStats()
+{
+	for(int i = 0;i<2;i++){
+		role &r = roles[i];
+		r.pings_failed = 0;
+		r.connects = 0;
+		r.connect_failures = 0;
+		r.exchanges = 0;
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef _CdrDbProbe_h_
+#define _CdrDbProbe_h_
+
+#include "AmThread.h"
+#include "AmArg.h"
+
+#include <string>
+#include <list>
+
+using std::string;
+using std::list;
+
+class cdr_writer_connection;
+struct CdrThreadCfg;
+
+/* health probing and reconnection of CdrThread DB connections.
+ *
+ * runs on its own timer out of the writer loop. servers are pinged without
+ * session setup. when writer has no usable connection the probe connects
+ * and prepares a new one which is picked up by writer in exchange().
+ * broken connections are handed back to the probe to be destroyed here */
+
+class CdrDbProbe : public AmThread {
+	struct role {
+		const char *name;
+		string conn_str;
+		bool master;
+		bool enabled;
+		bool reachable;
+		bool need_conn;					//writer has no usable connection
+		cdr_writer_connection *ready;	//connected and prepared for writer
+		bool alarm;
+		int alarm_id;
+		unsigned long pings_failed;
+		unsigned long connects;
+		unsigned long connect_failures;
+		unsigned long exchanges;
+	} roles[2];
+	list<cdr_writer_connection *> retired;
+	AmMutex mut;
+	AmCondition<bool> wakeup;
+	AmCondition<bool> stopped;
+	bool gotostop;
+	const CdrThreadCfg *config;
+
+	bool ping(role &r);
+	void probe(role &r);
+	void set_alarm(role &r, bool failed);
+	void exchange(role &r, cdr_writer_connection *&conn);
+	void cleanup();
+
+  public:
+	CdrDbProbe();
+	~CdrDbProbe();
+
+	void configure(const CdrThreadCfg &cfg);
+
+	/* called by writer. retires closed connections,
+	 * replaces missed ones with ready connections if any
+	 * and requests reconnection otherwise. never blocks on DB */
+	void exchange(cdr_writer_connection *&masterconn,
+				  cdr_writer_connection *&slaveconn);
+
+	void getStats(AmArg &arg);
+	void clearStats();
+
+	void run();
+	void on_stop();
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include "CdrFileCompressor.h"
+#include "log.h"
+
+#include <zlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#define COMPRESS_CHUNK_SIZE (128*1024)
+
+CdrFileCompressor::CdrFileCompressor():
+	queue_run(false),
+	stopped(false),
+	gotostop(false),
+	level(Z_DEFAULT_COMPRESSION)
+{
+	clearStats();
+}
+
+CdrFileCompressor::~CdrFileCompressor()
+{ }
+
+void CdrFileCompressor::configure(int compression_level)
+{
+	level = compression_level;
+}
+
+void CdrFileCompressor::post(const string &path)
+{
+	queue_mut.lock();
+		if(claimed.count(path)){
+			DBG("CdrFileCompressor: '%s' is claimed. skip it",path.c_str());
+		} else {
+			queue.push_back(path);
+			queue_run.set(true);
+		}
+	queue_mut.unlock();
+}
+
+bool CdrFileCompressor::claim(const string &path)
+{
+	AmLock l(queue_mut);
+	if(path==current ||
+	   std::find(queue.begin(),queue.end(),path)!=queue.end())
+		return false;
+	claimed.insert(path);
+	return true;
+}
+
+void CdrFileCompressor::unclaim(const string &path)
+{
+	AmLock l(queue_mut);
+	claimed.erase(path);
+}
+
+void CdrFileCompressor::getStats(AmArg &arg)
+{
+	queue_mut.lock();
+		arg["queue_len"] = (int)queue.size();
+	queue_mut.unlock();
+	arg["compressed"] = (long int)stats.compressed;
+	arg["failed"] = (long int)stats.failed;
+	arg["bytes_in"] = (long int)stats.bytes_in;
+	arg["bytes_out"] = (long int)stats.bytes_out;
+}
+
+void CdrFileCompressor::clearStats()
+{
+	stats.compressed = 0;
+	stats.failed = 0;
+	stats.bytes_in = 0;
+	stats.bytes_out = 0;
+}
+
+bool CdrFileCompressor::compress(const string &path)
+{
+	char mode[8];
+	static char buf[COMPRESS_CHUNK_SIZE];
+	string gz_path = path+CDR_FILE_COMPRESSED_SUFFIX;
+	string tmp_path = gz_path+".tmp";
+	unsigned long long in_bytes = 0;
+	struct stat st;
+	ssize_t r;
+	gzFile gz;
+	int fd;
+
+	if(-1==(fd = open(path.c_str(),O_RDONLY))){
+		ERROR("CdrFileCompressor: can't open '%s': %s",path.c_str(),strerror(errno));
+		return false;
+	}
+
+	snprintf(mode,sizeof(mode),"wb%d",level < 0 ? 6 : level);
+	if(NULL==(gz = gzopen(tmp_path.c_str(),mode))){
+		ERROR("CdrFileCompressor: can't open '%s' for writing",tmp_path.c_str());
+		close(fd);
+		return false;
+	}
+
+	while((r = read(fd,buf,sizeof(buf))) > 0){
+		if(gzwrite(gz,buf,r)!=r){
+			int errnum;
+			ERROR("CdrFileCompressor: failed to write '%s': %s",
+				  tmp_path.c_str(),gzerror(gz,&errnum));
+			break;
+		}
+		in_bytes+=r;
+	}
+	close(fd);
+
+	if(r!=0){
+		if(r < 0)
+			ERROR("CdrFileCompressor: failed to read '%s': %s",path.c_str(),strerror(errno));
+		gzclose(gz);
+		unlink(tmp_path.c_str());
+		return false;
+	}
+
+	if(Z_OK!=gzclose(gz)){
+		ERROR("CdrFileCompressor: failed to close '%s'",tmp_path.c_str());
+		unlink(tmp_path.c_str());
+		return false;
+	}
+
+	if(0!=rename(tmp_path.c_str(),gz_path.c_str())){
+		ERROR("CdrFileCompressor: can't move '%s' to '%s': %s",
+			  tmp_path.c_str(),gz_path.c_str(),strerror(errno));
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	unlink(path.c_str());
+
+	stats.bytes_in+=in_bytes;
+	if(0==stat(gz_path.c_str(),&st))
+		stats.bytes_out+=st.st_size;
+
+	DBG("CdrFileCompressor: '%s' compressed to '%s'",path.c_str(),gz_path.c_str());
+	return true;
+}
+
+void CdrFileCompressor::run()
+{
+	string path;
+
+	setThreadName("yeti-cdr-gz");
+	INFO("Starting CdrFileCompressor thread");
+
+	while(true){
+		queue_run.wait_for();
+
+		if(gotostop){
+			stopped.set(true);
+			return;
+		}
+
+		queue_mut.lock();
+			if(queue.empty()){
+				queue_run.set(false);
+				queue_mut.unlock();
+				continue;
+			}
+			path = queue.front();
+			queue.pop_front();
+			current = path;
+		queue_mut.unlock();
+
+		if(compress(path)) stats.compressed++;
+		else stats.failed++;
+
+		queue_mut.lock();
+			current.clear();
+		queue_mut.unlock();
+	}
+}
+
+void CdrFileCompressor::on_stop()
+{
+	INFO("Stopping CdrFileCompressor thread");
+	gotostop = true;
+	queue_run.set(true);
+	stopped.wait_for();
+}
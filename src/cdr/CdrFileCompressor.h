@@ -0,0 +1,58 @@
+#ifndef _CdrFileCompressor_h_
+#define _CdrFileCompressor_h_
+
+#include "AmThread.h"
+#include "AmArg.h"
+
+#include <string>
+#include <list>
+#include <set>
+
+using std::string;
+using std::list;
+using std::set;
+
+#define CDR_FILE_COMPRESSED_SUFFIX ".gz"
+
+/* gzip completed CDR failover files out of writer threads.
+ * file is compressed into path.gz.tmp which is renamed to path.gz
+ * and source file is removed on success.
+ * file claimed by the importer is not compressed (see claim()) */
+
+class CdrFileCompressor : public AmThread {
+	list<string> queue;
+	string current;			//file under compression
+	set<string> claimed;
+	AmMutex queue_mut;
+	AmCondition<bool> queue_run;
+	AmCondition<bool> stopped;
+	bool gotostop;
+	int level;
+
+	struct {
+		unsigned long compressed;
+		unsigned long failed;
+		unsigned long long bytes_in;
+		unsigned long long bytes_out;
+	} stats;
+
+	bool compress(const string &path);
+
+  public:
+	CdrFileCompressor();
+	~CdrFileCompressor();
+
+	void configure(int compression_level);
+	void post(const string &path);
+	/* take file for use as is. returns false if file is queued or compressed now */
+	bool claim(const string &path);
+	void unclaim(const string &path);
+
+	void getStats(AmArg &arg);
+	void clearStats();
+
+	void run();
+	void on_stop();
+};
+
+#endif
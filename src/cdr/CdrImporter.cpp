@@ -0,0 +1,460 @@
+#include "CdrImporter.h"
+#include "log.h"
+
+#include <sys/time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#define FIELDS_DESCR_HEADER "#fields_descr: "
+#define PROGRESS_SUFFIX ".progress"
+#define FAILED_SUFFIX ".failed"
+
+static bool has_suffix(const string &name, const char *suffix)
+{
+	size_t len = strlen(suffix);
+	return name.size() > len && 0==name.compare(name.size()-len,len,suffix);
+}
+
+CdrImporter::CdrImporter(const CdrWriterCfg &cfg, CdrFileCompressor *file_compressor):
+	config(cfg),
+	conn(NULL),
+	compressor(file_compressor),
+	stop_event(false),
+	stopped(false),
+	state(IMPORT_IDLE),
+	current_rows(0)
+{
+	ostringstream s;
+	write_cdr_file_fields_descr(s,config);
+	expected_fields_descr = s.str();
+	expected_columns = std::count(expected_fields_descr.begin(),
+								  expected_fields_descr.end(),',')+1;
+
+	clearStats();
+}
+
+CdrImporter::~CdrImporter()
+{
+	disconnect();
+}
+
+void CdrImporter::getStats(AmArg &arg)
+{
+	static const char *state_str[] = {
+		"idle",
+		"no_connection",
+		"running"
+	};
+
+	AmLock l(state_mut);
+	arg["state"] = state_str[state];
+	arg["pending_files"] = (int)pending_files;
+	if(state==IMPORT_RUNNING){
+		arg["current_file"] = current_file;
+		arg["current_rows"] = (long)current_rows;
+	}
+	arg["files_imported"] = (long)stats.files_imported;
+	arg["files_failed"] = (long)stats.files_failed;
+	arg["rows_imported"] = (long)stats.rows_imported;
+	arg["rows_failed"] = (long)stats.rows_failed;
+	arg["db_errors"] = (long)stats.db_errors;
+	arg["ambiguous_batches"] = (long)stats.ambiguous_batches;
+}
+
+void CdrImporter::clearStats()
+{
+	AmLock l(state_mut);
+	pending_files = 0;
+	stats.files_imported = 0;
+	stats.files_failed = 0;
+	stats.rows_imported = 0;
+	stats.rows_failed = 0;
+	stats.db_errors = 0;
+	stats.ambiguous_batches = 0;
+}
+
+void CdrImporter::set_state(state_t s)
+{
+	AmLock l(state_mut);
+	state = s;
+}
+
+bool CdrImporter::connect()
+{
+	if(conn)
+		return true;
+	try {
+		conn = new cdr_writer_connection(config.masterdb.conn_str(),true);
+		if(!conn->is_open()){
+			delete conn;
+			conn = NULL;
+			return false;
+		}
+		prepare_cdr_queries(conn,config);
+		INFO("CdrImporter: SQL connected. Backend pid: %d.",conn->backendpid());
+	} catch(const std::exception &e){
+		DBG("CdrImporter: SQL connection exception: %s",e.what());
+		delete conn;
+		conn = NULL;
+		return false;
+	}
+	return true;
+}
+
+void CdrImporter::disconnect()
+{
+	if(!conn)
+		return;
+	try {
+		conn->disconnect();
+	} catch(...) { }
+	delete conn;
+	conn = NULL;
+}
+
+void CdrImporter::scan(vector<string> &files)
+{
+	DIR *d = opendir(config.failover_file_completed_dir.c_str());
+	if(!d){
+		ERROR("CdrImporter: can't open '%s': %s",
+			  config.failover_file_completed_dir.c_str(),strerror(errno));
+		return;
+	}
+	struct dirent *e;
+	while((e = readdir(d))!=NULL){
+		string name(e->d_name);
+		if(!has_suffix(name,CDR_FILE_SUFFIX) &&
+		   !has_suffix(name,CDR_FILE_SUFFIX CDR_FILE_COMPRESSED_SUFFIX))
+			continue;
+		files.push_back(name);
+	}
+	closedir(d);
+
+	//file names begin with the creation time
+	std::sort(files.begin(),files.end());
+
+	AmLock l(state_mut);
+	pending_files = files.size();
+}
+
+bool CdrImporter::read_row(gzFile f, string &line)
+{
+	char buf[4096];
+	size_t quotes = 0;
+
+	line.clear();
+	while(gzgets(f,buf,sizeof(buf))){
+		size_t len = strlen(buf);
+		quotes+=std::count(buf,buf+len,'\'');
+		line.append(buf,len);
+		if(line[line.size()-1]!='\n')
+			continue;	//line is longer than buffer
+		if(quotes%2)
+			continue;	//newline within quoted value
+		line.erase(line.size()-1);
+		return true;
+	}
+	return !line.empty();
+}
+
+bool CdrImporter::parse_row(const string &line, AmArg &values)
+{
+	size_t i = 0, n = line.size();
+	string v;
+
+	values.assertArray();
+	while(true){
+		if(i < n && line[i]=='\''){
+			v.clear();
+			i++;
+			while(true){
+				if(i>=n) return false;	//unterminated value
+				if(line[i]=='\''){
+					if(i+1 < n && line[i+1]=='\''){
+						v+='\'';
+						i+=2;
+						continue;
+					}
+					i++;
+					break;
+				}
+				v+=line[i++];
+			}
+			values.push(AmArg(v));
+		} else {
+			if(i < n && line[i]!=',')
+				return false;	//unquoted value
+			values.push(AmArg());
+		}
+		if(i>=n) break;
+		if(line[i]!=',') return false;
+		i++;
+	}
+	return values.size()==expected_columns;
+}
+
+int CdrImporter::write_batch(const vector<AmArg> &batch, unsigned long &failed)
+{
+	try {
+		pqxx::work tnx(*conn);
+		if(!tnx.prepared("writecdr").exists()){
+			ERROR("CdrImporter: have no prepared SQL statement");
+			return -1;
+		}
+		for(vector<AmArg>::const_iterator it = batch.begin();
+			it!=batch.end();++it)
+		{
+			const AmArg &values = *it;
+			pqxx::prepare::invocation invoc = tnx.prepared("writecdr");
+			invoc(true);	//imported CDRs are written to master
+			for(unsigned int i = 0;i<values.size();i++){
+				const AmArg &a = values.get(i);
+				if(isArgUndef(a)) invoc();
+				else invoc(a.asCStr());
+			}
+			pqxx::result r = invoc.exec();
+			if(r.size()==0 || 0!=r[0][0].as<int>())
+				failed++;
+		}
+		tnx.commit();
+	} catch(const pqxx::in_doubt_error &e){
+		//commit outcome is unknown. batch will be imported again
+		ERROR("CdrImporter: batch commit is in doubt: %s",e.what());
+		state_mut.lock();
+			stats.db_errors++;
+			stats.ambiguous_batches++;
+		state_mut.unlock();
+		disconnect();
+		return -1;
+	} catch(const pqxx::broken_connection &e){
+		ERROR("CdrImporter: SQL connection exception: %s",e.what());
+		state_mut.lock();
+			stats.db_errors++;
+		state_mut.unlock();
+		disconnect();
+		return -1;
+	} catch(const pqxx::sql_error &e){
+		state_mut.lock();
+			stats.db_errors++;
+		state_mut.unlock();
+		if(batch.size()==1){
+			ERROR("CdrImporter: failed to import CDR: %s",e.what());
+			failed++;
+			return 0;
+		}
+		//find bad rows writing them one by one
+		DBG("CdrImporter: batch failed: %s. retry CDRs separately",e.what());
+		failed = 0;
+		for(vector<AmArg>::const_iterator it = batch.begin();
+			it!=batch.end();++it)
+		{
+			if(0!=write_batch(vector<AmArg>(1,*it),failed))
+				return -1;
+		}
+	} catch(const pqxx::pqxx_exception &e){
+		ERROR("CdrImporter: SQL exception: %s",e.base().what());
+		state_mut.lock();
+			stats.db_errors++;
+		state_mut.unlock();
+		disconnect();
+		return -1;
+	}
+	return 0;
+}
+
+unsigned long CdrImporter::load_progress(const string &path)
+{
+	unsigned long rows = 0;
+	ifstream f(path.c_str());
+	if(f.is_open())
+		f >> rows;
+	return rows;
+}
+
+void CdrImporter::save_progress(const string &path, unsigned long rows)
+{
+	ofstream f(path.c_str(),std::ofstream::out | std::ofstream::trunc);
+	if(!f.is_open()){
+		ERROR("CdrImporter: can't save progress to '%s'",path.c_str());
+		return;
+	}
+	f << rows << endl;
+}
+
+int CdrImporter::import_file(const string &name)
+{
+	string path = config.failover_file_completed_dir+"/"+name;
+	string progress_path = path+PROGRESS_SUFFIX;
+	vector<AmArg> batch;
+	unsigned long skip, row = 0;
+	bool header_ok = false;
+	bool have_line;
+	string line;
+	gzFile f;
+
+	//gzopen() reads plain files as is
+	bool plain = has_suffix(name,CDR_FILE_SUFFIX);
+	if(plain && compressor && !compressor->claim(path)){
+		DBG("CdrImporter: '%s' is queued for compression. skip it",name.c_str());
+		AmLock l(state_mut);
+		pending_files--;
+		return 0;
+	}
+
+	if(NULL==(f = gzopen(path.c_str(),"rb"))){
+		ERROR("CdrImporter: can't open '%s'",path.c_str());
+		goto file_failed;
+	}
+
+	//header
+	while((have_line = read_row(f,line))){
+		if(line.empty()) continue;
+		if(line[0]!='#') break;
+		if(0==line.compare(0,strlen(FIELDS_DESCR_HEADER),FIELDS_DESCR_HEADER))
+			header_ok = 0==line.compare(strlen(FIELDS_DESCR_HEADER),
+										string::npos,expected_fields_descr);
+	}
+	if(!header_ok){
+		ERROR("CdrImporter: '%s' fields are not the same as actual writecdr() arguments",
+			  path.c_str());
+		gzclose(f);
+		goto file_failed;
+	}
+
+	skip = load_progress(progress_path);
+	if(skip) INFO("CdrImporter: resume '%s' import after %lu rows",path.c_str(),skip);
+
+	state_mut.lock();
+		state = IMPORT_RUNNING;
+		current_file = name;
+		current_rows = skip;
+	state_mut.unlock();
+
+	while(have_line){
+		row++;
+		if(row > skip && !line.empty()){
+			AmArg values;
+			if(parse_row(line,values)){
+				batch.push_back(values);
+			} else {
+				ERROR("CdrImporter: '%s':%lu malformed row. skip it",path.c_str(),row);
+				AmLock l(state_mut);
+				stats.rows_failed++;
+			}
+		}
+
+		have_line = read_row(f,line);
+
+		if(batch.size() < (size_t)config.import_batch && (have_line || batch.empty()))
+			continue;
+
+		struct timeval start,now,diff;
+		unsigned long failed = 0;
+		gettimeofday(&start,NULL);
+
+		if(0!=write_batch(batch,failed)){
+			gzclose(f);
+			return -1;
+		}
+		save_progress(progress_path,row);
+
+		state_mut.lock();
+			stats.rows_imported+=batch.size()-failed;
+			stats.rows_failed+=failed;
+			current_rows = row;
+		state_mut.unlock();
+
+		//don't load DB faster than import_rate CDRs per second
+		gettimeofday(&now,NULL);
+		timersub(&now,&start,&diff);
+		long elapsed = diff.tv_sec*1000+diff.tv_usec/1000;
+		long expected = batch.size()*1000/config.import_rate;
+		batch.clear();
+		if(expected > elapsed && stop_event.wait_for_to(expected-elapsed)){
+			gzclose(f);
+			return -1;
+		}
+		if(stop_event.get()){
+			gzclose(f);
+			return -1;
+		}
+	}
+
+	if(!gzeof(f)){
+		int errnum;
+		ERROR("CdrImporter: failed to read '%s': %s",path.c_str(),gzerror(f,&errnum));
+		gzclose(f);
+		goto file_failed;
+	}
+	gzclose(f);
+
+	if(0!=rename(path.c_str(),(config.import_archive_dir+"/"+name).c_str())){
+		ERROR("CdrImporter: can't move '%s' to '%s': %s",
+			  path.c_str(),config.import_archive_dir.c_str(),strerror(errno));
+		goto file_failed;
+	}
+	unlink(progress_path.c_str());
+	if(plain && compressor) compressor->unclaim(path);
+
+	INFO("CdrImporter: '%s' imported. %lu rows",name.c_str(),row);
+	state_mut.lock();
+		stats.files_imported++;
+		pending_files--;
+		state = IMPORT_IDLE;
+	state_mut.unlock();
+	return 0;
+
+file_failed:
+	if(0!=rename(path.c_str(),(path+FAILED_SUFFIX).c_str())){
+		ERROR("CdrImporter: can't rename '%s': %s",path.c_str(),strerror(errno));
+	}
+	if(plain && compressor) compressor->unclaim(path);
+	state_mut.lock();
+		stats.files_failed++;
+		pending_files--;
+		state = IMPORT_IDLE;
+	state_mut.unlock();
+	return 1;
+}
+
+void CdrImporter::run()
+{
+	vector<string> files;
+
+	setThreadName("yeti-cdr-imp");
+	INFO("Starting CdrImporter thread");
+
+	while(!stop_event.wait_for_to(config.check_interval)){
+		if(!connect()){
+			set_state(IMPORT_NO_CONNECTION);
+			continue;
+		}
+		set_state(IMPORT_IDLE);
+
+		files.clear();
+		scan(files);
+		for(vector<string>::const_iterator it = files.begin();
+			it!=files.end();++it)
+		{
+			if(stop_event.get() || import_file(*it) < 0)
+				break;
+		}
+		if(!conn) set_state(IMPORT_NO_CONNECTION);
+		else set_state(IMPORT_IDLE);
+	}
+
+	disconnect();
+	stopped.set(true);
+}
+
+void CdrImporter::on_stop()
+{
+	INFO("Stopping CdrImporter thread");
+	stop_event.set(true);
+	stopped.wait_for();
+}
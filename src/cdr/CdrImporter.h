@@ -0,0 +1,83 @@
+#ifndef _CdrImporter_h_
+#define _CdrImporter_h_
+
+#include "AmThread.h"
+#include "AmArg.h"
+#include "CdrWriter.h"
+
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <set>
+
+using std::string;
+using std::vector;
+using std::set;
+
+/* loads completed failover CSV files back into the master DB.
+ *
+ * files are picked from failover_file_completed_dir
+ * (both plain and compressed ones. plain file is skipped
+ * while it is queued to CdrFileCompressor),
+ * header is checked against actual writecdr() arguments and
+ * rows are written in transactions of import_batch CDRs
+ * not faster than import_rate CDRs per second.
+ * imported rows count is saved into <file>.progress after each batch
+ * to resume import after restart or DB failure.
+ * imported file is moved to import_archive_dir,
+ * incompatible file is renamed to <file>.failed */
+
+class CdrImporter : public AmThread {
+	CdrWriterCfg config;
+	cdr_writer_connection *conn;
+	string expected_fields_descr;
+	unsigned int expected_columns;
+	CdrFileCompressor *compressor;
+
+	AmCondition<bool> stop_event;
+	AmCondition<bool> stopped;
+
+	//protects state and stats
+	AmMutex state_mut;
+	enum state_t {
+		IMPORT_IDLE = 0,
+		IMPORT_NO_CONNECTION,
+		IMPORT_RUNNING
+	} state;
+	string current_file;
+	unsigned long current_rows;
+	unsigned int pending_files;
+	struct {
+		unsigned long files_imported;
+		unsigned long files_failed;
+		unsigned long rows_imported;
+		unsigned long rows_failed;
+		unsigned long db_errors;
+		unsigned long ambiguous_batches;
+	} stats;
+
+	bool connect();
+	void disconnect();
+	void set_state(state_t s);
+
+	void scan(vector<string> &files);
+	int import_file(const string &name);
+	bool read_row(gzFile f, string &line);
+	bool parse_row(const string &line, AmArg &values);
+	int write_batch(const vector<AmArg> &batch, unsigned long &failed);
+
+	unsigned long load_progress(const string &path);
+	void save_progress(const string &path, unsigned long rows);
+
+  public:
+	CdrImporter(const CdrWriterCfg &cfg, CdrFileCompressor *file_compressor);
+	~CdrImporter();
+
+	void getStats(AmArg &arg);
+	void clearStats();
+
+	void run();
+	void on_stop();
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "CdrPool.h"
+#include "log.h"
+
+_CdrPool::_CdrPool():
+	max_free(DEFAULT_CDR_POOL_MAX_FREE)
+{
+	clearStats();
+}
+
+_CdrPool::~_CdrPool()
+{
+	for(vector<Cdr *>::iterator it = free_list.begin();
+		it!=free_list.end();++it)
+	{
+		delete *it;
+	}
+}
+
+void _CdrPool::configure(size_t max_free_objects)
+{
+	AmLock l(mut);
+	max_free = max_free_objects;
+	free_list.reserve(max_free);
+	DBG("CdrPool: keep up to %lu released CDRs",max_free);
+}
+
+Cdr *_CdrPool::get()
+{
+	Cdr *cdr = NULL;
+
+	mut.lock();
+		if(!free_list.empty()){
+			cdr = free_list.back();
+			free_list.pop_back();
+			stats.reused++;
+		} else {
+			stats.allocated++;
+		}
+	mut.unlock();
+
+	if(!cdr) return new Cdr();
+
+	cdr->reset();
+	return cdr;
+}
+
+Cdr *_CdrPool::create(const SqlCallProfile &profile)
+{
+	Cdr *cdr = get();
+	cdr->update_sql(profile);
+	return cdr;
+}
+
+Cdr *_CdrPool::create(const Cdr &prev, const SqlCallProfile &profile)
+{
+	Cdr *cdr = get();
+	cdr->update_sql(profile);
+	cdr->init_next_attempt(prev);
+	return cdr;
+}
+
+void _CdrPool::release(Cdr *cdr)
+{
+	mut.lock();
+		stats.released++;
+		if(free_list.size() < max_free){
+			free_list.push_back(cdr);
+			cdr = NULL;
+		} else {
+			stats.destroyed++;
+		}
+	mut.unlock();
+
+	delete cdr;
+}
+
+void _CdrPool::getStats(AmArg &arg)
+{
+	AmLock l(mut);
+	arg["max_free"] = (long)max_free;
+	arg["free"] = (long)free_list.size();
+	arg["allocated"] = (long)stats.allocated;
+	arg["reused"] = (long)stats.reused;
+	arg["released"] = (long)stats.released;
+	arg["destroyed"] = (long)stats.destroyed;
+}
+
+void _CdrPool::clearStats()
+{
+	AmLock l(mut);
+	stats.allocated = 0;
+	stats.reused = 0;
+	stats.released = 0;
+	stats.destroyed = 0;
+}
@@ -0,0 +1,53 @@
+#ifndef _CdrPool_h_
+#define _CdrPool_h_
+
+#include "singleton.h"
+#include "AmThread.h"
+#include "AmArg.h"
+#include "Cdr.h"
+
+#include <vector>
+
+using std::vector;
+
+#define DEFAULT_CDR_POOL_MAX_FREE 4096
+
+/* recycles Cdr objects written by CdrThread.
+ *
+ * released object is kept constructed with its strings and containers
+ * capacity and reset() on the next get(). so established call reuses
+ * memory of the finished one instead of the heap allocations */
+
+class _CdrPool {
+	vector<Cdr *> free_list;
+	AmMutex mut;
+	size_t max_free;
+
+	struct {
+		unsigned long allocated;	//new objects
+		unsigned long reused;
+		unsigned long released;
+		unsigned long destroyed;	//released with full pool
+	} stats;
+
+	Cdr *get();
+
+  public:
+	_CdrPool();
+	~_CdrPool();
+
+	void configure(size_t max_free_objects);
+
+	Cdr *create(const SqlCallProfile &profile);
+	/* the next attempt of the call */
+	Cdr *create(const Cdr &cdr, const SqlCallProfile &profile);
+	/* replaces delete */
+	void release(Cdr *cdr);
+
+	void getStats(AmArg &arg);
+	void clearStats();
+};
+
+typedef singleton<_CdrPool> CdrPool;
+
+#endif
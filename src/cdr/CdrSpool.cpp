@@ -0,0 +1,839 @@
+#include "CdrSpool.h"
+#include "log.h"
+#include "AmUtils.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define SPOOL_SEGMENT_MAGIC 0x50534359 //YCSP
+#define SPOOL_RECORD_MAGIC 0x52534359 //YCSR
+#define SPOOL_VERSION 2
+#define SPOOL_RECORD_ALIGN 8
+#define SPOOL_SEGMENT_SUFFIX ".spool"
+#define SPOOL_QUARANTINE_FILE "quarantine"
+
+enum {
+	RECORD_TYPE_DATA = 1,
+	RECORD_TYPE_ACK
+};
+
+struct segment_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t seq;
+};
+
+struct record_hdr {
+	uint32_t magic;
+	uint32_t type;
+	uint32_t len;
+	uint32_t crc;
+	uint64_t id;
+	uint32_t argc;		//writecdr() arguments count for data records
+	uint32_t reserved;
+};
+
+static inline size_t record_size(size_t payload_len){
+	size_t s = sizeof(record_hdr)+payload_len;
+	return (s + SPOOL_RECORD_ALIGN - 1) & ~(size_t)(SPOOL_RECORD_ALIGN - 1);
+}
+
+static inline size_t segment_data_start(){
+	return (sizeof(segment_hdr) + SPOOL_RECORD_ALIGN - 1) & ~(size_t)(SPOOL_RECORD_ALIGN - 1);
+}
+
+/* crc32 (IEEE 802.3) */
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init_table(){
+	for(uint32_t i = 0; i < 256; i++){
+		uint32_t c = i;
+		for(int k = 0; k < 8; k++)
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crc32_table[i] = c;
+	}
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t len){
+	const unsigned char *p = (const unsigned char *)buf;
+	crc = ~crc;
+	while(len--)
+		crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t record_crc(const record_hdr &h, const char *payload){
+	uint32_t crc = crc32_update(0,&h.type,sizeof(h.type));
+	crc = crc32_update(crc,&h.len,sizeof(h.len));
+	crc = crc32_update(crc,&h.id,sizeof(h.id));
+	crc = crc32_update(crc,&h.argc,sizeof(h.argc));
+	return crc32_update(crc,payload,h.len);
+}
+
+/* writecdr() arguments serialization.
+ * only scalar types are expected here (see invoc_AmArg in CdrWriter.cpp) */
+
+enum {
+	ARG_UNDEF = 0,
+	ARG_INT,
+	ARG_LONGLONG,
+	ARG_BOOL,
+	ARG_DOUBLE,
+	ARG_CSTR
+};
+
+template<class T>
+static inline void put_value(string &out, T v){
+	out.append((const char *)&v,sizeof(T));
+}
+
+template<class T>
+static inline bool get_value(const char *&p, const char *end, T &v){
+	if(p+sizeof(T) > end) return false;
+	memcpy(&v,p,sizeof(T));
+	p+=sizeof(T);
+	return true;
+}
+
+static void encode_args(string &out, const AmArg &a){
+	uint32_t n = a.size();
+	put_value(out,n);
+	for(uint32_t i = 0; i < n; i++){
+		const AmArg &v = a.get(i);
+		switch(v.getType()){
+		case AmArg::Int:
+			put_value<uint8_t>(out,ARG_INT);
+			put_value<int32_t>(out,v.asInt());
+			break;
+		case AmArg::LongLong:
+			put_value<uint8_t>(out,ARG_LONGLONG);
+			put_value<int64_t>(out,v.asLongLong());
+			break;
+		case AmArg::Bool:
+			put_value<uint8_t>(out,ARG_BOOL);
+			put_value<uint8_t>(out,v.asBool());
+			break;
+		case AmArg::Double:
+			put_value<uint8_t>(out,ARG_DOUBLE);
+			put_value<double>(out,v.asDouble());
+			break;
+		case AmArg::CStr: {
+			const char *s = v.asCStr();
+			uint32_t len = strlen(s);
+			put_value<uint8_t>(out,ARG_CSTR);
+			put_value(out,len);
+			out.append(s,len);
+		} break;
+		case AmArg::Undef:
+			put_value<uint8_t>(out,ARG_UNDEF);
+			break;
+		default:
+			ERROR("CdrSpool: unexpected argument type %s. replace with NULL",
+				  AmArg::t2str(v.getType()));
+			put_value<uint8_t>(out,ARG_UNDEF);
+		}
+	}
+}
+
+static bool decode_args(const char *p, size_t len, uint32_t argc, AmArg &a){
+	const char *end = p + len;
+	uint32_t n;
+
+	a.clear();
+	a.assertArray();
+
+	if(!get_value(p,end,n) || n!=argc) return false;
+	for(uint32_t i = 0; i < n; i++){
+		uint8_t type;
+		if(!get_value(p,end,type)) return false;
+		switch(type){
+		case ARG_INT: {
+			int32_t v;
+			if(!get_value(p,end,v)) return false;
+			a.push(AmArg((int)v));
+		} break;
+		case ARG_LONGLONG: {
+			int64_t v;
+			if(!get_value(p,end,v)) return false;
+			a.push(AmArg((long long)v));
+		} break;
+		case ARG_BOOL: {
+			uint8_t v;
+			if(!get_value(p,end,v)) return false;
+			a.push(AmArg((bool)v));
+		} break;
+		case ARG_DOUBLE: {
+			double v;
+			if(!get_value(p,end,v)) return false;
+			a.push(AmArg(v));
+		} break;
+		case ARG_CSTR: {
+			uint32_t l;
+			if(!get_value(p,end,l)) return false;
+			if(p+l > end) return false;
+			a.push(AmArg(string(p,l)));
+			p+=l;
+		} break;
+		case ARG_UNDEF:
+			a.push(AmArg());
+			break;
+		default:
+			return false;
+		}
+	}
+	return p==end;
+}
+
+CdrSpool::CdrSpool():
+	segment_size(0),
+	args_count(0),
+	opened(false),
+	active(NULL),
+	next_seq(1),
+	next_id(1),
+	syncing(false),
+	appended_bytes(0),
+	synced_bytes(0)
+{
+	pthread_once(&crc32_table_once,crc32_init_table);
+	pthread_mutex_init(&sync_mtx,NULL);
+	pthread_cond_init(&sync_cond,NULL);
+	clearStats();
+}
+
+CdrSpool::~CdrSpool()
+{
+	close();
+	pthread_cond_destroy(&sync_cond);
+	pthread_mutex_destroy(&sync_mtx);
+}
+
+int CdrSpool::open(const string &spool_dir, size_t spool_segment_size,
+				   uint32_t writecdr_args_count)
+{
+	DIR *d;
+	struct dirent *e;
+	map<uint64_t,string> files;
+
+	dir = spool_dir;
+	segment_size = spool_segment_size;
+	args_count = writecdr_args_count;
+
+	if(mkdir(dir.c_str(),0755) && errno!=EEXIST){
+		ERROR("CdrSpool: can't create spool dir '%s': %s",
+			  dir.c_str(),strerror(errno));
+		return -1;
+	}
+
+	if(NULL==(d = opendir(dir.c_str()))){
+		ERROR("CdrSpool: can't open spool dir '%s': %s",
+			  dir.c_str(),strerror(errno));
+		return -1;
+	}
+	while((e = readdir(d))!=NULL){
+		string name(e->d_name);
+		size_t suffix_pos = name.rfind(SPOOL_SEGMENT_SUFFIX);
+		if(suffix_pos==string::npos || suffix_pos==0 ||
+		   suffix_pos+strlen(SPOOL_SEGMENT_SUFFIX)!=name.size())
+			continue;
+		char *endp;
+		uint64_t seq = strtoull(name.c_str(),&endp,10);
+		if(endp!=name.c_str()+suffix_pos){
+			WARN("CdrSpool: skip unexpected file '%s/%s'",dir.c_str(),name.c_str());
+			continue;
+		}
+		files[seq] = dir + "/" + name;
+	}
+	closedir(d);
+
+	AmLock l(mtx);
+
+	/* skipped damaged segments stay on disk under their names.
+	 * never reuse sequence of any found file */
+	if(!files.empty())
+		next_seq = files.rbegin()->first+1;
+
+	//load existent segments. all not acknowledged records are orphaned
+	for(map<uint64_t,string>::iterator it = files.begin(); it!=files.end(); ++it){
+		open_segment(it->second,it->first);
+	}
+	for(Segments::iterator it = segments.begin(); it!=segments.end(); ++it){
+		load_segment(it->second);
+	}
+	for(Records::iterator it = records.begin(); it!=records.end(); ++it){
+		it->second.state = RECORD_ORPHANED;
+		orphans.insert(orphans.end(),it->first);
+		if(it->first >= next_id) next_id = it->first+1;
+	}
+	stats.recovered = orphans.size();
+
+	if(NULL==(active = create_segment())){
+		return -1;
+	}
+
+	opened = true;
+	cleanup();
+
+	INFO("CdrSpool: opened '%s'. segments: %ld, records to replay: %ld",
+		 dir.c_str(),segments.size(),orphans.size());
+
+	return 0;
+}
+
+void CdrSpool::close(){
+	mtx.lock();
+	opened = false;
+	mtx.unlock();
+
+	//wait for the group commit in progress. it uses the active segment out of mtx
+	pthread_mutex_lock(&sync_mtx);
+	while(syncing)
+		pthread_cond_wait(&sync_cond,&sync_mtx);
+	pthread_mutex_unlock(&sync_mtx);
+
+	AmLock l(mtx);
+	for(Segments::iterator it = segments.begin(); it!=segments.end(); ++it){
+		segment *s = it->second;
+		sync_segment(s,s->synced_off,s->write_off);
+		close_segment(s,false);
+	}
+	segments.clear();
+	records.clear();
+	orphans.clear();
+	active = NULL;
+}
+
+CdrSpool::segment *CdrSpool::create_segment(){
+	char name[32];
+	segment *s = new segment;
+
+	snprintf(name,sizeof(name),"%020llu" SPOOL_SEGMENT_SUFFIX,
+			 (unsigned long long)next_seq);
+	s->seq = next_seq;
+	s->path = dir + "/" + name;
+	s->size = segment_size;
+
+	s->fd = ::open(s->path.c_str(),O_RDWR | O_CREAT | O_EXCL,0644);
+	if(s->fd < 0){
+		ERROR("CdrSpool: can't create segment '%s': %s",
+			  s->path.c_str(),strerror(errno));
+		delete s;
+		return NULL;
+	}
+	/* reserve blocks now. sparse file from ftruncate() would fail
+	 * with SIGBUS on the mapped write when the disk is full */
+	int err = posix_fallocate(s->fd,0,s->size);
+	if(err){
+		ERROR("CdrSpool: can't allocate %ld bytes for segment '%s': %s",
+			  s->size,s->path.c_str(),strerror(err));
+		close_segment(s,true);
+		return NULL;
+	}
+	s->base = (char *)mmap(NULL,s->size,PROT_READ | PROT_WRITE,MAP_SHARED,s->fd,0);
+	if(s->base==MAP_FAILED){
+		ERROR("CdrSpool: can't map segment '%s': %s",
+			  s->path.c_str(),strerror(errno));
+		s->base = NULL;
+		close_segment(s,true);
+		return NULL;
+	}
+
+	segment_hdr *h = (segment_hdr *)s->base;
+	h->magic = SPOOL_SEGMENT_MAGIC;
+	h->version = SPOOL_VERSION;
+	h->seq = s->seq;
+	s->write_off = segment_data_start();
+	if(!sync_segment(s,0,s->write_off)){
+		close_segment(s,true);
+		return NULL;
+	}
+
+	//persist directory entry for the new segment
+	int dfd = ::open(dir.c_str(),O_RDONLY | O_DIRECTORY);
+	if(dfd >= 0){
+		fsync(dfd);
+		::close(dfd);
+	}
+
+	next_seq++;
+	segments[s->seq] = s;
+
+	DBG("CdrSpool: created segment '%s'",s->path.c_str());
+	return s;
+}
+
+bool CdrSpool::open_segment(const string &path, uint64_t seq){
+	struct stat st;
+	segment *s = new segment;
+
+	s->seq = seq;
+	s->path = path;
+
+	s->fd = ::open(path.c_str(),O_RDWR);
+	if(s->fd < 0 || fstat(s->fd,&st)){
+		ERROR("CdrSpool: can't open segment '%s': %s",
+			  path.c_str(),strerror(errno));
+		close_segment(s,false);
+		return false;
+	}
+	s->size = st.st_size;
+	if(s->size < segment_data_start()){
+		ERROR("CdrSpool: segment '%s' is truncated. remove it",path.c_str());
+		close_segment(s,true);
+		return false;
+	}
+	s->base = (char *)mmap(NULL,s->size,PROT_READ | PROT_WRITE,MAP_SHARED,s->fd,0);
+	if(s->base==MAP_FAILED){
+		ERROR("CdrSpool: can't map segment '%s': %s",
+			  path.c_str(),strerror(errno));
+		s->base = NULL;
+		close_segment(s,false);
+		return false;
+	}
+
+	const segment_hdr *h = (const segment_hdr *)s->base;
+	if(h->magic!=SPOOL_SEGMENT_MAGIC || h->version!=SPOOL_VERSION || h->seq!=seq){
+		ERROR("CdrSpool: segment '%s' has invalid header. skip it",path.c_str());
+		close_segment(s,false);
+		return false;
+	}
+
+	segments[seq] = s;
+	return true;
+}
+
+void CdrSpool::close_segment(segment *s, bool remove_file){
+	if(s->base) munmap(s->base,s->size);
+	if(s->fd >= 0) ::close(s->fd);
+	if(remove_file && unlink(s->path.c_str())){
+		ERROR("CdrSpool: can't remove segment '%s': %s",
+			  s->path.c_str(),strerror(errno));
+	}
+	delete s;
+}
+
+bool CdrSpool::load_segment(segment *s){
+	size_t off = segment_data_start();
+
+	while(off + sizeof(record_hdr) <= s->size){
+		const record_hdr *h = (const record_hdr *)(s->base+off);
+		if(h->magic==0) //end of data
+			break;
+		if(h->magic!=SPOOL_RECORD_MAGIC ||
+		   off + record_size(h->len) > s->size ||
+		   h->crc!=record_crc(*h,s->base+off+sizeof(record_hdr)))
+		{
+			ERROR("CdrSpool: segment '%s' is damaged at offset %ld. "
+				  "ignore remaining data",s->path.c_str(),off);
+			stats.corrupted++;
+			break;
+		}
+		switch(h->type){
+		case RECORD_TYPE_DATA: {
+			record_info &r = records[h->id];
+			r.segment_seq = s->seq;
+			r.offset = off;
+			r.state = RECORD_QUEUED;
+			s->pending++;
+		} break;
+		case RECORD_TYPE_ACK: {
+			Records::iterator it = records.find(h->id);
+			if(it!=records.end()){
+				Segments::iterator sit = segments.find(it->second.segment_seq);
+				if(sit!=segments.end()) sit->second->pending--;
+				records.erase(it);
+			}
+		} break;
+		}
+		if(h->id >= next_id) next_id = h->id+1;
+		off += record_size(h->len);
+	}
+
+	//never append to recovered segments
+	s->write_off = s->synced_off = off;
+	return true;
+}
+
+bool CdrSpool::msync_segment(segment *s, size_t from, size_t to){
+	static const size_t page_mask = ~(size_t)(sysconf(_SC_PAGESIZE)-1);
+	size_t start = from & page_mask;
+	if(msync(s->base+start,to-start,MS_SYNC)){
+		ERROR("CdrSpool: msync failed for '%s': %s",
+			  s->path.c_str(),strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool CdrSpool::sync_segment(segment *s, size_t from, size_t to){
+	if(to <= from) return true;
+	stats.syncs++;
+	if(!msync_segment(s,from,to)){
+		stats.sync_failed++;
+		return false;
+	}
+	return true;
+}
+
+bool CdrSpool::rotate(size_t rec_size){
+	if(segment_data_start()+rec_size > segment_size){
+		ERROR("CdrSpool: record with size %ld exceeds segment size %ld",
+			  rec_size,segment_size);
+		return false;
+	}
+
+	segment *s = create_segment();
+	if(!s) return false;
+
+	/* data in the previous segment must be durable before we forget about it.
+	 * on failure keep it active to let waiting appenders retry the sync */
+	if(!sync_segment(active,active->synced_off,active->write_off)){
+		segments.erase(s->seq);
+		close_segment(s,true);
+		return false;
+	}
+	active->synced_off = active->write_off;
+	active = s;
+
+	cleanup();
+	return true;
+}
+
+bool CdrSpool::write_record(uint32_t type, record_id_t id, uint32_t argc,
+							const string &payload, size_t &offset)
+{
+	size_t rec_size = record_size(payload.size());
+
+	if(active->write_off + rec_size > active->size){
+		if(!rotate(rec_size))
+			return false;
+	}
+
+	offset = active->write_off;
+	char *p = active->base + offset;
+	record_hdr *h = (record_hdr *)p;
+
+	memcpy(p+sizeof(record_hdr),payload.data(),payload.size());
+	h->type = type;
+	h->len = payload.size();
+	h->id = id;
+	h->argc = argc;
+	h->reserved = 0;
+	h->crc = record_crc(*h,p+sizeof(record_hdr));
+	h->magic = SPOOL_RECORD_MAGIC;
+
+	active->write_off += rec_size;
+	appended_bytes += rec_size;
+
+	return true;
+}
+
+bool CdrSpool::append(const AmArg &fields_values, record_id_t &id){
+	string payload;
+	size_t offset;
+	uint64_t target;
+
+	encode_args(payload,fields_values);
+
+	mtx.lock();
+	if(!opened){
+		mtx.unlock();
+		return false;
+	}
+	id = next_id;
+	if(!write_record(RECORD_TYPE_DATA,id,fields_values.size(),payload,offset)){
+		mtx.unlock();
+		return false;
+	}
+	next_id++;
+	record_info &r = records[id];
+	r.segment_seq = active->seq;
+	r.offset = offset;
+	r.state = RECORD_QUEUED;
+	active->pending++;
+	stats.appended++;
+	target = appended_bytes;
+	mtx.unlock();
+
+	if(!sync_to(target)){
+		//CDR will be written without spooling. never replay it
+		AmLock l(mtx);
+		Records::iterator it = records.find(id);
+		if(it!=records.end()) release(it);
+		return false;
+	}
+
+	return true;
+}
+
+bool CdrSpool::sync_to(uint64_t target){
+	bool ret = true;
+
+	pthread_mutex_lock(&sync_mtx);
+	while(synced_bytes < target){
+		if(syncing){
+			//somebody else is syncing. his sync may cover our record
+			pthread_cond_wait(&sync_cond,&sync_mtx);
+			continue;
+		}
+		syncing = true;
+		pthread_mutex_unlock(&sync_mtx);
+
+		mtx.lock();
+			if(!opened){
+				mtx.unlock();
+				pthread_mutex_lock(&sync_mtx);
+				syncing = false;
+				pthread_cond_broadcast(&sync_cond);
+				ret = false;
+				break;
+			}
+			//pinned segment is not removed by cleanup()
+			segment *s = active;
+			size_t from = s->synced_off,
+				   to = s->write_off;
+			uint64_t end = appended_bytes;
+			s->pinned++;
+		mtx.unlock();
+
+		//msync out of mtx to let other threads append meanwhile
+		bool synced = to <= from || msync_segment(s,from,to);
+
+		mtx.lock();
+			s->pinned--;
+			//keep synced_off on failure. the next sync will retry the range
+			if(synced && s->synced_off < to) s->synced_off = to;
+			if(to > from){
+				if(!synced) stats.sync_failed++;
+				stats.syncs++;
+			}
+			cleanup();
+		mtx.unlock();
+
+		pthread_mutex_lock(&sync_mtx);
+		if(synced && synced_bytes < end) synced_bytes = end;
+		syncing = false;
+		pthread_cond_broadcast(&sync_cond);
+		if(!synced){
+			ret = false;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sync_mtx);
+
+	return ret;
+}
+
+void CdrSpool::release(Records::iterator &it){
+	string empty;
+	size_t offset;
+
+	if(it->second.state==RECORD_ORPHANED)
+		orphans.erase(it->first);
+
+	Segments::iterator sit = segments.find(it->second.segment_seq);
+	if(sit!=segments.end()) sit->second->pending--;
+
+	//ack will be synced with the next group commit or on close
+	if(!write_record(RECORD_TYPE_ACK,it->first,0,empty,offset)){
+		ERROR("CdrSpool: failed to write ack for record %llu",
+			  (unsigned long long)it->first);
+	}
+
+	records.erase(it);
+	stats.acked++;
+
+	cleanup();
+}
+
+void CdrSpool::cleanup(){
+	/* remove only from the oldest side to ensure
+	 * that acks never outlive their data records */
+	while(!segments.empty()){
+		Segments::iterator it = segments.begin();
+		segment *s = it->second;
+		if(s==active || s->pending || s->pinned)
+			break;
+		DBG("CdrSpool: all records in '%s' are acknowledged. remove it",
+			s->path.c_str());
+		segments.erase(it);
+		close_segment(s,true);
+	}
+}
+
+void CdrSpool::ack(record_id_t id){
+	AmLock l(mtx);
+	Records::iterator it = records.find(id);
+	if(it==records.end()){
+		ERROR("CdrSpool: attempt to ack unknown record %llu",
+			  (unsigned long long)id);
+		return;
+	}
+	release(it);
+}
+
+void CdrSpool::orphan(record_id_t id){
+	AmLock l(mtx);
+	Records::iterator it = records.find(id);
+	if(it==records.end()){
+		ERROR("CdrSpool: attempt to orphan unknown record %llu",
+			  (unsigned long long)id);
+		return;
+	}
+	if(it->second.state!=RECORD_ORPHANED){
+		it->second.state = RECORD_ORPHANED;
+		orphans.insert(id);
+		stats.orphaned++;
+	}
+}
+
+bool CdrSpool::has_orphans(){
+	AmLock l(mtx);
+	return !orphans.empty();
+}
+
+bool CdrSpool::get_orphan(record_id_t &id, AmArg &fields_values){
+	AmLock l(mtx);
+
+	while(!orphans.empty()){
+		Records::iterator it = records.find(*orphans.begin());
+		if(it==records.end()){
+			ERROR("CdrSpool: orphaned record %llu is unknown. skip it",
+				  (unsigned long long)*orphans.begin());
+			orphans.erase(orphans.begin());
+			continue;
+		}
+
+		Segments::iterator sit = segments.find(it->second.segment_seq);
+		if(sit!=segments.end()){
+			segment *s = sit->second;
+			const record_hdr *h = (const record_hdr *)(s->base+it->second.offset);
+			const char *payload = s->base+it->second.offset+sizeof(record_hdr);
+			if(h->magic==SPOOL_RECORD_MAGIC && h->id==it->first &&
+			   h->crc==record_crc(*h,payload))
+			{
+				if(h->argc!=args_count){
+					//written for another writecdr() signature. will be rejected by DB
+					ERROR("CdrSpool: record %llu has %u arguments instead of %u",
+						  (unsigned long long)it->first,h->argc,args_count);
+					quarantine(it);
+					continue;
+				}
+				if(decode_args(payload,h->len,h->argc,fields_values)){
+					id = it->first;
+					it->second.state = RECORD_QUEUED;
+					orphans.erase(orphans.begin());
+					return true;
+				}
+			}
+		}
+
+		ERROR("CdrSpool: record %llu is damaged. drop it",
+			  (unsigned long long)it->first);
+		stats.corrupted++;
+		release(it);
+	}
+	return false;
+}
+
+void CdrSpool::quarantine(Records::iterator &it){
+	Segments::iterator sit = segments.find(it->second.segment_seq);
+	if(sit==segments.end()){
+		release(it);
+		return;
+	}
+	segment *s = sit->second;
+	const record_hdr *h = (const record_hdr *)(s->base+it->second.offset);
+	const char *p = (const char *)h;
+	size_t left = record_size(h->len);
+	string path = dir + "/" SPOOL_QUARANTINE_FILE;
+	bool ok = true;
+
+	//raw records in the spool format. file is never read by the spool
+	int fd = ::open(path.c_str(),O_WRONLY | O_CREAT | O_APPEND,0644);
+	if(fd < 0){
+		ERROR("CdrSpool: can't open '%s': %s",path.c_str(),strerror(errno));
+		ok = false;
+	}
+	while(ok && left){
+		ssize_t r = write(fd,p,left);
+		if(r < 0){
+			if(errno==EINTR) continue;
+			ERROR("CdrSpool: can't write to '%s': %s",path.c_str(),strerror(errno));
+			ok = false;
+			break;
+		}
+		p+=r;
+		left-=r;
+	}
+	if(ok && fdatasync(fd)){
+		ERROR("CdrSpool: can't sync '%s': %s",path.c_str(),strerror(errno));
+		ok = false;
+	}
+	if(fd >= 0) ::close(fd);
+
+	if(ok){
+		ERROR("CdrSpool: record %llu is moved to '%s'",
+			  (unsigned long long)it->first,path.c_str());
+	} else {
+		ERROR("CdrSpool: can't quarantine record %llu. drop it",
+			  (unsigned long long)it->first);
+	}
+	stats.quarantined++;
+	release(it);
+}
+
+void CdrSpool::quarantine(record_id_t id){
+	AmLock l(mtx);
+	Records::iterator it = records.find(id);
+	if(it==records.end()){
+		ERROR("CdrSpool: attempt to quarantine unknown record %llu",
+			  (unsigned long long)id);
+		return;
+	}
+	quarantine(it);
+}
+
+void CdrSpool::replayed(record_id_t id){
+	ack(id);
+	AmLock l(mtx);
+	stats.replayed++;
+}
+
+void CdrSpool::getStats(AmArg &arg){
+	AmLock l(mtx);
+	arg["dir"] = dir;
+	arg["segments"] = (long)segments.size();
+	arg["records"] = (long)records.size();
+	arg["orphaned"] = (long)orphans.size();
+	arg["appended"] = (long)stats.appended;
+	arg["acked"] = (long)stats.acked;
+	arg["orphaned_total"] = (long)stats.orphaned;
+	arg["replayed"] = (long)stats.replayed;
+	arg["recovered"] = (long)stats.recovered;
+	arg["corrupted"] = (long)stats.corrupted;
+	arg["quarantined"] = (long)stats.quarantined;
+	arg["syncs"] = (long)stats.syncs;
+	arg["sync_failed"] = (long)stats.sync_failed;
+}
+
+void CdrSpool::clearStats(){
+	AmLock l(mtx);
+	stats.appended = 0;
+	stats.acked = 0;
+	stats.orphaned = 0;
+	stats.replayed = 0;
+	stats.syncs = 0;
+	stats.sync_failed = 0;
+	stats.recovered = 0;
+	stats.corrupted = 0;
+	stats.quarantined = 0;
+}
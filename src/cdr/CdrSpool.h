@@ -0,0 +1,142 @@
+#ifndef _CdrSpool_h_
+#define _CdrSpool_h_
+
+#include "AmThread.h"
+#include "AmArg.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <set>
+
+using std::string;
+using std::map;
+
+/* write-ahead spool for CDRs
+ *
+ * every CDR is appended as writecdr() arguments into memory mapped
+ * segment file and made durable (group commit msync) before postcdr() returns.
+ * record is acknowledged when CDR reached DB (or failover file).
+ * not acknowledged records are replayed on startup and when master DB returns.
+ *
+ * segment layout: segment_hdr, then records aligned to 8 bytes.
+ * record: record_hdr, payload (serialized AmArg array for data records).
+ * record_hdr holds writecdr() arguments count. records with count other than
+ * the current statement expects are not replayed but moved to the quarantine
+ * file in the spool dir (as well as records rejected by DB, see quarantine()).
+ * acknowledgement is the separate record of type ack referencing data record id.
+ * segment file is removed when all data records in it are acknowledged */
+
+class CdrSpool {
+  public:
+	typedef uint64_t record_id_t;
+
+  private:
+	struct segment {
+		uint64_t seq;
+		string path;
+		int fd;
+		char *base;
+		size_t size;
+		size_t write_off;		//offset of the next record
+		size_t synced_off;		//data before offset is synced to disk
+		unsigned int pending;	//not acknowledged data records count
+		unsigned int pinned;	//msync in progress out of mtx
+		segment(): seq(0), fd(-1), base(NULL), size(0),
+			write_off(0), synced_off(0), pending(0), pinned(0) {}
+	};
+	typedef map<uint64_t,segment *> Segments;
+
+	enum record_state {
+		RECORD_QUEUED = 0,	//CDR is in the writer queue
+		RECORD_ORPHANED		//write attempt failed. replay required
+	};
+	struct record_info {
+		uint64_t segment_seq;
+		size_t offset;
+		record_state state;
+	};
+	typedef map<record_id_t,record_info> Records;
+
+	string dir;
+	size_t segment_size;
+	uint32_t args_count;	//writecdr() arguments of the current configuration
+	bool opened;
+
+	Segments segments;
+	segment *active;
+	uint64_t next_seq;
+	record_id_t next_id;
+	Records records;
+	std::set<record_id_t> orphans;	//ordered to replay the oldest first
+
+	//protects segments,records and write positions
+	AmMutex mtx;
+
+	//group commit state
+	pthread_mutex_t sync_mtx;
+	pthread_cond_t sync_cond;
+	bool syncing;
+	uint64_t appended_bytes;
+	uint64_t synced_bytes;
+
+	struct {
+		unsigned long appended;
+		unsigned long acked;
+		unsigned long orphaned;
+		unsigned long replayed;
+		unsigned long syncs;
+		unsigned long sync_failed;
+		unsigned long recovered;
+		unsigned long corrupted;
+		unsigned long quarantined;
+	} stats;
+
+	segment *create_segment();
+	bool open_segment(const string &path, uint64_t seq);
+	void close_segment(segment *s, bool remove_file);
+	bool load_segment(segment *s);
+	bool rotate(size_t record_size);
+	/* msync only. can be called without mtx */
+	bool msync_segment(segment *s, size_t from, size_t to);
+	/* msync and stats update. mtx must be held */
+	bool sync_segment(segment *s, size_t from, size_t to);
+	bool write_record(uint32_t type, record_id_t id, uint32_t argc,
+					  const string &payload, size_t &offset);
+	/* returns false if data up to target is not durable */
+	bool sync_to(uint64_t target);
+	void release(Records::iterator &it);
+	void quarantine(Records::iterator &it);
+	void cleanup();
+
+  public:
+	CdrSpool();
+	~CdrSpool();
+
+	int open(const string &spool_dir, size_t spool_segment_size,
+			 uint32_t writecdr_args_count);
+	void close();
+	bool is_opened() { return opened; }
+
+	/* append record and wait until it is synced to disk.
+	 * record is dropped from the spool if sync failed */
+	bool append(const AmArg &fields_values, record_id_t &id);
+	/* CDR is written. record will be removed with the segment */
+	void ack(record_id_t id);
+	/* CDR write failed. record becomes available for replay */
+	void orphan(record_id_t id);
+
+	bool has_orphans();
+	/* take oldest orphaned record for replay. returns false if nothing to replay.
+	 * record is queued until replayed() or orphan() is called for it */
+	bool get_orphan(record_id_t &id, AmArg &fields_values);
+	void replayed(record_id_t id);
+	/* record can't be written to DB. append it to the quarantine file and release */
+	void quarantine(record_id_t id);
+
+	void getStats(AmArg &arg);
+	void clearStats();
+};
+
+#endif
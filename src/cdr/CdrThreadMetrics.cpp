@@ -0,0 +1,179 @@
+#include "CdrThreadMetrics.h"
+
+#include <cstring>
+
+static unsigned long long tvdiff_us(const struct timeval &from, const struct timeval &to)
+{
+	struct timeval diff;
+	if(!timerisset(&from) || timercmp(&to,&from,<))
+		return 0;
+	timersub(&to,&from,&diff);
+	return diff.tv_sec*1000000ULL+diff.tv_usec;
+}
+
+int LatencyHistogram::bucket(unsigned long long v)
+{
+	if(v < SUB_COUNT)
+		return v;
+	int e = 63-__builtin_clzll(v);
+	if(e >= MAX_EXP)
+		return BUCKETS_COUNT-1;
+	int sub = (v >> (e-SUB_BITS)) & (SUB_COUNT-1);
+	return SUB_COUNT+(e-SUB_BITS)*SUB_COUNT+sub;
+}
+
+unsigned long long LatencyHistogram::bucket_value(int idx)
+{
+	if(idx < SUB_COUNT)
+		return idx;
+	int e = (idx-SUB_COUNT)/SUB_COUNT+SUB_BITS;
+	int sub = (idx-SUB_COUNT)%SUB_COUNT;
+	//upper bound of the bucket
+	return ((unsigned long long)(SUB_COUNT+sub+1) << (e-SUB_BITS))-1;
+}
+
+void LatencyHistogram::add(unsigned long long v)
+{
+	buckets[bucket(v)]++;
+	count++;
+	sum+=v;
+	if(v > max) max = v;
+}
+
+void LatencyHistogram::clear()
+{
+	memset(buckets,0,sizeof(buckets));
+	count = 0;
+	sum = 0;
+	max = 0;
+}
+
+unsigned long long LatencyHistogram::percentile(double p) const
+{
+	if(!count)
+		return 0;
+	unsigned long rank = (unsigned long)(p*count);
+	if(rank >= count) rank = count-1;
+	unsigned long seen = 0;
+	for(int i = 0;i<BUCKETS_COUNT;i++){
+		seen+=buckets[i];
+		if(seen > rank){
+			unsigned long long v = bucket_value(i);
+			return v > max ? max : v;
+		}
+	}
+	return max;
+}
+
+void LatencyHistogram::getStats(AmArg &arg) const
+{
+	arg["count"] = (long)count;
+	arg["avg"] = (long)(count ? sum/count : 0);
+	arg["p50"] = (long)percentile(0.5);
+	arg["p90"] = (long)percentile(0.9);
+	arg["p99"] = (long)percentile(0.99);
+	arg["p999"] = (long)percentile(0.999);
+	arg["max"] = (long)max;
+}
+
+void RateCounter::add(time_t now)
+{
+	int i = now%SLOTS;
+	if(times[i]!=now){
+		times[i] = now;
+		counts[i] = 0;
+	}
+	counts[i]++;
+}
+
+void RateCounter::clear()
+{
+	memset(counts,0,sizeof(counts));
+	memset(times,0,sizeof(times));
+}
+
+double RateCounter::rate(time_t now, int window) const
+{
+	//completed seconds only
+	unsigned long sum = 0;
+	for(int i = 0;i<SLOTS;i++){
+		if(times[i] < now && times[i] >= now-window)
+			sum+=counts[i];
+	}
+	return (double)sum/window;
+}
+
+void RateCounter::getStats(AmArg &arg, time_t now) const
+{
+	arg["1s"] = rate(now,1);
+	arg["10s"] = rate(now,10);
+	arg["60s"] = rate(now,60);
+}
+
+CdrThreadMetrics::CdrThreadMetrics():
+	mode(MODE_MASTER)
+{
+	clear();
+}
+
+const char *CdrThreadMetrics::mode2str(write_mode m)
+{
+	switch(m){
+	case MODE_MASTER: return "master";
+	case MODE_SLAVE: return "slave";
+	case MODE_FILE: return "file";
+	case MODE_NONE: return "none";
+	default: return "unknown";
+	}
+}
+
+void CdrThreadMetrics::account_mode_time(const struct timeval &now)
+{
+	mode_time[mode]+=tvdiff_us(mode_changed,now);
+	mode_changed = now;
+}
+
+void CdrThreadMetrics::on_write(const struct timeval &queued,const struct timeval &start,
+								const struct timeval &end,write_mode m)
+{
+	AmLock l(mut);
+	queue_wait.add(tvdiff_us(queued,start));
+	write_time.add(tvdiff_us(start,end));
+	if(m!=MODE_NONE)
+		rate.add(end.tv_sec);
+	if(m!=mode){
+		account_mode_time(end);
+		mode = m;
+		mode_switches++;
+	}
+}
+
+void CdrThreadMetrics::getStats(AmArg &arg)
+{
+	struct timeval now;
+	gettimeofday(&now,NULL);
+
+	AmLock l(mut);
+	account_mode_time(now);
+
+	queue_wait.getStats(arg["queue_wait_us"]);
+	write_time.getStats(arg["write_time_us"]);
+	rate.getStats(arg["cdrs_per_sec"],now.tv_sec);
+
+	arg["mode"] = mode2str(mode);
+	arg["mode_switches"] = (long)mode_switches;
+	AmArg &t = arg["mode_time_ms"];
+	for(int i = 0;i<MODE_MAX;i++)
+		t[mode2str((write_mode)i)] = (long)(mode_time[i]/1000);
+}
+
+void CdrThreadMetrics::clear()
+{
+	AmLock l(mut);
+	queue_wait.clear();
+	write_time.clear();
+	rate.clear();
+	memset(mode_time,0,sizeof(mode_time));
+	mode_switches = 0;
+	gettimeofday(&mode_changed,NULL);
+}
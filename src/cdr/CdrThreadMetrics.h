@@ -0,0 +1,84 @@
+#ifndef _CdrThreadMetrics_h_
+#define _CdrThreadMetrics_h_
+
+#include "AmThread.h"
+#include "AmArg.h"
+
+#include <sys/time.h>
+#include <time.h>
+
+/* latency histogram with ~6% relative error.
+ * values below 16 have own buckets, above - 16 sub-buckets per power of two */
+class LatencyHistogram {
+	enum {
+		SUB_BITS = 4,
+		SUB_COUNT = 1<<SUB_BITS,
+		MAX_EXP = 36,
+		BUCKETS_COUNT = SUB_COUNT+(MAX_EXP-SUB_BITS)*SUB_COUNT
+	};
+	unsigned long buckets[BUCKETS_COUNT];
+	unsigned long count;
+	unsigned long long sum;
+	unsigned long long max;
+
+	static int bucket(unsigned long long v);
+	static unsigned long long bucket_value(int idx);
+	unsigned long long percentile(double p) const;
+
+  public:
+	LatencyHistogram() { clear(); }
+	void add(unsigned long long v);
+	void clear();
+	void getStats(AmArg &arg) const;
+};
+
+/* events per second over the last 1s/10s/60s */
+class RateCounter {
+	enum { SLOTS = 61 };	//60 completed seconds and the current one
+	unsigned long counts[SLOTS];
+	time_t times[SLOTS];
+
+	double rate(time_t now, int window) const;
+
+  public:
+	RateCounter() { clear(); }
+	void add(time_t now);
+	void clear();
+	void getStats(AmArg &arg, time_t now) const;
+};
+
+/* CdrThread write path instrumentation */
+class CdrThreadMetrics {
+  public:
+	enum write_mode {
+		MODE_MASTER = 0,
+		MODE_SLAVE,
+		MODE_FILE,
+		MODE_NONE,		//CDR is not written anywhere
+		MODE_MAX
+	};
+
+  private:
+	AmMutex mut;
+	LatencyHistogram queue_wait;	//us from postcdr() to write start
+	LatencyHistogram write_time;	//us to write CDR including failover
+	RateCounter rate;
+	write_mode mode;
+	struct timeval mode_changed;
+	unsigned long long mode_time[MODE_MAX];	//us spent in the mode
+	unsigned long mode_switches;
+
+	void account_mode_time(const struct timeval &now);
+
+  public:
+	CdrThreadMetrics();
+
+	static const char *mode2str(write_mode m);
+
+	void on_write(const struct timeval &queued,const struct timeval &start,
+				  const struct timeval &end,write_mode m);
+	void getStats(AmArg &arg);
+	void clear();
+};
+
+#endif
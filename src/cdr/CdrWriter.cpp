@@ -1,5 +1,7 @@
 #include "sems.h"
 #include "CdrWriter.h"
+#include "CdrImporter.h"
+#include "CdrPool.h"
 #include "log.h"
 #include "AmThread.h"
 #include <pqxx/pqxx>
@@ -8,6 +10,27 @@
 #include "../cdr/TrustedHeaders.h"
 #include "../yeti_version.h"
 
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <cstdlib>
+
+#define DEFAULT_SPOOL_SEGMENT_SIZE (16*1024*1024)
+#define DEFAULT_SPOOL_REPLAY_BATCH 100
+#define DEFAULT_FILE_FLUSH_INTERVAL 1000
+#define DEFAULT_FILE_FLUSH_SIZE (64*1024)
+#define DEFAULT_FILE_COMPRESS_LEVEL 6
+#define DEFAULT_IMPORT_RATE 100
+#define DEFAULT_IMPORT_BATCH 50
+#define WBUF_RESERVE (16*1024) //room for the row which exceeds flush size
+#define DB_KEEPALIVES_COUNT 3
+
 const static_field cdr_static_fields[] = {
 	{ "is_master", "boolean" },
 	{ "node_id", "integer" },
@@ -47,7 +70,11 @@ const static_field cdr_static_fields[] = {
 };
 
 
-CdrWriter::CdrWriter()
+CdrWriter::CdrWriter():
+	compressor(NULL),
+	importer(NULL),
+	posting(0),
+	posting_idle(true)
 {
 
 }
@@ -60,6 +87,7 @@ CdrWriter::~CdrWriter()
 int CdrWriter::configure(CdrWriterCfg& cfg)
 {
 	config=cfg;
+	CdrPool::instance()->configure(config.cdr_pool_max_free);
 
 	//show all query args
 	int param_num = 1;
@@ -91,41 +119,126 @@ int CdrWriter::configure(CdrWriterCfg& cfg)
 void CdrWriter::start()
 {
 	cdrthreadpool_mut.lock();
+	if(config.failover_to_file && config.file_compress){
+		compressor = new CdrFileCompressor();
+		compressor->configure(config.file_compress_level);
+		compressor->start();
+		compress_leftovers();
+	}
 	DBG("CdrWriter::start: Starting %d async DB threads",config.poolsize);
 	for(unsigned int i=0;i<config.poolsize;i++){
 		CdrThread* th = new CdrThread;
-		th->configure(config);
+		th->configure(config,i,compressor);
 		th->start();
 		cdrthreadpool.push_back(th);
 	}
+	if(config.import_enabled){
+		importer = new CdrImporter(config,compressor);
+		importer->start();
+	}
 	cdrthreadpool_mut.unlock();
+
+	if(config.spool_enabled)
+		check_spool_leftovers();
+}
+
+void CdrWriter::check_spool_leftovers()
+{
+	//spool of thread is not replayed if pool became smaller
+	DIR *d = opendir(config.spool_dir.c_str());
+	if(!d) return;
+	struct dirent *e;
+	while((e = readdir(d))!=NULL){
+		char *end;
+		unsigned long idx = strtoul(e->d_name,&end,10);
+		if(end==e->d_name || *end!='\0')
+			continue;
+		if(idx >= config.poolsize){
+			WARN("CdrWriter: spool '%s/%s' is not served by any thread (%s_pool_size = %d). "
+				 "increase pool size to replay it",
+				 config.spool_dir.c_str(),e->d_name,config.name.c_str(),config.poolsize);
+		}
+	}
+	closedir(d);
+}
+
+void CdrWriter::compress_leftovers()
+{
+	//completed files which were not compressed before shutdown
+	DIR *d = opendir(config.failover_file_completed_dir.c_str());
+	if(!d) return;
+	struct dirent *e;
+	const size_t suffix_len = strlen(CDR_FILE_SUFFIX);
+	while((e = readdir(d))!=NULL){
+		size_t len = strlen(e->d_name);
+		if(len <= suffix_len ||
+		   strcmp(e->d_name+len-suffix_len,CDR_FILE_SUFFIX))
+			continue;
+		compressor->post(config.failover_file_completed_dir+"/"+e->d_name);
+	}
+	closedir(d);
 }
 
 void CdrWriter::stop()
 {
+	vector<CdrThread*> threads;
+
 	DBG("CdrWriter::stop: Begin shutdown cycle");
 	cdrthreadpool_mut.lock();
-	int len=cdrthreadpool.size();
+	if(importer){
+		importer->stop();
+		delete importer;
+		importer = NULL;
+	}
+	//new postcdr() calls will see empty pool
+	threads.swap(cdrthreadpool);
+	cdrthreadpool_mut.unlock();
+
+	//wait for postcdr() calls which already took the thread
+	posting_idle.wait_for();
+
+	cdrthreadpool_mut.lock();
+	int len=threads.size();
 	for(int i=0;i<len;i++){
 		DBG("CdrWriter::stop: Try shutdown thread %d",i);
-		CdrThread* th= cdrthreadpool.back();
-		cdrthreadpool.pop_back();
+		CdrThread* th= threads.back();
+		threads.pop_back();
 		th->stop();
 		delete th;
 	}
 	len=cdrthreadpool.size();
 	DBG("CdrWriter::stop: LEN:: %d", len);
+	if(compressor){
+		compressor->stop();
+		delete compressor;
+		compressor = NULL;
+	}
 	cdrthreadpool_mut.unlock();
 }
 
 void CdrWriter::postcdr(Cdr* cdr )
 {
 	if(cdr->suppress){
-		delete cdr;
+		CdrPool::instance()->release(cdr);
 		return;
 	}
 	cdrthreadpool_mut.lock();
-		cdrthreadpool[cdr->cdr_born_time.tv_usec%cdrthreadpool.size()]->postcdr(cdr);
+		if(cdrthreadpool.empty()){
+			cdrthreadpool_mut.unlock();
+			ERROR("CdrWriter: no threads to write CDR. forget about it");
+			CdrPool::instance()->release(cdr);
+			return;
+		}
+		CdrThread *th = cdrthreadpool[cdr->cdr_born_time.tv_usec%cdrthreadpool.size()];
+		//stop() waits for us before thread deletion
+		if(!posting++) posting_idle.set(false);
+	cdrthreadpool_mut.unlock();
+
+	//spool append waits for disk sync. don't hold pool lock here
+	th->postcdr(cdr);
+
+	cdrthreadpool_mut.lock();
+		if(!--posting) posting_idle.set(true);
 	cdrthreadpool_mut.unlock();
 }
 
@@ -146,11 +259,30 @@ void CdrWriter::getConfig(AmArg &arg){
 		params.push(int2str(param_num++)+": "+dit->name+" : "+dit->type_name);
 	}
 	arg.push("query_args",params);
+	arg["idempotency_key"] = config.idempotency_key;
 
 	arg["failover_to_file"] = config.failover_to_file;
 	if(config.failover_to_file){
 		arg["failover_file_dir"] = config.failover_file_dir;
 		arg["failover_file_completed_dir"] = config.failover_file_completed_dir;
+		arg["file_flush_interval"] = config.file_flush_interval;
+		arg["file_flush_size"] = (int)config.file_flush_size;
+		arg["file_rotate_size"] = (int)config.file_rotate_size;
+		arg["file_rotate_interval"] = config.file_rotate_interval;
+		arg["file_compress"] = config.file_compress;
+		arg["import_enabled"] = config.import_enabled;
+		if(config.import_enabled){
+			arg["import_archive_dir"] = config.import_archive_dir;
+			arg["import_rate"] = config.import_rate;
+			arg["import_batch"] = config.import_batch;
+		}
+	}
+
+	arg["spool_enabled"] = config.spool_enabled;
+	if(config.spool_enabled){
+		arg["spool_dir"] = config.spool_dir;
+		arg["spool_segment_size"] = (int)config.spool_segment_size;
+		arg["spool_replay_batch"] = config.spool_replay_batch;
 	}
 
 	arg["master_db"] = config.masterdb.conn_str();
@@ -164,8 +296,17 @@ void CdrWriter::showOpenedFiles(AmArg &arg){
 	for(vector<CdrThread*>::iterator it = cdrthreadpool.begin();it != cdrthreadpool.end();it++){
 		AmArg a;
 		(*it)->showOpenedFiles(a);
-		if(a.getType()!=AmArg::Undef)
-			arg.push(a);
+		arg.push(a);
+	}
+	cdrthreadpool_mut.unlock();
+}
+
+void CdrWriter::showImport(AmArg &arg){
+	cdrthreadpool_mut.lock();
+	if(importer){
+		importer->getStats(arg);
+	} else {
+		arg["state"] = "disabled";
 	}
 	cdrthreadpool_mut.unlock();
 }
@@ -187,7 +328,10 @@ void CdrWriter::getStats(AmArg &arg){
 		threads.push(underlying_stats);
 		underlying_stats.clear();
 	}
+	if(compressor)
+		compressor->getStats(arg["compressor"]);
 	cdrthreadpool_mut.unlock();
+	CdrPool::instance()->getStats(arg["cdr_pool"]);
 	arg.push("threads",threads);
 }
 
@@ -195,12 +339,23 @@ void CdrWriter::clearStats(){
 	cdrthreadpool_mut.lock();
 		for(vector<CdrThread*>::iterator it = cdrthreadpool.begin();it != cdrthreadpool.end();it++)
 		(*it)->clearStats();
+		if(compressor)
+			compressor->clearStats();
 	cdrthreadpool_mut.unlock();
+	CdrPool::instance()->clearStats();
 }
 
 void CdrThread::postcdr(Cdr* cdr)
 {
 	//DBG("%s[%p](%p)",FUNC_NAME,this,cdr);
+	if(spool.is_opened()){
+		prepare_fields_values(*cdr);
+		if(!spool.append(cdr->fields_values,cdr->spool_id)){
+			ERROR("CdrWriter %p can't append CDR to spool. write it without spooling",this);
+			cdr->spool_id = 0;
+		}
+	}
+	gettimeofday(&cdr->queued_time,NULL);
 	queue_mut.lock();
 		//queue.push_back(newcdr);
 		queue.push_back(cdr);
@@ -211,9 +366,11 @@ void CdrThread::postcdr(Cdr* cdr)
 
 CdrThread::CdrThread() :
 	queue_run(false),stopped(false),
-	masterconn(NULL),slaveconn(NULL),gotostop(false),
-	masteralarm(false),slavealarm(false)
+	masterconn(NULL),slaveconn(NULL),gotostop(false),probe_started(false),
+	wfd(-1),wfile_opened(0),wfile_seq(0),compressor(NULL)
 {
+	timerclear(&wbuf_flushed);
+	file_stats.file_bytes = 0;
 	clearStats();
 }
 
@@ -232,25 +389,65 @@ void CdrThread::getStats(AmArg &arg){
 	arg["db_exceptions"] = stats.db_exceptions;
 	arg["writed_cdrs"] = stats.writed_cdrs;
 	arg["tried_cdrs"] = stats.tried_cdrs;
+	arg["failed_writes"] = stats.failed_writes;
+	arg["ambiguous_writes"] = stats.ambiguous_writes;
+	probe.getStats(arg["probe"]);
+	metrics.getStats(arg["metrics"]);
+	if(spool.is_opened())
+		spool.getStats(arg["spool"]);
 }
 
 void CdrThread::showOpenedFiles(AmArg &arg){
-	if(wfp.get()&&wfp->is_open()){
-		arg = write_path;
+	AmLock l(file_mut);
+	if(wfd!=-1){
+		arg["file"] = write_path;
+		arg["opened_at"] = (int)wfile_opened;
+		arg["bytes_written"] = (long)file_stats.file_bytes;
+		arg["buffered_bytes"] = (long)wbuf.size();
 	} else {
-		arg = AmArg();
+		arg["file"] = AmArg();
 	}
+	arg["total_bytes_written"] = (long)file_stats.total_bytes;
+	arg["rotations"] = (long)file_stats.rotations;
+	arg["flushes"] = (long)file_stats.flushes;
+	arg["write_errors"] = (long)file_stats.write_errors;
 }
 
 void CdrThread::clearStats(){
 	stats.db_exceptions = 0;
 	stats.writed_cdrs = 0;
 	stats.tried_cdrs = 0;
+	stats.failed_writes = 0;
+	stats.ambiguous_writes = 0;
+	probe.clearStats();
+	metrics.clear();
+	file_stats.total_bytes = 0;
+	file_stats.rotations = 0;
+	file_stats.flushes = 0;
+	file_stats.write_errors = 0;
+	spool.clearStats();
 }
 
-int CdrThread::configure(CdrThreadCfg& cfg ){
+int CdrThread::configure(CdrThreadCfg& cfg,unsigned int thread_idx,
+						 CdrFileCompressor *file_compressor){
 	config=cfg;
+	compressor = file_compressor;
+	probe.configure(config);
+	if(config.failover_to_file)
+		wbuf.reserve(config.file_flush_size+WBUF_RESERVE);
 	queue_run.set(false);
+	if(config.spool_enabled){
+		string spool_dir = config.spool_dir+"/"+int2str(thread_idx);
+		if(0!=spool.open(spool_dir,config.spool_segment_size,writecdr_args_count(config))){
+			ERROR("CdrWriter %p can't open spool '%s'. continue without spooling",
+				  this,spool_dir.c_str());
+			return -1;
+		}
+		if(spool.has_orphans()){
+			INFO("CdrWriter %p has not written CDRs in spool '%s'. will replay them",
+				 this,spool_dir.c_str());
+		}
+	}
 	return 0;
 }
 
@@ -259,6 +456,8 @@ void CdrThread::on_stop(){
 	gotostop=true;
 	queue_run.set(true); // we must switch thread to run state for exit.
 	stopped.wait_for();
+	if(probe_started)
+		probe.stop();
 	if(masterconn){
 		DBG("CdrWriter: Disconnect master SQL. Backend pid: %d.",masterconn->backendpid());
 		masterconn->disconnect();
@@ -277,6 +476,9 @@ void CdrThread::run(){
 		throw std::logic_error("CdrWriter can't connect to any DB on startup");
 	}
 
+	probe.start();
+	probe_started = true;
+
 	bool db_err = false;
 
 while(true){
@@ -284,87 +486,36 @@ while(true){
 
 	//DBG("next cycle");
 
-	bool qrun = queue_run.wait_for_to(config.check_interval);
+	int wait_interval = config.check_interval;
+	if(wfd!=-1 && wait_interval > config.file_flush_interval)
+		wait_interval = config.file_flush_interval;
+
+	bool qrun = queue_run.wait_for_to(wait_interval);
 
 	if (gotostop){
 		stopped.set(true);
 		return;
 	}
 
-	if(db_err || !qrun){
-		//DBG("queue condition wait timeout. check connections");
-		//check master conn
-		if(masterconn!=NULL){
-			try {
-				pqxx::work t(*masterconn);
-				t.commit();
-				db_err = false;
-			} catch (const pqxx::pqxx_exception &e) {
-				delete masterconn;
-				if(!_connectdb(&masterconn,config.masterdb.conn_str(),true)){
-					if(!masteralarm){
-						ERROR("CdrWriter %p master DB connection failed alarm raised",this);
-						masteralarm = true;
-						RAISE_ALARM(alarms::CDR_DB_CONN);
-					}
-				} else {
-					INFO("CdrWriter %p master DB connection failed alarm cleared",this);
-					masteralarm = false;
-					db_err = false;
-					CLEAR_ALARM(alarms::CDR_DB_CONN);
-				}
-			}
-		} else {
-			if(!_connectdb(&masterconn,config.masterdb.conn_str(),true)){
-				if(!masteralarm){
-					ERROR("CdrWriter %p master DB connection failed alarm raised",this);
-					masteralarm = true;
-					RAISE_ALARM(alarms::CDR_DB_CONN);
-				}
-			} else {
-				INFO("CdrWriter %p master DB connection failed alarm cleared",this);
-				masteralarm = false;
-				CLEAR_ALARM(alarms::CDR_DB_CONN);
-			}
-		}
-		//check slave connecion
-		if(!config.failover_to_slave)
-			continue;
+	check_file_timers();
 
-		if(slaveconn!=NULL){
-			try {
-				pqxx::work t(*slaveconn);
-				t.commit();
-				db_err = false;
-			} catch (const pqxx::pqxx_exception &e) {
-				delete slaveconn;
-				if(!_connectdb(&slaveconn,config.slavedb.conn_str(),false)){
-					if(!slavealarm){
-						ERROR("CdrWriter %p slave DB connection failed alarm raised",this);
-						slavealarm = true;
-						RAISE_ALARM(alarms::CDR_DB_CONN_SLAVE);
-					}
-				} else {
-					INFO("CdrWriter %p slave DB connection failed alarm cleared",this);
-					slavealarm = false;
-					db_err = false;
-					CLEAR_ALARM(alarms::CDR_DB_CONN_SLAVE);
-				}
-			}
+	/* server can be reachable for probe while our session is dead.
+	 * check it when idle, so broken connection is retired by exchange()
+	 * before the next CDR is written */
+	if(!qrun) check_connections();
+
+	//health checks and reconnects are done by probe thread
+	probe.exchange(masterconn,slaveconn);
+	db_err = (masterconn==NULL);
+
+	if(!db_err && spool.is_opened() && spool.has_orphans()){
+		if(replay_spool()){
+			//don't wait for queue condition while spool is not empty
+			if(spool.has_orphans())
+				queue_run.set(true);
 		} else {
-			if(!_connectdb(&slaveconn,config.slavedb.conn_str(),false)){
-				if(!slavealarm){
-					ERROR("CdrWriter %p slave DB connection failed alarm raised",this);
-					slavealarm = true;
-					RAISE_ALARM(alarms::CDR_DB_CONN_SLAVE);
-				}
-			} else {
-				INFO("CdrWriter %p slave DB connection failed alarm cleared",this);
-				slavealarm = false;
-				CLEAR_ALARM(alarms::CDR_DB_CONN_SLAVE);
-			}
+			db_err = true;
 		}
-		//continue;
 	}
 
 	//DBG("CdrWriter cycle beginstartup");
@@ -387,6 +538,10 @@ while(true){
 	queue_mut.unlock();
 
 	bool cdr_writed = false;
+	CdrThreadMetrics::write_mode wmode = CdrThreadMetrics::MODE_NONE;
+	struct timeval write_start,write_end;
+	gettimeofday(&write_start,NULL);
+	prepare_fields_values(*cdr);
 #if 0 //used for tests
 	if(0!=writecdrtofile(cdr)){
 		ERROR("can't write CDR to file");
@@ -397,12 +552,17 @@ while(true){
 	}
 #endif
 //#if 0
-	if(0!=writecdr(masterconn,*cdr)){
+	int master_ret = writecdr(masterconn,cdr->fields_values);
+	if(WRITECDR_OK!=master_ret){
 		ERROR("Cant write CDR to master database");
+		if(master_ret==WRITECDR_AMBIGUOUS && !config.idempotency_key){
+			WARN("CDR could be written to master. "
+				 "enable cdr_idempotency_key to avoid duplicates on failover");
+		}
 		db_err = true;
 		if (config.failover_to_slave) {
 			DBG("failover_to_slave enabled. try");
-			if(!slaveconn || 0!=writecdr(slaveconn,*cdr)){
+			if(!slaveconn || 0!=writecdr(slaveconn,cdr->fields_values)){
 				db_err = true;
 				ERROR("Cant write CDR to slave database");
 				if(config.failover_to_file){
@@ -413,6 +573,7 @@ while(true){
 						//succ writed to file
 						DBG("CDR was written into file");
 						cdr_writed = true;
+						wmode = CdrThreadMetrics::MODE_FILE;
 					}
 				} else {
 					DBG("failover_to_file disabled");
@@ -421,6 +582,7 @@ while(true){
 				//succ writed to slave database
 				DBG("CDR was written into slave");
 				cdr_writed = true;
+				wmode = CdrThreadMetrics::MODE_SLAVE;
 				closefile();
 			}
 		} else {
@@ -433,6 +595,7 @@ while(true){
 					//succ writed to file
 					DBG("CDR was written into file");
 					cdr_writed = true;
+					wmode = CdrThreadMetrics::MODE_FILE;
 				}
 			} else {
 				DBG("failover_to_file disabled");
@@ -442,15 +605,25 @@ while(true){
 		//succ writed to master database
 		DBG("CDR was written into master");
 		cdr_writed = true;
+		wmode = CdrThreadMetrics::MODE_MASTER;
 		closefile();
 	}
 //#endif
+	gettimeofday(&write_end,NULL);
+	metrics.on_write(cdr->queued_time,write_start,write_end,wmode);
+
 	if(cdr_writed){
 		stats.writed_cdrs++;
+		if(cdr->spool_id)
+			spool.ack(cdr->spool_id);
 		DBG("CDR deleted from queue");
-		delete cdr;
+		CdrPool::instance()->release(cdr);
 	} else {
-		if(config.failover_requeue){
+		if(cdr->spool_id){
+			DBG("CDR is kept in spool. it will be replayed when master DB is available");
+			spool.orphan(cdr->spool_id);
+			CdrPool::instance()->release(cdr);
+		} else if(config.failover_requeue){
 			DBG("requeuing is enabled. return CDR into queue");
 			queue_mut.lock();
 				queue.push_back(cdr);
@@ -458,15 +631,15 @@ while(true){
 			queue_mut.unlock();
 		} else {
 			ERROR("CDR write failed. forget about it");
-			delete cdr;
+			CdrPool::instance()->release(cdr);
 		}
 	}
 } //while
 }
 
-void CdrThread::prepare_queries(pqxx::connection *c){
-	PreparedQueriesT_iterator it = config.prepared_queries.begin();
-	DynFieldsT_iterator dit;
+void prepare_cdr_queries(pqxx::connection *c, const CdrThreadCfg &config){
+	PreparedQueriesT::const_iterator it = config.prepared_queries.begin();
+	DynFieldsT_const_iterator dit;
 
 	c->set_variable("search_path",config.db_schema+", public");
 
@@ -492,24 +665,41 @@ void CdrThread::prepare_queries(pqxx::connection *c){
 		}
 		//trusted headers
 		TrustedHeaders::instance()->invocate(d);
+		if(config.idempotency_key)
+			d("varchar",pqxx::prepare::treat_direct);
 #endif
 		c->prepare_now(it->first);
 	}
 }
 
-int CdrThread::_connectdb(cdr_writer_connection **conn,string conn_str,bool master){
+/* silently dropped session becomes socket error in a few check intervals
+ * instead of the endless wait for the server reply */
+static string keepalive_conn_str(const string &conn_str, int check_interval){
+	int idle = check_interval/1000;
+	if(idle < 1) idle = 1;
+	return conn_str+
+		" keepalives=1"
+		" keepalives_idle="+int2str(idle)+
+		" keepalives_interval="+int2str(idle)+
+		" keepalives_count="+int2str(DB_KEEPALIVES_COUNT);
+}
+
+int cdr_connectdb(cdr_writer_connection **conn,const string &conn_str,bool master,
+				  const CdrThreadCfg &config)
+{
 	cdr_writer_connection *c = NULL;
 	int ret = 0;
 	try{
-		c = new cdr_writer_connection(conn_str,master);
+		c = new cdr_writer_connection(keepalive_conn_str(conn_str,config.check_interval),master);
 		if (c->is_open()){
-			prepare_queries(c);
+			prepare_cdr_queries(c,config);
 			INFO("CdrWriter: SQL connected. Backend pid: %d.",c->backendpid());
 			ret = 1;
 		}
 	} catch(const pqxx::broken_connection &e){
 			ERROR("CdrWriter: SQL connection exception: %s",e.what());
 		delete c;
+		c = NULL;
 	} catch(const pqxx::undefined_function &e){
 		ERROR("CdrWriter: SQL connection: undefined_function query: %s, what: %s",e.query().c_str(),e.what());
 		c->disconnect();
@@ -523,18 +713,19 @@ int CdrThread::_connectdb(cdr_writer_connection **conn,string conn_str,bool mast
 
 int CdrThread::connectdb(){
 	int ret;
-	ret = _connectdb(&masterconn,config.masterdb.conn_str(),true);
+	ret = cdr_connectdb(&masterconn,config.masterdb.conn_str(),true,config);
 	if(config.failover_to_slave){
-		ret|=_connectdb(&slaveconn,config.slavedb.conn_str(),false);
+		ret|=cdr_connectdb(&slaveconn,config.slavedb.conn_str(),false,config);
 	}
 	return ret;
 }
 
-void CdrThread::dbg_writecdr(AmArg &fields_values,Cdr &cdr){
-	int k = 0;
-	//static fields
-	for(int j = 0;j<WRITECDR_STATIC_FIELDS_COUNT;j++,k++){
-		AmArg &a = fields_values.get(k);
+void CdrThread::dbg_writecdr(const AmArg &fields_values){
+	unsigned int k = 0;
+	const unsigned int n = fields_values.size();
+	//static fields. is_master is not the part of fields_values
+	for(int j = 1;j<WRITECDR_STATIC_FIELDS_COUNT && k<n;j++,k++){
+		const AmArg &a = fields_values.get(k);
 		const static_field &f = cdr_static_fields[j];
 		ERROR("%d: %s[%s] -> %s[%s]",
 			k,f.name,f.type,
@@ -542,123 +733,322 @@ void CdrThread::dbg_writecdr(AmArg &fields_values,Cdr &cdr){
 			a.t2str(a.getType()));
 	}
 	//dynamic fields
-	const size_t n = cdr.dyn_fields.size();
-	const size_t m = config.dyn_fields.size();
-	if(m!=n){
-		ERROR("mismatched count of configured and actually gained dynamic fields."
-			  "cfg: %ld, actually: %ld",m,n);
-		return;
+	if(config.serialize_dynamic_fields){
+		if(k<n){
+			const AmArg &a = fields_values.get(k);
+			ERROR("%d: dynamic[json] -> %s[%s]",
+				k,AmArg::print(a).c_str(),
+				a.t2str(a.getType()));
+			k++;
+		}
+	} else {
+		DynFieldsT_const_iterator it = config.dyn_fields.begin();
+		for(;it!=config.dyn_fields.end() && k<n;++it,++k){
+			const DynField &f = *it;
+			const AmArg &a = fields_values.get(k);
+			ERROR("%d: %s[%s] -> %s[%s]",
+				k,f.name.c_str(),f.type_name.c_str(),
+				AmArg::print(a).c_str(),
+				a.t2str(a.getType()));
+		}
 	}
-	DynFieldsT_const_iterator it = config.dyn_fields.begin();
-	for(int j = 0;it!=config.dyn_fields.end();++it,++j,++k){
-		const DynField &f = *it;
-		AmArg &a = cdr.dyn_fields[f.name];
-		ERROR("%d: %s[%s] -> %s[%s]",
-			k,f.name.c_str(),f.type_name.c_str(),
-			AmArg::print(a).c_str(),
+	//trusted headers
+	const unsigned int trusted_end = config.idempotency_key && n ? n-1 : n;
+	for(;k<trusted_end;k++){
+		const AmArg &a = fields_values.get(k);
+		ERROR("%d: trusted_hdr -> %s[%s]",
+			k,AmArg::print(a).c_str(),
+			a.t2str(a.getType()));
+	}
+	if(k<n){
+		const AmArg &a = fields_values.get(k);
+		ERROR("%d: idempotency_key -> %s[%s]",
+			k,AmArg::print(a).c_str(),
 			a.t2str(a.getType()));
 	}
+}
+
+void CdrThread::prepare_fields_values(Cdr &cdr){
+	if(cdr.fields_values.getType()!=AmArg::Undef)
+		return;
+
+	Yeti::global_config &gc = Yeti::instance().config;
 
-	//TrustedHeaders::instance()->print_hdrs(cdr.trusted_hdrs);
+	cdr.fields_values.assertArray();
+	cdr.fields_values.push(AmArg(gc.node_id));
+	cdr.fields_values.push(AmArg(gc.pop_id));
+	cdr.get_fields_values(cdr.fields_values,config.dyn_fields,
+						  config.serialize_dynamic_fields);
+
+	if(config.idempotency_key){
+		//the same for every retry, replay and import of this CDR
+		cdr.fields_values.push(AmArg(
+			int2str(gc.node_id)+"/"+cdr.local_tag+"/"+int2str(cdr.attempt_num)));
+	}
 }
 
-int CdrThread::writecdr(cdr_writer_connection* conn, Cdr& cdr){
-#define invoc_field(field_value)\
-	fields_values.push(AmArg(field_value));\
-	invoc(field_value);
+static inline void invoc_AmArg(pqxx::prepare::invocation &invoc,const AmArg &arg){
+	short type = arg.getType();
+	switch(type){
+	case AmArg::Int:      { invoc(arg.asInt()); } break;
+	case AmArg::LongLong: { invoc(arg.asLongLong()); } break;
+	case AmArg::Bool:     { invoc(arg.asBool()); } break;
+	case AmArg::CStr:     { invoc(arg.asCStr()); } break;
+	case AmArg::Undef:    { invoc(); } break;
+	default: {
+		ERROR("invoc_AmArg. unhandled AmArg type %s",arg.t2str(type));
+		invoc();
+	}
+	}
+}
 
-	DBG("%s[%p](conn = %p,cdr = %p)",FUNC_NAME,this,conn,&cdr);
-	int ret = 1;
+/* data exceptions and integrity constraint violations.
+ * other errors (deadlocks, timeouts, lack of resources) can pass on retry */
+static bool is_permanent_sql_error(const pqxx::sql_error &e){
+	const string &state = e.sqlstate();
+	return state.compare(0,2,"22")==0 || state.compare(0,2,"23")==0;
+}
 
-	Yeti::global_config &gc = Yeti::instance().config;
-	AmArg fields_values;
+int CdrThread::writecdr(cdr_writer_connection* conn, const AmArg &fields_values){
+	DBG("%s[%p](conn = %p,fields_values = %p)",FUNC_NAME,this,conn,&fields_values);
+	int ret = WRITECDR_FAILED;
+	bool sent = false;
 
 	if(conn==NULL){
 		ERROR("writecdr() we got NULL connection pointer.");
-		return 1;
+		stats.failed_writes++;
+		return WRITECDR_FAILED;
 	}
 
-	fields_values.assertArray();
-
-	//TrustedHeaders::instance()->print_hdrs(cdr->trusted_hdrs);
-
 	stats.tried_cdrs++;
 	try{
 		pqxx::result r;
 		pqxx::nontransaction tnx(*conn);
 		if(!tnx.prepared("writecdr").exists()){
 			ERROR("have no prepared SQL statement");
-			return 1;
+			stats.failed_writes++;
+			return WRITECDR_FAILED;
 		}
 
 		pqxx::prepare::invocation invoc = tnx.prepared("writecdr");
 
-		invoc_field(conn->isMaster());
-		invoc_field(gc.node_id);
-		invoc_field(gc.pop_id);
-
-		cdr.invoc(invoc,fields_values,config.dyn_fields,
-				  config.serialize_dynamic_fields);
+		invoc(conn->isMaster());
+		for(unsigned int i = 0;i<fields_values.size();i++)
+			invoc_AmArg(invoc,fields_values.get(i));
 
+		sent = true;
 		r = invoc.exec();
 		if (r.size()!=0&&0==r[0][0].as<int>()){
-			ret = 0;
+			ret = WRITECDR_OK;
+		} else {
+			//declined by writecdr() function itself. the same on retry
+			ERROR("writecdr() function declined CDR");
+			ret = WRITECDR_REJECTED;
 		}
 
-		//dbg_writecdr(fields_values,cdr);
+		//dbg_writecdr(fields_values);
+	} catch(const pqxx::sql_error &e){
+		//statement is failed. nothing is written
+		DBG("SQL exception on CdrWriter thread: %s, sqlstate: %s",
+			e.what(),e.sqlstate().c_str());
+		dbg_writecdr(fields_values);
+		conn->disconnect();
+		stats.db_exceptions++;
+		if(is_permanent_sql_error(e))
+			ret = WRITECDR_REJECTED;
 	} catch(const pqxx::pqxx_exception &e){
 		DBG("SQL exception on CdrWriter thread: %s",e.base().what());
-		dbg_writecdr(fields_values,cdr);
+		if(sent){
+			//connection is lost after query was sent. it could be committed
+			ERROR("writecdr() outcome is unknown: %s",e.base().what());
+			ret = WRITECDR_AMBIGUOUS;
+		}
+		dbg_writecdr(fields_values);
 		conn->disconnect();
 		stats.db_exceptions++;
 	}
+
+	if(ret==WRITECDR_AMBIGUOUS) stats.ambiguous_writes++;
+	else if(ret!=WRITECDR_OK) stats.failed_writes++;
+
 	return ret;
-#undef invoc_field
 }
 
-bool CdrThread::openfile(){
-	if(wfp.get()&&wfp->is_open()){
-		return true;
-	} else {
-		wfp.reset(new ofstream());
-		ostringstream filename;
-		char buf[80];
-		time_t nowtime;
-		struct tm timeinfo;
-
-		time(&nowtime);
-		localtime_r (&nowtime,&timeinfo);
-		strftime (buf,80,"%G%m%d_%H%M%S",&timeinfo);
-		filename << "/" << std::dec << buf << "_" << std::dec << this << ".csv";
-		write_path = config.failover_file_dir+filename.str();
-		completed_path = config.failover_file_completed_dir+filename.str();
-		wfp->open(write_path.c_str(), std::ofstream::out | std::ofstream::trunc);
-		if(!wfp->is_open()){
-			ERROR("can't open '%s'. skip writing",write_path.c_str());
+void CdrThread::check_connection(cdr_writer_connection *conn){
+	if(!conn || !conn->is_open())
+		return;
+
+	/* idle session has nothing to read. readable or failed socket means
+	 * server terminated session or keepalive timed out. never blocks */
+	struct pollfd pfd;
+	pfd.fd = conn->sock();
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if(pfd.fd >= 0 && poll(&pfd,1,0)<=0)
+		return;
+
+	ERROR("CdrWriter %p %s DB connection is broken. close it",
+		  this,conn->isMaster() ? "master" : "slave");
+	conn->disconnect();
+}
+
+void CdrThread::check_connections(){
+	check_connection(masterconn);
+	check_connection(slaveconn);
+}
+
+bool CdrThread::replay_spool(){
+	CdrSpool::record_id_t id;
+	AmArg fields_values;
+	int n = config.spool_replay_batch;
+
+	while(n-- > 0){
+		fields_values.clear();
+		if(!spool.get_orphan(id,fields_values))
+			break;
+		int ret = writecdr(masterconn,fields_values);
+		if(ret==WRITECDR_REJECTED){
+			//replay would fail forever and block the rest of spool
+			ERROR("CdrWriter %p spooled CDR %llu is rejected by master database. move it out of spool",
+				  this,(unsigned long long)id);
+			if(!config.failover_to_file || 0!=writefieldstofile(fields_values,id))
+				spool.quarantine(id);
+			//connection could be closed after error. continue on the next cycle
+			break;
+		}
+		if(ret!=WRITECDR_OK){
+			ERROR("CdrWriter %p can't replay spooled CDR %llu to master database. postpone",
+				  this,(unsigned long long)id);
+			spool.orphan(id);
 			return false;
 		}
-		DBG("write cdr file header");
-		write_header();
+		spool.replayed(id);
+		stats.writed_cdrs++;
+	}
+	return true;
+}
+
+bool CdrThread::openfile(){
+	if(wfd!=-1)
+		return true;
+
+	ostringstream filename;
+	char buf[80];
+	time_t nowtime;
+	struct tm timeinfo;
+
+	time(&nowtime);
+	localtime_r (&nowtime,&timeinfo);
+	strftime (buf,80,"%G%m%d_%H%M%S",&timeinfo);
+	//sequence number avoids name clash on rotation within the same second
+	filename << "/" << std::dec << buf << "_" << std::dec << this
+			 << "_" << wfile_seq++ << CDR_FILE_SUFFIX;
+	write_path = config.failover_file_dir+filename.str();
+	completed_path = config.failover_file_completed_dir+filename.str();
+	wfd = open(write_path.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if(wfd==-1){
+		ERROR("can't open '%s': %s. skip writing",write_path.c_str(),strerror(errno));
+		file_stats.write_errors++;
+		return false;
+	}
+	wfile_opened = nowtime;
+	gettimeofday(&wbuf_flushed,NULL);
+	file_stats.file_bytes = 0;
+	wbuf.clear();
+	DBG("write cdr file header");
+	write_header();
+	return true;
+}
+
+bool CdrThread::flushfile(){
+	bool ret = true;
+	const char *p = wbuf.data();
+	size_t left = wbuf.size();
+
+	gettimeofday(&wbuf_flushed,NULL);
+	if(!left)
 		return true;
+
+	while(left){
+		ssize_t r = write(wfd,p,left);
+		if(r < 0){
+			if(errno==EINTR) continue;
+			ERROR("can't write to '%s': %s",write_path.c_str(),strerror(errno));
+			file_stats.write_errors++;
+			ret = false;
+			break;
+		}
+		p+=r;
+		left-=r;
+		file_stats.file_bytes+=r;
+		file_stats.total_bytes+=r;
 	}
-	return false;
+	wbuf.clear();
+	file_stats.flushes++;
+
+	if(wbuf_spool_ids.empty())
+		return ret;
+
+	//spooled CDRs are acknowledged only when they are on disk
+	if(ret && 0!=fdatasync(wfd)){
+		ERROR("can't sync '%s': %s",write_path.c_str(),strerror(errno));
+		file_stats.write_errors++;
+		ret = false;
+	}
+	for(vector<CdrSpool::record_id_t>::iterator it = wbuf_spool_ids.begin();
+		it!=wbuf_spool_ids.end();++it)
+	{
+		if(ret) spool.ack(*it);
+		else spool.orphan(*it);
+	}
+	wbuf_spool_ids.clear();
+
+	return ret;
+}
+
+void CdrThread::check_file_timers(){
+	AmLock l(file_mut);
+	if(wfd==-1)
+		return;
+
+	if(config.file_rotate_interval &&
+	   time(NULL) - wfile_opened >= config.file_rotate_interval)
+	{
+		DBG("rotate '%s' by time",write_path.c_str());
+		_closefile();
+		return;
+	}
+
+	struct timeval now,diff;
+	gettimeofday(&now,NULL);
+	timersub(&now,&wbuf_flushed,&diff);
+	if(diff.tv_sec*1000+diff.tv_usec/1000 >= config.file_flush_interval)
+		flushfile();
 }
 
 void CdrThread::closefile(){
-	if(!wfp.get())
+	AmLock l(file_mut);
+	_closefile();
+}
+
+void CdrThread::_closefile(){
+	if(wfd==-1)
 		return;
-	wfp->flush();
-	wfp->close();
-	wfp.reset();
+	flushfile();
+	close(wfd);
+	wfd = -1;
 	if(0==rename(write_path.c_str(),completed_path.c_str())){
 		ERROR("moved from '%s' to '%s'",write_path.c_str(),completed_path.c_str());
+		file_stats.rotations++;
+		if(compressor)
+			compressor->post(completed_path);
 	} else {
 		ERROR("can't move file from '%s' to '%s'",write_path.c_str(),completed_path.c_str());
 	}
 }
 
 void CdrThread::write_header(){
-	ofstream &wf = *wfp.get();
+	ostringstream wf;
 	TrustedHeaders &th = *TrustedHeaders::instance();
 		//write description header
 	wf << "#version: " << YETI_VERSION << endl;
@@ -666,45 +1056,77 @@ void CdrThread::write_header(){
 	wf << "#dynamic_fields_count: " << config.dyn_fields.size() << endl;
 	wf << "#trusted_hdrs_count: " << th.count() << endl;
 
-		//static fields names
 	wf << "#fields_descr: ";
-	for(int i = 0;i<WRITECDR_STATIC_FIELDS_COUNT;i++){
-		if(i) wf << ",";
-		wf << "'" << cdr_static_fields[i].name << "'";
+	write_cdr_file_fields_descr(wf,config);
+	wf << endl;
+
+	wbuf.append(wf.str());
+}
+
+void write_cdr_file_fields_descr(ostream &s, const CdrThreadCfg &config){
+		//static fields names. is_master is not written
+	for(int i = 1;i<WRITECDR_STATIC_FIELDS_COUNT;i++){
+		if(i>1) s << ",";
+		s << "'" << cdr_static_fields[i].name << "'";
 	}
 
 		//dynamic fields names
-	DynFieldsT_iterator dit = config.dyn_fields.begin();
-	for(;dit!=config.dyn_fields.end();++dit){
-		wf << ",'"<< dit->name << "'";
+	if(config.serialize_dynamic_fields){
+		s << ",'dynamic'";
+	} else {
+		DynFieldsT_const_iterator dit = config.dyn_fields.begin();
+		for(;dit!=config.dyn_fields.end();++dit){
+			s << ",'"<< dit->name << "'";
+		}
 	}
 
 		//trusted headers names
-	th.print_csv(wf);
+	TrustedHeaders::instance()->print_csv(s);
 
-	wf << endl;
-	wf.flush();
+	if(config.idempotency_key)
+		s << ",'idempotency_key'";
 }
 
 int CdrThread::writecdrtofile(Cdr* cdr){
-#define quote(v) "'"<<v<< "'" << ','
+	prepare_fields_values(*cdr);
+	if(0!=writefieldstofile(cdr->fields_values,cdr->spool_id))
+		return -1;
+	//acked after flush
+	cdr->spool_id = 0;
+	return 0;
+}
+
+int CdrThread::writefieldstofile(const AmArg &fields_values, CdrSpool::record_id_t spool_id){
+	AmLock l(file_mut);
 	if(!openfile()){
 		return -1;
 	}
-	ofstream &s = *wfp.get();
-	Yeti::global_config &gc = Yeti::instance().config;
 
-	s << std::dec <<
-	quote(gc.node_id) <<
-	quote(gc.pop_id);
+	wbuf.add_row(fields_values);
+
+	if(spool_id)
+		wbuf_spool_ids.push_back(spool_id);
 
-	cdr->to_csv_stream(s,config.dyn_fields);
+	if(wbuf.size() >= config.file_flush_size)
+		flushfile();
+
+	if(config.file_rotate_size &&
+	   file_stats.file_bytes >= config.file_rotate_size)
+	{
+		DBG("rotate '%s' by size",write_path.c_str());
+		_closefile();
+	}
 
-	s << endl;
-	s.flush();
 	stats.writed_cdrs++;
 	return 0;
-#undef quote
+}
+
+unsigned int writecdr_args_count(const CdrThreadCfg &config){
+	unsigned int n = WRITECDR_STATIC_FIELDS_COUNT-1;
+	n += config.serialize_dynamic_fields ? 1 : config.dyn_fields.size();
+	n += TrustedHeaders::instance()->count();
+	if(config.idempotency_key) n++;
+	return n;
 }
 
 int CdrThreadCfg::cfg2CdrThCfg(AmConfigReader& cfg, string& prefix){
@@ -714,7 +1136,10 @@ int CdrThreadCfg::cfg2CdrThCfg(AmConfigReader& cfg, string& prefix){
 
 	serialize_dynamic_fields = cfg.getParameterInt("serialize_dynamic_fields",0);
 	failover_requeue = cfg.getParameterInt("failover_requeue",0);
+	idempotency_key = cfg.getParameterInt(prefix+"_idempotency_key",0);
 
+	file_compress = false;
+	import_enabled = false;
 	failover_to_file = cfg.getParameterInt("failover_to_file",1);
 	if(failover_to_file){
 		if(!cfg.hasParameter(cdr_file_dir)){
@@ -748,6 +1173,72 @@ int CdrThreadCfg::cfg2CdrThCfg(AmConfigReader& cfg, string& prefix){
 			return -1;
 		}
 		remove(completed_dir_test_file.str().c_str());
+
+		file_flush_interval = cfg.getParameterInt(prefix+"_file_flush_interval",
+												  DEFAULT_FILE_FLUSH_INTERVAL);
+		if(file_flush_interval <= 0) file_flush_interval = DEFAULT_FILE_FLUSH_INTERVAL;
+		file_flush_size = cfg.getParameterInt(prefix+"_file_flush_size",
+											  DEFAULT_FILE_FLUSH_SIZE);
+		file_rotate_size = cfg.getParameterInt(prefix+"_file_rotate_size",0);
+		file_rotate_interval = cfg.getParameterInt(prefix+"_file_rotate_interval",0);
+		file_compress = cfg.getParameterInt(prefix+"_file_compress",0);
+		file_compress_level = cfg.getParameterInt(prefix+"_file_compress_level",
+												  DEFAULT_FILE_COMPRESS_LEVEL);
+		if(file_compress_level > 9) file_compress_level = 9;
+
+		import_enabled = cfg.getParameterInt(prefix+"_import_enabled",0);
+		if(import_enabled){
+			string cdr_import_archive_dir = prefix+"_import_archive_dir";
+			if(!cfg.hasParameter(cdr_import_archive_dir)){
+				ERROR("missed '%s'' parameter",cdr_import_archive_dir.c_str());
+				return -1;
+			}
+			import_archive_dir = cfg.getParameter(cdr_import_archive_dir);
+			import_rate = cfg.getParameterInt(prefix+"_import_rate",DEFAULT_IMPORT_RATE);
+			if(import_rate <= 0) import_rate = DEFAULT_IMPORT_RATE;
+			import_batch = cfg.getParameterInt(prefix+"_import_batch",DEFAULT_IMPORT_BATCH);
+			if(import_batch <= 0) import_batch = DEFAULT_IMPORT_BATCH;
+
+			ofstream t4;
+			ostringstream archive_dir_test_file;
+			archive_dir_test_file << import_archive_dir << "/test";
+			t4.open(archive_dir_test_file.str().c_str(),std::ofstream::out | std::ofstream::trunc);
+			if(!t4.is_open()){
+				ERROR("can't write test file in '%s' directory",import_archive_dir.c_str());
+				return -1;
+			}
+			remove(archive_dir_test_file.str().c_str());
+		}
+	}
+
+	spool_enabled = cfg.getParameterInt(prefix+"_spool_enabled",0);
+	if(spool_enabled){
+		string cdr_spool_dir = prefix+"_spool_dir";
+		if(!cfg.hasParameter(cdr_spool_dir)){
+			ERROR("missed '%s'' parameter",cdr_spool_dir.c_str());
+			return -1;
+		}
+		spool_dir = cfg.getParameter(cdr_spool_dir);
+		spool_segment_size = cfg.getParameterInt(prefix+"_spool_segment_size",
+												 DEFAULT_SPOOL_SEGMENT_SIZE);
+		spool_replay_batch = cfg.getParameterInt(prefix+"_spool_replay_batch",
+												 DEFAULT_SPOOL_REPLAY_BATCH);
+		if(spool_replay_batch <= 0) spool_replay_batch = 1;
+
+		//check for permissions
+		if(0!=mkdir(spool_dir.c_str(),0755) && errno!=EEXIST){
+			ERROR("can't create spool directory '%s': %s",spool_dir.c_str(),strerror(errno));
+			return -1;
+		}
+		ofstream t3;
+		ostringstream spool_dir_test_file;
+		spool_dir_test_file << spool_dir << "/test";
+		t3.open(spool_dir_test_file.str().c_str(),std::ofstream::out | std::ofstream::trunc);
+		if(!t3.is_open()){
+			ERROR("can't write test file in '%s' directory",spool_dir.c_str());
+			return -1;
+		}
+		remove(spool_dir_test_file.str().c_str());
 	}
 
 	masterdb.cfg2dbcfg(cfg,suffix);
@@ -759,6 +1250,7 @@ int CdrThreadCfg::cfg2CdrThCfg(AmConfigReader& cfg, string& prefix){
 
 int CdrWriterCfg::cfg2CdrWrCfg(AmConfigReader& cfg){
 	poolsize=cfg.getParameterInt(name+"_pool_size",10);
+	cdr_pool_max_free = cfg.getParameterInt("cdr_pool_max_free",DEFAULT_CDR_POOL_MAX_FREE);
 	check_interval = cfg.getParameterInt("cdr_check_interval",5000);
 	failover_to_slave = cfg.getParameterInt("cdr_failover_to_slave",1);
 	serialize_dynamic_fields = cfg.getParameterInt("serialize_dynamic_fields",0);
@@ -12,6 +12,11 @@
 #include "../db/DbConfig.h"
 #include "Cdr.h"
 #include "../db/DbTypes.h"
+#include "CdrSpool.h"
+#include "CdrFileCompressor.h"
+#include "CsvBuffer.h"
+#include "CdrDbProbe.h"
+#include "CdrThreadMetrics.h"
 #include <fstream>
 #include <sstream>
 #include <cstdio>
@@ -21,6 +26,15 @@ using std::string;
 using std::list;
 using std::vector;
 
+#define CDR_FILE_SUFFIX ".csv"
+
+enum writecdr_result {
+	WRITECDR_OK = 0,
+	WRITECDR_FAILED,
+	WRITECDR_AMBIGUOUS,	//CDR could be written or not
+	WRITECDR_REJECTED	//CDR data is rejected by DB. retry will fail too
+};
+
 class cdr_writer_connection: public pqxx::connection {
   private:
 	bool master;
@@ -36,18 +50,43 @@ struct CdrThreadCfg{
 	bool failover_to_file;
 	bool failover_requeue;
 	bool serialize_dynamic_fields;
+	bool idempotency_key;	//pass node_id/local_tag/attempt_num as the last writecdr() arg
 	string failover_file_dir;
 	int check_interval;
 	string failover_file_completed_dir;
+	int file_flush_interval;		//ms
+	size_t file_flush_size;
+	size_t file_rotate_size;		//0 - disabled
+	int file_rotate_interval;		//seconds. 0 - disabled
+	bool file_compress;
+	int file_compress_level;
+	bool import_enabled;
+	string import_archive_dir;
+	int import_rate;			//CDRs per second
+	int import_batch;
 	DbConfig masterdb,slavedb;
 	PreparedQueriesT prepared_queries;
 	DynFieldsT dyn_fields;
 	string db_schema;
+	bool spool_enabled;
+	string spool_dir;
+	size_t spool_segment_size;
+	int spool_replay_batch;
 	int cfg2CdrThCfg(AmConfigReader& cfg,string& prefix);
 };
 
+/* failover file columns description. the same as writecdr() args except is_master */
+void write_cdr_file_fields_descr(ostream &s, const CdrThreadCfg &config);
+/* writecdr() arguments count except is_master */
+unsigned int writecdr_args_count(const CdrThreadCfg &config);
+void prepare_cdr_queries(pqxx::connection *c, const CdrThreadCfg &config);
+/* connect and prepare writecdr. returns 1 on success */
+int cdr_connectdb(cdr_writer_connection **conn,const string &conn_str,bool master,
+				  const CdrThreadCfg &config);
+
 struct CdrWriterCfg :public CdrThreadCfg{
 	unsigned int poolsize;
+	size_t cdr_pool_max_free;
 	bool serialize_dynamic_fields;
 	string name;
 	int cfg2CdrWrCfg(AmConfigReader& cfg);
@@ -60,24 +99,51 @@ class CdrThread : public AmThread{
 	AmCondition<bool> stopped;
 	cdr_writer_connection *masterconn,*slaveconn;
 	CdrThreadCfg config;
-	auto_ptr<ofstream> wfp;
+	//failover file
+	int wfd;
+	CsvBuffer wbuf;
 	string write_path;
 	string completed_path;
-	bool masteralarm,slavealarm;
-	int _connectdb(cdr_writer_connection **conn,string conn_str,bool master);
+	time_t wfile_opened;
+	struct timeval wbuf_flushed;
+	unsigned int wfile_seq;
+	vector<CdrSpool::record_id_t> wbuf_spool_ids;	//to ack after flush
+	AmMutex file_mut;
+	CdrFileCompressor *compressor;
+	CdrSpool spool;
+	CdrDbProbe probe;
+	bool probe_started;
+	CdrThreadMetrics metrics;
 	int connectdb();
-	void prepare_queries(pqxx::connection *c);
-	void dbg_writecdr(AmArg &fields_values,Cdr &cdr);
-	int writecdr(cdr_writer_connection* conn,Cdr &cdr);
+	void dbg_writecdr(const AmArg &fields_values);
+	void prepare_fields_values(Cdr &cdr);
+	int writecdr(cdr_writer_connection* conn,const AmArg &fields_values);
+	void check_connection(cdr_writer_connection *conn);
+	/* close idle connections dropped by server. no queries are sent */
+	void check_connections();
+	bool replay_spool();
 	int writecdrtofile(Cdr* cdr);
+	int writefieldstofile(const AmArg &fields_values, CdrSpool::record_id_t spool_id);
 	bool openfile();
+	bool flushfile();
+	void _closefile();
+	void check_file_timers();
 	void write_header();
 	bool gotostop;
 	struct {
 		int db_exceptions;
 		int writed_cdrs;
 		int tried_cdrs;
+		int failed_writes;
+		int ambiguous_writes;	//connection lost after query was sent
 	} stats;
+	struct {
+		unsigned long long file_bytes;
+		unsigned long long total_bytes;
+		unsigned long rotations;
+		unsigned long flushes;
+		unsigned long write_errors;
+	} file_stats;
 public:
 	 CdrThread();
 	 ~CdrThread();
@@ -86,21 +152,32 @@ public:
 	void getStats(AmArg &arg);
 	void showOpenedFiles(AmArg &arg);
 	void postcdr(Cdr* cdr);
-	int configure(CdrThreadCfg& cfg);
+	int configure(CdrThreadCfg& cfg,unsigned int thread_idx,
+				  CdrFileCompressor *file_compressor);
 	void run();
 	void on_stop();
 };
 
+class CdrImporter;
+
 class CdrWriter{
 	vector<CdrThread*> cdrthreadpool;
 	AmMutex cdrthreadpool_mut;
+	//postcdr() calls which use thread out of cdrthreadpool_mut
+	unsigned int posting;
+	AmCondition<bool> posting_idle;
 	CdrWriterCfg config;
+	CdrFileCompressor *compressor;
+	CdrImporter *importer;
+	void check_spool_leftovers();
+	void compress_leftovers();
 public:
 	void clearStats();
 	void closeFiles();
 	void getStats(AmArg &arg);
 	void getConfig(AmArg &arg);
 	void showOpenedFiles(AmArg &arg);
+	void showImport(AmArg &arg);
 	void postcdr(Cdr* cdr);
 	int configure(CdrWriterCfg& cfg);
 	void start();
@@ -0,0 +1,137 @@
+#include "CsvBuffer.h"
+
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+
+CsvBuffer::CsvBuffer():
+	row_empty(true)
+{ }
+
+void CsvBuffer::put_uint(unsigned long long v)
+{
+	char tmp[24];
+	char *e = tmp+sizeof(tmp), *p = e;
+	do {
+		*--p = '0' + v%10;
+		v/=10;
+	} while(v);
+	buf.append(p,e-p);
+}
+
+void CsvBuffer::put_int(long long v)
+{
+	if(v < 0){
+		buf+='-';
+		put_uint(-(unsigned long long)v);
+	} else {
+		put_uint(v);
+	}
+}
+
+void CsvBuffer::put_fraction(unsigned long v, int digits)
+{
+	char tmp[24];
+	char *p = tmp+digits;
+	while(p!=tmp){
+		*--p = '0' + v%10;
+		v/=10;
+	}
+	buf.append(tmp,digits);
+}
+
+void CsvBuffer::add_null()
+{
+	separate();
+}
+
+void CsvBuffer::add_int(long long v)
+{
+	separate();
+	buf+='\'';
+	put_int(v);
+	buf+='\'';
+}
+
+void CsvBuffer::add_bool(bool v)
+{
+	separate();
+	buf+=v ? "'true'" : "'false'";
+}
+
+void CsvBuffer::add_double(double v)
+{
+	separate();
+	buf+='\'';
+
+	if(!std::isfinite(v) || fabs(v) >= 1e18){
+		//out of fast path range
+		char tmp[512];
+		int len = snprintf(tmp,sizeof(tmp),"%f",v);
+		if(len > 0) buf.append(tmp,len);
+	} else {
+		if(v < 0){
+			buf+='-';
+			v = -v;
+		}
+		//6 digits precision like %f
+		unsigned long long i = (unsigned long long)v;
+		unsigned long f = (unsigned long)((v-i)*1e6+0.5);
+		if(f >= 1000000){
+			i++;
+			f-=1000000;
+		}
+		put_uint(i);
+		buf+='.';
+		put_fraction(f,6);
+	}
+
+	buf+='\'';
+}
+
+void CsvBuffer::add_str(const char *s, size_t len)
+{
+	const char *e = s+len, *q;
+
+	separate();
+	buf+='\'';
+	while((q = (const char *)memchr(s,'\'',e-s))!=NULL){
+		buf.append(s,q-s+1);
+		buf+='\'';
+		s = q+1;
+	}
+	buf.append(s,e-s);
+	buf+='\'';
+}
+
+void CsvBuffer::add_arg(const AmArg &a)
+{
+	switch(a.getType()){
+	case AmArg::Undef: add_null(); break;
+	case AmArg::Int: add_int(a.asInt()); break;
+	case AmArg::LongLong: add_int(a.asLongLong()); break;
+	case AmArg::Bool: add_bool(a.asBool()); break;
+	case AmArg::Double: add_double(a.asDouble()); break;
+	case AmArg::CStr: {
+		const char *s = a.asCStr();
+		add_str(s,strlen(s));
+	} break;
+	default: {
+		string s = AmArg::print(a);
+		add_str(s);
+	}
+	}
+}
+
+void CsvBuffer::add_row(const AmArg &values)
+{
+	for(unsigned int i = 0;i<values.size();i++)
+		add_arg(values.get(i));
+	end_row();
+}
+
+void CsvBuffer::end_row()
+{
+	buf+='\n';
+	row_empty = true;
+}
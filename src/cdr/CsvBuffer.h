@@ -0,0 +1,54 @@
+#ifndef _CsvBuffer_h_
+#define _CsvBuffer_h_
+
+#include "AmArg.h"
+
+#include <string>
+
+using std::string;
+
+/* CSV rows formatter for CDR failover files.
+ *
+ * values are quoted with quotes doubling, NULL is written as empty unquoted field.
+ * numbers are formatted without stdio/iostream (locale-free).
+ * rows are appended to the buffer which keeps its capacity after clear() */
+
+class CsvBuffer {
+	string buf;
+	bool row_empty;
+
+	inline void separate() {
+		if(!row_empty) buf+=',';
+		row_empty = false;
+	}
+	void put_uint(unsigned long long v);
+	void put_int(long long v);
+	void put_fraction(unsigned long v, int digits);
+
+  public:
+	CsvBuffer();
+
+	void reserve(size_t size) { buf.reserve(size); }
+	void clear() { buf.clear(); row_empty = true; }
+
+	const char *data() const { return buf.data(); }
+	size_t size() const { return buf.size(); }
+	bool empty() const { return buf.empty(); }
+
+	void add_null();
+	void add_int(long long v);
+	void add_bool(bool v);
+	void add_double(double v);
+	void add_str(const char *s, size_t len);
+	void add_str(const string &s) { add_str(s.data(),s.size()); }
+	void add_arg(const AmArg &a);
+
+	/* all values of the array as one row */
+	void add_row(const AmArg &values);
+	void end_row();
+
+	/* data as is. e.g. header lines */
+	void append(const string &s) { buf+=s; }
+};
+
+#endif
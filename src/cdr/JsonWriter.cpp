@@ -0,0 +1,148 @@
+#include "JsonWriter.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <climits>
+
+#define JSON_WRITER_INITIAL_SIZE 1024
+
+JsonWriter::JsonWriter()
+{
+	buf.reserve(JSON_WRITER_INITIAL_SIZE);
+	reset();
+}
+
+void JsonWriter::reset()
+{
+	buf.clear();
+	first = true;
+}
+
+JsonWriter &JsonWriter::local()
+{
+	static thread_local JsonWriter w;
+	return w;
+}
+
+void JsonWriter::separate(const char *name)
+{
+	if(!first) buf+=',';
+	first = false;
+	if(name){
+		put_string(name);
+		buf+=':';
+	}
+}
+
+void JsonWriter::begin_object(const char *name)
+{
+	separate(name);
+	buf+='{';
+	first = true;
+}
+
+void JsonWriter::end_object()
+{
+	buf+='}';
+	first = false;
+}
+
+void JsonWriter::begin_array(const char *name)
+{
+	separate(name);
+	buf+='[';
+	first = true;
+}
+
+void JsonWriter::end_array()
+{
+	buf+=']';
+	first = false;
+}
+
+void JsonWriter::add_number(const char *name, double value)
+{
+	separate(name);
+	put_number(value);
+}
+
+void JsonWriter::add_string(const char *name, const char *value)
+{
+	separate(name);
+	put_string(value);
+}
+
+void JsonWriter::add_bool(const char *name, bool value)
+{
+	separate(name);
+	buf+=value ? "true" : "false";
+}
+
+void JsonWriter::add_null(const char *name)
+{
+	separate(name);
+	buf+="null";
+}
+
+/* the same escaping as cJSON print_string_ptr() */
+void JsonWriter::put_string(const char *s)
+{
+	char tmp[8];
+	const char *p, *run;
+
+	if(!s) return; //cJSON prints nothing for NULL string
+
+	buf+='"';
+	run = s;
+	for(p = s;*p;p++){
+		unsigned char c = *p;
+		if(c > 31 && c!='"' && c!='\\')
+			continue;
+		buf.append(run,p-run);
+		run = p+1;
+		switch(c){
+		case '\\': buf+="\\\\"; break;
+		case '"': buf+="\\\""; break;
+		case '\b': buf+="\\b"; break;
+		case '\f': buf+="\\f"; break;
+		case '\n': buf+="\\n"; break;
+		case '\r': buf+="\\r"; break;
+		case '\t': buf+="\\t"; break;
+		default:
+			snprintf(tmp,sizeof(tmp),"\\u%04x",c);
+			buf+=tmp;
+		}
+	}
+	buf.append(run,p-run);
+	buf+='"';
+}
+
+/* the same formatting as cJSON print_number() */
+void JsonWriter::put_number(double d)
+{
+	char tmp[64];
+
+	if(d<=INT_MAX && d>=INT_MIN && fabs((double)(int)d-d)<=DBL_EPSILON){
+		//locale-free fast path for the most common case
+		int i = (int)d;
+		unsigned int u = i < 0 ? -(unsigned int)i : i;
+		char *e = tmp+sizeof(tmp), *p = e;
+		do {
+			*--p = '0' + u%10;
+			u/=10;
+		} while(u);
+		if(i < 0) *--p = '-';
+		buf.append(p,e-p);
+		return;
+	}
+
+	if(fabs(floor(d)-d)<=DBL_EPSILON && fabs(d)<1.0e60)
+		snprintf(tmp,sizeof(tmp),"%.0f",d);
+	else if(fabs(d)<1.0e-6 || fabs(d)>1.0e9)
+		snprintf(tmp,sizeof(tmp),"%e",d);
+	else
+		snprintf(tmp,sizeof(tmp),"%f",d);
+	buf+=tmp;
+}
@@ -0,0 +1,43 @@
+#ifndef _JsonWriter_h_
+#define _JsonWriter_h_
+
+#include <string>
+#include <cstddef>
+
+using std::string;
+
+/* streaming JSON writer.
+ * output is the same as cJSON_PrintUnformatted() for the same items sequence
+ * (numbers are stored as double and printed using cJSON rules).
+ * buffer is reused between reset() calls */
+
+class JsonWriter {
+	string buf;
+	bool first;		//no items in the current container yet
+
+	void separate(const char *name);
+	void put_string(const char *s);
+	void put_number(double d);
+
+  public:
+	JsonWriter();
+
+	void reset();
+	const string &str() const { return buf; }
+
+	/* name is used for object members and must be NULL for array items */
+	void begin_object(const char *name = NULL);
+	void end_object();
+	void begin_array(const char *name = NULL);
+	void end_array();
+
+	void add_number(const char *name, double value);
+	void add_string(const char *name, const char *value);
+	void add_bool(const char *name, bool value);
+	void add_null(const char *name);
+
+	/* writer with buffer owned by the current thread */
+	static JsonWriter &local();
+};
+
+#endif
@@ -119,7 +119,7 @@ void _TrustedHeaders::print_hdrs(const vector<AmArg> &trusted_hdrs){
 	}
 }
 
-void _TrustedHeaders::print_csv(std::ofstream &s){
+void _TrustedHeaders::print_csv(std::ostream &s){
 	vector<string>::const_iterator hit = hdrs.begin();
 	for(;hit!=hdrs.end();++hit)
 		s << ",'"<< *hit << "'";
@@ -40,7 +40,7 @@ class _TrustedHeaders {
 #endif
 
 	void print_hdrs(const vector<AmArg> &trusted_hdrs);
-	void print_csv(std::ofstream &s);
+	void print_csv(std::ostream &s);
 };
 
 typedef singleton <_TrustedHeaders> TrustedHeaders;
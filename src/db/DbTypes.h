@@ -6,6 +6,7 @@
 
 #include <map>
 #include <list>
+#include <vector>
 #include <string>
 
 #include <pqxx/result>
@@ -145,6 +146,11 @@ struct DynField {
 typedef list<DynField> DynFieldsT;
 typedef DynFieldsT::iterator DynFieldsT_iterator;
 typedef DynFieldsT::const_iterator DynFieldsT_const_iterator;
+
+/* dynamic fields values. slot is the DynField position in DynFieldsT */
+typedef vector<AmArg> DynFieldsValues;
+/* precomputed name to slot lookup for RPC and filters */
+typedef map<string,unsigned int> DynFieldsSlots;
 class dyn_name_is_eq {
 	string field_name;
   public:
@@ -0,0 +1,315 @@
+#include "CallsExport.h"
+#include "log.h"
+#include "AmUtils.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#define CALLS_EXPORT_MAGIC 0x58454359 //YCEX
+#define CALLS_EXPORT_VERSION 1
+
+template<class T>
+static inline void put_value(string &out, T v){
+	out.append((const char *)&v,sizeof(T));
+}
+
+CallsExport::CallsExport(const DynFieldsT &df):
+	fd(-1), is_socket(false),
+	chunk_rows(0),
+	rows_total(0), chunks(0), bytes(0)
+{
+	add_column("cdr_born_time",COL_TIMESTAMP);
+	add_column("start_time",COL_TIMESTAMP);
+	add_column("end_time",COL_TIMESTAMP);
+	add_column("connect_time",COL_TIMESTAMP);
+
+	add_column("legB_remote_port",COL_UINT16);
+	add_column("legB_local_port",COL_UINT16);
+	add_column("legA_remote_port",COL_UINT16);
+	add_column("legA_local_port",COL_UINT16);
+	add_column("legB_remote_ip",COL_STRING);
+	add_column("legB_local_ip",COL_STRING);
+	add_column("legA_remote_ip",COL_STRING);
+	add_column("legA_local_ip",COL_STRING);
+
+	add_column("orig_call_id",COL_STRING);
+	add_column("term_call_id",COL_STRING);
+	add_column("local_tag",COL_STRING);
+	add_column("global_tag",COL_STRING);
+
+	add_column("time_limit",COL_INT32);
+	add_column("dump_level_id",COL_INT32);
+	add_column("audio_record_enabled",COL_UINT8);
+	add_column("attempt_num",COL_INT32);
+
+	add_column("resources",COL_STRING);
+	add_column("active_resources",COL_STRING);
+
+	unsigned int slot = 0;
+	for(DynFieldsT::const_iterator it = df.begin(); it!=df.end(); ++it, ++slot){
+		switch(it->type_id){
+		case DynField::INTEGER:
+		case DynField::BIGINT:
+			add_column(it->name,COL_INT64);
+			break;
+		case DynField::BOOL:
+			add_column(it->name,COL_UINT8);
+			break;
+		default:
+			add_column(it->name,COL_STRING);
+		}
+		dyn_fields.push_back(std::make_pair(slot,it->type_id));
+	}
+}
+
+CallsExport::~CallsExport(){
+	close();
+}
+
+void CallsExport::add_column(const string &name, column_type type){
+	columns.push_back(column(name,type));
+}
+
+void CallsExport::open(const string &p, int node_id, int pop_id){
+	struct stat st;
+
+	path = p;
+	if(0==stat(path.c_str(),&st) && S_ISSOCK(st.st_mode)){
+		struct sockaddr_un addr;
+		if(path.size() >= sizeof(addr.sun_path))
+			throw string("socket path is too long");
+		memset(&addr,0,sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path,path.c_str());
+		fd = socket(AF_UNIX,SOCK_STREAM,0);
+		if(fd==-1)
+			throw string("can't create socket: ")+strerror(errno);
+		if(-1==connect(fd,(struct sockaddr *)&addr,sizeof(addr))){
+			string err = string("can't connect to '")+path+"': "+strerror(errno);
+			close();
+			throw err;
+		}
+		is_socket = true;
+	} else {
+		fd = ::open(path.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+		if(fd==-1)
+			throw string("can't open '")+path+"': "+strerror(errno);
+	}
+
+	write_header(node_id,pop_id);
+	if(!write_buf()){
+		close();
+		throw string("can't write header to '")+path+"'";
+	}
+}
+
+void CallsExport::close(){
+	if(fd==-1)
+		return;
+	::close(fd);
+	fd = -1;
+}
+
+void CallsExport::write_header(int node_id, int pop_id){
+	struct timeval now;
+	gettimeofday(&now,NULL);
+
+	put_value<uint32_t>(buf,CALLS_EXPORT_MAGIC);
+	put_value<uint32_t>(buf,CALLS_EXPORT_VERSION);
+	put_value<int32_t>(buf,node_id);
+	put_value<int32_t>(buf,pop_id);
+	put_value<double>(buf,timeval2double(now));
+	put_value<uint32_t>(buf,columns.size());
+	for(vector<column>::const_iterator it = columns.begin(); it!=columns.end(); ++it){
+		put_value<uint8_t>(buf,it->type);
+		put_value<uint16_t>(buf,it->name.size());
+		buf.append(it->name);
+	}
+}
+
+/* values */
+
+void CallsExport::put_null(column &c){
+	unsigned int byte = chunk_rows/8;
+	if(c.nulls.size() <= byte)
+		c.nulls.resize(byte+1);
+	c.nulls[byte] |= 1 << (chunk_rows%8);
+	c.has_nulls = true;
+
+	//placeholder keeps values fixed width
+	switch(c.type){
+	case COL_TIMESTAMP: put_value<double>(c.values,0); break;
+	case COL_UINT8: put_value<uint8_t>(c.values,0); break;
+	case COL_UINT16: put_value<uint16_t>(c.values,0); break;
+	case COL_INT32: put_value<int32_t>(c.values,0); break;
+	case COL_INT64: put_value<int64_t>(c.values,0); break;
+	case COL_STRING: put_value<uint32_t>(c.values,0); break;
+	}
+}
+
+void CallsExport::put_timeval(column &c, const struct timeval &tv, bool null_if_unset){
+	if(null_if_unset && !timerisset(&tv)){
+		put_null(c);
+		return;
+	}
+	put_value<double>(c.values,timeval2double(tv));
+}
+
+template<class T>
+void CallsExport::put_number(column &c, T v){
+	put_value<T>(c.values,v);
+}
+
+void CallsExport::put_string(column &c, const string &s){
+	std::pair<std::unordered_map<string,uint32_t>::iterator,bool> r =
+		c.dict.insert(std::make_pair(s,(uint32_t)c.dict.size()));
+	put_value<uint32_t>(c.values,r.first->second);
+}
+
+void CallsExport::put_dyn(column &c, DynField::type type, const AmArg &a){
+	switch(type){
+	case DynField::INTEGER:
+	case DynField::BIGINT:
+		if(isArgInt(a)) put_number<int64_t>(c,a.asInt());
+		else if(isArgLongLong(a)) put_number<int64_t>(c,a.asLongLong());
+		else put_null(c);
+		break;
+	case DynField::BOOL:
+		if(isArgBool(a)) put_number<uint8_t>(c,a.asBool());
+		else put_null(c);
+		break;
+	default:
+		if(isArgCStr(a)) put_string(c,a.asCStr());
+		else put_null(c);
+	}
+}
+
+void CallsExport::add(const Cdr *cdr){
+	//same order as columns in constructor
+	vector<column>::iterator c = columns.begin();
+
+	put_timeval(*c++,cdr->cdr_born_time,false);
+	put_timeval(*c++,cdr->start_time,false);
+	put_timeval(*c++,cdr->end_time,true);
+	put_timeval(*c++,cdr->connect_time,true);
+
+	put_number<uint16_t>(*c++,cdr->legB_remote_port);
+	put_number<uint16_t>(*c++,cdr->legB_local_port);
+	put_number<uint16_t>(*c++,cdr->legA_remote_port);
+	put_number<uint16_t>(*c++,cdr->legA_local_port);
+	put_string(*c++,cdr->legB_remote_ip);
+	put_string(*c++,cdr->legB_local_ip);
+	put_string(*c++,cdr->legA_remote_ip);
+	put_string(*c++,cdr->legA_local_ip);
+
+	put_string(*c++,cdr->orig_call_id);
+	put_string(*c++,cdr->term_call_id);
+	put_string(*c++,cdr->local_tag);
+	put_string(*c++,cdr->global_tag);
+
+	put_number<int32_t>(*c++,cdr->time_limit);
+	put_number<int32_t>(*c++,cdr->dump_level_id);
+	put_number<uint8_t>(*c++,cdr->audio_record_enabled);
+	put_number<int32_t>(*c++,cdr->attempt_num);
+
+	put_string(*c++,cdr->resources);
+	put_string(*c++,cdr->active_resources);
+
+	for(vector<std::pair<unsigned int,DynField::type> >::const_iterator it = dyn_fields.begin();
+		it!=dyn_fields.end(); ++it, ++c)
+	{
+		put_dyn(*c,it->second,cdr->dyn_field(it->first));
+	}
+
+	chunk_rows++;
+}
+
+/* output */
+
+void CallsExport::serialize_chunk(){
+	put_value<uint32_t>(buf,chunk_rows);
+	for(vector<column>::iterator it = columns.begin(); it!=columns.end(); ++it){
+		column &c = *it;
+		put_value<uint8_t>(buf,c.has_nulls);
+		if(c.has_nulls){
+			c.nulls.resize((chunk_rows+7)/8);
+			buf.append((const char *)c.nulls.data(),c.nulls.size());
+		}
+		if(c.type==COL_STRING){
+			vector<const string *> entries(c.dict.size());
+			for(std::unordered_map<string,uint32_t>::const_iterator dit = c.dict.begin();
+				dit!=c.dict.end(); ++dit)
+			{
+				entries[dit->second] = &dit->first;
+			}
+			put_value<uint32_t>(buf,entries.size());
+			for(vector<const string *>::const_iterator eit = entries.begin(); eit!=entries.end(); ++eit){
+				put_value<uint32_t>(buf,(*eit)->size());
+				buf.append(**eit);
+			}
+			c.dict.clear();
+		}
+		buf.append(c.values);
+
+		c.values.clear();
+		c.nulls.clear();
+		c.has_nulls = false;
+	}
+}
+
+bool CallsExport::write_buf(){
+	const char *p = buf.data();
+	size_t left = buf.size();
+
+	while(left){
+		ssize_t r = is_socket ?
+			send(fd,p,left,MSG_NOSIGNAL) :
+			write(fd,p,left);
+		if(r < 0){
+			if(errno==EINTR) continue;
+			ERROR("calls export: can't write to '%s': %s",path.c_str(),strerror(errno));
+			buf.clear();
+			return false;
+		}
+		p+=r;
+		left-=r;
+		bytes+=r;
+	}
+	buf.clear();
+	return true;
+}
+
+bool CallsExport::flush(){
+	if(!chunk_rows)
+		return true;
+	serialize_chunk();
+	rows_total+=chunk_rows;
+	chunks++;
+	chunk_rows = 0;
+	return write_buf();
+}
+
+bool CallsExport::finish(){
+	bool ret = flush();
+	if(ret){
+		put_value<uint32_t>(buf,0);
+		ret = write_buf();
+	}
+	close();
+	return ret;
+}
+
+void CallsExport::getInfo(AmArg &ret){
+	ret["path"] = path;
+	ret["columns"] = (long)columns.size();
+	ret["rows"] = (long)rows_total;
+	ret["chunks"] = (long)chunks;
+	ret["bytes"] = (long)bytes;
+}
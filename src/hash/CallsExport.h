@@ -0,0 +1,95 @@
+#ifndef _CallsExport_h_
+#define _CallsExport_h_
+
+#include "AmArg.h"
+#include "../cdr/Cdr.h"
+#include "../db/DbTypes.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+using std::string;
+using std::vector;
+
+/* calls copied into the chunk while list is locked.
+ * chunk is written with list unlocked */
+#define CALLS_EXPORT_CHUNK 1024
+
+/* columnar binary export of the active calls
+ *
+ * all numbers are in host byte order.
+ * header: magic, version, node_id, pop_id, export time (double),
+ *   columns count, columns descriptions (type, name length, name).
+ * then chunks: rows count, columns data. chunk with zero rows ends the stream.
+ * column data: has_nulls flag, nulls bitmap (bit set for NULL row) if flag is set,
+ *   fixed width values or strings dictionary (count, length+data entries)
+ *   followed by the 32-bit dictionary index for each row.
+ * dictionary is built per chunk, so memory is bounded by the chunk size.
+ * static fields go first in getCalls() order, then dynamic fields by slot */
+
+class CallsExport {
+  public:
+	enum column_type {
+		COL_TIMESTAMP = 1,	//double seconds
+		COL_UINT8,
+		COL_UINT16,
+		COL_INT32,
+		COL_INT64,
+		COL_STRING			//dictionary encoded
+	};
+
+  private:
+	struct column {
+		string name;
+		column_type type;
+		string values;
+		vector<uint8_t> nulls;
+		bool has_nulls;
+		std::unordered_map<string,uint32_t> dict;
+		column(const string &name, column_type type):
+			name(name), type(type), has_nulls(false) {}
+	};
+	vector<column> columns;
+	vector<std::pair<unsigned int,DynField::type> > dyn_fields;
+
+	int fd;
+	bool is_socket;
+	string path;
+	string buf;
+	unsigned int chunk_rows;
+
+	unsigned long rows_total, chunks, bytes;
+
+	void add_column(const string &name, column_type type);
+	void put_null(column &c);
+	void put_timeval(column &c, const struct timeval &tv, bool null_if_unset);
+	void put_string(column &c, const string &s);
+	template<class T> void put_number(column &c, T v);
+	void put_dyn(column &c, DynField::type type, const AmArg &a);
+
+	void write_header(int node_id, int pop_id);
+	void serialize_chunk();
+	bool write_buf();
+
+  public:
+	CallsExport(const DynFieldsT &df);
+	~CallsExport();
+
+	/* open file or connect to the unix socket if path is the existent socket.
+	 * throws string on errors */
+	void open(const string &path, int node_id, int pop_id);
+	void close();
+
+	void add(const Cdr *cdr);
+	unsigned int rows() const { return chunk_rows; }
+	/* write collected rows. returns false on write error */
+	bool flush();
+	/* write stream end and close */
+	bool finish();
+
+	void getInfo(AmArg &ret);
+};
+
+#endif
@@ -4,33 +4,33 @@
 #include <algorithm>
 
 const static_call_field static_call_fields[] = {
-	{ "node_id", "integer", c_field_unsupported },
-	{ "pop_id", "integer", c_field_unsupported },
-	{ "local_time", "timestamp", c_field_unsupported },
-	{ "cdr_born_time", "timestamp", c_field_unsupported },
-	{ "start_time", "timestamp", c_field_unsupported },
+	{ "node_id", "integer", c_field_node_id },
+	{ "pop_id", "integer", c_field_pop_id },
+	{ "local_time", "timestamp", c_field_local_time },
+	{ "cdr_born_time", "timestamp", c_field_cdr_born_time },
+	{ "start_time", "timestamp", c_field_start_time },
 	{ "connect_time", "timestamp", c_field_connect_time },
-	{ "end_time", "timestamp", c_field_unsupported },
+	{ "end_time", "timestamp", c_field_end_time },
 	{ "duration", "double", c_field_duration },
 	{ "attempt_num", "integer", c_field_attempt_num },
-	{ "resources", "string", c_field_unsupported },
-	{ "active_resources", "string", c_field_unsupported },
-	{ "active_resources_json", "string", c_field_unsupported },
-	{ "legB_remote_port", "integer", c_field_unsupported },
-	{ "legB_local_port", "integer", c_field_unsupported },
-	{ "legA_remote_port", "integer", c_field_unsupported },
-	{ "legA_local_port", "integer", c_field_unsupported },
-	{ "legB_remote_ip", "string", c_field_unsupported },
-	{ "legB_local_ip", "string", c_field_unsupported },
-	{ "legA_remote_ip", "string", c_field_unsupported },
-	{ "legA_local_ip", "string", c_field_unsupported },
-	{ "orig_call_id", "string", c_field_unsupported },
-	{ "term_call_id", "string", c_field_unsupported },
-	{ "local_tag", "string", c_field_unsupported },
-	{ "global_tag", "string", c_field_unsupported },
-	{ "time_limit", "integer", c_field_unsupported },
-	{ "dump_level_id", "integer", c_field_unsupported },
-	{ "audio_record_enabled", "integer", c_field_unsupported },
+	{ "resources", "string", c_field_resources },
+	{ "active_resources", "string", c_field_active_resources },
+	{ "active_resources_json", "string", c_field_active_resources_json },
+	{ "legB_remote_port", "integer", c_field_legB_remote_port },
+	{ "legB_local_port", "integer", c_field_legB_local_port },
+	{ "legA_remote_port", "integer", c_field_legA_remote_port },
+	{ "legA_local_port", "integer", c_field_legA_local_port },
+	{ "legB_remote_ip", "string", c_field_legB_remote_ip },
+	{ "legB_local_ip", "string", c_field_legB_local_ip },
+	{ "legA_remote_ip", "string", c_field_legA_remote_ip },
+	{ "legA_local_ip", "string", c_field_legA_local_ip },
+	{ "orig_call_id", "string", c_field_orig_call_id },
+	{ "term_call_id", "string", c_field_term_call_id },
+	{ "local_tag", "string", c_field_local_tag },
+	{ "global_tag", "string", c_field_global_tag },
+	{ "time_limit", "integer", c_field_time_limit },
+	{ "dump_level_id", "integer", c_field_dump_level_id },
+	{ "audio_record_enabled", "integer", c_field_audio_record_enabled },
 	NULL
 };
 const unsigned int static_call_fields_count = 27;
@@ -47,6 +47,8 @@ typedef map<string,cmp_type_t>::const_iterator field_name2type_iterator;
 static map<string,cmp_cond_t> cond_name2type;
 typedef map<string,cmp_cond_t>::const_iterator cond_name2type_iterator;
 
+static DynFieldsSlots field_name2dyn_slot;
+
 
 //resolve sql types into internal type id
 static cmp_type_t get_type_by_name(const string &type_name){
@@ -89,9 +91,33 @@ static const char *get_cmp_type_name(cmp_type_t type){
 static const char *cmp_field_names[] = {
 	"unsupported",
 	"DYNAMIC",
-	"duration",
+	"node_id",
+	"pop_id",
+	"local_time",
+	"cdr_born_time",
+	"start_time",
 	"connect_time",
-	"attempt_num"
+	"end_time",
+	"duration",
+	"attempt_num",
+	"resources",
+	"active_resources",
+	"active_resources_json",
+	"legB_remote_port",
+	"legB_local_port",
+	"legA_remote_port",
+	"legA_local_port",
+	"legB_remote_ip",
+	"legB_local_ip",
+	"legA_remote_ip",
+	"legA_local_ip",
+	"orig_call_id",
+	"term_call_id",
+	"local_tag",
+	"global_tag",
+	"time_limit",
+	"dump_level_id",
+	"audio_record_enabled"
 };
 static const char *get_cmp_field_name(cmp_field_t field){
 	if(field>=c_field_max || field < 0){
@@ -116,164 +142,155 @@ static const char *get_cmp_cond_name(cmp_cond_t cond){
 }
 
 /************************
- *		comparators		*
+ *		predicates		*
  ************************/
 
-//generic comparators
-
-#define COMPARATOR_NAME(type,field,sop) cmp_ ## type ## _ ## field ## _ ## sop
-
-#define GENERIC_STATIC_COMPARATOR(field,type,op,sop) \
-	static bool COMPARATOR_NAME(type,field,sop)(const Cdr *cdr,type value){ \
-		DBG("called %s for Cdr[%p]",FUNC_NAME,cdr);\
-		return cdr->field op value; \
-	}
-
-#define TIMESTAMP_STATIC_COMPARATOR(field,type,op,sop) \
-	static bool COMPARATOR_NAME(type,field,sop)(const Cdr *cdr,const timeval &value){ \
-		DBG("called %s for Cdr[%p]",FUNC_NAME,cdr);\
-		if(!cdr->field.tv_sec){ \
-			DBG("CDR timestamp field "#field" is not initialized. return false"); \
-			return false; \
-		} \
-		return cdr->field.tv_sec op value.tv_sec; \
-	}
-
-#define ACTIVE_COMPARATOR(field,type,op,sop) GENERIC_STATIC_COMPARATOR(field,type,op,sop)
-
-#define EQ_STATIC_COMPARATOR(field,type) ACTIVE_COMPARATOR(field,type,==,eq)
-#define NEQ_STATIC_COMPARATOR(field,type) ACTIVE_COMPARATOR(field,type,!=,neq)
-#define GT_STATIC_COMPARATOR(field,type) ACTIVE_COMPARATOR(field,type,>,gt)
-#define LT_STATIC_COMPARATOR(field,type) ACTIVE_COMPARATOR(field,type,<,lt)
-#define GTE_STATIC_COMPARATOR(field,type) ACTIVE_COMPARATOR(field,type,>=,gte)
-#define LTE_STATIC_COMPARATOR(field,type) ACTIVE_COMPARATOR(field,type,<=,lte)
-
-#define DEFINE_STATIC_FIELD_COMPARATORS(field,type) \
-	EQ_STATIC_COMPARATOR(field,type) \
-	NEQ_STATIC_COMPARATOR(field,type) \
-	GT_STATIC_COMPARATOR(field,type) \
-	LT_STATIC_COMPARATOR(field,type) \
-	GTE_STATIC_COMPARATOR(field,type) \
-	LTE_STATIC_COMPARATOR(field,type)
-
-
-DEFINE_STATIC_FIELD_COMPARATORS(attempt_num,int)
-
-#undef ACTIVE_COMPARATOR
-#define ACTIVE_COMPARATOR(field,type,op,sop) TIMESTAMP_STATIC_COMPARATOR(field,type,op,sop)
-
-DEFINE_STATIC_FIELD_COMPARATORS(connect_time,timestamp)
-
-/* comparators for dynamic fields */
-
-#define DEF_ALL_OPS(MACRO_NAME) \
-	MACRO_NAME(==,eq) \
-	MACRO_NAME(!=,neq) \
-	MACRO_NAME(>,gt) \
-	MACRO_NAME(<,lt) \
-	MACRO_NAME(>=,gte) \
-	MACRO_NAME(<=,lte)
-
-#define DYN_COMPARATOR_NAME(type,op) cmp_dyn_ ## type ## _function_ ## op
-
-#define DEF_DYN_CMP_INT_FUNC(op,opname) \
-static bool cmp_dyn_int_function_ ##opname(const Cdr *cdr, \
-										 const string& field_name, \
-										 int value) \
-{ \
-	if(!cdr->dyn_fields.hasMember(field_name)){ \
-		ERROR("can't find dynamic field %s in %s",field_name.c_str(),FUNC_NAME); \
-		return false; \
-	} \
-	AmArg &a = cdr->dyn_fields[field_name]; \
-	if(a.getType()!=AmArg::Int){ \
-		ERROR("invalid type for field %s in %s",field_name.c_str(),FUNC_NAME); \
-		return false; \
-	} \
-	return a.asInt() op value; \
-}
-DEF_ALL_OPS(DEF_DYN_CMP_INT_FUNC)
-
-#define DEF_DYN_CMP_LONG_LONG_INT_FUNC(op,opname) \
-static bool cmp_dyn_long_long_int_function_ ##opname(const Cdr *cdr, \
-										 const string& field_name, \
-										 long_long_int value) \
-{ \
-	if(!cdr->dyn_fields.hasMember(field_name)){ \
-		ERROR("can't find dynamic field %s in %s",field_name.c_str(),FUNC_NAME); \
-		return false; \
-	} \
-	AmArg &a = cdr->dyn_fields[field_name]; \
-	if(isArgInt(a)) { \
-		return a.asLong() op value; \
-	} else if(isArgLongLong(a)) { \
-		return a.asLongLong() op value; \
-	} \
-	ERROR("invalid type for field %s in %s",field_name.c_str(),FUNC_NAME); \
-	return false; \
-}
-DEF_ALL_OPS(DEF_DYN_CMP_LONG_LONG_INT_FUNC)
-
-#define DEF_DYN_CMP_STRING_FUNC(op,opname) \
-static bool cmp_dyn_string_function_ ##opname(const Cdr *cdr, \
-										 const string& field_name, \
-										 const string& value) \
-{ \
-	if(!cdr->dyn_fields.hasMember(field_name)){ \
-		ERROR("can't find dynamic field %s in %s",field_name.c_str(),FUNC_NAME); \
-		return false; \
-	} \
-	AmArg &a = cdr->dyn_fields[field_name]; \
-	if(a.getType()!=AmArg::CStr){ \
-		ERROR("invalid type for field '%s' in %s",field_name.c_str(),FUNC_NAME); \
-		return false; \
-	} \
-	return value op a.asCStr(); \
-}
+/* conditions */
 
-DEF_DYN_CMP_STRING_FUNC(==,eq)
-DEF_DYN_CMP_STRING_FUNC(!=,neq)
+struct op_eq { template<typename A, typename B> bool operator()(const A &a, const B &b) const { return a == b; } };
+struct op_neq { template<typename A, typename B> bool operator()(const A &a, const B &b) const { return a != b; } };
+struct op_gt { template<typename A, typename B> bool operator()(const A &a, const B &b) const { return a > b; } };
+struct op_lt { template<typename A, typename B> bool operator()(const A &a, const B &b) const { return a < b; } };
+struct op_gte { template<typename A, typename B> bool operator()(const A &a, const B &b) const { return a >= b; } };
+struct op_lte { template<typename A, typename B> bool operator()(const A &a, const B &b) const { return a <= b; } };
 
-/* macro definitions for static field case declaration in functor constructor */
+/* fields accessors. fn<Op> is instantiated for each condition */
 
-#define CMP_FIELD_PTR_CASE(type,name,op) \
-	case c_cond_ ## op: fptr_ ## type = &COMPARATOR_NAME(type,name,op); break;
+template <typename M, M Cdr::*field>
+struct int_field {
+	template <typename Op>
+	static bool fn(const Cdr *cdr, const cmp_predicate &p){
+		return Op()((int)(cdr->*field),p.v_int);
+	}
+};
 
-#define CMP_FIELD_TYPE_CASES(type,name) \
-	switch(cmp_cond){ \
-		CMP_FIELD_PTR_CASE(type,name,eq) \
-		CMP_FIELD_PTR_CASE(type,name,neq) \
-		CMP_FIELD_PTR_CASE(type,name,gt) \
-		CMP_FIELD_PTR_CASE(type,name,lt) \
-		CMP_FIELD_PTR_CASE(type,name,gte) \
-		CMP_FIELD_PTR_CASE(type,name,lte) \
-		default: \
-			throw string(string("condition ")+get_cmp_cond_name(cmp_cond)+ \
-						" for field "+get_cmp_field_name(cmp_field) + " is not implemented"); \
-	} \
+template <struct timeval Cdr::*field>
+struct timestamp_field {
+	template <typename Op>
+	static bool fn(const Cdr *cdr, const cmp_predicate &p){
+		const struct timeval &t = cdr->*field;
+		if(!t.tv_sec) return false;	//not initialized
+		return Op()(t.tv_sec,p.v_time.tv_sec);
+	}
+};
 
-#define CMP_FIELD_CASE(type,name) \
-	case c_field_ ## name: \
-	CMP_FIELD_TYPE_CASES(type,name) \
-	break
-
-/* macro definitions for dynamic fields case declaration in functor constructor */
-
-#define DYN_FIELD_PTR_CASE(type,op) \
-	case c_cond_ ## op: fptr_dyn_ ## type = &DYN_COMPARATOR_NAME(type,op); break;
-
-#define DYN_FIELD_CASE(type) \
-	switch(cmp_cond){ \
-	DYN_FIELD_PTR_CASE(type,eq) \
-	DYN_FIELD_PTR_CASE(type,neq) \
-	DYN_FIELD_PTR_CASE(type,gt) \
-	DYN_FIELD_PTR_CASE(type,lt) \
-	DYN_FIELD_PTR_CASE(type,gte) \
-	DYN_FIELD_PTR_CASE(type,lte) \
-	default: \
-		throw string(string("condition ")+get_cmp_cond_name(cmp_cond)+ \
-					" for dynamic field "+dyn_field_name + " is not implemented"); \
-	} \
+template <string Cdr::*field>
+struct string_field {
+	template <typename Op>
+	static bool fn(const Cdr *cdr, const cmp_predicate &p){
+		return Op()(cdr->*field,p.v_string);
+	}
+};
+
+struct active_resources_json_field {
+	template <typename Op>
+	static bool fn(const Cdr *cdr, const cmp_predicate &p){
+		return Op()(AmArg::print(cdr->active_resources_amarg),p.v_string);
+	}
+};
+
+struct dyn_int_field {
+	template <typename Op>
+	static bool fn(const Cdr *cdr, const cmp_predicate &p){
+		const AmArg &a = cdr->dyn_field(p.slot);
+		if(a.getType()!=AmArg::Int){
+			ERROR("invalid type for dynamic field %s",p.field_name.c_str());
+			return false;
+		}
+		return Op()(a.asInt(),p.v_int);
+	}
+};
+
+struct dyn_long_long_int_field {
+	template <typename Op>
+	static bool fn(const Cdr *cdr, const cmp_predicate &p){
+		const AmArg &a = cdr->dyn_field(p.slot);
+		if(isArgInt(a)) {
+			return Op()((long_long_int)a.asLong(),p.v_long_long_int);
+		} else if(isArgLongLong(a)) {
+			return Op()((long_long_int)a.asLongLong(),p.v_long_long_int);
+		}
+		ERROR("invalid type for dynamic field %s",p.field_name.c_str());
+		return false;
+	}
+};
+
+struct dyn_string_field {
+	template <typename Op>
+	static bool fn(const Cdr *cdr, const cmp_predicate &p){
+		const AmArg &a = cdr->dyn_field(p.slot);
+		if(a.getType()!=AmArg::CStr){
+			ERROR("invalid type for dynamic field '%s'",p.field_name.c_str());
+			return false;
+		}
+		return Op()(a.asCStr(),p.v_string);
+	}
+};
+
+/* function for the condition. strings support equality only */
+template <typename F>
+static cmp_predicate::function *cond_function(cmp_cond_t cond, bool ordered){
+	switch(cond){
+	case c_cond_eq: return &F::template fn<op_eq>;
+	case c_cond_neq: return &F::template fn<op_neq>;
+	default: break;
+	}
+	if(!ordered)
+		return NULL;
+	switch(cond){
+	case c_cond_gt: return &F::template fn<op_gt>;
+	case c_cond_lt: return &F::template fn<op_lt>;
+	case c_cond_gte: return &F::template fn<op_gte>;
+	case c_cond_lte: return &F::template fn<op_lte>;
+	default: break;
+	}
+	return NULL;
+}
+
+/* condition for values known on parsing */
+static bool eval_cond(cmp_cond_t cond, long_long_int a, long_long_int b){
+	switch(cond){
+	case c_cond_eq: return a == b;
+	case c_cond_neq: return a != b;
+	case c_cond_gt: return a > b;
+	case c_cond_lt: return a < b;
+	case c_cond_gte: return a >= b;
+	case c_cond_lte: return a <= b;
+	default: break;
+	}
+	throw string(string("unknown condition ")+get_cmp_cond_name(cond));
+}
+
+/* relative costs of the value check */
+enum predicate_cost {
+	cost_int = 1,
+	cost_dyn_int = 2,
+	cost_string = 3,
+	cost_dyn_string = 4,
+	cost_json = 50
+};
+
+/* rough probability that call passes condition */
+static float cond_pass_probability(cmp_cond_t cond){
+	switch(cond){
+	case c_cond_eq: return 0.1;
+	case c_cond_neq: return 0.9;
+	default: return 0.5;
+	}
+}
+
+/* static string fields which are set before CdrList::insert() and never change.
+ * fields updated later (legB_*, term_call_id, resources) would leave stale index keys */
+static string Cdr::*static_string_field(cmp_field_t field){
+	switch(field){
+	case c_field_legA_remote_ip: return &Cdr::legA_remote_ip;
+	case c_field_legA_local_ip: return &Cdr::legA_local_ip;
+	case c_field_orig_call_id: return &Cdr::orig_call_id;
+	case c_field_local_tag: return &Cdr::local_tag;
+	case c_field_global_tag: return &Cdr::global_tag;
+	default: return NULL;
+	}
+}
 
 /* functor constructors */
 
@@ -282,12 +299,6 @@ cmp_functor::cmp_functor(int value, cmp_field_t cmp_field, cmp_cond_t cmp_cond)
 	: cmp_type(c_type_int), cmp_field(cmp_field), cmp_cond(cmp_cond),
 	  v_int(value)
 {
-	switch(cmp_field){
-	//CMP_FIELD_CASE(int,time_limit);
-	CMP_FIELD_CASE(int,attempt_num);
-	default:
-		throw string(string("unknown field: ")+int2str(cmp_field));
-	}
 	DBG("created functor %s",info().c_str());
 }
 
@@ -318,7 +329,6 @@ cmp_functor::cmp_functor(double value, cmp_field_t cmp_field_in, cmp_cond_t cmp_
 		cmp_cond = invert_condition_direction(cmp_cond);
 		cmp_field = c_field_connect_time;
 		cmp_type = c_type_timestamp;
-		CMP_FIELD_TYPE_CASES(timestamp,connect_time)
 	break;
 	default:
 		throw string(string("unknown field: ")+int2str(cmp_field));
@@ -331,83 +341,41 @@ cmp_functor::cmp_functor(const timeval &value, cmp_field_t cmp_field, cmp_cond_t
 	: cmp_type(c_type_timestamp), cmp_field(cmp_field), cmp_cond(cmp_cond),
 	  v_time(value)
 {
-	switch(cmp_field){
-	CMP_FIELD_CASE(timestamp,connect_time);
-	default:
-		throw string(string("unknown field: ")+int2str(cmp_field));
-	}
+	DBG("created functor %s",info().c_str());
+}
+
+//static fields with type string
+cmp_functor::cmp_functor(const string &value, cmp_field_t cmp_field, cmp_cond_t cmp_cond)
+	: cmp_type(c_type_string), cmp_field(cmp_field), cmp_cond(cmp_cond),
+	  v_string(value)
+{
 	DBG("created functor %s",info().c_str());
 }
 
 //dynamic fields with type int
-cmp_functor::cmp_functor(int value,const string &field_name,cmp_cond_t cmp_cond)
+cmp_functor::cmp_functor(int value,const string &field_name,unsigned int slot,cmp_cond_t cmp_cond)
 	: cmp_type(c_type_int), cmp_field(c_field_dynamic), cmp_cond(cmp_cond),
-	  v_int(value), dyn_field_name(field_name)
+	  v_int(value), dyn_field_name(field_name), dyn_field_slot(slot)
 {
-	DYN_FIELD_CASE(int)
 	DBG("created functor %s",info().c_str());
 }
 
 //dynamic fields with type bigint (long long int)
-cmp_functor::cmp_functor(long long int value,const string &field_name,cmp_cond_t cmp_cond)
+cmp_functor::cmp_functor(long long int value,const string &field_name,unsigned int slot,cmp_cond_t cmp_cond)
 	: cmp_type(c_type_long_long_int), cmp_field(c_field_dynamic), cmp_cond(cmp_cond),
-	  v_long_long_int(value), dyn_field_name(field_name)
+	  v_long_long_int(value), dyn_field_name(field_name), dyn_field_slot(slot)
 {
-	DYN_FIELD_CASE(long_long_int)
 	DBG("created functor %s",info().c_str());
 }
 
-
 //dynamic fields with type string
-cmp_functor::cmp_functor(const string &value,const string &field_name,cmp_cond_t cmp_cond)
+cmp_functor::cmp_functor(const string &value,const string &field_name,unsigned int slot,cmp_cond_t cmp_cond)
 	: cmp_type(c_type_string), cmp_field(c_field_dynamic), cmp_cond(cmp_cond),
-	  v_string(value), dyn_field_name(field_name)
+	  v_string(value), dyn_field_name(field_name), dyn_field_slot(slot)
 {
-	switch(cmp_cond){
-	DYN_FIELD_PTR_CASE(string,eq)
-	DYN_FIELD_PTR_CASE(string,neq)
-	default:
-		throw string(string("condition ")+get_cmp_cond_name(cmp_cond)+
-							" for dynamic field "+dyn_field_name + " is not implemented"); \
-	}
 	DBG("created functor %s",info().c_str());
 }
 
-//match function
-bool cmp_functor::operator()(const Cdr *cdr) const {
-	if(cmp_field==c_field_dynamic){
-		switch(cmp_type){
-		case c_type_int:
-			return (*fptr_dyn_int)(cdr,dyn_field_name,v_int);
-			break;
-		case c_type_long_long_int:
-			return (*fptr_dyn_long_long_int)(cdr,dyn_field_name,v_long_long_int);
-			break;
-		case c_type_string:
-			return (*fptr_dyn_string)(cdr,dyn_field_name,v_string);
-			break;
-		default:
-			;
-		}
-	} else {
-		switch(cmp_type){
-		case c_type_int:
-			return (*fptr_int)(cdr,v_int);
-			break;
-		case c_type_double:
-			return (*fptr_double)(cdr,v_double);
-			break;
-		case c_type_timestamp:
-			return (*fptr_timestamp)(cdr,v_time);
-			break;
-		default:
-			;
-		}
-	}
-	ERROR("wrong initialized cmp_functor: %s",info().c_str());
-	return false;
-}
-
 string cmp_functor::info() const {
 	stringstream info;
 
@@ -432,22 +400,194 @@ string cmp_functor::info() const {
 	return info.str();
 }
 
-bool apply_filter_rules(const Cdr *cdr,const cmp_rules &rules){
-	bool matched = true;
-	for(cmp_rules_it it = rules.begin(); it!=rules.end(); ++it){
-		if(!(*it)(cdr)) {
-			DBG("[%s] NOT MATCHED against functor: %s",
-				cdr->local_tag.c_str(),
-				it->info().c_str());
-			matched = false;
+bool cmp_functor::get_index_lookup(string &field_name, string &key) const {
+	if(cmp_cond!=c_cond_eq)
+		return false;
+
+	if(cmp_field==c_field_dynamic){
+		field_name = dyn_field_name;
+		switch(cmp_type){
+		case c_type_int: key = int2str(v_int); return true;
+		case c_type_long_long_int: key = longlong2str(v_long_long_int); return true;
+		case c_type_string: key = v_string; return true;
+		default: return false;
+		}
+	}
+
+	if(cmp_type!=c_type_string)
+		return false;
+	field_name = get_cmp_field_name(cmp_field);
+	key = v_string;
+	return true;
+}
+
+/************************
+ *		compiler		*
+ ************************/
+
+#define INT_FIELD_CASE(name) \
+	case c_field_ ## name: \
+		p.fn = cond_function<int_field<decltype(Cdr::name),&Cdr::name> >(f.cmp_cond,true); \
+		type = c_type_int; \
+		cost = cost_int; \
+		break;
+
+#define TIMESTAMP_FIELD_CASE(name) \
+	case c_field_ ## name: \
+		p.fn = cond_function<timestamp_field<&Cdr::name> >(f.cmp_cond,true); \
+		type = c_type_timestamp; \
+		cost = cost_int; \
+		break;
+
+#define STRING_FIELD_CASE(name) \
+	case c_field_ ## name: \
+		p.fn = cond_function<string_field<&Cdr::name> >(f.cmp_cond,false); \
+		type = c_type_string; \
+		cost = cost_string; \
+		break;
+
+void cmp_rules::compile(const cmp_functor &f, cmp_predicate &p){
+	cmp_type_t type;
+	int cost;
+
+	p.fn = NULL;
+	p.slot = f.dyn_field_slot;
+	p.field_name = f.dyn_field_name;
+	p.v_int = f.v_int;
+	p.v_long_long_int = f.v_long_long_int;
+	p.v_time = f.v_time;
+	p.v_string = f.v_string;
+
+	if(f.cmp_field==c_field_dynamic){
+		type = f.cmp_type;
+		switch(f.cmp_type){
+		case c_type_int:
+			p.fn = cond_function<dyn_int_field>(f.cmp_cond,true);
+			cost = cost_dyn_int;
 			break;
-		} else {
-			DBG("[%s] MATCHED against functor: %s",
-				cdr->local_tag.c_str(),
-				it->info().c_str());
+		case c_type_long_long_int:
+			p.fn = cond_function<dyn_long_long_int_field>(f.cmp_cond,true);
+			cost = cost_dyn_int;
+			break;
+		case c_type_string:
+			p.fn = cond_function<dyn_string_field>(f.cmp_cond,false);
+			cost = cost_dyn_string;
+			break;
+		default:
+			throw string(string("not supported dynamic field type: ")+get_cmp_type_name(f.cmp_type));
 		}
+		if(!p.fn)
+			throw string(string("condition ")+get_cmp_cond_name(f.cmp_cond)+
+						 " for dynamic field "+f.dyn_field_name + " is not implemented");
+	} else {
+		switch(f.cmp_field){
+		TIMESTAMP_FIELD_CASE(cdr_born_time)
+		TIMESTAMP_FIELD_CASE(start_time)
+		TIMESTAMP_FIELD_CASE(connect_time)
+		TIMESTAMP_FIELD_CASE(end_time)
+		INT_FIELD_CASE(attempt_num)
+		INT_FIELD_CASE(legB_remote_port)
+		INT_FIELD_CASE(legB_local_port)
+		INT_FIELD_CASE(legA_remote_port)
+		INT_FIELD_CASE(legA_local_port)
+		INT_FIELD_CASE(time_limit)
+		INT_FIELD_CASE(dump_level_id)
+		INT_FIELD_CASE(audio_record_enabled)
+		STRING_FIELD_CASE(resources)
+		STRING_FIELD_CASE(active_resources)
+		STRING_FIELD_CASE(legB_remote_ip)
+		STRING_FIELD_CASE(legB_local_ip)
+		STRING_FIELD_CASE(legA_remote_ip)
+		STRING_FIELD_CASE(legA_local_ip)
+		STRING_FIELD_CASE(orig_call_id)
+		STRING_FIELD_CASE(term_call_id)
+		STRING_FIELD_CASE(local_tag)
+		STRING_FIELD_CASE(global_tag)
+		case c_field_active_resources_json:
+			p.fn = cond_function<active_resources_json_field>(f.cmp_cond,false);
+			type = c_type_string;
+			cost = cost_json;
+			break;
+		default:
+			throw string(string("field ")+get_cmp_field_name(f.cmp_field)+" is not supported");
+		}
+		if(type!=f.cmp_type)
+			throw string(string("unexpected value type ")+get_cmp_type_name(f.cmp_type)+
+						 " for field "+get_cmp_field_name(f.cmp_field));
+		if(!p.fn)
+			throw string(string("condition ")+get_cmp_cond_name(f.cmp_cond)+
+						 " for field "+get_cmp_field_name(f.cmp_field) + " is not implemented");
+	}
+
+	//expected cost spent on the call before it will be rejected
+	p.rank = cost/(1-cond_pass_probability(f.cmp_cond));
+}
+
+#undef INT_FIELD_CASE
+#undef TIMESTAMP_FIELD_CASE
+#undef STRING_FIELD_CASE
+
+static bool predicate_rank_less(const cmp_predicate &a, const cmp_predicate &b){
+	return a.rank < b.rank;
+}
+
+cmp_rules::cmp_rules(int node_id, int pop_id, bool reorder):
+	node_id(node_id), pop_id(pop_id),
+	reorder(reorder),
+	never_match(false)
+{ }
+
+void cmp_rules::push_back(const cmp_functor &f){
+	bool matched;
+	timeval now;
+
+	//rules with values known now
+	switch(f.cmp_field){
+	case c_field_node_id:
+	case c_field_pop_id:
+		if(f.cmp_type!=c_type_int)
+			throw string(string("unexpected value type for field ")+get_cmp_field_name(f.cmp_field));
+		matched = eval_cond(f.cmp_cond,f.cmp_field==c_field_node_id ? node_id : pop_id,f.v_int);
+		break;
+	case c_field_local_time:
+		if(f.cmp_type!=c_type_timestamp)
+			throw string(string("unexpected value type for field ")+get_cmp_field_name(f.cmp_field));
+		gettimeofday(&now,NULL);
+		matched = eval_cond(f.cmp_cond,now.tv_sec,f.v_time.tv_sec);
+		break;
+	default: {
+		cmp_predicate p;
+		compile(f,p);
+		p.rule = rules.size();
+		rules.push_back(f);
+		vector<cmp_predicate>::iterator pos = program.end();
+		//stable: rules with the same rank are checked in the requested order
+		if(reorder) pos = std::upper_bound(program.begin(),program.end(),p,predicate_rank_less);
+		program.insert(pos,p);
+	} return;
+	}
+
+	rules.push_back(f);
+	if(!matched){
+		DBG("rule %s will never match",f.info().c_str());
+		never_match = true;
+	}
+}
+
+void cmp_rules::getInfo(AmArg &ret) const {
+	ret.assertArray();
+	if(never_match){
+		ret.push("never match");
+		return;
+	}
+	for(vector<cmp_predicate>::const_iterator it = program.begin();
+		it!=program.end(); ++it)
+	{
+		ret.push(AmArg());
+		AmArg &a = ret.back();
+		a["rule"] = rules[it->rule].info();
+		a["rank"] = it->rank;
 	}
-	return matched;
 }
 
 /* helper to parse rule string
@@ -527,6 +667,15 @@ void insert_rule(cmp_rules &rules,
 		throw string("field "+field+" is known but unsupported");
 	}
 
+	unsigned int slot = 0;
+	if(field_name_type==c_field_dynamic){
+		DynFieldsSlots::const_iterator slot_it = field_name2dyn_slot.find(field);
+		if(slot_it==field_name2dyn_slot.end()){
+			throw string("unknown dynamic field "+field+" in WHERE clause");
+		}
+		slot = slot_it->second;
+	}
+
 	cond_name2type_iterator cond_type_it = cond_name2type.find(op);
 	if(cond_type_it==cond_name2type.end()){
 		throw string("unsupported operator "+op);
@@ -549,7 +698,7 @@ void insert_rule(cmp_rules &rules,
 		if(!str2int(value,v_int)){
 			throw string(string("can't cast '")+value+"' to integer");
 		}
-		if(field_name_type==c_field_dynamic) rules.push_back(cmp_functor(v_int,field,cond_type));
+		if(field_name_type==c_field_dynamic) rules.push_back(cmp_functor(v_int,field,slot,cond_type));
 		else rules.push_back(cmp_functor(v_int,field_name_type,cond_type));
 	} break;
 	case c_type_long_long_int: {
@@ -557,7 +706,7 @@ void insert_rule(cmp_rules &rules,
 		if(!str2longlong(value,v_long_long_int)){
 			throw string(string("can't cast '")+value+"' to long long integer");
 		}
-		if(field_name_type==c_field_dynamic) rules.push_back(cmp_functor((long long int)v_long_long_int,field,cond_type));
+		if(field_name_type==c_field_dynamic) rules.push_back(cmp_functor((long long int)v_long_long_int,field,slot,cond_type));
 		else throw string(string("not supported static field type: ")+get_cmp_type_name(field_type));
 	} break;
 	case c_type_double: {
@@ -569,14 +718,27 @@ void insert_rule(cmp_rules &rules,
 		else rules.push_back(cmp_functor(v_double,field_name_type,cond_type));
 	} break;
 	case c_type_string: {
-		if(field_name_type==c_field_dynamic) rules.push_back(cmp_functor(value,field,cond_type));
-		else throw string(string("not supported static field type: ")+get_cmp_type_name(field_type));
+		if(field_name_type==c_field_dynamic) rules.push_back(cmp_functor(value,field,slot,cond_type));
+		else rules.push_back(cmp_functor(value,field_name_type,cond_type));
 	} break;
 	default:
 		throw string(string("not supported field type: ")+get_cmp_type_name(field_type));
 	}
 }
 
+void parse_rule(cmp_rules &rules, const string &rule){
+	int op_len;
+	const char *s = rule.c_str();
+	DBG("parse filter rule: %s",s);
+	const char *op = get_operator_pos(s,rule.length(),op_len);
+	if(!op)
+		throw std::string(string("can't parse rule: ")+rule);
+	insert_rule(rules,
+				string(s,op-s),		//field
+				string(op,op_len),	//operator
+				string(op+op_len));	//value
+}
+
 void parse_fields(cmp_rules &rules, const AmArg &params, vector<string> &fields){
 	int state = 0;
 
@@ -597,18 +759,9 @@ void parse_fields(cmp_rules &rules, const AmArg &params, vector<string> &fields)
 				fields.push_back(entry);
 			}
 		break;
-		case 1: {//state after WHERE keyword. rules
-			int op_len;
-			const char *s = entry.c_str();
-			DBG("parse filter rule: %s",s);
-			const char *op = get_operator_pos(s,entry.length(),op_len);
-			if(!op)
-				throw std::string(string("can't parse rule: ")+entry);
-			insert_rule(rules,
-						string(s,op-s),		//field
-						string(op,op_len),	//operator
-						string(op+op_len));	//value
-		} break;
+		case 1: //state after WHERE keyword. rules
+			parse_rule(rules,entry);
+		break;
 		}
 	}
 
@@ -642,9 +795,13 @@ int configure_filter(const SqlRouter *router){
 
 	//dynamic fields
 	const DynFieldsT &df = router->getDynFields();
+	field_name2dyn_slot.clear();
 	for(DynFieldsT_const_iterator it = df.begin();
 		it!=df.end(); ++it)
 	{
+		unsigned int slot;
+		if(router->getDynFieldSlot(it->name,slot))
+			field_name2dyn_slot[it->name] = slot;
 		try {
 			field_name2type.insert(
 						std::pair<string,cmp_type_t>(
@@ -677,3 +834,55 @@ int configure_filter(const SqlRouter *router){
 
 }
 
+
+void resolve_index_field(const string &name, cdr_index_field &f){
+	f.name = name;
+	f.slot = 0;
+
+	field_name2field_type_iterator field_it = field_name2field_type.find(name);
+	if(field_it!=field_name2field_type.end()){
+		if(!static_string_field(field_it->second))
+			throw string("static field "+name+" can't be indexed");
+		f.field = field_it->second;
+		return;
+	}
+
+	DynFieldsSlots::const_iterator slot_it = field_name2dyn_slot.find(name);
+	if(slot_it==field_name2dyn_slot.end()){
+		throw string("unknown field "+name);
+	}
+
+	field_name2type_iterator type_it = field_name2type.find(name);
+	if(type_it==field_name2type.end()){
+		throw string("unknown type of dynamic field "+name);
+	}
+	switch(type_it->second){
+	case c_type_int:
+	case c_type_long_long_int:
+	case c_type_string:
+		break;
+	default:
+		throw string(string("dynamic field ")+name+" with type "+
+					 get_cmp_type_name(type_it->second)+" can't be indexed");
+	}
+
+	f.field = c_field_dynamic;
+	f.slot = slot_it->second;
+}
+
+bool get_index_key(const Cdr *cdr, const cdr_index_field &f, string &key){
+	if(f.field==c_field_dynamic){
+		const AmArg &a = cdr->dyn_field(f.slot);
+		switch(a.getType()){
+		case AmArg::CStr: key = a.asCStr(); return true;
+		case AmArg::Int: key = int2str(a.asInt()); return true;
+		case AmArg::LongLong: key = longlong2str(a.asLongLong()); return true;
+		default: return false;
+		}
+	}
+	string Cdr::*field = static_string_field(f.field);
+	if(!field)
+		return false;
+	key = cdr->*field;
+	return true;
+}
@@ -5,7 +5,9 @@
 #include "../SqlRouter.h"
 
 #include <list>
+#include <vector>
 using std::list;
+using std::vector;
 
 /* condition internal type. see  CdrFilter.cpp:get_type_by_name()*/
 enum cmp_type_t {
@@ -17,13 +19,38 @@ enum cmp_type_t {
 	c_type_max,
 };
 
-/* types to make distinction between static fields */
+/* types to make distinction between static fields.
+ * must comply to static_call_fields order */
 enum cmp_field_t {
 	c_field_unsupported = 0,
 	c_field_dynamic,
-	c_field_duration,
+	c_field_node_id,
+	c_field_pop_id,
+	c_field_local_time,
+	c_field_cdr_born_time,
+	c_field_start_time,
 	c_field_connect_time,
+	c_field_end_time,
+	c_field_duration,
 	c_field_attempt_num,
+	c_field_resources,
+	c_field_active_resources,
+	c_field_active_resources_json,
+	c_field_legB_remote_port,
+	c_field_legB_local_port,
+	c_field_legA_remote_port,
+	c_field_legA_local_port,
+	c_field_legB_remote_ip,
+	c_field_legB_local_ip,
+	c_field_legA_remote_ip,
+	c_field_legA_local_ip,
+	c_field_orig_call_id,
+	c_field_term_call_id,
+	c_field_local_tag,
+	c_field_global_tag,
+	c_field_time_limit,
+	c_field_dump_level_id,
+	c_field_audio_record_enabled,
 	c_field_max
 };
 
@@ -47,48 +74,18 @@ typedef struct {
 extern const static_call_field static_call_fields[];
 extern const unsigned int static_call_fields_count;
 
-
-/* types definitions for static fields comparsion functions */
-
-#define STATIC_CMP_FUNCTION_PTR(type) cmp_ ## type ## _function_ptr
-#define DEF_STATIC_CMP_FUNCTION(type,value_type) \
-typedef bool cmp_ ## type ## _function(const Cdr *cdr, value_type value);\
-typedef cmp_ ## type ## _function *cmp_ ## type ## _function_ptr;
-
-DEF_STATIC_CMP_FUNCTION(int,int)
-DEF_STATIC_CMP_FUNCTION(double,double)
-DEF_STATIC_CMP_FUNCTION(timestamp,const timeval &)
-
-#define DYNAMIC_CMP_FUNCTION_PTR(type) cmp_dyn_ ## type ## _function_ptr
-#define DEF_DYNAMIC_CMP_FUNCTION(type, val_type) \
-typedef bool cmp_dyn_ ## type ## _function(const Cdr *cdr, const string& field_name, val_type value); \
-typedef cmp_dyn_ ## type ## _function *cmp_dyn_ ## type ## _function_ptr;
-
-DEF_DYNAMIC_CMP_FUNCTION(int,int)
-DEF_DYNAMIC_CMP_FUNCTION(string,const string &)
-
 typedef long long int long_long_int;
-DEF_DYNAMIC_CMP_FUNCTION(long_long_int,long_long_int)
 
-/* functor is used to memorize comparsion parameters for further use */
+/* parsed rule. keeps comparsion parameters as they were requested */
 class cmp_functor {
-	/* functor parameters */
+	friend class cmp_rules;
 
 	cmp_type_t cmp_type;
 	cmp_field_t cmp_field;
 	cmp_cond_t cmp_cond;
 
 	string dyn_field_name;
-
-	/* pointers to the appropriate comparsion function */
-
-	STATIC_CMP_FUNCTION_PTR(int) fptr_int;
-	STATIC_CMP_FUNCTION_PTR(double) fptr_double;
-	STATIC_CMP_FUNCTION_PTR(timestamp) fptr_timestamp;
-
-	DYNAMIC_CMP_FUNCTION_PTR(int) fptr_dyn_int;
-	DYNAMIC_CMP_FUNCTION_PTR(long_long_int) fptr_dyn_long_long_int;
-	DYNAMIC_CMP_FUNCTION_PTR(string) fptr_dyn_string;
+	unsigned int dyn_field_slot;	//position in Cdr::dyn_fields
 
 	/* value holders */
 	int v_int;
@@ -102,33 +99,105 @@ class cmp_functor {
 	cmp_functor(int value, cmp_field_t cmp_field, cmp_cond_t cmp_cond);
 	cmp_functor(double value, cmp_field_t cmp_field, cmp_cond_t cmp_cond);
 	cmp_functor(const timeval &value, cmp_field_t cmp_field, cmp_cond_t cmp_cond);
+	cmp_functor(const string &value, cmp_field_t cmp_field, cmp_cond_t cmp_cond);
 
 	/* constructor for dynamic fields */
-	cmp_functor(int value,const string &field_name, cmp_cond_t cmp_cond);
-	cmp_functor(long long int value,const string &field_name, cmp_cond_t cmp_cond);
-	cmp_functor(const string &value,const string &field_name, cmp_cond_t cmp_cond);
-
-
-	/* check for matching with given Cdr */
-	bool operator()(const Cdr *cdr) const;
+	cmp_functor(int value,const string &field_name, unsigned int slot, cmp_cond_t cmp_cond);
+	cmp_functor(long long int value,const string &field_name, unsigned int slot, cmp_cond_t cmp_cond);
+	cmp_functor(const string &value,const string &field_name, unsigned int slot, cmp_cond_t cmp_cond);
 
 	/* short self-info */
 	string info() const;
+
+	/* equality rule which can be resolved using index.
+	 * returns field name and the value in the index key form */
+	bool get_index_lookup(string &field_name, string &key) const;
 };
 
-/* types definitions of functors list */
-typedef list<cmp_functor> cmp_rules;
+/* compiled rule. function is specialized for field, value type and condition */
+struct cmp_predicate {
+	typedef bool function(const Cdr *cdr, const cmp_predicate &p);
+
+	function *fn;
+	float rank;				//expected cost to reject call. lower is checked earlier
+	unsigned int rule;		//position in requested rules
+	unsigned int slot;		//dynamic field position
+	string field_name;		//dynamic field name for errors reporting
+
+	int v_int;
+	long_long_int v_long_long_int;
+	timeval v_time;
+	string v_string;
+};
+
+/* rules are compiled on insertion into the predicates array
+ * ordered by rank. rules which don't depend on call
+ * (node_id, pop_id, local_time) are resolved immediately */
+class cmp_rules {
+	vector<cmp_functor> rules;		//as requested
+	vector<cmp_predicate> program;	//as executed
+	int node_id, pop_id;
+	bool reorder;
+	bool never_match;
+
+	void compile(const cmp_functor &f, cmp_predicate &p);
+
+  public:
+	typedef vector<cmp_functor>::const_iterator const_iterator;
+
+	cmp_rules(int node_id = 0, int pop_id = 0, bool reorder = true);
+
+	void push_back(const cmp_functor &f);
+
+	/* true if all rules matched for given Cdr */
+	bool match(const Cdr *cdr) const {
+		if(never_match) return false;
+		for(vector<cmp_predicate>::const_iterator it = program.begin();
+			it!=program.end(); ++it)
+		{
+			if(!(*it->fn)(cdr,*it))
+				return false;
+		}
+		return true;
+	}
+
+	const_iterator begin() const { return rules.begin(); }
+	const_iterator end() const { return rules.end(); }
+	bool empty() const { return rules.empty(); }
+	size_t size() const { return rules.size(); }
+
+	/* rules in the execution order */
+	void getInfo(AmArg &ret) const;
+};
 typedef cmp_rules::const_iterator cmp_rules_it;
 
-/* walk over functors from list and run each of them for given Cdr
+/* run compiled rules for given Cdr
  * return true if all rules matched and false otherwise */
-bool apply_filter_rules(const Cdr *cdr,const cmp_rules &rules);
+inline bool apply_filter_rules(const Cdr *cdr,const cmp_rules &rules){
+	return rules.match(cdr);
+}
 
-/* parse one rule and append rules list with created functor */
+/* parse one rule string (e.g. "attempt_num>1") and append rules with created functor */
+void parse_rule(cmp_rules &rules, const string &rule);
+
+/* parse fields and rules after WHERE keyword */
 void parse_fields(cmp_rules &rules, const AmArg &params, vector<string> &fields);
 
 /* prepare structures for fast parsing */
 int configure_filter(const SqlRouter *router);
 
+/* field of the active calls secondary index */
+struct cdr_index_field {
+	string name;
+	cmp_field_t field;	//static field type or c_field_dynamic
+	unsigned int slot;	//position in Cdr::dyn_fields for dynamic field
+};
+
+/* resolve field name for index or aggregation group. throws string if field can't be indexed */
+void resolve_index_field(const string &name, cdr_index_field &f);
+
+/* get index key for the field value. returns false if value is not set */
+bool get_index_key(const Cdr *cdr, const cdr_index_field &f, string &key);
+
 
 #endif // CDR_FILTER_H
@@ -1,8 +1,18 @@
 #include "CdrList.h"
 #include "log.h"
 #include "../yeti.h"
+#include "CallsExport.h"
 
-CdrList::CdrList(unsigned long buckets):MurmurHash<string,string,Cdr>(buckets){
+#include <sched.h>
+#include <algorithm>
+#include <map>
+#include <climits>
+
+CdrList::CdrList(unsigned long capacity):
+	OpenHash<string,string,Cdr>(capacity),
+	seq(0),
+	full_scans(0)
+{
 	//DBG("CdrList()");
 }
 
@@ -35,10 +45,15 @@ int CdrList::insert(Cdr *cdr){
 	if(cdr){
 		DBG("%s() local_tag = %s",FUNC_NAME,cdr->local_tag.c_str());
 		cdr->lock();
-			if(!cdr->inserted2list && MurmurHash::insert(&cdr->local_tag,cdr,true,true)){
+			lock();
+			if(!cdr->inserted2list && OpenHash::insert(&cdr->local_tag,cdr,false,true)){
 				err = 0;
 				cdr->inserted2list = true;
+				index_call(cdr);
+				log_change(CallInserted,cdr->local_tag);
+				unlock();
 			} else {
+				unlock();
 				ERROR("attempt to double insert cdr with local_tag '%s' into active calls list. integrity threat",
 					  cdr->local_tag.c_str());
 				log_stacktrace(L_ERR);
@@ -52,7 +67,159 @@ int CdrList::insert(Cdr *cdr){
 }
 
 void CdrList::erase_unsafe(const string &local_tag, bool locked){
-	erase_lookup_key(&local_tag, locked);
+	if(locked) lock();
+	if(!indexes.empty()){
+		const Cdr *cdr = at_data(&local_tag,false);
+		if(cdr) unindex_call(cdr);
+	}
+	erase_lookup_key(&local_tag,false);
+	log_change(CallRemoved,local_tag);
+	if(locked) unlock();
+}
+
+void CdrList::notify_update(Cdr *cdr){
+	if(!cdr) return;
+	cdr->lock();
+		if(cdr->inserted2list){
+			lock();
+				//indexed fields could be changed too
+				unindex_call(cdr);
+				index_call(cdr);
+				log_change(CallUpdated,cdr->local_tag);
+			unlock();
+		}
+	cdr->unlock();
+}
+
+void CdrList::log_change(change_type type, const string &local_tag){
+	changes.push_back(change(++seq,type,local_tag));
+	if(changes.size() > CALLS_CHANGES_LOG_SIZE)
+		changes.pop_front();
+}
+
+int CdrList::configure_indexes(const string &fields){
+	vector<string> names = explode(fields,",");
+	indexes.clear();
+	for(vector<string>::const_iterator it = names.begin(); it!=names.end(); ++it){
+		string name = trim(*it," ");
+		if(name.empty()) continue;
+		indexes.push_back(calls_index());
+		calls_index &idx = indexes.back();
+		try {
+			resolve_index_field(name,idx.field);
+		} catch(std::string &s){
+			ERROR("can't create active calls index: %s",s.c_str());
+			indexes.clear();
+			return 1;
+		}
+		idx.lookups = 0;
+		DBG("active calls index for field '%s'",name.c_str());
+	}
+	return 0;
+}
+
+void CdrList::aggregate_counters::add(const struct timeval &connect_time){
+	count++;
+	if(timerisset(&connect_time)){
+		connected++;
+		connect_sec_sum+=connect_time.tv_sec;
+		connect_usec_sum+=connect_time.tv_usec;
+	}
+}
+
+void CdrList::aggregate_counters::remove(const struct timeval &connect_time){
+	count--;
+	if(timerisset(&connect_time)){
+		connected--;
+		connect_sec_sum-=connect_time.tv_sec;
+		connect_usec_sum-=connect_time.tv_usec;
+	}
+}
+
+void CdrList::aggregate_counters::getInfo(AmArg &a, const struct timeval &now) const {
+	a["count"] = (long)count;
+	a["connected"] = (long)connected;
+	a["ringing"] = (long)(count-connected);
+	//sum of (now - connect_time) for connected calls
+	double duration_sum =
+		(double)((long long)connected*now.tv_sec-connect_sec_sum) +
+		(double)((long long)connected*now.tv_usec-connect_usec_sum)/1000000;
+	a["duration_sum"] = duration_sum < 0 ? 0 : duration_sum;
+}
+
+void CdrList::index_call(Cdr *cdr){
+	if(indexes.empty()) return;
+	indexed_call &c = indexed_calls[cdr];
+	call_index_keys &keys = c.keys;
+	c.connect_time = cdr->connect_time;
+	keys.resize(indexes.size());
+	for(unsigned int i = 0; i < indexes.size(); i++){
+		std::pair<bool,string> &k = keys[i];
+		k.first = get_index_key(cdr,indexes[i].field,k.second);
+		if(k.first)
+			indexes[i].values.insert(std::make_pair(k.second,cdr));
+		else
+			k.second.clear();
+		//calls without value are counted under "" as in the scan aggregation
+		indexes[i].counters[k.second].add(c.connect_time);
+	}
+}
+
+void CdrList::unindex_call(const Cdr *cdr){
+	if(indexes.empty()) return;
+	std::unordered_map<const Cdr *,indexed_call>::iterator cit = indexed_calls.find(cdr);
+	if(cit==indexed_calls.end()) return;
+	const call_index_keys &keys = cit->second.keys;
+	for(unsigned int i = 0; i < keys.size(); i++){
+		if(keys[i].first){
+			index_values &values = indexes[i].values;
+			std::pair<index_values::iterator,index_values::iterator> range =
+				values.equal_range(keys[i].second);
+			for(index_values::iterator it = range.first; it!=range.second; ++it){
+				if(it->second==cdr){
+					values.erase(it);
+					break;
+				}
+			}
+		}
+		std::unordered_map<string,aggregate_counters>::iterator ait =
+			indexes[i].counters.find(keys[i].second);
+		if(ait!=indexes[i].counters.end()){
+			ait->second.remove(cit->second.connect_time);
+			if(!ait->second.count)
+				indexes[i].counters.erase(ait);
+		}
+	}
+	indexed_calls.erase(cit);
+}
+
+CdrList::calls_index *CdrList::find_index(const cmp_rules &rules, string &key){
+	string field_name;
+	if(indexes.empty()) return NULL;
+	for(cmp_rules_it it = rules.begin(); it!=rules.end(); ++it){
+		if(!it->get_index_lookup(field_name,key))
+			continue;
+		for(vector<calls_index>::iterator i = indexes.begin(); i!=indexes.end(); ++i){
+			if(i->field.name==field_name)
+				return &(*i);
+		}
+	}
+	return NULL;
+}
+
+void CdrList::getIndexes(AmArg &ret){
+	ret.assertStruct();
+	lock();
+		ret["full_scans"] = (long)full_scans;
+		AmArg &a = ret["indexes"];
+		a.assertStruct();
+		for(vector<calls_index>::const_iterator it = indexes.begin(); it!=indexes.end(); ++it){
+			AmArg &i = a[it->field.name];
+			i["dynamic"] = it->field.field==c_field_dynamic;
+			i["entries"] = (long)it->values.size();
+			i["lookups"] = (long)it->lookups;
+		}
+	unlock();
 }
 
 int CdrList::erase(Cdr *cdr){
@@ -94,9 +261,40 @@ int CdrList::getCall(const string &local_tag,AmArg &call,const SqlRouter *router
 	return ret;
 }
 
+void CdrList::get_calls_ctx::resolve_fields(){
+	const vector<string> &wanted_fields = *fields;
+
+	for(const static_call_field *f = static_call_fields; f->name; f++){
+		if(find(wanted_fields.begin(),wanted_fields.end(),f->name)!=wanted_fields.end())
+			static_fields.set(f->name_type);
+	}
+
+	const DynFieldsT &df = router->getDynFields();
+	unsigned int slot = 0;
+	for(DynFieldsT::const_iterator it = df.begin(); it!=df.end(); ++it,++slot){
+		if(find(wanted_fields.begin(),wanted_fields.end(),it->name)!=wanted_fields.end())
+			dyn_fields.push_back(std::make_pair(slot,&(*it)));
+	}
+}
+
+Cdr *CdrList::cursor_next(cursor &c){
+	entry *e = cursor_next_entry(c);
+	return e ? e->data : NULL;
+}
+
+void CdrList::relax_lock(int &batch){
+	if(++batch < CALLS_SERIALIZE_BATCH)
+		return;
+	batch = 0;
+	unlock();
+	sched_yield();
+	lock();
+}
+
 void CdrList::getCalls(AmArg &calls,int limit,const SqlRouter *router){
-	entry *e;
-	int i = limit;
+	cursor pos;
+	Cdr *cdr;
+	int i = limit, batch = 0;
 	Yeti::global_config &gc = Yeti::instance().config;
 
 	const get_calls_ctx ctx(gc.node_id,gc.pop_id,router);
@@ -105,25 +303,27 @@ void CdrList::getCalls(AmArg &calls,int limit,const SqlRouter *router){
 
 	PROF_START(calls_serialization);
 	lock();
-		e = first;
-		while(e&&i--){
+		cursor_link(pos);
+		while(i-- && (cdr = cursor_next(pos))){
 			calls.push(AmArg());
-			cdr2arg<Unfiltered>(calls.back(),e->data,ctx);
-			e = e->list_next;
+			cdr2arg<Unfiltered>(calls.back(),cdr,ctx);
+			relax_lock(batch);
 		}
+		cursor_unlink(pos);
 	unlock();
 	PROF_END(calls_serialization);
 	PROF_PRINT("active calls serialization",calls_serialization);
 }
 
 void CdrList::getCallsFields(AmArg &calls,int limit,const SqlRouter *router, const AmArg &params){
-	entry *e;
+	cursor pos;
+	Cdr *cdr;
 
 	calls.assertArray();
-	int i = limit;
+	int i = limit, batch = 0;
 	Yeti::global_config &gc = Yeti::instance().config;
 
-	cmp_rules filter_rules;
+	cmp_rules filter_rules(gc.node_id,gc.pop_id);
 	vector<string> fields;
 
 	parse_fields(filter_rules, params, fields);
@@ -132,22 +332,237 @@ void CdrList::getCallsFields(AmArg &calls,int limit,const SqlRouter *router, con
 
 	const get_calls_ctx ctx(gc.node_id,gc.pop_id,router,&fields);
 
+	string key;
+
 	PROF_START(calls_serialization);
 	lock();
-		e = first;
-		while(e&&i--){
-			Cdr *cdr = e->data;
-			if(apply_filter_rules(cdr,filter_rules)){
-				calls.push(AmArg());
-				cdr2arg<Filtered>(calls.back(),e->data,ctx);
+		calls_index *idx = find_index(filter_rules,key);
+		if(idx){
+			//remember candidates. they can be erased while lock is relaxed
+			vector<string> local_tags;
+			std::pair<index_values::const_iterator,index_values::const_iterator> range =
+				idx->values.equal_range(key);
+			for(index_values::const_iterator it = range.first; it!=range.second; ++it)
+				local_tags.push_back(it->second->local_tag);
+			idx->lookups++;
+
+			for(vector<string>::const_iterator it = local_tags.begin();
+				it!=local_tags.end() && i--; ++it)
+			{
+				if(!(cdr = get_by_local_tag(*it)))
+					continue;
+				if(apply_filter_rules(cdr,filter_rules)){
+					calls.push(AmArg());
+					cdr2arg<Filtered>(calls.back(),cdr,ctx);
+				}
+				relax_lock(batch);
+			}
+		} else {
+			full_scans++;
+			cursor_link(pos);
+			while(i-- && (cdr = cursor_next(pos))){
+				if(apply_filter_rules(cdr,filter_rules)){
+					calls.push(AmArg());
+					cdr2arg<Filtered>(calls.back(),cdr,ctx);
+				}
+				relax_lock(batch);
 			}
-			e = e->list_next;
+			cursor_unlink(pos);
 		}
 	unlock();
 	PROF_END(calls_serialization);
 	PROF_PRINT("active calls serialization",calls_serialization);
 }
 
+void CdrList::getCallsAggregate(AmArg &ret,const SqlRouter *router, const AmArg &params){
+	cursor pos;
+	Cdr *cdr;
+	int batch = 0;
+	struct timeval now;
+	Yeti::global_config &gc = Yeti::instance().config;
+
+	cmp_rules filter_rules(gc.node_id,gc.pop_id);
+	vector<string> fields;
+
+	parse_fields(filter_rules, params, fields);
+	if(fields.empty())
+		throw std::string("no group by fields");
+
+	vector<cdr_index_field> group_fields(fields.size());
+	for(unsigned int i = 0; i < fields.size(); i++)
+		resolve_index_field(fields[i],group_fields[i]);
+
+	AmArg &groups = ret["groups"];
+	groups.assertArray();
+
+	PROF_START(calls_aggregation);
+	lock();
+		gettimeofday(&now,NULL);
+
+		//counters maintained for the indexed field
+		if(filter_rules.empty() && fields.size()==1){
+			for(vector<calls_index>::const_iterator it = indexes.begin(); it!=indexes.end(); ++it){
+				if(it->field.name!=fields[0])
+					continue;
+				for(std::unordered_map<string,aggregate_counters>::const_iterator cit = it->counters.begin();
+					cit!=it->counters.end(); ++cit)
+				{
+					groups.push(AmArg());
+					AmArg &a = groups.back();
+					a[fields[0]] = cit->first;
+					cit->second.getInfo(a,now);
+				}
+				unlock();
+				ret["source"] = "index";
+				PROF_END(calls_aggregation);
+				PROF_PRINT("active calls aggregation",calls_aggregation);
+				return;
+			}
+		}
+
+		std::map<vector<string>,aggregate_counters> aggregated;
+		vector<string> key(fields.size());
+
+		full_scans++;
+		cursor_link(pos);
+		while((cdr = cursor_next(pos))){
+			if(apply_filter_rules(cdr,filter_rules)){
+				for(unsigned int i = 0; i < group_fields.size(); i++){
+					if(!get_index_key(cdr,group_fields[i],key[i]))
+						key[i].clear();
+				}
+				aggregated[key].add(cdr->connect_time);
+			}
+			relax_lock(batch);
+		}
+		cursor_unlink(pos);
+	unlock();
+
+	for(std::map<vector<string>,aggregate_counters>::const_iterator it = aggregated.begin();
+		it!=aggregated.end(); ++it)
+	{
+		groups.push(AmArg());
+		AmArg &a = groups.back();
+		for(unsigned int i = 0; i < fields.size(); i++)
+			a[fields[i]] = it->first[i];
+		it->second.getInfo(a,now);
+	}
+	ret["source"] = "scan";
+	PROF_END(calls_aggregation);
+	PROF_PRINT("active calls aggregation",calls_aggregation);
+}
+
+void CdrList::exportCalls(AmArg &ret,const string &path,const SqlRouter *router){
+	cursor pos;
+	Cdr *cdr;
+	int batch = 0;
+	bool ok = true;
+	Yeti::global_config &gc = Yeti::instance().config;
+
+	CallsExport e(router->getDynFields());
+	e.open(path,gc.node_id,gc.pop_id);
+
+	PROF_START(calls_export);
+	lock();
+		cursor_link(pos);
+		while(true){
+			while(e.rows() < CALLS_EXPORT_CHUNK && (cdr = cursor_next(pos))){
+				e.add(cdr);
+				relax_lock(batch);
+			}
+			if(!e.rows())
+				break;
+			//write chunk without blocking calls insert/erase
+			unlock();
+			ok = e.flush();
+			lock();
+			if(!ok) break;
+		}
+		cursor_unlink(pos);
+	unlock();
+
+	if(ok) ok = e.finish();
+	else e.close();
+	PROF_END(calls_export);
+	PROF_PRINT("active calls export",calls_export);
+
+	e.getInfo(ret);
+	if(!ok)
+		throw string("failed to write calls to '")+path+"'";
+}
+
+unsigned long CdrList::countMatched(const cmp_rules &rules){
+	cursor pos;
+	Cdr *cdr;
+	unsigned long matched = 0;
+	int batch = 0;
+
+	lock();
+		cursor_link(pos);
+		while((cdr = cursor_next(pos))){
+			if(apply_filter_rules(cdr,rules))
+				matched++;
+			relax_lock(batch);
+		}
+		cursor_unlink(pos);
+	unlock();
+	return matched;
+}
+
+void CdrList::getCallsChanges(AmArg &ret,unsigned long long since,const SqlRouter *router){
+	std::map<string,change_type> changed;
+	Yeti::global_config &gc = Yeti::instance().config;
+	const get_calls_ctx ctx(gc.node_id,gc.pop_id,router);
+	int batch = 0;
+	bool full;
+
+	PROF_START(calls_serialization);
+	lock();
+		ret["seq"] = (long)seq;
+		//since > seq means our sequence was restarted
+		full = since > seq ||
+			   (since < seq && (changes.empty() || changes.front().seq > since+1));
+		if(!full){
+			//changes are ordered by seq. the last one for the call wins
+			std::deque<change>::const_reverse_iterator it = changes.rbegin();
+			for(;it!=changes.rend() && it->seq > since;++it){
+				if(changed.find(it->local_tag)==changed.end())
+					changed[it->local_tag] = it->type;
+			}
+		}
+	unlock();
+
+	ret["full"] = full;
+	if(full){
+		/* client must replace its calls set. calls_show_limit is not applied:
+		 * calls missed in the snapshot would never appear in the next changes */
+		getCalls(ret["calls"],INT_MAX,router);
+		return;
+	}
+
+	AmArg &calls = ret["calls"];
+	AmArg &removed = ret["removed"];
+	calls.assertArray();
+	removed.assertArray();
+
+	lock();
+		for(std::map<string,change_type>::const_iterator it = changed.begin();
+			it!=changed.end();++it)
+		{
+			Cdr *cdr;
+			if(it->second==CallRemoved || !(cdr = get_by_local_tag(it->first))){
+				removed.push(it->first);
+				continue;
+			}
+			calls.push(AmArg());
+			cdr2arg<Unfiltered>(calls.back(),cdr,ctx);
+			relax_lock(batch);
+		}
+	unlock();
+	PROF_END(calls_serialization);
+	PROF_PRINT("active calls changes serialization",calls_serialization);
+}
+
 void CdrList::getFields(AmArg &ret,SqlRouter *r){
 	ret.assertStruct();
 
@@ -5,11 +5,21 @@
 #include "../cdr/Cdr.h"
 #include "../SqlRouter.h"
 #include "CdrFilter.h"
-#include "MurmurHash.h"
+#include "OpenHash.h"
 
-class CdrList: public MurmurHash<string,string,Cdr> {
+#include <deque>
+#include <bitset>
+#include <unordered_map>
+
+/* max calls serialized while list is locked.
+ * lock is released between batches to let calls insert/erase */
+#define CALLS_SERIALIZE_BATCH 128
+/* max changes kept for incremental requests */
+#define CALLS_CHANGES_LOG_SIZE 65536
+
+class CdrList: public OpenHash<string,string,Cdr> {
   public:
-	CdrList(unsigned long buckets = 65000);
+	CdrList(unsigned long capacity = 1024);
 	~CdrList();
 	
 	Cdr *get_by_local_tag(string local_tag);
@@ -19,6 +29,11 @@ class CdrList: public MurmurHash<string,string,Cdr> {
 		int node_id, pop_id;
 		const SqlRouter *router;
 		const vector<string> *fields;
+
+		/* wanted fields resolved once per request */
+		std::bitset<c_field_max> static_fields;
+		vector<std::pair<unsigned int,const DynField *> > dyn_fields;
+
 		get_calls_ctx(
 			int node_id, int pop_id,
 			const SqlRouter *router,
@@ -28,14 +43,35 @@ class CdrList: public MurmurHash<string,string,Cdr> {
 			fields(fields)
 		{
 			gettimeofday(&now,NULL);
+			if(fields) resolve_fields();
 		}
+		void resolve_fields();
 	};
 	void getCalls(AmArg &calls,int limit,const SqlRouter *router);
 	void getCallsFields(AmArg &calls,int limit,const SqlRouter *router, const AmArg &params);
+	/* calls count, connected calls count and durations sum
+	 * grouped by fields values. params are group by fields and optional WHERE rules */
+	void getCallsAggregate(AmArg &ret,const SqlRouter *router, const AmArg &params);
 	int getCall(const string &local_tag,AmArg &call,const SqlRouter *router);
+	/* write calls in columnar binary format (see CallsExport.h) to the file or unix socket.
+	 * throws string on errors */
+	void exportCalls(AmArg &ret,const string &path,const SqlRouter *router);
+	/* count calls matched by rules without serialization */
+	unsigned long countMatched(const cmp_rules &rules);
 	int insert(Cdr *cdr);
 	int erase(Cdr *cdr);
 	void erase_unsafe(const string &local_tag, bool locked = true);
+	/* call info was changed (e.g. connected) */
+	void notify_update(Cdr *cdr);
+
+	/* calls inserted/updated and local_tags of calls removed after the sequence number.
+	 * full snapshot of all calls is returned if requested changes are out of the log */
+	void getCallsChanges(AmArg &ret,unsigned long long since,const SqlRouter *router);
+
+	/* secondary indexes for the comma-separated fields list.
+	 * must be called after configure_filter() */
+	int configure_indexes(const string &fields);
+	void getIndexes(AmArg &ret);
 
 	void getFields(AmArg &ret,SqlRouter *r);
 	void validate_fields(const vector<string> &wanted_fields, const SqlRouter *router);
@@ -47,6 +83,62 @@ class CdrList: public MurmurHash<string,string,Cdr> {
 	void free_key(string *key);
 
   private:
+	enum change_type {
+		CallInserted = 0,
+		CallUpdated,
+		CallRemoved
+	};
+	struct change {
+		unsigned long long seq;
+		change_type type;
+		string local_tag;
+		change(unsigned long long seq, change_type type, const string &local_tag):
+			seq(seq), type(type), local_tag(local_tag) {}
+	};
+	std::deque<change> changes;
+	unsigned long long seq;		//last change sequence number
+	void log_change(change_type type, const string &local_tag);
+
+	/* calls count and durations for aggregation */
+	struct aggregate_counters {
+		unsigned long count, connected;
+		long long connect_sec_sum, connect_usec_sum;
+		aggregate_counters():
+			count(0), connected(0),
+			connect_sec_sum(0), connect_usec_sum(0) {}
+		void add(const struct timeval &connect_time);
+		void remove(const struct timeval &connect_time);
+		void getInfo(AmArg &a, const struct timeval &now) const;
+	};
+
+	/* secondary indexes are changed under list lock.
+	 * filter uses index for the equality rule on the indexed field.
+	 * aggregation by the single indexed field uses per value counters */
+	typedef std::unordered_multimap<string,Cdr *> index_values;
+	struct calls_index {
+		cdr_index_field field;
+		index_values values;
+		std::unordered_map<string,aggregate_counters> counters;
+		unsigned long lookups;
+	};
+	vector<calls_index> indexes;
+	unsigned long full_scans;
+	/* keys the call was indexed with. flag is false if the field had no value */
+	typedef vector<std::pair<bool,string> > call_index_keys;
+	struct indexed_call {
+		call_index_keys keys;
+		struct timeval connect_time;
+	};
+	std::unordered_map<const Cdr *,indexed_call> indexed_calls;
+	void index_call(Cdr *cdr);
+	void unindex_call(const Cdr *cdr);
+	calls_index *find_index(const cmp_rules &rules, string &key);
+
+	/* cursor is linked to the table (see OpenHash::cursor), so it stays valid
+	 * between batches when lock is relaxed. calls inserted meanwhile are visited */
+	Cdr *cursor_next(cursor &c);
+	void relax_lock(int &batch);
+
 	enum get_calls_type {
 		Unfiltered, Filtered
 	};
@@ -61,29 +153,27 @@ template <>
 inline void CdrList::cdr2arg<CdrList::Filtered>(AmArg& arg, const Cdr *cdr, const get_calls_ctx &ctx) const
 {
 	#define filter(val)\
-		if(find(wanted_fields.begin(),wanted_fields.end(),val)!=wanted_fields.end())
+		if(ctx.static_fields[c_field_ ## val])
 	#define add_field(val)\
-		filter(#val)\
+		filter(val)\
 			arg[#val] = cdr->val;
 	#define add_timeval_field(val)\
-		filter(#val)\
+		filter(val)\
 			arg[#val] = timeval2double(cdr->val);
 
 	struct timeval duration;
 	double duration_double;
-	const vector<string> &wanted_fields = *ctx.fields;
-	(void)wanted_fields;
 
 	arg.assertStruct();
 
 	if(ctx.fields->empty())
 		return;
 
-	filter("node_id") arg["node_id"] = ctx.node_id;
-	filter("pop_id") arg["pop_id"] = ctx.pop_id;
+	filter(node_id) arg["node_id"] = ctx.node_id;
+	filter(pop_id) arg["pop_id"] = ctx.pop_id;
 
 	//!added for compatibility with old versions of web interface
-	filter("local_time") arg["local_time"] = timeval2double(ctx.now);
+	filter(local_time) arg["local_time"] = timeval2double(ctx.now);
 
 
 	add_timeval_field(cdr_born_time);
@@ -91,8 +181,8 @@ inline void CdrList::cdr2arg<CdrList::Filtered>(AmArg& arg, const Cdr *cdr, cons
 	add_timeval_field(end_time);
 
 	const struct timeval &connect_time = cdr->connect_time;
-	filter("connect_time") arg["connect_time"] = timeval2double(connect_time);
-	filter("duration") {
+	filter(connect_time) arg["connect_time"] = timeval2double(connect_time);
+	filter(duration) {
 		if(timerisset(&connect_time)){
 			timersub(&ctx.now,&connect_time,&duration);
 			duration_double = timeval2double(duration);
@@ -125,17 +215,16 @@ inline void CdrList::cdr2arg<CdrList::Filtered>(AmArg& arg, const Cdr *cdr, cons
 
 	add_field(resources);
 	add_field(active_resources);
-	filter("active_resources_json") arg["active_resources_json"] = cdr->active_resources_amarg;
-
-	const DynFieldsT &df = ctx.router->getDynFields();
-	for(DynFieldsT::const_iterator dit = df.begin(); dit!=df.end(); dit++){
-		const string &fname = (*dit).name;
-		filter(fname) {
-			AmArg &f = cdr->dyn_fields[fname];
-			if(f.getType()==AmArg::Undef && ((*dit).type_id==DynField::VARCHAR))
-				arg[fname] = "";
-			arg[fname] = f;
-		}
+	filter(active_resources_json) arg["active_resources_json"] = cdr->active_resources_amarg;
+
+	for(vector<std::pair<unsigned int,const DynField *> >::const_iterator it = ctx.dyn_fields.begin();
+		it!=ctx.dyn_fields.end(); ++it)
+	{
+		const DynField &df = *it->second;
+		const AmArg &f = cdr->dyn_field(it->first);
+		if(f.getType()==AmArg::Undef && (df.type_id==DynField::VARCHAR))
+			arg[df.name] = "";
+		arg[df.name] = f;
 	}
 
 	#undef add_field
@@ -202,9 +291,10 @@ inline void CdrList::cdr2arg<CdrList::Unfiltered>(AmArg& arg, const Cdr *cdr, co
 	arg["active_resources_json"] = cdr->active_resources_amarg;
 
 	const DynFieldsT &df = ctx.router->getDynFields();
-	for(DynFieldsT::const_iterator dit = df.begin(); dit!=df.end(); dit++){
+	unsigned int slot = 0;
+	for(DynFieldsT::const_iterator dit = df.begin(); dit!=df.end(); dit++,slot++){
 		const string &fname = (*dit).name;
-		AmArg &f = cdr->dyn_fields[fname];
+		const AmArg &f = cdr->dyn_field(slot);
 		if(f.getType()==AmArg::Undef && ((*dit).type_id==DynField::VARCHAR))
 			arg[fname] = "";
 		arg[fname] = f;
@@ -0,0 +1,127 @@
+#ifndef _OpenHash_
+#define _OpenHash_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <AmThread.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "log.h"
+#include "hashfn.h"
+
+/* open addressing hash table keyed by pointers to keys.
+ *
+ * table slots are probed by groups of 16 control bytes (SSE2 when available).
+ * control byte keeps 7 bits of the entry hash, so most of mismatched slots
+ * are skipped without key comparison. full hash is stored in entry
+ * and is used to move entries on resize without keys hashing.
+ *
+ * table grows (or purges deleted slots) incrementally: new table is
+ * allocated and each insert/erase moves a few entries from the old one.
+ *
+ * entries are kept densely in 'entries' vector which is the iteration order.
+ * table slots hold indexes in it, so resize moves indexes only.
+ * erase moves the last entry into the freed position. registered cursors
+ * are adjusted on erase to never skip or repeat entries (see cursor_next()).
+ * entry pointers are valid until the next insert or erase */
+
+template<class key_type,class lookup_key_type,class data_type>
+class OpenHash : public AmMutex {
+public:
+	struct entry {
+		key_type *key;
+		data_type *data;
+		uint64_t hash;
+	};
+
+	/* iteration position. entries before it are visited.
+	 * inserted entries are appended and will be visited too */
+	struct cursor {
+		unsigned long pos;
+	};
+
+	OpenHash(unsigned long capacity = 1024);
+	virtual ~OpenHash();
+
+	uint64_t hashfn(const void *k, int len);
+
+	unsigned long get_count();
+	unsigned long get_capacity();
+
+	bool insert(const lookup_key_type *data_key,data_type *data,bool locked	= true,bool unique = false);
+	void erase_lookup_key(const lookup_key_type *key,bool locked	= true);
+	void erase(entry	*e,bool locked = true);
+	entry * at(const lookup_key_type *key,bool locked = true);
+	data_type * at_data(const lookup_key_type *key,bool locked = true);
+
+	/* cursor functions must be called under lock */
+	void cursor_link(cursor &c);
+	void cursor_unlink(cursor &c);
+	entry * cursor_next_entry(cursor &c);
+
+protected:
+	virtual uint64_t hash_lookup_key(const lookup_key_type *key) = 0;
+	virtual bool cmp_lookup_key(const lookup_key_type *k1,const key_type *k2) = 0;
+	virtual void init_key(key_type **dest,const lookup_key_type *src) = 0;
+	virtual void free_key(key_type *key) = 0;
+
+	std::vector<entry> entries;
+
+private:
+	enum {
+		GROUP_SIZE = 16,
+		MIGRATE_STEP = 64,		//old table slots moved per insert/erase
+		CTRL_EMPTY = -128,
+		CTRL_DELETED = -2
+	};
+
+	struct table {
+		int8_t *ctrl;			//CTRL_EMPTY, CTRL_DELETED or 7 bits of hash
+		uint32_t *slots;		//indexes in entries
+		unsigned long mask;		//groups count-1
+		unsigned long used;		//full and deleted slots
+		unsigned long full;
+	};
+
+	table t;			//inserts go here
+	table old;			//entries are moved from here to t while resizing
+	unsigned long migrate_pos;
+	unsigned long min_capacity;		//table is not shrunk below initial capacity
+	std::vector<cursor *> cursors;
+
+	static unsigned long capacity(const table &tbl) { return (tbl.mask+1)*GROUP_SIZE; }
+	static unsigned long max_used(const table &tbl) { return capacity(tbl)/8*7; }
+
+	static uint32_t match_byte(const int8_t *g, int8_t b);
+	static uint32_t match_empty(const int8_t *g);
+	static uint32_t match_empty_or_deleted(const int8_t *g);
+
+	static void table_alloc(table &tbl, unsigned long slots_count);
+	static void table_free(table &tbl);
+	static void table_put(table &tbl, uint64_t hash, uint32_t idx);
+	static void table_clear_slot(table &tbl, unsigned long slot);
+	long table_find(const table &tbl, const lookup_key_type *key, uint64_t hash);
+	static long table_find_index(const table &tbl, uint64_t hash, uint32_t idx);
+	uint32_t *index_slot(unsigned long idx);
+	void move_entry(unsigned long from, unsigned long to);
+	static bool cursor_less(const cursor *a, const cursor *b) { return a->pos < b->pos; }
+
+	void migrate(unsigned long slots_count);
+	void resize(unsigned long slots_count);
+	void grow();
+
+	entry * _at(const lookup_key_type *key);
+	void _erase(entry	*e);
+};
+
+#include "OpenHash.impl"
+
+#endif
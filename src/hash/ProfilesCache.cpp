@@ -2,8 +2,8 @@
 #include "AmUtils.h"
 
 ProfilesCache::ProfilesCache(const vector<UsedHeaderField> &used_header_fields,
-							 unsigned long buckets, double timeout):
-	MurmurHash<ProfilesCacheKey,AmSipRequest,ProfilesCacheEntry>(buckets),
+							 unsigned long capacity, double timeout):
+	OpenHash<ProfilesCacheKey,AmSipRequest,ProfilesCacheEntry>(capacity),
 	timeout(timeout),
 	used_header_fields(used_header_fields)
 {
@@ -113,22 +113,22 @@ void ProfilesCache::insert_profile(const AmSipRequest *req,ProfilesCacheEntry *e
 }
 
 void ProfilesCache::check_obsolete(){
-	entry *e,*next;
+	entry *e;
+	cursor pos;
 	struct timeval now;
 	ProfilesCacheEntry *cache_entry;
 	list<ProfilesCacheEntry *> free_entries;
 
 	lock();
 	gettimeofday(&now,NULL);
-	e = first;
-	while(e){
-		next = e->list_next;
+	cursor_link(pos);
+	while((e = cursor_next_entry(pos))){
 		if(is_obsolete(e,&now)){
 			free_entries.push_back(e->data);
 			erase(e,false);
 		}
-		e = next;
 	}
+	cursor_unlink(pos);
 	unlock();
 	while(!free_entries.empty()){
 		cache_entry = free_entries.front();
@@ -155,15 +155,18 @@ void ProfilesCache::on_clean(){
 
 void ProfilesCache::getStats(AmArg &arg){
 	arg["entries"] = (int)get_count();
+	arg["capacity"] = (int)get_capacity();
 }
 
 void ProfilesCache::dump(AmArg &arg){
 	AmArg a,profiles,profile;
 	ProfilesCacheEntry *cache_entry;
 	ProfilesCacheKey *cache_key;
+	entry *e;
+	cursor pos;
 	lock();
-	entry *e = first;
-	while(e){
+	cursor_link(pos);
+	while((e = cursor_next_entry(pos))){
 		cache_entry = e->data;
 		cache_key = e->key;
 
@@ -189,23 +192,23 @@ void ProfilesCache::dump(AmArg &arg){
 		}
 		a["profiles"] = profiles;
 		arg.push(a);
-		e = e->list_next;
 	}
+	cursor_unlink(pos);
 	unlock();
 }
 
 void ProfilesCache::clear(){
-	entry *e,*next;
+	entry *e;
+	cursor pos;
 	list<ProfilesCacheEntry *> free_entries;
 	ProfilesCacheEntry *cache_entry;
 	lock();
-	e = first;
-	while(e){
-		next = e->list_next;
+	cursor_link(pos);
+	while((e = cursor_next_entry(pos))){
 		free_entries.push_back(e->data);
 		erase(e,false);
-		e = next;
 	}
+	cursor_unlink(pos);
 	unlock();
 	while(!free_entries.empty()){
 		cache_entry = free_entries.front();
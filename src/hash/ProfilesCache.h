@@ -5,7 +5,7 @@
 #include "AmAppTimer.h"
 #include "AmArg.h"
 #include "../SqlCallProfile.h"
-#include "MurmurHash.h"
+#include "OpenHash.h"
 #include "../UsedHeaderField.h"
 
 using namespace std;
@@ -47,12 +47,12 @@ struct ProfilesCacheEntry {
 };
 
 class ProfilesCache:
-public MurmurHash<ProfilesCacheKey,AmSipRequest,ProfilesCacheEntry>,
+public OpenHash<ProfilesCacheKey,AmSipRequest,ProfilesCacheEntry>,
 public DirectAppTimer
 {
 public:
 	ProfilesCache(const vector<UsedHeaderField> &used_header_fields,
-				  unsigned long buckets = 65000,double timeout = 5);
+				  unsigned long capacity = 1024,double timeout = 5);
 	~ProfilesCache();
 
 	bool get_profiles(const AmSipRequest *req,list<SqlCallProfile *> &profiles);
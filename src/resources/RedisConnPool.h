@@ -33,9 +33,10 @@ class RedisConnPool : public
 
 	RedisCfg _cfg;
 
-	int cfg2RedisCfg(const AmConfigReader &cfg, RedisCfg &rcfg,string prefix);
 	bool reconnect(redisContext *&ctx);
 public:
+	static int cfg2RedisCfg(const AmConfigReader &cfg, RedisCfg &rcfg,string prefix);
+
 	enum ConnReturnState {
 		CONN_STATE_OK,
 		CONN_STATE_ERR
@@ -0,0 +1,470 @@
+#include "ResourceAsyncChecker.h"
+#include "ResourceCache.h"
+#include "log.h"
+#include "AmSessionContainer.h"
+#include "AmUtils.h"
+
+#include "../yeti.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#define EPOLL_MAX_EVENTS 16
+#define RECONNECT_INTERVAL 1000 //msec
+#define MARKER_TTL 60 //sec. rollback is possible while marker exists
+
+/* return resources taken by the lost request.
+ * KEYS and ARGV are the same as for the get script with marker */
+static const char *rollback_script_code =
+	"local marker = ARGV[#KEYS*3+2]\n"
+	"local v = redis.call('GET', marker)\n"
+	"if not v then return 0 end\n"
+	"for s in string.gmatch(v, '%d+') do\n"
+	"  local i = tonumber(s)\n"
+	"  local takes = tonumber(ARGV[i*3])\n"
+	"  if takes > 0 then\n"
+	"    if redis.call('HINCRBY', KEYS[i], ARGV[1], -takes) < 0 then\n"
+	"      redis.call('HSET', KEYS[i], ARGV[1], 0)\n"
+	"    end\n"
+	"  end\n"
+	"end\n"
+	"redis.call('DEL', marker)\n"
+	"return 1\n";
+
+ResourceCheckReplyEvent::~ResourceCheckReplyEvent(){
+	if(consumed || result!=RES_SUCC || !cache)
+		return;
+	DBG("async resources check result is not consumed. release resources");
+	cache->put(resources);
+}
+
+ResourceAsyncChecker::ResourceAsyncChecker(ResourceCache &cache):
+	cache(cache),
+	epoll_fd(-1), event_fd(-1),
+	ac(NULL),
+	connected(false),
+	watched_events(0),
+	fd_added(false),
+	tostop(false),
+	last_connect(0),
+	marker_seq(0)
+{
+	memset(&stats,0,sizeof(stats));
+}
+
+ResourceAsyncChecker::~ResourceAsyncChecker(){
+	for(std::deque<request *>::iterator it = rollbacks.begin();it!=rollbacks.end();++it)
+		delete *it;
+	if(event_fd!=-1) close(event_fd);
+	if(epoll_fd!=-1) close(epoll_fd);
+}
+
+int ResourceAsyncChecker::configure(const AmConfigReader &c){
+	if(RedisConnPool::cfg2RedisCfg(c,cfg,"write"))
+		return -1;
+
+	//unique across nodes and restarts. doesn't match resources keys pattern
+	marker_prefix = "async:"+int2str(Yeti::instance().config.node_id)+
+					":"+int2str((unsigned int)time(NULL))+":";
+
+	epoll_fd = epoll_create1(0);
+	if(epoll_fd==-1){
+		ERROR("epoll_create1(): %s",strerror(errno));
+		return -1;
+	}
+	event_fd = eventfd(0,EFD_NONBLOCK);
+	if(event_fd==-1){
+		ERROR("eventfd(): %s",strerror(errno));
+		return -1;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = event_fd;
+	if(epoll_ctl(epoll_fd,EPOLL_CTL_ADD,event_fd,&ev)==-1){
+		ERROR("epoll_ctl(): %s",strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+void ResourceAsyncChecker::run(){
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+
+	setThreadName("yeti-res-async");
+
+	while(!tostop){
+		if(!ac && time(NULL)-last_connect >= RECONNECT_INTERVAL/1000)
+			connect();
+
+		int n = epoll_wait(epoll_fd,events,EPOLL_MAX_EVENTS,ac ? -1 : RECONNECT_INTERVAL);
+		if(n < 0){
+			if(errno==EINTR) continue;
+			ERROR("epoll_wait(): %s",strerror(errno));
+			break;
+		}
+
+		for(int i = 0;i<n;i++){
+			if(events[i].data.fd==event_fd){
+				uint64_t v;
+				if(read(event_fd,&v,sizeof(v)) < 0 && errno!=EAGAIN)
+					ERROR("eventfd read: %s",strerror(errno));
+				send_queued();
+				continue;
+			}
+			//context can be freed by the previous handler
+			if(ac && (events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)))
+				redisAsyncHandleRead(ac);
+			if(ac && (events[i].events & EPOLLOUT))
+				redisAsyncHandleWrite(ac);
+		}
+	}
+
+	if(ac){
+		//pending callbacks are called with NULL reply
+		redisAsyncContext *c = ac;
+		ac = NULL;
+		redisAsyncFree(c);
+	}
+	send_queued();
+}
+
+void ResourceAsyncChecker::on_stop(){
+	uint64_t v = 1;
+	tostop = true;
+	if(write(event_fd,&v,sizeof(v)) < 0)
+		ERROR("eventfd write: %s",strerror(errno));
+}
+
+void ResourceAsyncChecker::connect(){
+	last_connect = time(NULL);
+
+	if(cfg.socket.empty())
+		ac = redisAsyncConnect(cfg.server.c_str(),cfg.port);
+	else
+		ac = redisAsyncConnectUnix(cfg.socket.c_str());
+
+	if(!ac){
+		ERROR("can't allocate redis async context");
+		return;
+	}
+	if(ac->err){
+		ERROR("redis async connect: %s",ac->errstr);
+		redisAsyncFree(ac);
+		ac = NULL;
+		return;
+	}
+
+	ac->data = this;
+	watched_events = 0;
+	fd_added = false;
+
+	ac->ev.data = this;
+	ac->ev.addRead = add_read;
+	ac->ev.delRead = del_read;
+	ac->ev.addWrite = add_write;
+	ac->ev.delWrite = del_write;
+	ac->ev.cleanup = cleanup;
+
+	redisAsyncSetDisconnectCallback(ac,on_disconnect);
+	//waits for the first write event. so must be set after adapter
+	redisAsyncSetConnectCallback(ac,on_connect);
+
+	stats_mutex.lock();
+		stats.reconnects++;
+	stats_mutex.unlock();
+}
+
+void ResourceAsyncChecker::update_events(unsigned int add, unsigned int del){
+	unsigned int events = (watched_events | add) & ~del;
+	if(fd_added && events==watched_events)
+		return;
+
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.fd = ac->c.fd;
+	if(epoll_ctl(epoll_fd,fd_added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,ac->c.fd,&ev)==-1){
+		ERROR("epoll_ctl(%d): %s",ac->c.fd,strerror(errno));
+		return;
+	}
+	fd_added = true;
+	watched_events = events;
+}
+
+/* hiredis adapter */
+
+void ResourceAsyncChecker::add_read(void *privdata){
+	((ResourceAsyncChecker *)privdata)->update_events(EPOLLIN,0);
+}
+
+void ResourceAsyncChecker::del_read(void *privdata){
+	((ResourceAsyncChecker *)privdata)->update_events(0,EPOLLIN);
+}
+
+void ResourceAsyncChecker::add_write(void *privdata){
+	((ResourceAsyncChecker *)privdata)->update_events(EPOLLOUT,0);
+}
+
+void ResourceAsyncChecker::del_write(void *privdata){
+	((ResourceAsyncChecker *)privdata)->update_events(0,EPOLLOUT);
+}
+
+void ResourceAsyncChecker::cleanup(void *privdata){
+	ResourceAsyncChecker *self = (ResourceAsyncChecker *)privdata;
+	if(self->fd_added && self->ac){
+		struct epoll_event ev;
+		epoll_ctl(self->epoll_fd,EPOLL_CTL_DEL,self->ac->c.fd,&ev);
+	}
+	self->fd_added = false;
+	self->watched_events = 0;
+}
+
+/* hiredis callbacks */
+
+void ResourceAsyncChecker::on_connect(const redisAsyncContext *c, int status){
+	ResourceAsyncChecker *self = (ResourceAsyncChecker *)c->data;
+	if(status!=REDIS_OK){
+		//context is freed by hiredis after return
+		ERROR("redis async connect failed: %s",c->errstr);
+		self->connected = false;
+		self->ac = NULL;
+		return;
+	}
+	INFO("resources async checker connected");
+	self->connected = true;
+	self->load_script();
+	self->send_rollbacks();
+}
+
+void ResourceAsyncChecker::on_disconnect(const redisAsyncContext *c, int status){
+	ResourceAsyncChecker *self = (ResourceAsyncChecker *)c->data;
+	if(status!=REDIS_OK)
+		ERROR("redis async connection lost: %s",c->errstr);
+	self->connected = false;
+	self->ac = NULL;
+}
+
+void ResourceAsyncChecker::on_script_loaded(redisAsyncContext *c, void *r, void *privdata){
+	ResourceAsyncChecker *self = (ResourceAsyncChecker *)privdata;
+	redisReply *reply = (redisReply *)r;
+	if(!reply) return;
+	if(reply->type==REDIS_REPLY_STRING){
+		self->sha = reply->str;
+		DBG("resources async get script loaded. sha: %s",self->sha.c_str());
+	} else if(reply->type==REDIS_REPLY_ERROR) {
+		ERROR("async SCRIPT LOAD reply error: %s",reply->str);
+	}
+}
+
+void ResourceAsyncChecker::on_reply(redisAsyncContext *c, void *r, void *privdata){
+	request *req = (request *)privdata;
+	ResourceAsyncChecker *self = req->checker;
+	redisReply *reply = (redisReply *)r;
+
+	//command is completed (or failed with NULL reply). resend is counted again
+	self->stats_mutex.lock();
+		self->stats.pending--;
+	self->stats_mutex.unlock();
+
+	if(!reply){
+		//connection is lost. script could be executed before it
+		self->reply(req,NULL);
+		if(self->tostop){
+			delete req;
+			return;
+		}
+		req->lost = time(NULL);
+		self->rollbacks.push_back(req);
+		self->stats_mutex.lock();
+			self->stats.lost++;
+		self->stats_mutex.unlock();
+		return;
+	}
+
+	if(reply && reply->type==REDIS_REPLY_ERROR
+		&& 0==strncmp(reply->str,"NOSCRIPT",8) && !req->eval)
+	{
+		//script cache was flushed. resend with script body and reload it
+		DBG("async EVALSHA NOSCRIPT. resend with EVAL");
+		self->sha.clear();
+		self->load_script();
+		req->eval = true;
+		self->send(req);
+		return;
+	}
+	self->reply(req,reply);
+	delete req;
+}
+
+void ResourceAsyncChecker::on_rollback(redisAsyncContext *c, void *r, void *privdata){
+	request *req = (request *)privdata;
+	ResourceAsyncChecker *self = req->checker;
+	redisReply *reply = (redisReply *)r;
+
+	if(!reply){
+		//try again after reconnect
+		if(!self->tostop){
+			self->rollbacks.push_back(req);
+			return;
+		}
+	} else if(reply->type==REDIS_REPLY_INTEGER){
+		if(reply->integer){
+			INFO("resources taken by lost async check of %s are returned",
+				 req->session_tag.c_str());
+			self->stats_mutex.lock();
+				self->stats.rolled_back++;
+			self->stats_mutex.unlock();
+		} else {
+			DBG("lost async check of %s took nothing",req->session_tag.c_str());
+		}
+	} else if(reply->type==REDIS_REPLY_ERROR){
+		ERROR("async rollback of %s reply error: %s",req->session_tag.c_str(),reply->str);
+	}
+	delete req;
+}
+
+/* requests */
+
+void ResourceAsyncChecker::load_script(){
+	if(!ac) return;
+	redisAsyncCommand(ac,on_script_loaded,this,"SCRIPT LOAD %s",cache.get_script_source());
+}
+
+void ResourceAsyncChecker::send_rollbacks(){
+	std::deque<request *> q;
+	q.swap(rollbacks);
+
+	for(std::deque<request *>::iterator it = q.begin();it!=q.end();++it){
+		request *r = *it;
+		if(time(NULL)-r->lost >= MARKER_TTL){
+			ERROR("can't return resources taken by lost async check of %s. marker is expired",
+				  r->session_tag.c_str());
+			stats_mutex.lock();
+				stats.rollback_expired++;
+			stats_mutex.unlock();
+			delete r;
+			continue;
+		}
+
+		vector<string> args;
+		args.push_back("EVAL");
+		args.push_back(rollback_script_code);
+		script_args(r,args);
+
+		vector<const char *> argv(args.size());
+		vector<size_t> argvlen(args.size());
+		for(unsigned int i = 0;i<args.size();i++){
+			argv[i] = args[i].c_str();
+			argvlen[i] = args[i].size();
+		}
+		if(!ac || REDIS_OK!=redisAsyncCommandArgv(ac,on_rollback,r,argv.size(),argv.data(),argvlen.data()))
+			rollbacks.push_back(r);
+	}
+}
+
+void ResourceAsyncChecker::post(const string &session_tag, const ResourceList &rl){
+	uint64_t v = 1;
+
+	queue_mutex.lock();
+		queue.push_back(new request(session_tag,rl,marker_prefix+long2str(marker_seq++),this));
+	queue_mutex.unlock();
+
+	stats_mutex.lock();
+		stats.requests++;
+	stats_mutex.unlock();
+
+	if(write(event_fd,&v,sizeof(v)) < 0)
+		ERROR("eventfd write: %s",strerror(errno));
+}
+
+void ResourceAsyncChecker::send_queued(){
+	std::deque<request *> q;
+
+	queue_mutex.lock();
+		q.swap(queue);
+	queue_mutex.unlock();
+
+	for(std::deque<request *>::iterator it = q.begin();it!=q.end();++it){
+		if(tostop || !ac){
+			reply(*it,NULL);
+			delete *it;
+			continue;
+		}
+		send(*it);
+	}
+}
+
+void ResourceAsyncChecker::send(request *r){
+	vector<string> args;
+
+	if(r->eval || sha.empty()){
+		args.push_back("EVAL");
+		args.push_back(cache.get_script_source());
+	} else {
+		args.push_back("EVALSHA");
+		args.push_back(sha);
+	}
+	script_args(r,args);
+
+	vector<const char *> argv(args.size());
+	vector<size_t> argvlen(args.size());
+	for(unsigned int i = 0;i<args.size();i++){
+		argv[i] = args[i].c_str();
+		argvlen[i] = args[i].size();
+	}
+
+	if(REDIS_OK!=redisAsyncCommandArgv(ac,on_reply,r,argv.size(),argv.data(),argvlen.data())){
+		reply(r,NULL);
+		delete r;
+		return;
+	}
+
+	stats_mutex.lock();
+		stats.pending++;
+	stats_mutex.unlock();
+}
+
+void ResourceAsyncChecker::script_args(request *r, vector<string> &args){
+	cache.get_script_args(r->rl,args);
+	args.push_back(r->marker);
+	args.push_back(int2str(MARKER_TTL));
+}
+
+void ResourceAsyncChecker::reply(request *r, redisReply *reply){
+	ResourceResponse result = RES_ERR;
+	ResourceList::iterator failed = r->rl.begin();
+
+	if(reply){
+		result = cache.get_script_result(reply,r->rl,failed);
+	} else {
+		ERROR("no reply for async resources check of %s",r->session_tag.c_str());
+	}
+
+	stats_mutex.lock();
+		if(reply) stats.replies++;
+		if(result==RES_ERR) stats.errors++;
+	stats_mutex.unlock();
+
+	//event releases taken resources if session is gone
+	ResourceCheckReplyEvent *ev = new ResourceCheckReplyEvent(
+		result,r->rl,std::distance(r->rl.begin(),failed),&cache);
+	if(!AmSessionContainer::instance()->postEvent(r->session_tag,ev))
+		DBG("session %s is gone",r->session_tag.c_str());
+}
+
+void ResourceAsyncChecker::getStats(AmArg &ret){
+	ret["connected"] = connected;
+	AmLock l(stats_mutex);
+	ret["requests"] = (long)stats.requests;
+	ret["replies"] = (long)stats.replies;
+	ret["errors"] = (long)stats.errors;
+	ret["reconnects"] = (long)stats.reconnects;
+	ret["pending"] = (long)stats.pending;
+	ret["lost"] = (long)stats.lost;
+	ret["rolled_back"] = (long)stats.rolled_back;
+	ret["rollback_expired"] = (long)stats.rollback_expired;
+}
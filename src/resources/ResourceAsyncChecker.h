@@ -0,0 +1,128 @@
+#ifndef RESOURCEASYNCCHECKER_H
+#define RESOURCEASYNCCHECKER_H
+
+#include "AmConfigReader.h"
+#include "AmThread.h"
+#include "AmEvent.h"
+#include "AmArg.h"
+#include "hiredis/hiredis.h"
+#include "hiredis/async.h"
+
+#include "Resource.h"
+#include "RedisConnPool.h"
+
+#include <time.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class ResourceCache;
+
+/* result of the async resources check posted to the call leg.
+ * resources contains taken/active flags to apply to the checked list.
+ * taken resources are released on destruction if the result was not consumed
+ * (session is gone, event is dropped or ignored) */
+#define ResourceCheckReplyEvent_ID -565
+struct ResourceCheckReplyEvent : public AmEvent {
+	int result;					//ResourceResponse
+	ResourceList resources;
+	int failed_resource;		//position of the overloaded resource
+	ResourceCache *cache;
+	mutable bool consumed;		//resources are owned by the call or released
+	ResourceCheckReplyEvent(int result, const ResourceList &rl, int failed_resource,
+							ResourceCache *cache):
+		AmEvent(ResourceCheckReplyEvent_ID),
+		result(result), resources(rl), failed_resource(failed_resource),
+		cache(cache), consumed(false) {}
+	~ResourceCheckReplyEvent();
+};
+
+/* event loop thread with hiredis async context to the write redis.
+ * runs atomic check-and-take script (same as resources_atomic_get)
+ * and posts ResourceCheckReplyEvent to the session,
+ * so session threads never wait for redis replies or free connections.
+ *
+ * script saves taken resources into the per-request marker key.
+ * if connection is lost after the script was sent, session gets RES_ERR
+ * and resources taken by the script (if it was executed)
+ * are returned by the rollback script after reconnect */
+
+class ResourceAsyncChecker
+	: public AmThread
+{
+	struct request {
+		string session_tag;
+		ResourceList rl;
+		string marker;		//key with indexes of taken resources
+		bool eval;			//send script body (NOSCRIPT received)
+		time_t lost;		//reply is lost. rollback is tried until marker expires
+		ResourceAsyncChecker *checker;
+		request(const string &tag, const ResourceList &l, const string &marker,
+				ResourceAsyncChecker *c):
+			session_tag(tag), rl(l), marker(marker), eval(false), lost(0), checker(c) {}
+	};
+
+	ResourceCache &cache;
+	RedisCfg cfg;
+
+	int epoll_fd, event_fd;
+	redisAsyncContext *ac;
+	bool connected;
+	unsigned int watched_events;	//epoll events for ac fd
+	bool fd_added;
+	string sha;
+	bool tostop;
+	time_t last_connect;
+
+	std::deque<request *> queue;
+	AmMutex queue_mutex;
+	string marker_prefix;
+	unsigned long marker_seq;
+
+	//requests with lost replies. used by event loop thread only
+	std::deque<request *> rollbacks;
+
+	struct {
+		unsigned long requests, replies, errors, reconnects, pending;
+		unsigned long lost, rolled_back, rollback_expired;
+	} stats;
+	AmMutex stats_mutex;
+
+	void connect();
+	void update_events(unsigned int add, unsigned int del);
+	void send_queued();
+	void send(request *r);
+	void script_args(request *r, vector<string> &args);
+	void reply(request *r, redisReply *reply);
+	void load_script();
+	void send_rollbacks();
+
+	/* hiredis adapter and callbacks */
+	static void add_read(void *privdata);
+	static void del_read(void *privdata);
+	static void add_write(void *privdata);
+	static void del_write(void *privdata);
+	static void cleanup(void *privdata);
+	static void on_connect(const redisAsyncContext *c, int status);
+	static void on_disconnect(const redisAsyncContext *c, int status);
+	static void on_reply(redisAsyncContext *c, void *r, void *privdata);
+	static void on_script_loaded(redisAsyncContext *c, void *r, void *privdata);
+	static void on_rollback(redisAsyncContext *c, void *r, void *privdata);
+
+  public:
+	ResourceAsyncChecker(ResourceCache &cache);
+	~ResourceAsyncChecker();
+
+	int configure(const AmConfigReader &cfg);
+	void run();
+	void on_stop();
+
+	/* queue check. result is posted to the session with session_tag */
+	void post(const string &session_tag, const ResourceList &rl);
+
+	void getStats(AmArg &ret);
+};
+
+#endif // RESOURCEASYNCCHECKER_H
@@ -2,6 +2,9 @@
 #include "log.h"
 #include "AmUtils.h"
 #include <sstream>
+#include <string.h>
+
+#include "../hash/hashfn.h"
 
 #include "../yeti.h"
 
@@ -11,6 +14,12 @@
 #define CHECK_STATE_FAILOVER 1
 #define CHECK_STATE_SKIP 2
 
+#define RESOURCES_WRITE_WINDOW_MAX 1000 //msec
+
+//resources keys are "type:id"
+#define RESOURCES_KEYS_PATTERN "[0-9]*:[0-9]*"
+#define RESOURCES_INIT_CHUNK_DEFAULT 1000
+
 struct GetReplyException {
 	string what;
 	int status;
@@ -65,205 +74,398 @@ static long int Reply2Int(redisReply *r){
 	return ret;
 }
 
+/* atomic check-and-take.
+ * KEYS: resources keys in the list order
+ * ARGV: node_id, then limit, takes (0 for already taken), failover_to_next for each key
+ * returns {1, indexes of the resources to take...} on success
+ * or {0, index of the overloaded resource} if resources are busy.
+ * optional ARGV after the resources: marker key and its ttl.
+ * indexes of the taken resources are saved into the marker on success
+ * (see ResourceAsyncChecker rollback).
+ * checking is the same as in the get() availability check cycle */
+static const char *get_script_code =
+	"local node = ARGV[1]\n"
+	"local state = 0\n" //0 - normal, 1 - failover, 2 - skip
+	"local active = {}\n"
+	"for i = 1, #KEYS do\n"
+	"  local limit = tonumber(ARGV[i*3-1])\n"
+	"  local failover = ARGV[i*3+1] == '1'\n"
+	"  if state == 2 then\n"
+	"    if not failover then state = 0 end\n"
+	"  else\n"
+	"    local now = 0\n"
+	"    for _, v in ipairs(redis.call('HVALS', KEYS[i])) do now = now + tonumber(v) end\n"
+	"    if now >= limit then\n"
+	"      if not failover then return {0, i} end\n"
+	"      state = 1\n"
+	"    else\n"
+	"      active[#active+1] = i\n"
+	"      if failover then state = 2 else state = 0 end\n"
+	"    end\n"
+	"  end\n"
+	"end\n"
+	"local ret = {1}\n"
+	"for _, i in ipairs(active) do\n"
+	"  local takes = tonumber(ARGV[i*3])\n"
+	"  if takes > 0 then redis.call('HINCRBY', KEYS[i], node, takes) end\n"
+	"  ret[#ret+1] = i\n"
+	"end\n"
+	"local marker = ARGV[#KEYS*3+2]\n"
+	"if marker then redis.call('SET', marker, table.concat(ret, ',', 2), 'EX', ARGV[#KEYS*3+3]) end\n"
+	"return ret\n";
+
+/* lease reservation.
+ * KEYS: resource key
+ * ARGV: node_id, limit, want, need
+ * reserves up to want (but not less than need) within the limit.
+ * returns reserved amount */
+static const char *lease_reserve_script_code =
+	"local used = 0\n"
+	"for _, v in ipairs(redis.call('HVALS', KEYS[1])) do used = used + tonumber(v) end\n"
+	"local avail = tonumber(ARGV[2]) - used\n"
+	"if avail < tonumber(ARGV[4]) then return 0 end\n"
+	"local n = math.min(tonumber(ARGV[3]), avail)\n"
+	"redis.call('HINCRBY', KEYS[1], ARGV[1], n)\n"
+	"return n\n";
+
+/* lease return.
+ * KEYS: resource key
+ * ARGV: node_id, amount
+ * node counter could be reset by resources initialization. never go below zero */
+static const char *lease_return_script_code =
+	"local v = redis.call('HINCRBY', KEYS[1], ARGV[1], -tonumber(ARGV[2]))\n"
+	"if v < 0 then redis.call('HSET', KEYS[1], ARGV[1], 0) v = 0 end\n"
+	"return v\n";
+
 ResourceCache::ResourceCache():
+	writers_count(1),
+	reconnect_cb(NULL),
+	reconnect_cb_arg(NULL),
+	write_window(0),
+	init_chunk(RESOURCES_INIT_CHUNK_DEFAULT),
+	atomic_get(false),
+	get_script("get",get_script_code),
+	use_leases(false),
+	lease_reserve_script("lease_reserve",lease_reserve_script_code),
+	lease_return_script("lease_return",lease_return_script_code),
+	async_get(false),
+	async_checker(*this),
 	tostop(false),
 	data_ready(true)
 {
 }
 
+ResourceCache::~ResourceCache(){
+	for(vector<ResourceShard *>::iterator it = shards.begin();it!=shards.end();++it)
+		delete *it;
+}
+
 int ResourceCache::configure(const AmConfigReader &cfg){
-	int ret = write_pool.configure(cfg,"write",false) ||
-			  read_pool.configure(cfg,"read",true);
-	//!TODO: remove this dirty hack with proper write_pool class replace
+	int ret = 0;
+
+	unsigned int shards_count = cfg.getParameterInt("resources_shards",1);
+	if(shards_count < 1){
+		ERROR("invalid resources_shards value: %u",shards_count);
+		return -1;
+	}
+	for(unsigned int i = 0;i<shards_count && !ret;i++){
+		ResourceShard *shard = new ResourceShard(i);
+		shards.push_back(shard);
+		ret = shard->configure(cfg);
+		if(ret) break;
+		shard->write_pool.registerReconnectCallback(reconnect_cb,reconnect_cb_arg);
+		ring.add(shard->name,i);
+		INFO("resources shard %u: %s",i,shard->name.c_str());
+	}
+
+	writers_count = cfg.getParameterInt("resources_writers",1);
+	if(!ret && writers_count < 1){
+		ERROR("invalid resources_writers value: %u",writers_count);
+		ret = -1;
+	}
+	init_chunk = cfg.getParameterInt("resources_init_chunk",RESOURCES_INIT_CHUNK_DEFAULT);
+	if(!ret && init_chunk < 1){
+		ERROR("invalid resources_init_chunk value: %u",init_chunk);
+		ret = -1;
+	}
+	write_window = cfg.getParameterInt("resources_write_window",0);
+	if(!ret && write_window > RESOURCES_WRITE_WINDOW_MAX){
+		ERROR("resources_write_window %u exceeds max value %d msec",
+			write_window,RESOURCES_WRITE_WINDOW_MAX);
+		ret = -1;
+	}
 	if(!ret){
-		write_pool.setPoolSize(1); //set pool size to 1 for write_pool anyway
+		//one connection for each writer
+		for(vector<ResourceShard *>::iterator it = shards.begin();it!=shards.end();++it){
+			ResourceShard &shard = **it;
+			shard.write_pool.setPoolSize(writers_count);
+			for(unsigned int i = 0;i<writers_count;i++){
+				shard.writers.push_back(new ResourceWriter(*this,shard.write_pool,
+					shard.idx*writers_count+i,write_window));
+			}
+		}
+	}
+
+	atomic_get = cfg.getParameterInt("resources_atomic_get",0)==1;
+	use_leases = cfg.getParameterInt("resources_lease",0)==1;
+	if(!ret && use_leases){
+		ret = leases.configure(cfg);
+	}
+	async_get = cfg.getParameterInt("resources_async_get",0)==1;
+	if(async_get && use_leases){
+		WARN("resources_async_get is not applicable with resources_lease. disable it");
+		async_get = false;
+	}
+	if(!ret && shards_count > 1 && (atomic_get || use_leases || async_get)){
+		//scripts need all keys of the resources list on the same redis
+		ERROR("resources_atomic_get, resources_lease and resources_async_get "
+			  "are not supported with multiple resources shards");
+		ret = -1;
+	}
+	if(!ret && (atomic_get || use_leases)){
+		ret = script_pool.configure(cfg,"write",false);
+	}
+	if(!ret && async_get){
+		ret = async_checker.configure(cfg);
 	}
 	return ret;
 }
 
-void ResourceCache::run(){
-	ResourceList put,get;
-	ResourceList filtered_put;
-	redisReply *reply;
-	list <int> desired_response;
-	redisContext *write_ctx;
+/* ResourceWriter */
 
-	setThreadName("yeti-res-wr");
+ResourceWriter::ResourceWriter(ResourceCache &cache, RedisConnPool &pool, int idx, unsigned int window):
+	cache(cache),
+	pool(pool),
+	idx(idx),
+	window(window),
+	data_ready(false),
+	tostop(false)
+{
+	memset(&stats,0,sizeof(stats));
+}
 
-	Yeti::global_config &gc = Yeti::instance().config;
+void ResourceWriter::put(const Resource &r){
+	AmLock l(queue_mutex);
+	put_queue.push_back(r);
+}
 
-	read_pool.start();
-	write_pool.start();
+void ResourceWriter::get(const Resource &r){
+	AmLock l(queue_mutex);
+	get_queue.push_back(r);
+}
 
-	if(!init_resources(true)){
-		DBG("can't init resources. stop thread");
-		return;
+void ResourceWriter::notify(){
+	data_ready.set(true);
+}
+
+void ResourceWriter::clear(){
+	AmLock l(queue_mutex);
+	put_queue.clear();
+	get_queue.clear();
+}
+
+void ResourceWriter::coalesce(const ResourceList &rl, bool take, Deltas &deltas){
+	for(ResourceList::const_iterator rit = rl.begin();rit!=rl.end();++rit){
+		const Resource &r = *rit;
+		deltas[cache.get_key(r)] += take ? r.takes : -r.takes;
 	}
+}
 
-	while(!tostop){
-        //INFO("ResrouceCache::run() before data_ready");
-		data_ready.wait_for();
+void ResourceWriter::write(redisContext *ctx, const Deltas &deltas, unsigned long commands){
+	redisReply *reply = NULL;
+	list <int> desired_response;
+	int node_id = Yeti::instance().config.node_id;
 
-        //INFO("ResrouceCache::run() before getConnection");
+	redisAppendCommand(ctx,"MULTI");
+	desired_response.push_back(REDIS_REPLY_STATUS);
+	for(Deltas::const_iterator it = deltas.begin();it!=deltas.end();++it){
+		if(!it->second) continue;
+		redisAppendCommand(ctx,"HINCRBY %b %d %ld",
+			it->first.c_str(),it->first.size(),
+			node_id,
+			it->second);
+		desired_response.push_back(REDIS_REPLY_STATUS);
+	}
+	redisAppendCommand(ctx,"EXEC");
+	desired_response.push_back(REDIS_REPLY_ARRAY);
 
-		write_ctx = write_pool.getConnection();
-		while(write_ctx==NULL){
-			DBG("get connection can't get connection from write redis pool. retry every 5s");
-			sleep(5);
-			if(tostop)
-				return;
-			write_ctx = write_pool.getConnection();
+	try {
+		while(!desired_response.empty()){
+			int desired = desired_response.front();
+			desired_response.pop_front();
+			int state = redisGetReply(ctx,(void **)&reply);
+			if(state!=REDIS_OK)
+				throw GetReplyException("HINCRBY redisGetReply() != REDIS_OK",state);
+			if(reply==NULL)
+				throw GetReplyException("HINCRBY reply == NULL",state);
+			if(reply->type != desired){
+				if(reply->type==REDIS_REPLY_ERROR){
+					DBG("HINCRBY redis reply_error: %s",reply->str);
+				}
+				DBG("HINCRBY desired_reply: %d, reply: %d",desired,reply->type);
+				throw ReplyTypeException("HINCRBY type not desired",reply->type);
+			}
+			if(reply->type==REDIS_REPLY_ARRAY){ /* process EXEC here */
+				size_t n = reply->elements;
+				if(n != commands){
+					DBG("HINCRBY reply->elements = %ld, desired size = %ld",
+						n,commands);
+					throw ReplyDataException("HINCRBY mismatch responses array size");
+				}
+				Deltas::const_iterator it = deltas.begin();
+				for(unsigned int i = 0;i<n;i++,++it){
+					while(!it->second) ++it;
+					redisReply *r = reply->element[i];
+					if(r->type!=REDIS_REPLY_INTEGER){
+						if(r->type==REDIS_REPLY_ERROR)
+							DBG("HINCRBY redis reply_error: %s",r->str);
+						throw ReplyDataException("HINCRBY integer expected");
+					}
+					DBG("update_resource %s %d %+ld = %lld",
+						it->first.c_str(),node_id,it->second,r->integer);
+				}
+			}
+			freeReplyObject(reply);
+			reply = NULL;
 		}
+	} catch(...) {
+		if(reply) freeReplyObject(reply);
+		throw;
+	}
+}
 
-        //INFO("ResrouceCache::run() got Connection");
+void ResourceWriter::run(){
+	ResourceList put,get;
+	Deltas deltas;
+	redisContext *write_ctx;
 
-		queues_mutex.lock();
-			put.swap(put_resources_queue);
-			get.swap(get_resources_queue);
-		queues_mutex.unlock();
+	setThreadName("yeti-res-wr");
 
-        //INFO("ResrouceCache::run() got queues");
+	while(!tostop){
+		data_ready.wait_for();
+		if(tostop)
+			break;
 
-		for(ResourceList::const_iterator rit = put.begin();rit!=put.end();++rit)
-			if((*rit).taken)
-				filtered_put.push_back(*rit);
+		//collect more events to coalesce
+		if(window)
+			usleep(window*1000);
 
-		if(!filtered_put.size()&&!get.size()){
+		queue_mutex.lock();
+			put.swap(put_queue);
+			get.swap(get_queue);
 			data_ready.set(false);
-			write_pool.putConnection(write_ctx,RedisConnPool::CONN_STATE_OK);
+		queue_mutex.unlock();
+
+		if(!put.size()&&!get.size())
 			continue;
-		}
 
-		try {
-			if(get.size()){ //we have resources to grab
-				desired_response.clear();
-				redisAppendCommand(write_ctx,"MULTI");
-				desired_response.push_back(REDIS_REPLY_STATUS);
-				for(ResourceList::iterator rit = get.begin();rit!=get.end();++rit){
-					Resource &r = (*rit);
-					string key = get_key(r);
-					redisAppendCommand(write_ctx,"HINCRBY %b %d %d",
-						key.c_str(),key.size(),
-						gc.node_id,
-						r.takes);
-					desired_response.push_back(REDIS_REPLY_STATUS);
-				}
-				redisAppendCommand(write_ctx,"EXEC");
-				desired_response.push_back(REDIS_REPLY_ARRAY);
-
-				while(!desired_response.empty()){
-					int desired = desired_response.front();
-					desired_response.pop_front();
-					int state = redisGetReply(write_ctx,(void **)&reply);
-					if(state!=REDIS_OK)
-						throw GetReplyException("HINCRBY redisGetReply() != REDIS_OK",state);
-					if(reply==NULL)
-						throw GetReplyException("HINCRBY reply == NULL",state);
-					if(reply->type != desired){
-						if(reply->type==REDIS_REPLY_ERROR){
-							DBG("HINCRBY redis reply_error: %s",reply->str);
-						}
-						DBG("HINCRBY desired_reply: %d, reply: %d",desired,reply->type);
-						throw ReplyTypeException("HINCRBY type not desired",reply->type);
-					}
-					if(reply->type==REDIS_REPLY_ARRAY){
-						size_t n = reply->elements;
-						if(n != get.size()){
-							DBG("HINCRBY reply->elements = %ld, desired size = %ld",
-								n,get.size());
-							throw ReplyDataException("HINCRBY mismatch responses array size");
-						}
-
-						ResourceList::iterator it = get.begin();
-						for(unsigned int i = 0;i<n;i++,++it){
-							redisReply *r = reply->element[i];
-							if(r->type!=REDIS_REPLY_INTEGER){
-								if(r->type==REDIS_REPLY_ERROR)
-									DBG("HINCRBY redis reply_error: %s",r->str);
-								throw ReplyDataException("HINCRBY integer expected");
-							}
-							Resource &res = *it;
-							DBG("get_resource %d:%d %d %lld",res.type,res.id,gc.node_id,r->integer);
-						}
-					}
-					freeReplyObject(reply);
-				}
+		//net delta for each key. takes and releases of the same key cancel each other
+		coalesce(get,true,deltas);
+		coalesce(put,false,deltas);
+
+		unsigned long events = put.size()+get.size();
+		unsigned long commands = 0;
+		for(Deltas::const_iterator it = deltas.begin();it!=deltas.end();++it)
+			if(it->second) commands++;
+
+		bool failed = false;
+		if(commands){
+			write_ctx = pool.getConnection();
+			while(write_ctx==NULL){
+				DBG("writer %d can't get connection from write redis pool. retry every 5s",idx);
+				sleep(5);
+				if(tostop)
+					return;
+				write_ctx = pool.getConnection();
 			}
 
-			if(filtered_put.size()){
-
-				desired_response.clear();
-				redisAppendCommand(write_ctx,"MULTI");
-				desired_response.push_back(REDIS_REPLY_STATUS);
-
-				ResourceList::iterator rit = filtered_put.begin();
-				for(;rit!=filtered_put.end();++rit){
-					Resource &r = (*rit);
-					string key = get_key(r);
-					redisAppendCommand(write_ctx,"HINCRBY %b %d %d",
-						key.c_str(),key.size(),
-						gc.node_id,
-						-r.takes/*pass negative to increment*/);
-					desired_response.push_back(REDIS_REPLY_STATUS);
-				}
-
-				redisAppendCommand(write_ctx,"EXEC");
-				desired_response.push_back(REDIS_REPLY_ARRAY);
-
-				//process replies
-				while(!desired_response.empty()){
-					int desired = desired_response.front();
-					desired_response.pop_front();
-					int state = redisGetReply(write_ctx,(void **)&reply);
-					if(state!=REDIS_OK)
-						throw GetReplyException("HDECRBY redisGetReply() != REDIS_OK",state);
-					if(reply==NULL)
-						throw GetReplyException("HDECRBY reply == NULL",state);
-					if(reply->type != desired){
-						if(reply->type==REDIS_REPLY_ERROR){
-							DBG("redis reply_error: %s",reply->str);
-						}
-						DBG("HDECRBY desired_reply: %d, reply: %d",desired,reply->type);
-						throw ReplyTypeException("HDECRBY type not desired",reply->type);
-					}
-
-					if(reply->type==REDIS_REPLY_ARRAY){ /* process EXEC here */
-						redisReply *r;
-						if(reply->elements != filtered_put.size())
-							throw ReplyDataException("HDECRBY mismatch responses array size");
-						ResourceList::iterator it = filtered_put.begin();
-						for(unsigned int i = 0;i<reply->elements;i++,++it){
-							r = reply->element[i];
-							if(r->type!=REDIS_REPLY_INTEGER){
-								DBG("HDECRBY r->type!=REDIS_REPLY_INTEGER, r->type = %d",
-									r->type);
-								throw ReplyDataException("HDECRBY integer expected");
-							}
-							Resource &res = *it;
-							DBG("put_resource %d:%d %d %lld",res.type,res.id,gc.node_id,r->integer);
-						}
-					}
-					freeReplyObject(reply);
-				}
+			try {
+				write(write_ctx,deltas,commands);
+				pool.putConnection(write_ctx,RedisConnPool::CONN_STATE_OK);
+			} catch(GetReplyException &e){
+				ERROR("writer %d GetReplyException %s status: %d",idx,e.what.c_str(),e.status);
+				failed = true;
+			} catch(ReplyTypeException &e){
+				ERROR("writer %d ReplyTypeException %s type: %d",idx,e.what.c_str(),e.type);
+				failed = true;
+			} catch(ReplyDataException &e){
+				ERROR("writer %d ReplyDataException %s",idx,e.what.c_str());
+				failed = true;
 			}
-			write_pool.putConnection(write_ctx,RedisConnPool::CONN_STATE_OK);
-		} catch(GetReplyException &e){
-			ERROR("GetReplyException %s status: %d",e.what.c_str(),e.status);
-			//freeReplyObject(reply);
-			write_pool.putConnection(write_ctx,RedisConnPool::CONN_STATE_ERR);
-		} catch(ReplyTypeException &e){
-			ERROR("ReplyTypeException %s type: %d",e.what.c_str(),e.type);
-			freeReplyObject(reply);
-			write_pool.putConnection(write_ctx,RedisConnPool::CONN_STATE_ERR);
-		} catch(ReplyDataException &e){
-			ERROR("ReplyDataException %s",e.what.c_str());
-			freeReplyObject(reply);
-			write_pool.putConnection(write_ctx,RedisConnPool::CONN_STATE_ERR);
+			if(failed)
+				pool.putConnection(write_ctx,RedisConnPool::CONN_STATE_ERR);
 		}
+
+		stats_mutex.lock();
+			stats.batches++;
+			stats.resources += events;
+			stats.commands += commands;
+			stats.zero_deltas += deltas.size()-commands;
+			stats.last_batch = events;
+			if(events > stats.max_batch) stats.max_batch = events;
+			if(failed) stats.errors++;
+		stats_mutex.unlock();
+
 		get.clear();
 		put.clear();
-		filtered_put.clear();
-		data_ready.set(false);
+		deltas.clear();
+	}
+}
+
+void ResourceWriter::on_stop(){
+	tostop = true;
+	data_ready.set(true);
+}
+
+void ResourceWriter::getStats(AmArg &ret){
+	queue_mutex.lock();
+		ret["queue_depth"] = (long)(put_queue.size()+get_queue.size());
+	queue_mutex.unlock();
+
+	AmLock l(stats_mutex);
+	ret["batches"] = (long)stats.batches;
+	ret["resources"] = (long)stats.resources;
+	ret["commands"] = (long)stats.commands;
+	ret["zero_deltas"] = (long)stats.zero_deltas;
+	ret["errors"] = (long)stats.errors;
+	ret["last_batch"] = (long)stats.last_batch;
+	ret["max_batch"] = (long)stats.max_batch;
+	ret["avg_batch"] = stats.batches ? (double)stats.resources/stats.batches : 0.0;
+}
+
+/* ResourceCache */
+
+void ResourceCache::run(){
+	setThreadName("yeti-res-wr");
+
+	for(vector<ResourceShard *>::iterator it = shards.begin();it!=shards.end();++it){
+		(*it)->read_pool.start();
+		(*it)->write_pool.start();
+	}
+	if(atomic_get || use_leases)
+		script_pool.start();
+	if(async_get)
+		async_checker.start();
+
+	if(!init_resources(true)){
+		DBG("can't init resources. stop thread");
+		return;
+	}
+
+	for(vector<ResourceShard *>::iterator sit = shards.begin();sit!=shards.end();++sit){
+		vector<ResourceWriter *> &writers = (*sit)->writers;
+		for(vector<ResourceWriter *>::iterator it = writers.begin();it!=writers.end();++it)
+			(*it)->start();
+	}
+
+	while(!tostop){
+		if(use_leases){
+			data_ready.wait_for_to(leases.get_interval());
+			leases_maintenance();
+		} else {
+			data_ready.wait_for();
+			data_ready.set(false);
+		}
 	}
 }
 
@@ -271,133 +473,555 @@ void ResourceCache::on_stop(){
 	tostop = true;
 	data_ready.set(true);
 
-	write_pool.stop();
-	read_pool.stop();
+	for(vector<ResourceShard *>::iterator sit = shards.begin();sit!=shards.end();++sit){
+		ResourceShard &shard = **sit;
+		for(vector<ResourceWriter *>::iterator it = shard.writers.begin();it!=shard.writers.end();++it)
+			(*it)->stop();
+		shard.write_pool.stop();
+		shard.read_pool.stop();
+	}
+	if(atomic_get || use_leases)
+		script_pool.stop();
+	if(async_get)
+		async_checker.stop();
 }
 
 void ResourceCache::registerReconnectCallback(RedisConnPool::cb_func *func,void *arg){
-	write_pool.registerReconnectCallback(func,arg);
+	//applied to the shards write pools on configure
+	reconnect_cb = func;
+	reconnect_cb_arg = arg;
+	for(vector<ResourceShard *>::iterator it = shards.begin();it!=shards.end();++it)
+		(*it)->write_pool.registerReconnectCallback(func,arg);
 }
 
 void ResourceCache::registerResourcesInitializedCallback(cb_func *func){
 	resources_initialized_cb = func;
 }
 
-string ResourceCache::get_key(Resource &r){
+string ResourceCache::get_key(const Resource &r){
 	ostringstream ss;
 	ss << r.type << ":" << r.id;
 	return ss.str();
 }
 
-bool ResourceCache::init_resources(bool initial){
+long ResourceCache::init_chunk_replies(redisContext *ctx, unsigned int pending){
+	redisReply *reply;
+	long removed = 0;
+
+	for(unsigned int i = 0;i<pending;i++){
+		int state = redisGetReply(ctx,(void **)&reply);
+		if(state!=REDIS_OK)
+			throw GetReplyException("HDEL redisGetReply() != REDIS_OK",state);
+		if(reply==NULL)
+			throw GetReplyException("HDEL reply == NULL",state);
+		if(reply->type==REDIS_REPLY_INTEGER){
+			removed += reply->integer;
+		} else if(reply->type==REDIS_REPLY_ERROR){
+			//e.g. WRONGTYPE for foreign key matched by pattern
+			WARN("HDEL reply error: %s",reply->str);
+		} else {
+			int type = reply->type;
+			freeReplyObject(reply);
+			throw ReplyTypeException("HDEL type not desired",type);
+		}
+		freeReplyObject(reply);
+	}
+	return removed;
+}
+
+bool ResourceCache::init_shard(ResourceShard &shard, bool initial,
+							   unsigned long &iterations, unsigned long &keys, unsigned long &fields)
+{
+	RedisConnPool &write_pool = shard.write_pool;
 	redisContext *write_ctx = NULL;
 	redisReply *reply = NULL;
-	list <int> desired_response;
 	int node_id = Yeti::instance().config.node_id;
+	string cursor = "0";
 
-	try {
+	write_ctx = write_pool.getConnection();
+	while(write_ctx==NULL){
+		if(!initial) {
+			ERROR("get connection can't get connection from write redis pool of shard %u",shard.idx);
+			return false;
+		}
+		ERROR("get connection can't get connection from write redis pool of shard %u. retry every 1s",
+			shard.idx);
+		sleep(1);
+		if(tostop) {
+			return false;
+		}
 		write_ctx = write_pool.getConnection();
-		while(write_ctx==NULL){
-			if(!initial) {
-				ERROR("get connection can't get connection from write redis pool");
-				return false;
+	}
+
+	try {
+		/* iterate over resources keys with SCAN and remove our node counters.
+		 * each SCAN batch is pipelined by chunks of init_chunk commands */
+		do {
+			reply = (redisReply *)redisCommand(write_ctx,"SCAN %s MATCH %s COUNT %u",
+				cursor.c_str(),RESOURCES_KEYS_PATTERN,init_chunk);
+			if(reply==NULL)
+				throw GetReplyException("SCAN reply == NULL",write_ctx->err);
+			if(reply->type != REDIS_REPLY_ARRAY){
+				if(reply->type==REDIS_REPLY_ERROR)
+					throw ReplyDataException(reply->str);
+				throw ReplyTypeException("SCAN type not desired",reply->type);
 			}
-			ERROR("get connection can't get connection from write redis pool. retry every 1s");
-			sleep(1);
-			if(tostop) {
-				return false;
+			if(reply->elements!=2
+				|| reply->element[0]->type!=REDIS_REPLY_STRING
+				|| reply->element[1]->type!=REDIS_REPLY_ARRAY)
+			{
+				throw ReplyDataException("SCAN unexpected reply format");
 			}
-			write_ctx = write_pool.getConnection();
-		}
+			cursor = reply->element[0]->str;
+
+			redisReply *k = reply->element[1];
+			unsigned int pending = 0;
+			for(unsigned int i = 0;i<k->elements;i++){
+				redisReply *r = k->element[i];
+				redisAppendCommand(write_ctx,"HDEL %b %d",r->str,r->len,node_id);
+				if(++pending==init_chunk){
+					fields += init_chunk_replies(write_ctx,pending);
+					pending = 0;
+				}
+			}
+			if(pending)
+				fields += init_chunk_replies(write_ctx,pending);
 
-		queues_mutex.lock();
+			keys += k->elements;
+			iterations++;
+			freeReplyObject(reply);
+			reply = NULL;
 
-		put_resources_queue.clear();
-		get_resources_queue.clear();
+			init_mutex.lock();
+				init_stats.iterations = iterations;
+				init_stats.keys = keys;
+				init_stats.fields = fields;
+			init_mutex.unlock();
+			DBG("resources initialization progress: shard %u, %lu iterations, %lu keys, %lu counters removed",
+				shard.idx,iterations,keys,fields);
+		} while(cursor!="0" && !tostop);
 
+		write_pool.putConnection(write_ctx,RedisConnPool::CONN_STATE_OK);
 
-		redisAppendCommand(write_ctx,"KEYS *");
+		if(cursor!="0"){
+			INFO("resources initialization interrupted");
+			return false;
+		}
+		return true;
+	} catch(GetReplyException &e){
+		ERROR("GetReplyException: %s, status: %d",e.what.c_str(),e.status);
+	} catch(ReplyDataException &e){
+		ERROR("ReplyDataException: %s",e.what.c_str());
+	} catch(ReplyTypeException &e){
+		ERROR("ReplyTypeException %s type: %d",e.what.c_str(),e.type);
+	}
+	if(reply)
+		freeReplyObject(reply);
 
-		int state = redisGetReply(write_ctx,(void **)&reply);
-		if(state!=REDIS_OK)
-			throw GetReplyException("KEYS redisGetReply() != REDIS_OK",state);
+	write_pool.putConnection(write_ctx,RedisConnPool::CONN_STATE_ERR);
+	return false;
+}
 
-		if(reply->type != REDIS_REPLY_ARRAY){
-			if(reply->type==REDIS_REPLY_ERROR)
-				throw ReplyDataException(reply->str);
-			if(reply->type==REDIS_REPLY_NIL){
-				INFO("empty database. skip resources initialization");
-				write_pool.putConnection(write_ctx,RedisConnPool::CONN_STATE_OK);
-				queues_mutex.unlock();
-				return true;
-			}
+bool ResourceCache::init_resources(bool initial){
+	unsigned long iterations = 0, keys = 0, fields = 0;
+	struct timeval start, end, d;
+	bool ret = true;
+
+	for(vector<ResourceShard *>::iterator sit = shards.begin();sit!=shards.end();++sit){
+		vector<ResourceWriter *> &writers = (*sit)->writers;
+		for(vector<ResourceWriter *>::iterator it = writers.begin();it!=writers.end();++it)
+			(*it)->clear();
+	}
+	//node counters will be zeroed. drop reservations
+	if(use_leases)
+		leases.reset();
+
+	gettimeofday(&start,NULL);
+	init_mutex.lock();
+		init_stats.in_progress = true;
+		init_stats.started = start;
+		init_stats.keys = init_stats.fields = init_stats.iterations = 0;
+	init_mutex.unlock();
+
+	for(vector<ResourceShard *>::iterator it = shards.begin();it!=shards.end();++it){
+		if(!init_shard(**it,initial,iterations,keys,fields)){
+			ret = false;
+			break;
 		}
+	}
 
-		//iterate over keys and set their values to zero
-		redisAppendCommand(write_ctx,"MULTI");
-		desired_response.push_back(REDIS_REPLY_STATUS);
-		for(unsigned int i = 0;i<reply->elements;i++){
-			redisReply *r = reply->element[i];
-			redisAppendCommand(write_ctx,"HSET %s %d %d",r->str,node_id,0);
-			desired_response.push_back(REDIS_REPLY_STATUS);
-		}
-		redisAppendCommand(write_ctx,"EXEC");
-		desired_response.push_back(REDIS_REPLY_ARRAY);
+	gettimeofday(&end,NULL);
+	timersub(&end,&start,&d);
+
+	init_mutex.lock();
+		init_stats.in_progress = false;
+		init_stats.last_duration = d;
+		init_stats.last_result = ret;
+		init_stats.runs++;
+		if(!ret) init_stats.failures++;
+	init_mutex.unlock();
+
+	if(!ret)
+		return false;
+
+	INFO("resources initialized. %lu shards, %lu keys, %lu counters removed, %lu iterations in %.3f seconds",
+		shards.size(),keys,fields,iterations,timeval2double(d));
+
+	if(resources_initialized_cb)
+		resources_initialized_cb();
+
+	return true;
+}
 
+void ResourceCache::getInitStats(AmArg &ret){
+	AmLock l(init_mutex);
+	ret["in_progress"] = init_stats.in_progress;
+	ret["runs"] = (long)init_stats.runs;
+	ret["failures"] = (long)init_stats.failures;
+	ret["last_succeeded"] = init_stats.last_result;
+	ret["last_duration"] = timeval2double(init_stats.last_duration);
+	ret["iterations"] = (long)init_stats.iterations;
+	ret["keys"] = (long)init_stats.keys;
+	ret["counters_removed"] = (long)init_stats.fields;
+}
+
+ResourceShard *ResourceCache::get_shard(const string &key){
+	return shards[ring.get(key)];
+}
+
+ResourceWriter *ResourceCache::get_writer(const string &key){
+	vector<ResourceWriter *> &writers = get_shard(key)->writers;
+	return writers[murmur_hash64(key.data(),key.size()) % writers.size()];
+}
+
+void ResourceCache::pending_get(Resource &r){
+	get_writer(get_key(r))->get(r);
+}
+
+void ResourceCache::pending_get_finish(){
+	for(vector<ResourceShard *>::iterator sit = shards.begin();sit!=shards.end();++sit){
+		vector<ResourceWriter *> &writers = (*sit)->writers;
+		for(vector<ResourceWriter *>::iterator it = writers.begin();it!=writers.end();++it)
+			(*it)->notify();
+	}
+}
+
+bool ResourceCache::load_script(redisContext *ctx, redis_script &s, string &sha){
+	redisReply *reply = (redisReply *)redisCommand(ctx,"SCRIPT LOAD %s",s.code);
+	if(reply==NULL){
+		ERROR("SCRIPT LOAD %s no reply",s.name);
+		return false;
+	}
+	if(reply->type!=REDIS_REPLY_STRING){
+		if(reply->type==REDIS_REPLY_ERROR)
+			ERROR("SCRIPT LOAD %s reply error: %s",s.name,reply->str);
+		else
+			ERROR("SCRIPT LOAD %s reply type not desired: %d",s.name,reply->type);
 		freeReplyObject(reply);
+		return false;
+	}
+	sha = reply->str;
+	freeReplyObject(reply);
+
+	DBG("resources %s script loaded. sha: %s",s.name,sha.c_str());
+	s.sha_mutex.lock();
+		s.sha = sha;
+	s.sha_mutex.unlock();
+	return true;
+}
 
-		while(!desired_response.empty()){
-			int desired = desired_response.front();
-			desired_response.pop_front();
-			state = redisGetReply(write_ctx,(void **)&reply);
-			if(state!=REDIS_OK)
-				throw GetReplyException("MULTI HSET redisGetReply() != REDIS_OK, state = %d",state);
-			if(reply==NULL)
-				throw GetReplyException("MULTI HSET reply == NULL",state);
-			if(reply->type!=desired){
-				throw ReplyTypeException("MULTI HSET type not desired",reply->type);
-			}
+redisReply *ResourceCache::eval_script(redisContext *ctx, redis_script &s, const vector<string> &args){
+	redisReply *reply;
+	string sha;
+
+	s.sha_mutex.lock();
+		sha = s.sha;
+	s.sha_mutex.unlock();
+	if(sha.empty() && !load_script(ctx,s,sha))
+		return NULL;
+
+	vector<const char *> argv(args.size()+2);
+	vector<size_t> argvlen(args.size()+2);
+	argv[0] = "EVALSHA";
+	argvlen[0] = 7;
+	for(unsigned int i = 0;i<args.size();i++){
+		argv[i+2] = args[i].c_str();
+		argvlen[i+2] = args[i].size();
+	}
+
+	for(int attempt = 0;;attempt++){
+		argv[1] = sha.c_str();
+		argvlen[1] = sha.size();
+		reply = (redisReply *)redisCommandArgv(ctx,argv.size(),argv.data(),argvlen.data());
+		if(reply!=NULL && reply->type==REDIS_REPLY_ERROR
+			&& 0==strncmp(reply->str,"NOSCRIPT",8) && !attempt)
+		{
+			//script cache was flushed (e.g. redis restart). load it again
+			DBG("EVALSHA %s NOSCRIPT. reload script",s.name);
 			freeReplyObject(reply);
+			if(!load_script(ctx,s,sha))
+				return NULL;
+			continue;
 		}
+		return reply;
+	}
+}
 
-		INFO("resources initialized");
+void ResourceCache::get_script_args(ResourceList &rl, vector<string> &args){
+	//numkeys key1 .. keyN node_id limit1 takes1 failover1 ..
+	args.reserve(args.size()+2+rl.size()*4);
+	args.push_back(int2str((unsigned int)rl.size()));
+	for(ResourceList::iterator rit = rl.begin();rit!=rl.end();++rit)
+		args.push_back(get_key(*rit));
+	args.push_back(int2str(Yeti::instance().config.node_id));
+	for(ResourceList::iterator rit = rl.begin();rit!=rl.end();++rit){
+		const Resource &r = *rit;
+		args.push_back(int2str(r.limit));
+		args.push_back(int2str(r.taken ? 0 : r.takes));
+		args.push_back(r.failover_to_next ? "1" : "0");
+	}
+}
 
-		write_pool.putConnection(write_ctx,RedisConnPool::CONN_STATE_OK);
-		queues_mutex.unlock();
+ResourceResponse ResourceCache::get_script_result(redisReply *reply, ResourceList &rl,
+												  ResourceList::iterator &resource)
+{
+	resource = rl.begin();
+	try {
+		if(reply->type!=REDIS_REPLY_ARRAY){
+			if(reply->type==REDIS_REPLY_ERROR)
+				throw ReplyDataException(reply->str);
+			throw ReplyTypeException("EVALSHA type not desired",reply->type);
+		}
+		if(reply->elements < 1)
+			throw ReplyDataException("EVALSHA empty reply");
+
+		//resources to take on success or the overloaded resource if busy
+		vector<bool> take(rl.size(),false);
+		for(unsigned int i = 1;i<reply->elements;i++){
+			long int idx = Reply2Int(reply->element[i]);
+			if(idx < 1 || idx > (long int)rl.size())
+				throw ReplyDataException("EVALSHA resource index out of range");
+			take[idx-1] = true;
+		}
 
-		if(resources_initialized_cb)
-			resources_initialized_cb();
+		if(Reply2Int(reply->element[0])){
+			unsigned int i = 0;
+			for(ResourceList::iterator rit = rl.begin();rit!=rl.end();++rit,++i){
+				Resource &r = *rit;
+				if(!take[i]) continue;
+				DBG("get_resource %d:%d atomic",r.type,r.id);
+				r.active = true;
+				r.taken = true;
+			}
+			resource = rl.end();
+			return RES_SUCC;
+		}
 
-		return true;
-	} catch(GetReplyException &e){
-		ERROR("GetReplyException: %s, status: %d",e.what.c_str(),e.status);
+		for(unsigned int i = 0;i<take.size() && !take[i];i++)
+			++resource;
+		DBG("resource %d:%d overload",resource->type,resource->id);
+		return RES_BUSY;
+	} catch(ReplyTypeException &e){
+		ERROR("ReplyTypeException: %s, type: %d",e.what.c_str(),e.type);
 	} catch(ReplyDataException &e){
-		freeReplyObject(reply);
 		ERROR("ReplyDataException: %s",e.what.c_str());
-	} catch(ReplyTypeException &e){
-		freeReplyObject(reply);
-		ERROR("ReplyTypeException %s type: %d",e.what.c_str(),e.type);
 	}
+	resource = rl.begin();
+	return RES_ERR;
+}
 
-	write_pool.putConnection(write_ctx,RedisConnPool::CONN_STATE_ERR);
-	queues_mutex.unlock();
-	return false;
+ResourceResponse ResourceCache::get_atomic(ResourceList &rl,
+										   ResourceList::iterator &resource)
+{
+	ResourceResponse ret;
+	vector<string> args;
+
+	resource = rl.begin();
+
+	redisContext *redis_ctx = script_pool.getConnection();
+	if(redis_ctx==NULL){
+		ERROR("can't get connection from script redis pool");
+		return RES_ERR;
+	}
+
+	get_script_args(rl,args);
+
+	redisReply *reply = eval_script(redis_ctx,get_script,args);
+	if(reply==NULL){
+		ERROR("EVALSHA reply == NULL, status: %d",redis_ctx->err);
+		script_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
+		return RES_ERR;
+	}
+
+	ret = get_script_result(reply,rl,resource);
+	freeReplyObject(reply);
+	script_pool.putConnection(redis_ctx,
+		ret==RES_ERR ? RedisConnPool::CONN_STATE_ERR : RedisConnPool::CONN_STATE_OK);
+
+	return ret;
 }
 
-void ResourceCache::pending_get(Resource &r){
-	queues_mutex.lock();
-		get_resources_queue.insert(get_resources_queue.begin(),r);
-	queues_mutex.unlock();
+long ResourceCache::lease_eval(redisContext *ctx, redis_script &s, const string &key, const vector<string> &argv){
+	long ret = -1;
+	vector<string> args;
+	args.reserve(argv.size()+2);
+	args.push_back("1");
+	args.push_back(key);
+	args.insert(args.end(),argv.begin(),argv.end());
+
+	redisReply *reply = eval_script(ctx,s,args);
+	if(reply==NULL){
+		ERROR("EVALSHA %s %s no reply",s.name,key.c_str());
+		return -1;
+	}
+	if(reply->type==REDIS_REPLY_INTEGER){
+		ret = reply->integer;
+	} else if(reply->type==REDIS_REPLY_ERROR){
+		ERROR("EVALSHA %s %s reply error: %s",s.name,key.c_str(),reply->str);
+	} else {
+		ERROR("EVALSHA %s %s reply type not desired: %d",s.name,key.c_str(),reply->type);
+	}
+	freeReplyObject(reply);
+	return ret;
 }
 
-void ResourceCache::pending_get_finish(){
-	data_ready.set(true);
+long ResourceCache::lease_reserve(redisContext *ctx, const string &key, ResourceLeases::lease &l, long want, long need){
+	vector<string> argv;
+	argv.push_back(int2str(Yeti::instance().config.node_id));
+	argv.push_back(int2str(l.limit.load()));
+	argv.push_back(long2str(want));
+	argv.push_back(long2str(need));
+
+	long n = lease_eval(ctx,lease_reserve_script,key,argv);
+	if(n > 0){
+		l.add_reserved(n);
+		l.refills++;
+	} else if(n==0){
+		l.refill_failures++;
+	}
+	return n;
+}
+
+void ResourceCache::leases_maintenance(){
+	struct timeval now;
+	vector<ResourceLeases::action> actions;
+
+	gettimeofday(&now,NULL);
+	if(!leases.maintenance_ready(now))
+		return;
+	leases.maintenance(now,actions);
+	if(actions.empty())
+		return;
+
+	redisContext *ctx = script_pool.getConnection();
+	bool failed = (ctx==NULL);
+
+	for(vector<ResourceLeases::action>::iterator it = actions.begin();it!=actions.end();++it){
+		ResourceLeases::action &a = *it;
+		if(a.amount > 0){
+			if(failed) continue;
+			if(lease_reserve(ctx,a.key,*a.l,a.amount,1) < 0)
+				failed = (ctx->err!=0);
+		} else {
+			vector<string> argv;
+			argv.push_back(int2str(Yeti::instance().config.node_id));
+			argv.push_back(long2str(-a.amount));
+			if(failed || lease_eval(ctx,lease_return_script,a.key,argv) < 0){
+				//keep reservation locally if it can't be returned
+				a.l->add_reserved(-a.amount);
+				if(!failed) failed = (ctx->err!=0);
+				continue;
+			}
+			a.l->returns++;
+		}
+	}
+
+	if(ctx)
+		script_pool.putConnection(ctx,
+			(ctx->err!=0) ? RedisConnPool::CONN_STATE_ERR : RedisConnPool::CONN_STATE_OK);
+}
+
+ResourceResponse ResourceCache::get_leased(ResourceList &rl,
+										   ResourceList::iterator &resource)
+{
+	ResourceResponse ret = RES_SUCC;
+	int check_state = CHECK_STATE_NORMAL;
+	vector<ResourceList::iterator> taken;
+
+	//same checking as in the get() availability check cycle
+	for(resource = rl.begin();resource!=rl.end();++resource){
+		Resource &res = *resource;
+
+		if(CHECK_STATE_SKIP==check_state){
+			if(!res.failover_to_next) //last failover resource
+				check_state = CHECK_STATE_NORMAL;
+			continue;
+		}
+
+		if(!res.taken){
+			string key = get_key(res);
+			ResourceLeases::lease &l = *leases.get(key,res.limit);
+			l.takes+=res.takes;
+			if(!l.take(res.takes)){
+				//lease exhausted. refill it synchronously
+				l.refill_misses++;
+				long n = -1;
+				redisContext *ctx = script_pool.getConnection();
+				if(ctx){
+					n = lease_reserve(ctx,key,l,std::max(l.size.load(),(long)res.takes),res.takes);
+					script_pool.putConnection(ctx,
+						(ctx->err!=0) ? RedisConnPool::CONN_STATE_ERR : RedisConnPool::CONN_STATE_OK);
+				} else {
+					ERROR("can't get connection from script redis pool");
+				}
+				if(n < 0){
+					ret = RES_ERR;
+					break;
+				}
+				if(n==0 || !l.take(res.takes)){
+					DBG("resource %d:%d overload",res.type,res.id);
+					if(res.failover_to_next){
+						DBG("failover_to_next enabled. check the next resource");
+						check_state = CHECK_STATE_FAILOVER;
+						continue;
+					}
+					ret = RES_BUSY;
+					break;
+				}
+			}
+			DBG("get_resource %d:%d leased",res.type,res.id);
+			res.taken = true;
+			taken.push_back(resource);
+		}
+
+		res.active = true;
+		check_state = res.failover_to_next ?
+			CHECK_STATE_SKIP : CHECK_STATE_NORMAL;
+	}
+
+	if(ret!=RES_SUCC){
+		//return takes of the partially acquired list
+		for(vector<ResourceList::iterator>::iterator it = taken.begin();it!=taken.end();++it){
+			Resource &r = **it;
+			leases.get(get_key(r),r.limit)->release(r.takes);
+			r.taken = false;
+			r.active = false;
+		}
+	}
+
+	return ret;
 }
 
 ResourceResponse ResourceCache::get(ResourceList &rl,
 									ResourceList::iterator &resource)
 {
 	ResourceResponse ret = RES_ERR;
+
+	if(use_leases)
+		return get_leased(rl,resource);
+	if(atomic_get)
+		return get_atomic(rl,resource);
+
 	resource = rl.begin();
 
 	try {
@@ -405,39 +1029,132 @@ ResourceResponse ResourceCache::get(ResourceList &rl,
 		//preliminary resources availability check
 
 		bool resources_available = true;
-		list <int> desired_response;
-		redisReply *reply = NULL;
-		redisContext *redis_ctx = NULL;
-		RedisConnPool *redis_pool = &read_pool;
-
-		redis_ctx = redis_pool->getConnection();
-		if(redis_ctx==NULL){
-			throw ResourceCacheException("can't get connection from read redis pool",0);
+		vector<long int> values(rl.size(),0);
+
+		get_values(rl,values);
+
+		//resources availability checking cycle
+		int check_state = CHECK_STATE_NORMAL;
+		resource = rl.begin();
+		for(unsigned int i = 0;i<values.size();i++,++resource){
+			long int now = values[i];
+			Resource &res = *resource;
+
+			if(CHECK_STATE_SKIP==check_state){
+				DBG("skip %d:%d intended for failover",res.type,res.id);
+				if(!res.failover_to_next) //last failover resource
+					check_state = CHECK_STATE_NORMAL;
+				continue;
+			}
+
+			DBG("check_resource %d:%d %ld/%d",
+				res.type,res.id,now,res.limit);
+
+			//check limit
+			if(now >= res.limit){
+				DBG("resource %d:%d overload ",
+					res.type,res.id);
+				if(res.failover_to_next){
+					DBG("failover_to_next enabled. check the next resource");
+					check_state = CHECK_STATE_FAILOVER;
+					continue;
+				}
+				resources_available = false;
+				break;
+			} else {
+				res.active = true;
+				if(CHECK_STATE_FAILOVER==check_state){
+					DBG("failovered to resource %d:%d",res.type,res.id);
+					/*if(res.failover_to_next)	//skip if not last
+						check_state = CHECK_STATE_SKIP;*/
+				}
+				check_state = res.failover_to_next ?
+					CHECK_STATE_SKIP : CHECK_STATE_NORMAL;
+			}
 		}
 
-			//prepare request
-		redisAppendCommand(redis_ctx,"MULTI");
-		desired_response.push_back(REDIS_REPLY_STATUS);
+		//aquire resources if available
+
+		if(!resources_available){
+			DBG("resources unavailable");
+			ret = RES_BUSY;
+		} else {
+			bool non_empty = false;
+			for(ResourceList::iterator rit = rl.begin();rit!=rl.end();++rit){
+				Resource &r = (*rit);
+				if(!r.active || r.taken) continue;
+				non_empty = true;
+				pending_get(r);
+				r.taken = true;
+			}
+			if(non_empty) pending_get_finish();
+			ret = RES_SUCC;
+		}
+	} catch(ResourceCacheException &e){
+		ERROR("exception: %s %d",e.what.c_str(),e.code);
+	}
 
-		ResourceList::iterator rit = rl.begin();
-		for(;rit!=rl.end();++rit){
-			string key = get_key(*rit);
-			//redisAppendCommand(redis_ctx,"GET %b",
-			redisAppendCommand(redis_ctx,"HVALS %b",
-				key.c_str(),key.size());
-			desired_response.push_back(REDIS_REPLY_STATUS);
+	return ret;
+}
+
+void ResourceCache::get_values(ResourceList &rl, vector<long int> &values){
+	struct shard_request {
+		redisContext *ctx;
+		vector<unsigned int> positions;		//resources positions in the list
+		shard_request(): ctx(NULL) {}
+	};
+	vector<shard_request> requests(shards.size());
+	vector<string> keys;
+	list <int> desired_response;
+	redisReply *reply = NULL;
+	bool failed = true;
+	unsigned int i = 0;
+
+	keys.reserve(rl.size());
+	for(ResourceList::iterator rit = rl.begin();rit!=rl.end();++rit,++i){
+		keys.push_back(get_key(*rit));
+		requests[ring.get(keys.back())].positions.push_back(i);
+	}
+
+	try {
+		//send requests to all involved shards before reading replies
+		for(unsigned int s = 0;s<requests.size();s++){
+			shard_request &q = requests[s];
+			if(q.positions.empty()) continue;
+
+			q.ctx = shards[s]->read_pool.getConnection();
+			if(q.ctx==NULL)
+				throw ResourceCacheException("can't get connection from read redis pool of shard "+int2str(s),0);
+
+			redisAppendCommand(q.ctx,"MULTI");
+			for(vector<unsigned int>::const_iterator p = q.positions.begin();p!=q.positions.end();++p){
+				const string &key = keys[*p];
+				redisAppendCommand(q.ctx,"HVALS %b",
+					key.c_str(),key.size());
+			}
+			redisAppendCommand(q.ctx,"EXEC");
+
+			int done = 0;
+			while(!done){
+				if(redisBufferWrite(q.ctx,&done)!=REDIS_OK)
+					throw GetReplyException("GET redisBufferWrite() != REDIS_OK",q.ctx->err);
+			}
 		}
 
-		redisAppendCommand(redis_ctx,"EXEC");
-		desired_response.push_back(REDIS_REPLY_ARRAY);
+		for(unsigned int s = 0;s<requests.size();s++){
+			shard_request &q = requests[s];
+			if(!q.ctx) continue;
+
+			desired_response.clear();
+			desired_response.push_back(REDIS_REPLY_STATUS);
+			desired_response.insert(desired_response.end(),q.positions.size(),REDIS_REPLY_STATUS);
+			desired_response.push_back(REDIS_REPLY_ARRAY);
 
-			//perform request
-		try {
 			while(!desired_response.empty()){
 				int desired = desired_response.front();
 				desired_response.pop_front();
 
-				int state = redisGetReply(redis_ctx,(void **)&reply);
+				int state = redisGetReply(q.ctx,(void **)&reply);
 				if(state!=REDIS_OK)
 					throw GetReplyException("GET redisGetReply() != REDIS_OK",state);
 				if(reply==NULL)
@@ -449,243 +1166,284 @@ ResourceResponse ResourceCache::get(ResourceList &rl,
 				}
 				if(reply->type==REDIS_REPLY_ARRAY){ /* process EXEC here */
 					size_t n = reply->elements;
-					if(n != rl.size()){
+					if(n != q.positions.size()){
 						DBG("GET reply->elements = %ld, desired size = %ld",
-							n,rl.size());
+							n,q.positions.size());
 						throw ReplyDataException("GET mismatch responses array size");
 					}
-
-					//resources availability checking cycle
-					int check_state = CHECK_STATE_NORMAL;
-					resource = rl.begin();
-					for(unsigned int i = 0;i<n;i++,++resource){
-						long int now = Reply2Int(reply->element[i]);
-						Resource &res = *resource;
-
-						if(CHECK_STATE_SKIP==check_state){
-							DBG("skip %d:%d intended for failover",res.type,res.id);
-							if(!res.failover_to_next) //last failover resource
-								check_state = CHECK_STATE_NORMAL;
-							continue;
-						}
-
-						DBG("check_resource %d:%d %ld/%d",
-							res.type,res.id,now,res.limit);
-
-						//check limit
-						if(now >= res.limit){
-							DBG("resource %d:%d overload ",
-								res.type,res.id);
-							if(res.failover_to_next){
-								DBG("failover_to_next enabled. check the next resource");
-								check_state = CHECK_STATE_FAILOVER;
-								continue;
-							}
-							resources_available = false;
-							break;
-						} else {
-							res.active = true;
-							if(CHECK_STATE_FAILOVER==check_state){
-								DBG("failovered to resource %d:%d",res.type,res.id);
-								/*if(res.failover_to_next)	//skip if not last
-									check_state = CHECK_STATE_SKIP;*/
-							}
-							check_state = res.failover_to_next ?
-								CHECK_STATE_SKIP : CHECK_STATE_NORMAL;
-						}
-					}
+					for(unsigned int j = 0;j<n;j++)
+						values[q.positions[j]] = Reply2Int(reply->element[j]);
 				}
 				freeReplyObject(reply);
+				reply = NULL;
 			}
-			redis_pool->putConnection(redis_ctx,RedisConnPool::CONN_STATE_OK);
-
-			//aquire resources if available
 
-			if(!resources_available){
-				DBG("resources unavailable");
-				ret = RES_BUSY;
-			} else {
-				bool non_empty = false;
-				for(ResourceList::iterator rit = rl.begin();rit!=rl.end();++rit){
-					Resource &r = (*rit);
-					if(!r.active || r.taken) continue;
-					non_empty = true;
-					pending_get(r);
-					r.taken = true;
-				}
-				if(non_empty) pending_get_finish();
-				ret = RES_SUCC;
-			}
-		} catch(GetReplyException &e){
-			ERROR("GetReplyException: %s, status: %d",e.what.c_str(),e.status);
-			redis_pool->putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
-		} catch(ReplyTypeException &e){
-			ERROR("ReplyTypeException: %s, type: %d",e.what.c_str(),e.type);
-			freeReplyObject(reply);
-			redis_pool->putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
-		} catch(ReplyDataException &e){
-			ERROR("ReplyDataException: %s",e.what.c_str());
-			freeReplyObject(reply);
-			redis_pool->putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
+			shards[s]->read_pool.putConnection(q.ctx,RedisConnPool::CONN_STATE_OK);
+			q.ctx = NULL;
 		}
+		failed = false;
+	} catch(GetReplyException &e){
+		ERROR("GetReplyException: %s, status: %d",e.what.c_str(),e.status);
+	} catch(ReplyTypeException &e){
+		ERROR("ReplyTypeException: %s, type: %d",e.what.c_str(),e.type);
+	} catch(ReplyDataException &e){
+		ERROR("ReplyDataException: %s",e.what.c_str());
 	} catch(ResourceCacheException &e){
-		ERROR("exception: %s %d",e.what.c_str(),e.code);
+		ERROR("%s",e.what.c_str());
 	}
 
-	return ret;
+	if(!failed)
+		return;
+
+	if(reply)
+		freeReplyObject(reply);
+	for(unsigned int s = 0;s<requests.size();s++){
+		if(requests[s].ctx)
+			shards[s]->read_pool.putConnection(requests[s].ctx,RedisConnPool::CONN_STATE_ERR);
+	}
+	throw ResourceCacheException("failed to get resources values",0);
 }
 
 void ResourceCache::put(ResourceList &rl){
-	queues_mutex.lock();
-		put_resources_queue.insert(
-			put_resources_queue.begin(),
-			rl.begin(), rl.end());
-	queues_mutex.unlock();
-	data_ready.set(true);
+	if(use_leases){
+		//return takes to the local leases. surplus is returned by maintenance
+		for(ResourceList::iterator rit = rl.begin();rit!=rl.end();++rit){
+			Resource &r = *rit;
+			if(!r.taken) continue;
+			leases.get(get_key(r),r.limit)->release(r.takes);
+		}
+		return;
+	}
+	for(ResourceList::const_iterator rit = rl.begin();rit!=rl.end();++rit){
+		const Resource &r = *rit;
+		if(!r.taken) continue;
+		ResourceWriter *w = get_writer(get_key(r));
+		w->put(r);
+		w->notify();
+	}
 }
 
 void ResourceCache::getResourceState(int type, int id, AmArg &ret){
 	DBG("getResourceState(%d,%d,...)",type,id);
 
-	redisReply *reply = NULL;
-	redisContext *redis_ctx = NULL;
-	list <int> d;
-
 	ret.assertStruct();
 
-	redis_ctx = read_pool.getConnection();
-	if(redis_ctx==NULL){
-		throw ResourceCacheException("can't get connection from read_pool",500);
-	}
-
 	if(type!=ANY_VALUE and id!=ANY_VALUE){
 		//create fake resource
 		Resource r;
 		r.type = type;
 		r.id = id;
 
-		//prepare request
 		string key = get_key(r);
-		redisAppendCommand(redis_ctx,"HGETALL %b",
-			key.c_str(),key.size());
+		getKeyState(get_shard(key)->read_pool,key,ret);
+	} else {
+#define int2key(v) (v==ANY_VALUE) ? "*" : int2str(v)
+		string key = int2key(type);
+		key.append(":");
+		key.append(int2key(id));
+#undef int2key
+		DBG("%s(): lookup of keys '%s'",FUNC_NAME,key.c_str());
+		for(vector<ResourceShard *>::iterator it = shards.begin();it!=shards.end();++it)
+			getKeysState((*it)->read_pool,key,ret);
+	}
+}
 
-		int state = redisGetReply(redis_ctx,(void **)&reply);
+void ResourceCache::getKeyState(RedisConnPool &read_pool, const string &key, AmArg &ret){
+	redisReply *reply = NULL;
+	redisContext *redis_ctx = NULL;
 
-		if(state!=REDIS_OK || reply==NULL){
-			read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
-			throw ResourceCacheException("no reply from storage",500);
-		}
+	redis_ctx = read_pool.getConnection();
+	if(redis_ctx==NULL){
+		throw ResourceCacheException("can't get connection from read_pool",500);
+	}
+
+	//prepare request
+	redisAppendCommand(redis_ctx,"HGETALL %b",
+		key.c_str(),key.size());
+
+	int state = redisGetReply(redis_ctx,(void **)&reply);
+
+	if(state!=REDIS_OK || reply==NULL){
+		read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
+		throw ResourceCacheException("no reply from storage",500);
+	}
+
+	if(reply->type != REDIS_REPLY_ARRAY){
+		freeReplyObject(reply);
+		read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
+		throw ResourceCacheException("undesired reply from storage",500);
+	}
+
+	size_t n = reply->elements;
+	if(0==n){
+		freeReplyObject(reply);
+		read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_OK);
+		throw ResourceCacheException("unknown resource",404);
+	}
+
+	for(unsigned int i = 0; i < n; i+=2){
+		ret.push(int2str((unsigned int)Reply2Int(reply->element[i])),	//node_id
+				 AmArg(Reply2Int(reply->element[i+1])));				//value
+	}
+
+	freeReplyObject(reply);
+	read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_OK);
+}
+
+void ResourceCache::getKeysState(RedisConnPool &read_pool, const string &pattern, AmArg &ret){
+	redisReply *reply = NULL;
+	redisContext *redis_ctx = NULL;
+	list <int> d;
+
+	redis_ctx = read_pool.getConnection();
+	if(redis_ctx==NULL){
+		throw ResourceCacheException("can't get connection from read_pool",500);
+	}
+
+	redisAppendCommand(redis_ctx,"KEYS %s",pattern.c_str());
+
+	int state = redisGetReply(redis_ctx,(void **)&reply);
+	if(state!=REDIS_OK || reply==NULL){
+		read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
+		throw ResourceCacheException("no reply from storage",500);
+	}
 
-		if(reply->type != REDIS_REPLY_ARRAY){
-			freeReplyObject(reply);
-			read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
-			throw ResourceCacheException("undesired reply from storage",500);
-		}
 
-		size_t n = reply->elements;
-		if(0==n){
+	if(reply->type != REDIS_REPLY_ARRAY){
+		if(reply->type==REDIS_REPLY_NIL){
 			freeReplyObject(reply);
 			read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_OK);
-			throw ResourceCacheException("unknown resource",404);
+			throw ResourceCacheException("no resources matched",404);
 		}
-
-		for(unsigned int i = 0; i < n; i+=2){
-			ret.push(int2str((unsigned int)Reply2Int(reply->element[i])),	//node_id
-					 AmArg(Reply2Int(reply->element[i+1])));				//value
-		}
-
 		freeReplyObject(reply);
-	} else { //if(type!=ANY_VALUE and id!=ANY_VALUE){
-#define int2key(v) (v==ANY_VALUE) ? "*" : int2str(v)
-		string key = int2key(type);
-		key.append(":");
-		key.append(int2key(id));
-#undef int2key
-		DBG("%s(): lookup of keys '%s'",FUNC_NAME,key.c_str());
-		redisAppendCommand(redis_ctx,"KEYS %s",key.c_str());
+		read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
+		throw ResourceCacheException("undesired reply from storage",500);
+	}
+	DBG("%s(): got %ld keys",FUNC_NAME,reply->elements);
+
+	list<string> keys;
+	redisAppendCommand(redis_ctx,"MULTI");
+	d.push_back(REDIS_REPLY_STATUS);
+	for(unsigned int i = 0;i<reply->elements;i++){
+		redisReply *r = reply->element[i];
+		redisAppendCommand(redis_ctx,"HGETALL %s",r->str);
+		keys.push_back(r->str);
+		d.push_back(REDIS_REPLY_STATUS);
+	}
+	redisAppendCommand(redis_ctx,"EXEC");
+	d.push_back(REDIS_REPLY_ARRAY);
+
+	freeReplyObject(reply);
 
-		int state = redisGetReply(redis_ctx,(void **)&reply);
+	while(!d.empty()){
+		int desired = d.front();
+		d.pop_front();
+		state = redisGetReply(redis_ctx,(void **)&reply);
 		if(state!=REDIS_OK || reply==NULL){
 			read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
 			throw ResourceCacheException("no reply from storage",500);
 		}
-
-
-		if(reply->type != REDIS_REPLY_ARRAY){
-			if(reply->type==REDIS_REPLY_NIL){
-				freeReplyObject(reply);
-				read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_OK);
-				throw ResourceCacheException("no resources matched",404);
-			}
+		if(reply->type!=desired){
 			freeReplyObject(reply);
 			read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
 			throw ResourceCacheException("undesired reply from storage",500);
 		}
-		DBG("%s(): got %ld keys",FUNC_NAME,reply->elements);
-
-		list<string> keys;
-		redisAppendCommand(redis_ctx,"MULTI");
-		d.push_back(REDIS_REPLY_STATUS);
-		for(unsigned int i = 0;i<reply->elements;i++){
-			redisReply *r = reply->element[i];
-			redisAppendCommand(redis_ctx,"HGETALL %s",r->str);
-			keys.push_back(r->str);
-			d.push_back(REDIS_REPLY_STATUS);
-		}
-		redisAppendCommand(redis_ctx,"EXEC");
-		d.push_back(REDIS_REPLY_ARRAY);
-
-		freeReplyObject(reply);
-
-		while(!d.empty()){
-			int desired = d.front();
-			d.pop_front();
-			state = redisGetReply(redis_ctx,(void **)&reply);
-			if(state!=REDIS_OK || reply==NULL){
-				read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
-				throw ResourceCacheException("no reply from storage",500);
-			}
-			if(reply->type!=desired){
-				freeReplyObject(reply);
-				read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
-				throw ResourceCacheException("undesired reply from storage",500);
-			}
-			if(reply->type == REDIS_REPLY_ARRAY){
-				list<string>::const_iterator k = keys.begin();
-				for(unsigned int i = 0; i < reply->elements; i++,k++){
-					redisReply *r = reply->element[i];
-					if(r->type!=REDIS_REPLY_ARRAY){
+		if(reply->type == REDIS_REPLY_ARRAY){
+			list<string>::const_iterator k = keys.begin();
+			for(unsigned int i = 0; i < reply->elements; i++,k++){
+				redisReply *r = reply->element[i];
+				if(r->type!=REDIS_REPLY_ARRAY){
+					freeReplyObject(reply);
+					read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
+					throw ResourceCacheException("undesired reply from storage",500);
+				}
+				ret.push(*k,AmArg());
+				AmArg &q = ret[*k];
+				for(unsigned int j = 0; j < r->elements; j+=2){
+					try {
+					q.push(int2str((unsigned int)Reply2Int(r->element[j])),	//node_id
+						 AmArg(Reply2Int(r->element[j+1])));				//value*/
+					} catch(...){
 						freeReplyObject(reply);
 						read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
-						throw ResourceCacheException("undesired reply from storage",500);
-					}
-					ret.push(*k,AmArg());
-					AmArg &q = ret[*k];
-					for(unsigned int j = 0; j < r->elements; j+=2){
-						try {
-						q.push(int2str((unsigned int)Reply2Int(r->element[j])),	//node_id
-							 AmArg(Reply2Int(r->element[j+1])));				//value*/
-						} catch(...){
-							freeReplyObject(reply);
-							read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_ERR);
-							throw ResourceCacheException("can't parse response",500);
-						}
+						throw ResourceCacheException("can't parse response",500);
 					}
 				}
 			}
-			freeReplyObject(reply);
 		}
+		freeReplyObject(reply);
 	}
+
 	read_pool.putConnection(redis_ctx,RedisConnPool::CONN_STATE_OK);
 }
 
+bool ResourceCache::get_async(const string &session_tag, const ResourceList &rl){
+	if(!async_get)
+		return false;
+	async_checker.post(session_tag,rl);
+	return true;
+}
+
+void ResourceCache::getLeases(AmArg &ret){
+	if(!use_leases)
+		throw ResourceCacheException("resources leases are disabled",500);
+	leases.getInfo(ret);
+}
+
+void ResourceCache::getWritersStats(AmArg &ret){
+	ret.assertArray();
+	for(vector<ResourceShard *>::iterator sit = shards.begin();sit!=shards.end();++sit){
+		vector<ResourceWriter *> &writers = (*sit)->writers;
+		for(vector<ResourceWriter *>::iterator it = writers.begin();it!=writers.end();++it){
+			AmArg w;
+			w["shard"] = (int)(*sit)->idx;
+			(*it)->getStats(w);
+			ret.push(w);
+		}
+	}
+}
+
 void ResourceCache::GetConfig(AmArg& ret){
 	AmArg u;
 
-	read_pool.GetConfig(u);
+	//first shard pools
+	shards[0]->read_pool.GetConfig(u);
 	ret.push("read_pool",u);
 
 	u.clear();
-	write_pool.GetConfig(u);
+	shards[0]->write_pool.GetConfig(u);
 	ret.push("write_pool",u);
+
+	AmArg &s = ret["shards"];
+	s.assertArray();
+	for(vector<ResourceShard *>::iterator it = shards.begin();it!=shards.end();++it){
+		ResourceShard &shard = **it;
+		AmArg a;
+		a["idx"] = (int)shard.idx;
+		a["name"] = shard.name;
+		u.clear();
+		shard.read_pool.GetConfig(u);
+		a.push("read_pool",u);
+		u.clear();
+		shard.write_pool.GetConfig(u);
+		a.push("write_pool",u);
+		s.push(a);
+	}
+
+	ret["writers"] = (int)writers_count;
+	ret["write_window"] = (int)write_window;
+	ret["init_chunk"] = (int)init_chunk;
+	ret["atomic_get"] = atomic_get;
+	ret["leases"] = use_leases;
+	if(atomic_get){
+		u.clear();
+		script_pool.GetConfig(u);
+		ret.push("script_pool",u);
+	}
+	ret["async_get"] = async_get;
+	if(async_get){
+		u.clear();
+		async_checker.getStats(u);
+		ret.push("async_checker",u);
+	}
 }
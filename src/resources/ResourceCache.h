@@ -7,8 +7,14 @@
 #include "AmArg.h"
 #include "hiredis/hiredis.h"
 #include "RedisConnPool.h"
+#include "ResourceLeases.h"
+#include "ResourceAsyncChecker.h"
+#include "ResourceShards.h"
 
+#include <sys/time.h>
 #include <list>
+#include <map>
+#include <vector>
 
 //used for resources lookup in function getResourceState
 #define ANY_VALUE -1
@@ -25,23 +31,150 @@ enum ResourceResponse {
 	RES_ERR				//error occured on interaction with cache
 };
 
-class ResourceCache
+class ResourceCache;
+
+/* resources writer shard. applies HINCRBY for taken/released resources
+ * with MULTI/EXEC batches on own write_pool connection.
+ * resource key is always routed to the same shard to keep per-key ordering */
+class ResourceWriter
 	: public AmThread
 {
-	RedisConnPool write_pool,read_pool;
-	ResourceList put_resources_queue;
-	ResourceList get_resources_queue;
-	AmMutex queues_mutex;
+	ResourceCache &cache;
+	RedisConnPool &pool;
+	int idx;
+	unsigned int window;		//msec to collect events before batch
+
+	ResourceList put_queue, get_queue;
+	AmMutex queue_mutex;
 	AmCondition <bool>data_ready;
 	bool tostop;
 
-	string get_key(Resource &r);
+	struct {
+		unsigned long batches;
+		unsigned long resources;	//events in all batches
+		unsigned long commands;		//HINCRBY sent after coalescing
+		unsigned long zero_deltas;	//keys skipped with zero net delta
+		unsigned long errors;
+		unsigned long last_batch;	//queue depth taken by the last batch
+		unsigned long max_batch;
+	} stats;
+	AmMutex stats_mutex;
+
+	/* net node counter delta for each key */
+	typedef map<string,long> Deltas;
+	void coalesce(const ResourceList &rl, bool take, Deltas &deltas);
+	/* HINCRBY for all non-zero deltas in MULTI/EXEC */
+	void write(redisContext *ctx, const Deltas &deltas, unsigned long commands);
+
+  public:
+	ResourceWriter(ResourceCache &cache, RedisConnPool &pool, int idx, unsigned int window);
+
+	void put(const Resource &r);
+	void get(const Resource &r);
+	void notify();
+	void clear();
+
+	void run();
+	void on_stop();
+
+	void getStats(AmArg &ret);
+};
 
+class ResourceCache
+	: public AmThread
+{
+	/* resources keys are distributed across shards by consistent hashing.
+	 * write_pool of each shard has connection per writer */
+	vector<ResourceShard *> shards;
+	ResourceRing ring;
+	unsigned int writers_count;
+	RedisConnPool::cb_func *reconnect_cb;
+	void *reconnect_cb_arg;
+	unsigned int write_window;
+
+	/* init_resources() SCAN COUNT and pipeline size */
+	unsigned int init_chunk;
+	struct init_stats_t {
+		bool in_progress;
+		bool last_result;
+		unsigned long runs, failures;
+		unsigned long iterations, keys, fields;	//progress of the current or last run
+		struct timeval started, last_duration;
+		init_stats_t():
+			in_progress(false), last_result(false),
+			runs(0), failures(0),
+			iterations(0), keys(0), fields(0)
+		{
+			timerclear(&started);
+			timerclear(&last_duration);
+		}
+	} init_stats;
+	AmMutex init_mutex;
+	/* read replies for pipelined HDEL. returns removed counters */
+	long init_chunk_replies(redisContext *ctx, unsigned int pending);
+	bool init_shard(ResourceShard &shard, bool initial,
+					unsigned long &iterations, unsigned long &keys, unsigned long &fields);
+
+	/* atomic check-and-take mode. limits are checked and counters are incremented
+	 * by the server-side script in one round trip (see get_atomic()).
+	 * script_pool connects to the write redis with write_redis_size connections */
+	bool atomic_get;
+	RedisConnPool script_pool;
+
+	/* lua script loaded by SCRIPT LOAD on first use */
+	struct redis_script {
+		const char *name;
+		const char *code;
+		string sha;
+		AmMutex sha_mutex;
+		redis_script(const char *name, const char *code):
+			name(name), code(code) {}
+	};
+	redis_script get_script;
+
+	/* node-local leases mode (see ResourceLeases.h).
+	 * uses script_pool for reservations */
+	bool use_leases;
+	ResourceLeases leases;
+	redis_script lease_reserve_script, lease_return_script;
+	/* async check mode. atomic script is sent by async_checker
+	 * and result is posted to the session (see ResourceAsyncChecker.h) */
+	bool async_get;
+	ResourceAsyncChecker async_checker;
+
+	AmCondition <bool>data_ready;
+	bool tostop;
+
+	ResourceShard *get_shard(const string &key);
+	ResourceWriter *get_writer(const string &key);
+	/* sum of node counters for each resource.
+	 * requests are grouped and pipelined per shard */
+	void get_values(ResourceList &rl, vector<long int> &values);
+	void getKeyState(RedisConnPool &read_pool, const string &key, AmArg &ret);
+	void getKeysState(RedisConnPool &read_pool, const string &pattern, AmArg &ret);
 	void pending_get(Resource &r);
 	void pending_get_finish();
 
+	bool load_script(redisContext *ctx, redis_script &s, string &sha);
+	/* EVALSHA with args after the sha. reloads script on NOSCRIPT.
+	 * returns NULL if script can't be loaded or on connection error */
+	redisReply *eval_script(redisContext *ctx, redis_script &s, const vector<string> &args);
+	ResourceResponse get_atomic(ResourceList &rl,
+								ResourceList::iterator &resource);
+
+	/* integer result of the lease script or -1 on errors */
+	long lease_eval(redisContext *ctx, redis_script &s, const string &key, const vector<string> &argv);
+	/* reserve up to want (at least need) for the lease. returns reserved amount or -1 on errors */
+	long lease_reserve(redisContext *ctx, const string &key, ResourceLeases::lease &l, long want, long need);
+	void leases_maintenance();
+	ResourceResponse get_leased(ResourceList &rl,
+								ResourceList::iterator &resource);
+
 public:
 	ResourceCache();
+	~ResourceCache();
+
+	string get_key(const Resource &r);
 	bool init_resources(bool initial = false);
 
 	redisContext *w_ctx;
@@ -59,7 +192,19 @@ public:
 						 ResourceList::iterator &resource);
 	void put(ResourceList &rl);
 
+	/* queue async check. returns false if async mode is disabled */
+	bool get_async(const string &session_tag, const ResourceList &rl);
+
+	/* atomic get script helpers. shared with async_checker */
+	const char *get_script_source() const { return get_script.code; }
+	void get_script_args(ResourceList &rl, vector<string> &args);
+	ResourceResponse get_script_result(redisReply *reply, ResourceList &rl,
+									   ResourceList::iterator &resource);
+
 	void getResourceState(int type, int id, AmArg &ret);
+	void getLeases(AmArg &ret);
+	void getWritersStats(AmArg &ret);
+	void getInitStats(AmArg &ret);
 
 	void GetConfig(AmArg& ret);
 };
@@ -234,6 +234,72 @@ ResourceCtlResponse ResourceControl::get(
 	/*for(ResourceList::const_iterator i = rl.begin();i!=rl.end();++i)
 		DBG("ResourceControl::get() resource: <%s>",(*i).print().c_str());*/
 
+	return process_cache_response(ret,rl,handler,owner_tag,reject_code,reject_reason,rli);
+}
+
+bool ResourceControl::get_async(ResourceList &rl, const string &owner_tag)
+{
+	AmLock l(rl);
+	(void)l;
+
+	if(rl.empty() || !container_ready.get())
+		return false;
+
+	if(!cache.get_async(owner_tag,rl))
+		return false;
+
+	stat.hits++;
+	return true;
+}
+
+ResourceCtlResponse ResourceControl::get_async_reply(
+	const ResourceCheckReplyEvent &ev,
+	ResourceList &rl,
+	string &handler,
+	const string &owner_tag,
+	int &reject_code,
+	string &reject_reason,
+	ResourceList::iterator &rli)
+{
+	AmLock l(rl);
+	(void)l;
+
+	//taken resources are owned by the call now
+	ev.consumed = true;
+
+	//apply taken/active flags from the checked copy
+	rl.assign(ev.resources.begin(),ev.resources.end());
+	if(ev.result==RES_SUCC) {
+		rli = rl.end();
+	} else {
+		rli = rl.begin();
+		std::advance(rli,ev.failed_resource);
+	}
+
+	return process_cache_response((ResourceResponse)ev.result,
+		rl,handler,owner_tag,reject_code,reject_reason,rli);
+}
+
+void ResourceControl::release_async_reply(const ResourceCheckReplyEvent &ev)
+{
+	if(ev.consumed)
+		return;
+	ev.consumed = true;
+	if(ev.result!=RES_SUCC)
+		return;
+	ResourceList rl(ev.resources);
+	cache.put(rl);
+}
+
+ResourceCtlResponse ResourceControl::process_cache_response(
+	ResourceResponse ret,
+	ResourceList &rl,
+	string &handler,
+	const string &owner_tag,
+	int &reject_code,
+	string &reject_reason,
+	ResourceList::iterator &rli)
+{
 	switch(ret){
 		case RES_SUCC: {
 			handler = AmSession::getNewId();
@@ -373,6 +439,8 @@ void ResourceControl::clearStats(){
 
 void ResourceControl::getStats(AmArg &ret){
 	stat.get(ret);
+	cache.getWritersStats(ret["writers"]);
+	cache.getInitStats(ret["init"]);
 }
 
 void ResourceControl::getResourceState(int type, int id, AmArg &ret){
@@ -459,3 +527,7 @@ void ResourceControl::showResourcesById(int id, AmArg &ret){
 
 	handlers_lock.unlock();
 }
+
+void ResourceControl::showLeases(AmArg &ret){
+	cache.getLeases(ret);
+}
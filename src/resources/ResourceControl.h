@@ -82,6 +82,15 @@ class ResourceControl
 	int load_resources_config();
 	int reject_on_error;
 
+	/* handler creation and reject reason for the cache get result */
+	ResourceCtlResponse process_cache_response(ResourceResponse ret,
+							  ResourceList &rl,
+							  string &handler,
+							  const string &owner_tag,
+							  int &reject_code,
+							  string &reject_reason,
+							  ResourceList::iterator &rli);
+
 	struct {
 		unsigned int hits;
 		unsigned int overloaded;
@@ -124,6 +133,20 @@ public:
 							  string &reject_reason,
 							  ResourceList::iterator &rli);
 
+	/* queue async check (resources_async_get).
+	 * returns false if check must be done synchronously by get() */
+	bool get_async(ResourceList &rl, const string &owner_tag);
+	/* same as get() for the result received by the session */
+	ResourceCtlResponse get_async_reply(const ResourceCheckReplyEvent &ev,
+							  ResourceList &rl,
+							  string &handler,
+							  const string &owner_tag,
+							  int &reject_code,
+							  string &reject_reason,
+							  ResourceList::iterator &rli);
+	/* free resources taken for the call which is gone */
+	void release_async_reply(const ResourceCheckReplyEvent &ev);
+
 	//void put(ResourceList &rl);
 	void put(const string &handler);
 
@@ -135,6 +158,7 @@ public:
 	void showResourceByHandler(const string &h, AmArg &ret);
 	void showResourceByLocalTag(const string &tag, AmArg &ret);
 	void showResourcesById(int id, AmArg &ret);
+	void showLeases(AmArg &ret);
 };
 
 #endif // RESOURCECONTROL_H
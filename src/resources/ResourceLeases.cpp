@@ -0,0 +1,181 @@
+#include "ResourceLeases.h"
+#include "log.h"
+#include "AmUtils.h"
+
+#include <sys/time.h>
+
+#define LEASE_DEFAULT_SIZE_MIN 0
+#define LEASE_DEFAULT_SIZE_MAX 32
+#define LEASE_DEFAULT_WINDOW 5
+#define LEASE_DEFAULT_INTERVAL 1000
+
+/* lease */
+
+bool ResourceLeases::lease::take(int n){
+	uint64_t s = state.load();
+	do {
+		if((uint64_t)used(s)+n > reserved(s))
+			return false;
+	} while(!state.compare_exchange_weak(s,s+n));
+	return true;
+}
+
+void ResourceLeases::lease::release(int n){
+	uint64_t s = state.load(), ns;
+	do {
+		//used can be less than n after reset
+		uint32_t u = used(s) > (uint32_t)n ? used(s)-n : 0;
+		ns = (s & 0xffffffff00000000ULL) | u;
+	} while(!state.compare_exchange_weak(s,ns));
+}
+
+void ResourceLeases::lease::add_reserved(long n){
+	state.fetch_add((uint64_t)n << 32);
+}
+
+long ResourceLeases::lease::cut_free(long keep){
+	uint64_t s = state.load();
+	long n;
+	do {
+		long free = (long)reserved(s)-used(s);
+		if(free <= keep)
+			return 0;
+		n = free-keep;
+	} while(!state.compare_exchange_weak(s,s-((uint64_t)n << 32)));
+	return n;
+}
+
+void ResourceLeases::lease::info(AmArg &a) const {
+	uint64_t s = state.load();
+	a["reserved"] = (long)reserved(s);
+	a["used"] = (long)used(s);
+	a["size"] = size.load();
+	a["limit"] = limit.load();
+	a["refills"] = (long)refills.load();
+	a["refill_misses"] = (long)refill_misses.load();
+	a["refill_failures"] = (long)refill_failures.load();
+	a["returns"] = (long)returns.load();
+}
+
+/* leases */
+
+ResourceLeases::ResourceLeases():
+	size_min(LEASE_DEFAULT_SIZE_MIN),
+	size_max(LEASE_DEFAULT_SIZE_MAX),
+	window(LEASE_DEFAULT_WINDOW),
+	interval(LEASE_DEFAULT_INTERVAL)
+{
+	gettimeofday(&last_maintenance,NULL);
+}
+
+ResourceLeases::~ResourceLeases(){
+	for(Leases::iterator it = leases.begin();it!=leases.end();++it)
+		delete it->second;
+}
+
+int ResourceLeases::configure(const AmConfigReader &cfg){
+	size_min = cfg.getParameterInt("resources_lease_min",LEASE_DEFAULT_SIZE_MIN);
+	size_max = cfg.getParameterInt("resources_lease_max",LEASE_DEFAULT_SIZE_MAX);
+	window = cfg.getParameterInt("resources_lease_window",LEASE_DEFAULT_WINDOW);
+	interval = cfg.getParameterInt("resources_lease_interval",LEASE_DEFAULT_INTERVAL);
+	if(size_min < 0 || size_max < size_min){
+		ERROR("invalid resources lease size bounds: %ld-%ld",size_min,size_max);
+		return -1;
+	}
+	if(window <= 0 || interval < 10){
+		ERROR("invalid resources lease window %d or interval %u",window,interval);
+		return -1;
+	}
+	return 0;
+}
+
+ResourceLeases::lease *ResourceLeases::get(const string &key, int limit){
+	lease *l;
+	AmLock lk(leases_mutex);
+	Leases::iterator it = leases.find(key);
+	if(it==leases.end()){
+		l = new lease(limit);
+		leases.insert(std::make_pair(key,l));
+	} else {
+		l = it->second;
+		l->limit = limit;
+	}
+	return l;
+}
+
+void ResourceLeases::reset(){
+	AmLock lk(leases_mutex);
+	for(Leases::iterator it = leases.begin();it!=leases.end();++it)
+		it->second->state = 0;
+}
+
+bool ResourceLeases::maintenance_ready(const struct timeval &now){
+	struct timeval next = last_maintenance;
+	next.tv_sec += interval/1000;
+	next.tv_usec += (interval%1000)*1000;
+	if(next.tv_usec >= 1000000){
+		next.tv_sec++;
+		next.tv_usec -= 1000000;
+	}
+	return !timercmp(&now,&next,<);
+}
+
+void ResourceLeases::maintenance(const struct timeval &now, vector<action> &actions){
+	struct timeval d;
+	timersub(&now,&last_maintenance,&d);
+	double elapsed = timeval2double(d);
+	last_maintenance = now;
+	if(elapsed <= 0)
+		return;
+
+	AmLock lk(leases_mutex);
+	for(Leases::iterator it = leases.begin();it!=leases.end();++it){
+		lease &l = *it->second;
+
+		//free capacity enough for the usage rate during window
+		unsigned long takes = l.takes.exchange(0);
+		long target = (long)(takes*window/elapsed+0.5);
+		if(target < size_min) target = size_min;
+		if(target > size_max) target = size_max;
+		if(target > l.limit) target = l.limit;
+		l.size = target;
+
+		uint64_t s = l.state.load();
+		long free = (long)lease::reserved(s)-lease::used(s);
+		if(target && free*2 < target){
+			action a = { it->first, &l, target-free };
+			actions.push_back(a);
+		} else if(free > target*2) {
+			long n = l.cut_free(target);
+			if(n){
+				action a = { it->first, &l, -n };
+				actions.push_back(a);
+			}
+		}
+	}
+}
+
+void ResourceLeases::getInfo(AmArg &ret){
+	unsigned long reserved = 0, used = 0, misses = 0;
+
+	ret["size_min"] = size_min;
+	ret["size_max"] = size_max;
+	ret["window"] = window;
+	ret["interval"] = (int)interval;
+
+	AmArg &r = ret["leases"];
+	r.assertStruct();
+
+	AmLock lk(leases_mutex);
+	for(Leases::const_iterator it = leases.begin();it!=leases.end();++it){
+		const lease &l = *it->second;
+		l.info(r[it->first]);
+		uint64_t s = l.state.load();
+		reserved += lease::reserved(s);
+		used += lease::used(s);
+		misses += l.refill_misses.load();
+	}
+	ret["reserved"] = (long)reserved;
+	ret["used"] = (long)used;
+	ret["refill_misses"] = (long)misses;
+}
@@ -0,0 +1,88 @@
+#ifndef RESOURCELEASES_H
+#define RESOURCELEASES_H
+
+#include "AmConfigReader.h"
+#include "AmThread.h"
+#include "AmArg.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* node-local resources leases
+ *
+ * node reserves capacity for the resource key in redis in advance
+ * (node counter in the resource hash is incremented by the lease size),
+ * so sum of all nodes reservations never exceeds the limit.
+ * calls take from the local lease without redis interaction.
+ * lease is refilled synchronously only if it is exhausted (refill miss).
+ * resources writer thread periodically resizes leases by usage rate:
+ * refills leases which are going to be exhausted and returns surplus */
+
+class ResourceLeases {
+  public:
+	struct lease {
+		/* reserved in redis (high 32 bits) and used locally (low 32 bits).
+		 * packed to check and change both with single CAS */
+		std::atomic<uint64_t> state;
+		std::atomic<int> limit;					//last seen limit
+		std::atomic<unsigned long> takes;		//takes since last maintenance
+		std::atomic<long> size;					//target free capacity
+		std::atomic<unsigned long> refills, refill_misses, refill_failures, returns;
+		lease(int limit):
+			state(0), limit(limit), takes(0), size(0),
+			refills(0), refill_misses(0), refill_failures(0), returns(0) {}
+
+		static uint32_t reserved(uint64_t s) { return s >> 32; }
+		static uint32_t used(uint64_t s) { return s & 0xffffffff; }
+
+		/* take from local reservation. returns false if lease is exhausted */
+		bool take(int n);
+		void release(int n);
+		void add_reserved(long n);
+		/* cut free reservation down to keep. returns cut amount */
+		long cut_free(long keep);
+		void info(AmArg &a) const;
+	};
+
+	/* maintenance actions for the writer thread */
+	struct action {
+		string key;
+		lease *l;
+		long amount;		//>0 - reserve, <0 - return
+	};
+
+  private:
+	typedef map<string,lease *> Leases;
+	Leases leases;
+	AmMutex leases_mutex;
+
+	long size_min, size_max;
+	int window;						//seconds of usage covered by lease
+	unsigned int interval;			//maintenance interval (msec)
+	struct timeval last_maintenance;
+
+  public:
+	ResourceLeases();
+	~ResourceLeases();
+
+	int configure(const AmConfigReader &cfg);
+	unsigned int get_interval() const { return interval; }
+
+	/* lease for the key. created empty on first access */
+	lease *get(const string &key, int limit);
+	/* forget all reservations (e.g. redis counters were reset) */
+	void reset();
+
+	/* recompute leases sizes. returns reservations to refill/return */
+	bool maintenance_ready(const struct timeval &now);
+	void maintenance(const struct timeval &now, vector<action> &actions);
+
+	void getInfo(AmArg &ret);
+};
+
+#endif // RESOURCELEASES_H
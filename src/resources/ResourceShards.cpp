@@ -0,0 +1,54 @@
+#include "ResourceShards.h"
+#include "ResourceCache.h"
+#include "log.h"
+#include "AmUtils.h"
+
+#include "../hash/hashfn.h"
+
+/* ResourceShard */
+
+ResourceShard::~ResourceShard(){
+	for(vector<ResourceWriter *>::iterator it = writers.begin();it!=writers.end();++it)
+		delete *it;
+}
+
+string ResourceShard::cfg_prefix(const char *pool, unsigned int idx){
+	string prefix(pool);
+	if(idx) prefix+=int2str(idx);
+	return prefix;
+}
+
+int ResourceShard::configure(const AmConfigReader &cfg){
+	string write_prefix = cfg_prefix("write",idx),
+		   read_prefix = cfg_prefix("read",idx);
+	RedisCfg rcfg;
+
+	if(write_pool.configure(cfg,write_prefix,false) ||
+	   read_pool.configure(cfg,read_prefix,true))
+	{
+		ERROR("failed to configure redis pools for resources shard %u",idx);
+		return -1;
+	}
+
+	RedisConnPool::cfg2RedisCfg(cfg,rcfg,write_prefix);
+	name = rcfg.socket.empty() ? rcfg.server+":"+int2str(rcfg.port) : rcfg.socket;
+	return 0;
+}
+
+/* ResourceRing */
+
+void ResourceRing::add(const string &name, unsigned int shard){
+	for(unsigned int i = 0;i<vnodes;i++){
+		string point = name+"#"+int2str(i);
+		points[murmur_hash64(point.data(),point.size())] = shard;
+	}
+}
+
+unsigned int ResourceRing::get(const string &key) const {
+	if(points.empty())
+		return 0;
+	Points::const_iterator it = points.lower_bound(murmur_hash64(key.data(),key.size()));
+	if(it==points.end())
+		it = points.begin();
+	return it->second;
+}
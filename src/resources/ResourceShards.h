@@ -0,0 +1,46 @@
+#ifndef RESOURCESHARDS_H
+#define RESOURCESHARDS_H
+
+#include "RedisConnPool.h"
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class ResourceWriter;
+
+/* redis instance (read/write pair) holding part of resources counters.
+ * shard 0 uses write_redis_* / read_redis_* options,
+ * shard N uses writeN_redis_* / readN_redis_* */
+struct ResourceShard {
+	unsigned int idx;
+	string name;					//identity on the ring. write redis address
+	RedisConnPool write_pool, read_pool;
+	vector<ResourceWriter *> writers;
+
+	ResourceShard(unsigned int idx): idx(idx) {}
+	~ResourceShard();
+
+	int configure(const AmConfigReader &cfg);
+	static string cfg_prefix(const char *pool, unsigned int idx);
+};
+
+/* consistent hashing ring of shards.
+ * adding or removing a shard remaps only keys between it and its neighbours */
+class ResourceRing {
+	typedef map<uint64_t,unsigned int> Points;
+	Points points;
+	unsigned int vnodes;
+
+  public:
+	ResourceRing(unsigned int vnodes = 160): vnodes(vnodes) {}
+
+	void add(const string &name, unsigned int shard);
+	void clear() { points.clear(); }
+	unsigned int get(const string &key) const;
+};
+
+#endif // RESOURCESHARDS_H
@@ -176,6 +176,11 @@ int Yeti::onLoad() {
 		return -1;
 	}
 
+	if(cdr_list.configure_indexes(cfg.getParameter("calls_index_fields"))){
+		ERROR("active calls indexes configure failed");
+		return -1;
+	}
+
 	if(init_radius_module(cfg)){
 		ERROR("radius module configure failed");
 		return -1;
@@ -265,7 +265,8 @@ CCChainProcessing YetiCC::onBLegRefused(SBCCallLeg *call, AmSipReply& reply) {
 	return ContinueProcessing;
 }
 
-void YetiCC::onRoutingReady(SBCCallLeg *call, AmSipRequest &aleg_modified_invite, AmSipRequest &modified_invite)
+void YetiCC::onRoutingReady(SBCCallLeg *call, AmSipRequest &aleg_modified_invite, AmSipRequest &modified_invite,
+							const ResourceCheckReplyEvent *resources_reply)
 {
 	DBG("%s(%p,leg%s)",FUNC_NAME,call,call->isALeg()?"A":"B");
 
@@ -288,10 +289,23 @@ void YetiCC::onRoutingReady(SBCCallLeg *call, AmSipRequest &aleg_modified_invite
 	PROF_START(rchk);
 	do {
 		DBG("%s() check resources for profile. attempt %d",FUNC_NAME,attempt);
-		rctl_ret = rctl.get(ctx->getCurrentResourceList(),
-							ctx->getCurrentProfile()->resource_handler,
-							call->getLocalTag(),
-							refuse_code,refuse_reason,ri);
+		if(resources_reply){
+			rctl_ret = rctl.get_async_reply(*resources_reply,
+								ctx->getCurrentResourceList(),
+								ctx->getCurrentProfile()->resource_handler,
+								call->getLocalTag(),
+								refuse_code,refuse_reason,ri);
+			resources_reply = NULL;
+		} else if(rctl.get_async(ctx->getCurrentResourceList(),call->getLocalTag())) {
+			//continue in onResourcesReply()
+			DBG("%s() wait for async resources check",FUNC_NAME);
+			return;
+		} else {
+			rctl_ret = rctl.get(ctx->getCurrentResourceList(),
+								ctx->getCurrentProfile()->resource_handler,
+								call->getLocalTag(),
+								refuse_code,refuse_reason,ri);
+		}
 
 		if(rctl_ret == RES_CTL_OK){
 			DBG("%s() check resources succ",FUNC_NAME);
@@ -604,6 +618,12 @@ CCChainProcessing YetiCC::onEvent(SBCCallLeg *call, AmEvent *e) {
 		return StopProcessing;
 	}
 
+	ResourceCheckReplyEvent *resources_event = dynamic_cast<ResourceCheckReplyEvent*>(e);
+	if(resources_event){
+		onResourcesReply(call,*resources_event);
+		return StopProcessing;
+	}
+
 	AmRtpTimeoutEvent *rtp_event = dynamic_cast<AmRtpTimeoutEvent*>(e);
 	if(rtp_event){
 		DBG("rtp event id: %d",rtp_event->event_id);
@@ -964,6 +984,7 @@ void YetiCC::onCallConnected(SBCCallLeg *call, const AmSipReply& reply){
 
 	if(call->isALeg()) cdr->update(Connect);
 	else cdr->update(BlegConnect);
+	cdr_list.notify_update(cdr);
 
 	radius_accounting_start(call,*cdr,call_profile);
 }
@@ -1551,6 +1572,30 @@ void YetiCC::onRadiusReply(SBCCallLeg *call, const RadiusReplyEvent &ev)
 	}
 }
 
+void YetiCC::onResourcesReply(SBCCallLeg *call, const ResourceCheckReplyEvent &ev)
+{
+	DBG("got resources check reply for %s",call->getLocalTag().c_str());
+
+	if(AmBasicSipDialog::Cancelling==call->dlg->getStatus()) {
+		DBG("[%s] ignore resources check reply in Cancelling state",call->getLocalTag().c_str());
+		rctl.release_async_reply(ev);
+		return;
+	}
+
+	if(NULL==call->getCallCtx()){
+		ERROR("CallCtx = nullptr ");
+		log_stacktrace(L_ERR);
+		rctl.release_async_reply(ev);
+		return;
+	}
+
+	try {
+		onRoutingReady(call,call->getAlegModifiedReq(),call->getModifiedReq(),&ev);
+	} catch(AmSession::Exception &e) {
+		call->onEarlyEventException(e.code,e.reason);
+	}
+}
+
 void YetiCC::onInterimRadiusTimer(SBCCallLeg *call)
 {
 	DBG("interim accounting timer fired for %s",call->getLocalTag().c_str());
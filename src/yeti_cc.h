@@ -51,6 +51,7 @@ class YetiCC
     bool connectCallee(CallCtx *call_ctx,SBCCallLeg *call,const AmSipRequest &orig_req);
     bool chooseNextProfile(SBCCallLeg *call);
     void onRadiusReply(SBCCallLeg *call, const RadiusReplyEvent &ev);
+    void onResourcesReply(SBCCallLeg *call, const ResourceCheckReplyEvent &ev);
     void onInterimRadiusTimer(SBCCallLeg *call);
     void onFakeRingingTimer(SBCCallLeg *call);
 
@@ -69,7 +70,9 @@ class YetiCC
         YetiRadius(base)
     { }
 
-    void onRoutingReady(SBCCallLeg *call, AmSipRequest &aleg_modified_invite, AmSipRequest &modified_invite);
+    /*! resources_reply is the result of the async resources check for the current profile */
+    void onRoutingReady(SBCCallLeg *call, AmSipRequest &aleg_modified_invite, AmSipRequest &modified_invite,
+                        const ResourceCheckReplyEvent *resources_reply = NULL);
 
     /*! return true if call refused */
     bool check_and_refuse(SqlCallProfile *profile,Cdr *cdr,
@@ -3,6 +3,7 @@
 #include "yeti_rpc.h"
 #include "Registration.h"
 #include "codecs_bench.h"
+#include "bench/bench.h"
 #include "alarms.h"
 
 #include "sip/resolver.h"
@@ -106,6 +107,7 @@ void YetiRpc::init_rpc_cmds(){
 
 
 			reg_method(show_resource,"types","show resources types",showResourceTypes,"");
+			reg_method(show_resource,"leases","show node-local resources leases",showResourceLeases,"");
 
 		reg_method(show,"sensors","show active sensors configuration",showSensorsState,"");
 		/*reg_leaf(show,show_sensors,"sensors","sensors related functions");
@@ -116,6 +118,7 @@ void YetiRpc::init_rpc_cmds(){
 
 			reg_leaf(show_router,show_router_cdrwriter,"cdrwriter","cdrwriter");
 				reg_method(show_router_cdrwriter,"opened-files","show opened csv files",showRouterCdrWriterOpenedFiles,"");
+				reg_method(show_router_cdrwriter,"import","show csv files import progress",showRouterCdrWriterImport,"");
 
 		reg_leaf(show,show_media,"media","media processor instance");
 			reg_method(show_media,"streams","active media streams info",showMediaStreams,"");
@@ -124,8 +127,13 @@ void YetiRpc::init_rpc_cmds(){
 						"<LOCAL-TAG>","retreive call by local_tag");
 			reg_method(show_calls,"count","active calls count",GetCallsCount,"");
 			reg_method(show_calls,"fields","show available call fields",showCallsFields,"");
+			reg_method_arg(show_calls,"changes","calls changed after sequence number",GetCallsChanges,"",
+						"<SEQ>","inserted/updated calls and removed local_tags since SEQ");
+			reg_method(show_calls,"indexes","active calls secondary indexes",GetCallsIndexes,"");
 			reg_method_arg(show_calls,"filtered","active calls. specify desired fields",GetCallsFields,"",
 						"<field1> <field2> ...","active calls. send only certain fields");
+			reg_method_arg(show_calls,"aggregate","active calls count and durations grouped by fields",GetCallsAggregate,"",
+						"<field1> <field2> ... [WHERE rules]","group calls by fields values");
 
 		reg_method(show,"configuration","actual settings",GetConfig,"");
 
@@ -180,6 +188,10 @@ void YetiRpc::init_rpc_cmds(){
 
 			reg_leaf(request_router,request_router_cdrwriter,"cdrwriter","CDR writer instance");
 				reg_method(request_router_cdrwriter,"close-files","immideatly close failover csv files",closeCdrFiles,"");
+				reg_method_arg(request_router_cdrwriter,"serialize-benchmark","compare CDR blobs serialization with cJSON",
+							   requestCdrSerializeBenchmark,"","<iterations>","iterations count");
+				reg_method_arg(request_router_cdrwriter,"pool-benchmark","compare CDR objects recycling with new/delete",
+							   requestCdrPoolBenchmark,"","<calls>","concurrent calls count");
 
 			reg_leaf(request_router,request_router_translations,"translations","disconnect/internal_db codes translator");
 				reg_method(request_router_translations,"reload","reload translator",reloadTranslations,"");
@@ -203,6 +215,13 @@ void YetiRpc::init_rpc_cmds(){
 		reg_leaf(request,request_call,"call","active calls control");
 			reg_method_arg(request_call,"disconnect","drop call",DropCall,
 						   "","<LOCAL-TAG>","drop call by local_tag");
+			reg_method_arg(request_call,"filter-benchmark","measure active calls filter matching throughput",
+						   requestCallsFilterBenchmark,"","<calls> [<rule1> <rule2> ...]",
+						   "synthetic calls count and filter rules");
+			reg_method_arg(request_call,"export","write active calls in binary columnar format",
+						   requestCallsExport,"","<path>","file or unix socket path");
+			reg_method_arg(request_call,"hash-benchmark","compare active calls hash tables",
+						   requestCallsHashBenchmark,"","<entries>","entries count");
 
 		reg_leaf(request,request_media,"media","media processor instance");
 			reg_method_arg(request_media,"payloads","loaded codecs",showPayloads,"show supported codecs",
@@ -526,6 +545,37 @@ void YetiRpc::GetCallsFields(const AmArg &args, AmArg &ret){
 	}
 }
 
+void YetiRpc::GetCallsAggregate(const AmArg &args, AmArg &ret){
+	handler_log();
+
+	if(!args.size()){
+		throw AmSession::Exception(500,"you should specify at least one group by field");
+	}
+
+	try {
+		cdr_list.getCallsAggregate(ret,&router,args);
+	} catch(std::string &s){
+		throw AmSession::Exception(500,s);
+	}
+}
+
+void YetiRpc::GetCallsChanges(const AmArg &args, AmArg &ret){
+	long long since = 0;
+	handler_log();
+
+	if(args.size()){
+		if(!str2longlong(args.get(0).asCStr(),since) || since < 0){
+			throw AmSession::Exception(500,"invalid sequence number");
+		}
+	}
+	cdr_list.getCallsChanges(ret,since,&router);
+}
+
+void YetiRpc::GetCallsIndexes(const AmArg &args, AmArg &ret){
+	handler_log();
+	cdr_list.getIndexes(ret);
+}
+
 void YetiRpc::showCallsFields(const AmArg &args, AmArg &ret){
 	cdr_list.getFields(ret,&router);
 }
@@ -962,6 +1012,72 @@ void YetiRpc::closeCdrFiles(const AmArg& args, AmArg& ret){
 	ret = RPC_CMD_SUCC;
 }
 
+void YetiRpc::requestCdrSerializeBenchmark(const AmArg& args, AmArg& ret){
+	int iterations = DEFAULT_CDR_BENCH_ITERATIONS;
+	handler_log();
+	if(args.size()){
+		if(!str2int(args.get(0).asCStr(),iterations) || iterations <= 0){
+			throw AmSession::Exception(500,"invalid iterations count");
+		}
+	}
+	cdr_serialize_bench(iterations,ret);
+}
+
+void YetiRpc::requestCdrPoolBenchmark(const AmArg& args, AmArg& ret){
+	int calls = DEFAULT_CDR_POOL_BENCH_CALLS;
+	handler_log();
+	if(args.size()){
+		if(!str2int(args.get(0).asCStr(),calls) || calls <= 0){
+			throw AmSession::Exception(500,"invalid calls count");
+		}
+	}
+	cdr_pool_bench(calls,ret);
+}
+
+void YetiRpc::requestCallsFilterBenchmark(const AmArg& args, AmArg& ret){
+	int calls = DEFAULT_CALLS_FILTER_BENCH_CALLS, n;
+	AmArg rules;
+	handler_log();
+	for(unsigned int i = 0;i<args.size();i++){
+		//optional calls count before rules
+		if(i==0 && str2int(args.get(0).asCStr(),n)){
+			if(n <= 0)
+				throw AmSession::Exception(500,"invalid calls count");
+			calls = n;
+			continue;
+		}
+		rules.push(args.get(i));
+	}
+	try {
+		calls_filter_bench(calls,rules,ret);
+	} catch(std::string &s){
+		throw AmSession::Exception(500,s);
+	}
+}
+
+void YetiRpc::requestCallsExport(const AmArg& args, AmArg& ret){
+	handler_log();
+	if(!args.size()){
+		throw AmSession::Exception(500,"path expected");
+	}
+	try {
+		cdr_list.exportCalls(ret,args.get(0).asCStr(),&router);
+	} catch(std::string &s){
+		throw AmSession::Exception(500,s);
+	}
+}
+
+void YetiRpc::requestCallsHashBenchmark(const AmArg& args, AmArg& ret){
+	int entries = DEFAULT_HASH_BENCH_ENTRIES;
+	handler_log();
+	if(args.size()){
+		if(!str2int(args.get(0).asCStr(),entries) || entries <= 0){
+			throw AmSession::Exception(500,"invalid entries count");
+		}
+	}
+	hash_bench(entries,ret);
+}
+
 void YetiRpc::showMediaStreams(const AmArg& args, AmArg& ret){
 	handler_log();
 	AmMediaProcessor::instance()->getInfo(ret);
@@ -1049,6 +1165,12 @@ void YetiRpc::showRouterCdrWriterOpenedFiles(const AmArg& args, AmArg& ret){
 	router.showOpenedFiles(ret);
 }
 
+void YetiRpc::showRouterCdrWriterImport(const AmArg& args, AmArg& ret){
+	handler_log();
+	(void)args;
+	router.showCdrImport(ret);
+}
+
 void YetiRpc::requestSystemLogDump(const AmArg& args, AmArg& ret){
 	handler_log();
 
@@ -1291,6 +1413,15 @@ void YetiRpc::showResourceTypes(const AmArg& args, AmArg& ret){
 	rctl.GetConfig(ret,true);
 }
 
+void YetiRpc::showResourceLeases(const AmArg& args, AmArg& ret){
+	handler_log();
+	try {
+		rctl.showLeases(ret);
+	} catch(const ResourceCacheException &e){
+		throw AmSession::Exception(e.code,e.what);
+	}
+}
+
 void YetiRpc::requestResourcesInvalidate(const AmArg& args, AmArg& ret){
 	handler_log();
 	if(rctl.invalidate_resources()){
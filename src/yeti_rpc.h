@@ -44,6 +44,9 @@ class YetiRpc
     rpc_handler GetCall;
     rpc_handler GetCalls;
     rpc_handler GetCallsFields;
+    rpc_handler GetCallsAggregate;
+    rpc_handler GetCallsChanges;
+    rpc_handler GetCallsIndexes;
     rpc_handler GetCallsCount;
     rpc_handler GetRegistration;
     rpc_handler GetRegistrations;
@@ -59,6 +62,12 @@ class YetiRpc
     rpc_handler showPayloads;
     rpc_handler showInterfaces;
     rpc_handler showRouterCdrWriterOpenedFiles;
+    rpc_handler showRouterCdrWriterImport;
+    rpc_handler requestCdrSerializeBenchmark;
+    rpc_handler requestCdrPoolBenchmark;
+    rpc_handler requestCallsFilterBenchmark;
+    rpc_handler requestCallsExport;
+    rpc_handler requestCallsHashBenchmark;
     rpc_handler showCallsFields;
     rpc_handler requestSystemLogDump;
 
@@ -85,6 +94,7 @@ class YetiRpc
     rpc_handler getResourceState;
     rpc_handler showResources;
     rpc_handler showResourceTypes;
+    rpc_handler showResourceLeases;
     rpc_handler showResourceByHandler;
     rpc_handler showResourceByLocalTag;
     rpc_handler showResourcesById;